@@ -0,0 +1,563 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Host test runner for firmware control code
+ *
+ * microscope.c, scan.c and telemetry.c are built against mocked registers, DMA interrupt
+ * is called directly. Checks are followed by per-buffer compute benchmarks.
+ *
+ * Usage: hosttest [budget, ns per DAC buffer]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include <stm32f4xx.h>
+
+#include "microscope.h"
+#include "scan.h"
+#include "sigmadelta.h"
+#include "telemetry.h"
+#include "mock.h"
+
+/* Same as in microscope.c */
+#define DAC_VALUE_COUNT		16
+#define DAC_BUFFER_SIZE		(DAC_VALUE_COUNT * 3)
+
+#define BENCH_TICKS			200000
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+
+void DMA1_Stream7_IRQHandler(void);
+
+static int failures;
+static int half;
+
+
+/* DMA buffer is static in microscope.c, its address is taken from DMA register.
+ * Host binary is linked as non-PIE, so static data address fits in 32 bits. */
+static uint32_t *dacBuffer(void)
+{
+	return (uint32_t *)(uintptr_t)DMA1_Stream7->M0AR;
+}
+
+/* Run one DAC buffer period, returns buffer half which was just refilled */
+static uint32_t *tick(void)
+{
+	uint32_t *buf;
+
+	DMA1->HISR = half ? DMA_HISR_TCIF7 : DMA_HISR_HTIF7;
+	DMA1_Stream7_IRQHandler();
+	DMA1->HISR = 0;
+
+	buf = dacBuffer() + (half ? DAC_BUFFER_SIZE : 0);
+	half ^= 1;
+
+	return buf;
+}
+
+static void setup(uint8_t order)
+{
+	mockReset();
+	micInit();
+	half = 0;
+
+	micGetConfig()->zcontrol = AFM_ZCONTROL_ON;
+	micGetConfig()->dacOrder = order;
+}
+
+static double nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/***** Checks *****/
+
+static void testChannels(void)
+{
+	uint32_t *buf;
+	int i;
+
+	setup(1);
+	buf = tick();
+	for (i = 0; i < DAC_BUFFER_SIZE; i++) CHECK((buf[i] & 3) == (uint32_t)(i % 3));
+}
+
+/* Mean of modulated 16 bit output must match 32 bit setpoint */
+static void testAverage(void)
+{
+	const uint32_t x = 0x80001234;
+	uint8_t order;
+	uint32_t *buf;
+	double sum, mean;
+	int i, n, count;
+
+	for (order = SD_ORDER_MIN; order <= SD_ORDER_MAX; order++) {
+		setup(order);
+		micSetPosition(x, 0x80000000);
+		tick();
+		tick();
+
+		sum = 0;
+		count = 0;
+		for (n = 0; n < 256; n++) {
+			buf = tick();
+			for (i = 0; i < DAC_VALUE_COUNT; i++, count++) sum += buf[i * 3] & 0xFFFF0000;
+		}
+		mean = sum / count;
+		CHECK((mean - x) < 0.01 * 65536 && (x - mean) < 0.01 * 65536);
+	}
+}
+
+/* Setpoint change is ramped over the buffer */
+static void testRamp(void)
+{
+	const uint32_t x = 0x81000000;
+	uint32_t *buf;
+
+	setup(2);
+	tick();
+	tick();
+	micSetPosition(x, 0x80000000);
+	buf = tick();
+
+	CHECK((buf[0] >> 16) < 0x8020);
+	CHECK((buf[(DAC_VALUE_COUNT - 1) * 3] >> 16) > 0x80F0);
+	CHECK((buf[(DAC_VALUE_COUNT - 1) * 3] >> 16) <= 0x8108);
+}
+
+/* Z step is below one 16 bit LSB, so run loop for several buffers */
+static void testZLoop(void)
+{
+	uint16_t z;
+	int n;
+
+	setup(1);
+	z = micGetHeight();
+
+	/* Probe is lower than setpoint */
+	ADC1->SR = ADC_SR_EOC;
+	ADC1->DR = 2000;
+	for (n = 0; n < 64; n++) tick();
+	CHECK(micGetHeight() > z);
+
+	/* Probe is higher */
+	z = micGetHeight();
+	ADC1->DR = 100;
+	for (n = 0; n < 64; n++) tick();
+	CHECK(micGetHeight() < z);
+}
+
+static int runUntilIdle(int limit)
+{
+	int n;
+
+	for (n = 0; (n < limit) && scanIsRunning(); n++) tick();
+
+	return !scanIsRunning();
+}
+
+/* Count messages of raster scan */
+static void checkRaster(uint16_t res)
+{
+	struct afmImageData *d;
+	int i, eol, retrace, samples;
+
+	CHECK(mockUsbCount > 2);
+	CHECK(mockUsbMsg[0].code == AFM_IMAGE_START);
+	CHECK(mockUsbMsg[mockUsbCount - 1].code == AFM_IMAGE_END);
+
+	eol = 0;
+	retrace = 0;
+	samples = 0;
+	for (i = 0; i < mockUsbCount; i++) {
+		if (mockUsbMsg[i].code != AFM_IMAGE_DATA) continue;
+		d = (struct afmImageData *)mockUsbMsg[i].data;
+		samples += (mockUsbMsg[i].len - 5) / 2;
+		if (d->flags & AFM_IMAGE_FLAG_EOL) {
+			eol++;
+			if (d->flags & AFM_IMAGE_FLAG_RETRACE) retrace++;
+		}
+	}
+
+	CHECK(eol == res * 2);
+	CHECK(retrace == res);
+	CHECK(samples == res * res * 2);
+}
+
+static void testRaster(void)
+{
+	struct afmRun run = { -50, -50, 100, 5 };
+
+	setup(1);
+	CHECK(scanRun(&run));
+	CHECK(runUntilIdle(100000));
+	checkRaster(run.res);
+}
+
+/* Scan waits while USB queue is full and loses nothing */
+static void testRasterHold(void)
+{
+	struct afmRun run = { 0, 0, 100, 5 };
+	int n;
+
+	setup(1);
+	CHECK(scanRun(&run));
+	for (n = 0; n < 500; n++) {
+		mockUsbFull = (n % 7) != 0;
+		tick();
+	}
+	mockUsbFull = 0;
+	CHECK(runUntilIdle(100000));
+	checkRaster(run.res);
+}
+
+/* Movie restarts the raster by itself and stops after the last frame */
+static void testMovie(void)
+{
+	struct afmRunMovie movie = { { 0, 0, 100, 4 }, 3 };
+	int i, starts = 0, ends = 0;
+
+	setup(1);
+	CHECK(scanRunMovie(&movie));
+	CHECK(runUntilIdle(100000));
+	for (i = 0; i < mockUsbCount; i++) {
+		if (mockUsbMsg[i].code == AFM_IMAGE_START) starts++;
+		if (mockUsbMsg[i].code == AFM_IMAGE_END) {
+			ends++;
+			/* Next frame follows the end at once */
+			if (i + 1 < mockUsbCount) CHECK(mockUsbMsg[i + 1].code == AFM_IMAGE_START);
+		}
+	}
+	CHECK(starts == 3);
+	CHECK(ends == 3);
+
+	/* Unlimited movie runs until stopped */
+	movie.frames = 0;
+	setup(1);
+	CHECK(scanRunMovie(&movie));
+	CHECK(!runUntilIdle(20000));
+	scanStop();
+	CHECK(!scanIsRunning());
+}
+
+/* Scanned lines, each trace pass counted by its line index */
+static int countLines(uint8_t *lines, int res)
+{
+	struct afmImageData *d;
+	int i, n = 0;
+
+	memset(lines, 0, res);
+	for (i = 0; i < mockUsbCount; i++) {
+		if (mockUsbMsg[i].code != AFM_IMAGE_DATA) continue;
+		d = (struct afmImageData *)mockUsbMsg[i].data;
+		if ((d->flags & AFM_IMAGE_FLAG_EOL) && !(d->flags & AFM_IMAGE_FLAG_RETRACE)) {
+			if (d->line < res) lines[d->line]++;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* Flat surface keeps the coarse pass only, zero threshold fills every line once */
+static void testAdaptive(void)
+{
+	struct afmRunAdaptive ad = { { 0, 0, 100, 10 }, 4, 0xFFFF };
+	struct afmRunAdaptive bad = { { 0, 0, 100, 10 }, 0, 0 };
+	uint8_t lines[10];
+	int i;
+
+	setup(1);
+	CHECK(!scanRunAdaptive(&bad));
+	bad.step = AFM_ADAPTIVE_MAX_STEP + 1;
+	CHECK(!scanRunAdaptive(&bad));
+
+	CHECK(scanRunAdaptive(&ad));
+	CHECK(runUntilIdle(100000));
+	CHECK(mockUsbMsg[mockUsbCount - 1].code == AFM_IMAGE_END);
+	CHECK(countLines(lines, 10) == 4);
+	CHECK(lines[0] && lines[4] && lines[8] && lines[9]);
+
+	ad.threshold = 0;
+	setup(1);
+	CHECK(scanRunAdaptive(&ad));
+	CHECK(runUntilIdle(100000));
+	CHECK(countLines(lines, 10) == 10);
+	for (i = 0; i < 10; i++) CHECK(lines[i] == 1);
+
+	/* Plain raster after adaptive one is not adaptive */
+	setup(1);
+	CHECK(scanRun(&ad.run));
+	CHECK(runUntilIdle(100000));
+	checkRaster(ad.run.res);
+}
+
+/* Burst DMA stores samples per tick, each sample holds its own index */
+static void burstTick(int total, int perTick)
+{
+	uint16_t *buf = (uint16_t *)(uintptr_t)DMA2_Stream0->M0AR;
+	int n;
+
+	if (DMA2_Stream0->CR & DMA_SxCR_EN) {
+		for (n = 0; (n < perTick) && DMA2_Stream0->NDTR; n++) {
+			buf[total - DMA2_Stream0->NDTR] = total - DMA2_Stream0->NDTR;
+			DMA2_Stream0->NDTR--;
+		}
+	}
+	tick();
+}
+
+/* Force curve goes down by travel and back, samples arrive in order.
+ * With 1 ms period one sample is taken per DAC buffer, so Z leads by one. */
+static void testSpectro(void)
+{
+	struct afmSpectro sp = { 0, 0, 100, 50, 1000 };
+	struct afmSpectroData *d;
+	uint16_t base, h, peak = 0;
+	int i, j, n, total = sp.points * 2, next = 0, lead = 0;
+
+	setup(1);
+	micGetConfig()->zcontrol = AFM_ZCONTROL_OFF;
+	CHECK(!scanSpectro(&sp));
+	micGetConfig()->zcontrol = AFM_ZCONTROL_ON;
+	sp.points = AFM_SPECTRO_MAX_POINTS + 1;
+	CHECK(!scanSpectro(&sp));
+	sp.points = 50;
+	sp.period = AFM_SPECTRO_MIN_PERIOD - 1;
+	CHECK(!scanSpectro(&sp));
+	sp.period = 1000;
+
+	base = micGetHeight();
+	CHECK(scanSpectro(&sp));
+	for (n = 0; (n < 10000) && scanIsRunning(); n++) {
+		burstTick(total, 1);
+		h = micGetHeight();
+		if (h > peak) peak = h;
+		/* Z moves before the first sample */
+		if ((TIM2->CR1 & TIM_CR1_CEN) && !micBurstDone() && (h > base)) lead = 1;
+	}
+	CHECK(!scanIsRunning());
+	CHECK(lead);
+	CHECK(peak == base + sp.travel);
+	CHECK(micGetHeight() == base);
+	CHECK(!(TIM2->CR1 & TIM_CR1_CEN));
+	CHECK(TIM2->ARR == (uint32_t)sp.period - 1);
+
+	CHECK(mockUsbMsg[0].code == AFM_SPECTRO_START);
+	CHECK(((struct afmSpectroStart *)mockUsbMsg[0].data)->points == sp.points);
+	CHECK(mockUsbMsg[mockUsbCount - 1].code == AFM_SPECTRO_END);
+	for (i = 1; i < mockUsbCount - 1; i++) {
+		CHECK(mockUsbMsg[i].code == AFM_SPECTRO_DATA);
+		d = (struct afmSpectroData *)mockUsbMsg[i].data;
+		CHECK(d->index == next);
+		for (j = 0; j < (mockUsbMsg[i].len - 2) / 2; j++) CHECK(d->adc[j] == next + j);
+		next += j;
+	}
+	CHECK(next == total);
+}
+
+static void testPath(void)
+{
+	struct afmPathStart start = { 1 };
+	uint8_t pkt[2 + 3 * sizeof(struct afmPathPoint)];
+	uint8_t end[2] = { AFM_PATH_END, 0 };
+	struct afmPathPoint *pt = (struct afmPathPoint *)(pkt + 2);
+	struct afmPathCredit *credit;
+	uint32_t x, y;
+	int i, credits, done;
+
+	setup(1);
+	CHECK(scanPathStart(&start));
+
+	pkt[0] = AFM_PATH_DATA;
+	pkt[1] = 3 * sizeof(struct afmPathPoint);
+	for (i = 0; i < 3; i++) {
+		pt[i].x = 100 * i;
+		pt[i].y = -100 * i;
+	}
+	scanPathData(pkt, sizeof(pkt));
+	scanPathData(end, sizeof(end));
+
+	CHECK(runUntilIdle(100));
+	micGetPosition(&x, &y);
+	CHECK(x == 0x80000000 + 200 * SCAN_DAC_PER_NM);
+	CHECK(y == 0x80000000 - 200 * SCAN_DAC_PER_NM);
+
+	credits = 0;
+	done = 0;
+	for (i = 0; i < mockUsbCount; i++) {
+		if (mockUsbMsg[i].code == AFM_PATH_CREDIT) {
+			credit = (struct afmPathCredit *)mockUsbMsg[i].data;
+			credits += credit->credits;
+		}
+		if (mockUsbMsg[i].code == AFM_PATH_DONE) done++;
+	}
+	CHECK(credits == 3);
+	CHECK(done == 1);
+}
+
+/* Collect telemetry samples, returns count; checks that seq has no gaps
+ * except one of given size */
+static int collectTelemetry(uint16_t *first, int gap, int16_t *error)
+{
+	struct afmTelemetryData *tm;
+	uint16_t next = 0;
+	int i, n, count = 0, gaps = 0;
+
+	for (i = 0; i < mockUsbCount; i++) {
+		if (mockUsbMsg[i].code != AFM_TELEMETRY) continue;
+		tm = (struct afmTelemetryData *)mockUsbMsg[i].data;
+		n = (mockUsbMsg[i].len - sizeof(tm->seq)) / sizeof(tm->s[0]);
+
+		if (!count) *first = tm->seq;
+		else if (tm->seq != next) {
+			CHECK((uint16_t)(tm->seq - next) == gap);
+			gaps++;
+		}
+		if (error && n) *error = tm->s[0].error;
+
+		next = tm->seq + n;
+		count += n;
+	}
+	CHECK(gaps == (gap ? 1 : 0));
+
+	return count;
+}
+
+static void testTelemetry(void)
+{
+	uint16_t first;
+	int16_t error = 0;
+	int n;
+
+	setup(1);
+	ADC1->SR = ADC_SR_EOC;
+	ADC1->DR = 1100;
+
+	/* Off by default */
+	for (n = 0; n < 30; n++) tick();
+	CHECK(collectTelemetry(&first, 0, NULL) == 0);
+
+	/* Every second loop period */
+	telemetrySetDecimation(2);
+	for (n = 0; n < 30; n++) tick();
+	CHECK(collectTelemetry(&first, 0, &error) == 15);
+	CHECK(first == 0);
+	CHECK(error == 100);
+
+	/* Link is busy: ring overflows, lost samples leave a gap in seq */
+	mockUsbReset();
+	telemetrySetDecimation(1);
+	mockUsbFull = 1;
+	for (n = 0; n < TELEMETRY_RING_SIZE + 44; n++) tick();
+	mockUsbFull = 0;
+	for (n = 0; n < TELEMETRY_RING_SIZE; n++) tick();
+	/* Ring is still full when the first sample after that is taken */
+	CHECK(collectTelemetry(&first, 44 + 1, NULL) >= TELEMETRY_RING_SIZE);
+	CHECK(first == 15);
+
+	telemetrySetDecimation(0);
+}
+
+/***** Benchmarks *****/
+
+/* Time of one DAC interrupt (scan engine tick and buffer fill) */
+static double bench(uint8_t order, int raster)
+{
+	struct afmRun run = { 0, 0, 1000, 1000 };
+	double t, ns;
+	int n;
+#ifdef HAVE_RDTSC
+	uint64_t tsc;
+#endif
+
+	setup(order);
+	if (raster) scanRun(&run);
+
+	t = nowNs();
+#ifdef HAVE_RDTSC
+	tsc = __rdtsc();
+#endif
+	for (n = 0; n < BENCH_TICKS; n++) {
+		tick();
+		mockUsbCount = 0;
+	}
+	ns = (nowNs() - t) / BENCH_TICKS;
+
+#ifdef HAVE_RDTSC
+	printf("  order %d, %-6s  %7.1f ns  %7.0f cycles\n", order, raster ? "raster" : "idle",
+			ns, (double)(__rdtsc() - tsc) / BENCH_TICKS);
+#else
+	printf("  order %d, %-6s  %7.1f ns\n", order, raster ? "raster" : "idle", ns);
+#endif
+
+	return ns;
+}
+
+int main(int argc, char **argv)
+{
+	double budget = 0, ns;
+	uint8_t order;
+	int raster;
+
+	if (argc > 1) budget = atof(argv[1]);
+
+	printf("Checks\n");
+	testChannels();
+	testAverage();
+	testRamp();
+	testZLoop();
+	testRaster();
+	testRasterHold();
+	testMovie();
+	testAdaptive();
+	testSpectro();
+	testPath();
+	testTelemetry();
+	printf("  %d failed\n", failures);
+
+	printf("DAC interrupt time per buffer\n");
+	for (order = SD_ORDER_MIN; order <= SD_ORDER_MAX; order++) {
+		for (raster = 0; raster < 2; raster++) {
+			ns = bench(order, raster);
+			if ((budget > 0) && (ns > budget)) {
+				printf("  FAIL budget %.1f ns exceeded\n", budget);
+				failures++;
+			}
+		}
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <string.h>
+
+#include <stm32f4xx.h>
+
+#include "usb.h"
+#include "mock.h"
+
+
+GPIO_TypeDef mockGPIOA;
+GPIO_TypeDef mockGPIOB;
+GPIO_TypeDef mockGPIOC;
+GPIO_TypeDef mockGPIOD;
+RCC_TypeDef mockRCC;
+SPI_TypeDef mockSPI3;
+SPI_TypeDef mockI2S3ext;
+DMA_TypeDef mockDMA1;
+DMA_Stream_TypeDef mockDMA1_Stream5;
+DMA_Stream_TypeDef mockDMA1_Stream7;
+DMA_TypeDef mockDMA2;
+DMA_Stream_TypeDef mockDMA2_Stream0;
+TIM_TypeDef mockTIM2;
+ADC_TypeDef mockADC1;
+NVIC_Type mockNVIC;
+
+mock_msg_t mockUsbMsg[MOCK_USB_MESSAGES];
+int mockUsbCount;
+int mockUsbFull;
+
+
+/* Registers after reset, with status bits firmware is polling for */
+void mockReset(void)
+{
+	memset(&mockGPIOA, 0, sizeof(mockGPIOA));
+	memset(&mockGPIOB, 0, sizeof(mockGPIOB));
+	memset(&mockGPIOC, 0, sizeof(mockGPIOC));
+	memset(&mockGPIOD, 0, sizeof(mockGPIOD));
+	memset(&mockRCC, 0, sizeof(mockRCC));
+	memset(&mockSPI3, 0, sizeof(mockSPI3));
+	memset(&mockI2S3ext, 0, sizeof(mockI2S3ext));
+	memset(&mockDMA1, 0, sizeof(mockDMA1));
+	memset(&mockDMA1_Stream5, 0, sizeof(mockDMA1_Stream5));
+	memset(&mockDMA1_Stream7, 0, sizeof(mockDMA1_Stream7));
+	memset(&mockDMA2, 0, sizeof(mockDMA2));
+	memset(&mockDMA2_Stream0, 0, sizeof(mockDMA2_Stream0));
+	memset(&mockTIM2, 0, sizeof(mockTIM2));
+	memset(&mockADC1, 0, sizeof(mockADC1));
+	memset(&mockNVIC, 0, sizeof(mockNVIC));
+
+	mockRCC.CR = RCC_CR_PLLI2SRDY;
+
+	mockUsbReset();
+}
+
+void mockUsbReset(void)
+{
+	mockUsbCount = 0;
+	mockUsbFull = 0;
+}
+
+/* Firmware USB layer replacement */
+int usbSendFromISR(uint8_t code, void *data, uint8_t len)
+{
+	mock_msg_t *msg;
+
+	if (mockUsbFull) return 0;
+	if (len > MOCK_USB_MSG_SIZE - 2) return 0;
+	if (mockUsbCount >= MOCK_USB_MESSAGES) return 0;
+
+	msg = &mockUsbMsg[mockUsbCount++];
+	msg->code = code;
+	msg->len = len;
+	if (len) memcpy(msg->data, data, len);
+
+	return 1;
+}
+
+/* Queue is either empty or full */
+int usbTxFreeFromISR(void)
+{
+	return mockUsbFull ? 0 : MOCK_USB_QUEUE_ITEMS;
+}
@@ -0,0 +1,26 @@
+#ifndef MOCK_H_
+#define MOCK_H_
+
+
+#include <stdint.h>
+
+
+/* Messages captured from usbSendFromISR() */
+#define MOCK_USB_MESSAGES	4096
+#define MOCK_USB_MSG_SIZE	16
+#define MOCK_USB_QUEUE_ITEMS	32
+
+typedef struct {
+	uint8_t		code;
+	uint8_t		len;
+	uint8_t		data[MOCK_USB_MSG_SIZE - 2];
+} mock_msg_t;
+
+extern mock_msg_t mockUsbMsg[MOCK_USB_MESSAGES];
+extern int mockUsbCount;
+extern int mockUsbFull;
+
+void mockUsbReset(void);
+
+
+#endif /* MOCK_H_ */
@@ -0,0 +1,155 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Sigma-delta DAC extension simulator
+ *
+ * Runs the firmware modulator on a slow sine input and reports
+ * in-band quantization noise and compute time for each order.
+ *
+ * Usage: sdsim [oversampling ratio]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "sigmadelta.h"
+
+/* Same as DAC_VALUE_COUNT in microscope.c */
+#define SIM_VALUE_COUNT		16
+#define SIM_CHANNELS		3
+
+#define SIM_SAMPLES			16384
+#define SIM_BENCH_BUFFERS	200000
+
+
+static double nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* In-band RMS of quantization error, in 16 bit LSB */
+static double inbandNoise(uint8_t order, int osr)
+{
+	static uint32_t buf[SIM_SAMPLES];
+	static double err[SIM_SAMPLES];
+	sd_state_t s;
+	double v, w, re, im, power;
+	uint32_t vin;
+	int i, k, n, band;
+
+	sdInit(&s, order);
+
+	/* Input: mid-scale with 0.3 full scale sine inside the band,
+	 * frequency is not bin-aligned to exercise all low bits */
+	for (n = 0; n < SIM_SAMPLES; n += SIM_VALUE_COUNT) {
+		for (i = 0; i < SIM_VALUE_COUNT; i++) {
+			v = 2147483648.0 + 1288490188.8 * sin(2 * M_PI * 3.3 * (n + i) / SIM_SAMPLES);
+			vin = (uint32_t)v;
+			sdModulate(&s, &buf[n + i], 1, 1, vin, 0, 0);
+			err[n + i] = ((double)buf[n + i] - vin) / 65536.0;
+		}
+	}
+
+	/* Hann windowed DFT of error over the signal band */
+	band = SIM_SAMPLES / (2 * osr);
+	power = 0;
+	for (k = 1; k <= band; k++) {
+		re = 0;
+		im = 0;
+		for (n = 0; n < SIM_SAMPLES; n++) {
+			w = 0.5 - 0.5 * cos(2 * M_PI * n / SIM_SAMPLES);
+			re += w * err[n] * cos(2 * M_PI * k * n / SIM_SAMPLES);
+			im -= w * err[n] * sin(2 * M_PI * k * n / SIM_SAMPLES);
+		}
+		power += re * re + im * im;
+	}
+
+	/* Parseval with Hann window power gain 3/8, one-sided spectrum */
+	power = 2 * power / ((double)SIM_SAMPLES * SIM_SAMPLES * 0.375);
+
+	return sqrt(power);
+}
+
+/* Time to fill one DAC buffer (all channels), in ns and CPU cycles */
+static void bench(uint8_t order, double *ns, double *cycles)
+{
+	static uint32_t buf[SIM_VALUE_COUNT * SIM_CHANNELS];
+	sd_state_t s[SIM_CHANNELS];
+	double t;
+	int i, c;
+#ifdef HAVE_RDTSC
+	uint64_t tsc;
+#endif
+
+	for (c = 0; c < SIM_CHANNELS; c++) sdInit(&s[c], order);
+
+	t = nowNs();
+#ifdef HAVE_RDTSC
+	tsc = __rdtsc();
+#endif
+	for (i = 0; i < SIM_BENCH_BUFFERS; i++) {
+		for (c = 0; c < SIM_CHANNELS; c++)
+			sdModulate(&s[c], buf + c, SIM_VALUE_COUNT, SIM_CHANNELS, 0x80001234 + i, 0x1000, c);
+		/* Keep the compiler from dropping the loop */
+		__asm__ __volatile__("" : : "r"(buf) : "memory");
+	}
+#ifdef HAVE_RDTSC
+	*cycles = (double)(__rdtsc() - tsc) / SIM_BENCH_BUFFERS;
+#else
+	*cycles = 0;
+#endif
+	*ns = (nowNs() - t) / SIM_BENCH_BUFFERS;
+}
+
+int main(int argc, char **argv)
+{
+	int osr = 16;
+	uint8_t order;
+	double noise, ref, ns, cycles;
+
+	if (argc > 1) osr = atoi(argv[1]);
+	if (osr < 1) osr = 1;
+
+	printf("Oversampling ratio %d, %d samples\n", osr, SIM_SAMPLES);
+	printf("order  in-band rms, LSB  gain, dB  eff. bits  ns/buffer  cycles/buffer\n");
+
+	ref = 0;
+	for (order = SD_ORDER_MIN; order <= SD_ORDER_MAX; order++) {
+		noise = inbandNoise(order, osr);
+		if (order == SD_ORDER_MIN) ref = noise;
+		bench(order, &ns, &cycles);
+
+		printf("%5d  %16.6f  %8.2f  %9.2f  %9.1f  %13.0f\n",
+				order, noise, 20 * log10(ref / noise),
+				16 + log2((1 / sqrt(12.0)) / noise), ns, cycles);
+	}
+
+	printf("Cycles are host TSC ticks, compare orders relative to each other.\n");
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef HOST_STM32F4XX_H_
+#define HOST_STM32F4XX_H_
+
+/* Register mock layer for host builds
+ *
+ * Register definitions are taken from the real device header,
+ * peripheral instances are redirected to plain structures in memory.
+ */
+
+#include "../stm32/stm32f4xx.h"
+
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#undef RCC
+#undef SPI3
+#undef I2S3ext
+#undef DMA1
+#undef DMA1_Stream5
+#undef DMA1_Stream7
+#undef DMA2
+#undef DMA2_Stream0
+#undef TIM2
+#undef ADC1
+#undef NVIC
+
+extern GPIO_TypeDef mockGPIOA;
+extern GPIO_TypeDef mockGPIOB;
+extern GPIO_TypeDef mockGPIOC;
+extern GPIO_TypeDef mockGPIOD;
+extern RCC_TypeDef mockRCC;
+extern SPI_TypeDef mockSPI3;
+extern SPI_TypeDef mockI2S3ext;
+extern DMA_TypeDef mockDMA1;
+extern DMA_Stream_TypeDef mockDMA1_Stream5;
+extern DMA_Stream_TypeDef mockDMA1_Stream7;
+extern DMA_TypeDef mockDMA2;
+extern DMA_Stream_TypeDef mockDMA2_Stream0;
+extern TIM_TypeDef mockTIM2;
+extern ADC_TypeDef mockADC1;
+extern NVIC_Type mockNVIC;
+
+#define GPIOA			(&mockGPIOA)
+#define GPIOB			(&mockGPIOB)
+#define GPIOC			(&mockGPIOC)
+#define GPIOD			(&mockGPIOD)
+#define RCC				(&mockRCC)
+#define SPI3			(&mockSPI3)
+#define I2S3ext			(&mockI2S3ext)
+#define DMA1			(&mockDMA1)
+#define DMA1_Stream5	(&mockDMA1_Stream5)
+#define DMA1_Stream7	(&mockDMA1_Stream7)
+#define DMA2			(&mockDMA2)
+#define DMA2_Stream0	(&mockDMA2_Stream0)
+#define TIM2			(&mockTIM2)
+#define ADC1			(&mockADC1)
+#define NVIC			(&mockNVIC)
+
+void mockReset(void);
+
+
+#endif /* HOST_STM32F4XX_H_ */
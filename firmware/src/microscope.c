@@ -18,6 +18,9 @@
 #include <stm32f4xx.h>
 
 #include "microscope.h"
+#include "scan.h"
+#include "sigmadelta.h"
+#include "telemetry.h"
 
 /* Hardware connections
  *
@@ -66,13 +69,25 @@
 
 /* Piezo DAC DMA circular buffer
  * 3 words (X, Y, Z) and 16->20 bit DAC extension (x16)
- * give us 48 words buffer size
+ * give us 48 words buffer size.
+ * DMA buffer holds two such buffers: one half is refilled
+ * while DMA is sending another one.
  */
 #define DAC_VALUE_COUNT	16
 #define DAC_BUFFER_SIZE	(DAC_VALUE_COUNT * 3)
 
+/* Time to send one buffer of 32-bit words at I2S clock, in nanoseconds */
+#define DAC_BUFFER_NS	((uint32_t)DAC_BUFFER_SIZE * 32 * 1000 * I2S_DIV * 2 * I2S_PLL_R / I2S_PLL_N)
+
+/* ADC burst sample timer: TIM2 on APB1, counting microseconds */
+#define BURST_TIMER_CLOCK	84000000
+#define BURST_TIMER_TICK	(BURST_TIMER_CLOCK / 1000000)
+
+/* DMA interrupt priority, must be not higher than configMAX_SYSCALL_INTERRUPT_PRIORITY */
+#define DAC_IRQ_PRIORITY	0xB0
+
 /* High 16 bits are DAC value, low 2 bits are DAC channel */
-static uint32_t dacDMABuffer[DAC_BUFFER_SIZE];
+static uint32_t dacDMABuffer[DAC_BUFFER_SIZE * 2];
 static uint32_t dacChipSelect = 0x0000FFFC;
 
 
@@ -85,8 +100,26 @@ static uint32_t ySet;
 static uint32_t zSet;
 static uint32_t biasSet;
 
+/* XYZ setpoints at the end of previously filled DAC buffer */
+static uint32_t xOut;
+static uint32_t yOut;
+static uint32_t zOut;
+
+/* Z loop is paused, Z is set by micSetHeight() */
+static volatile uint8_t zHold;
+
+/* 16->20 bit DAC extension modulators */
+static sd_state_t sdX;
+static sd_state_t sdY;
+static sd_state_t sdZ;
+
 /* ADC setpoint */
 static uint32_t adcSet;
+/* Last ADC conversion result */
+static uint32_t adcLast;
+/* Samples requested by micBurstStart() and their period, microseconds */
+static uint16_t burstCount;
+static uint16_t burstPeriod;
 
 
 void DMA1_Stream7_IRQHandler(void);
@@ -131,8 +164,7 @@ static void ledSet(uint32_t leds)
 
 static void fillDACBuffer(uint32_t *buf)
 {
-	int i;
-	uint32_t x, y, z;
+	int32_t dx, dy, dz;
 	uint32_t zdev;
 	uint32_t adc;
 
@@ -143,8 +175,11 @@ static void fillDACBuffer(uint32_t *buf)
 		zSet = 0x80000000;
 		break;
 	case AFM_ZCONTROL_ON:
+		/* ADC is owned by burst sampling while Z is held */
+		if (zHold) break;
 		if (ADC1->SR & ADC_SR_EOC) {
 			adc = ADC1->DR;
+			adcLast = adc;
 			zdev = 0x00001000;
 			/* Probe is lower */
 			if (adc > adcSet) {
@@ -160,24 +195,35 @@ static void fillDACBuffer(uint32_t *buf)
 		break;
 	}
 
-	x = xSet;
-	y = ySet;
-	z = zSet;
+	telemetrySample(zSet, (int32_t)adcLast - (int32_t)adcSet);
 
-	/* Fill buffer with sigma-delta modulated values */
-	for (i = 0; i < DAC_VALUE_COUNT; i++) {
-		x = (x & 0xFFFF) + xSet;
-		*buf++ = (x & 0xFFFF0000) | DAC_X;
-		y = (y & 0xFFFF) + ySet;
-		*buf++ = (y & 0xFFFF0000) | DAC_Y;
-		z = (z & 0xFFFF) + zSet;
-		*buf++ = (z & 0xFFFF0000) | DAC_Z;
+	/* Setpoint change is spread over the buffer as a linear ramp
+	 * instead of a step, so the piezo is not kicked on every pixel */
+	dx = ((int64_t)xSet - xOut) / DAC_VALUE_COUNT;
+	dy = ((int64_t)ySet - yOut) / DAC_VALUE_COUNT;
+	dz = ((int64_t)zSet - zOut) / DAC_VALUE_COUNT;
+
+	/* Modulator order is changed by host, restart modulators */
+	if (sdX.order != cfg.dacOrder) {
+		sdInit(&sdX, cfg.dacOrder);
+		sdInit(&sdY, cfg.dacOrder);
+		sdInit(&sdZ, cfg.dacOrder);
 	}
+
+	/* Fill buffer with sigma-delta modulated values */
+	sdModulate(&sdX, buf + 0, DAC_VALUE_COUNT, 3, xOut, dx, DAC_X);
+	sdModulate(&sdY, buf + 1, DAC_VALUE_COUNT, 3, yOut, dy, DAC_Y);
+	sdModulate(&sdZ, buf + 2, DAC_VALUE_COUNT, 3, zOut, dz, DAC_Z);
+
+	xOut = xSet;
+	yOut = ySet;
+	zOut = zSet;
 }
 
 static void dacStart(void)
 {
 	fillDACBuffer(dacDMABuffer);
+	fillDACBuffer(dacDMABuffer + DAC_BUFFER_SIZE);
 
 	/* Start SPI3 */
 	DMA1_Stream7->CR |= DMA_SxCR_EN;
@@ -195,6 +241,7 @@ void micInit()
 	cfg.afm.freq = 0;
 	cfg.stm.bias = 50;
 	cfg.stm.current = 100;
+	cfg.dacOrder = 2;
 
 	/* Zero DAC outputs */
 	xSet = 0x80000000;
@@ -202,11 +249,20 @@ void micInit()
 	zSet = 0x80000000;
 	biasSet = 0x80000000;
 	adcSet = 1000;
+	adcLast = adcSet;
+	xOut = xSet;
+	yOut = ySet;
+	zOut = zSet;
+	zHold = 0;
+
+	scanInit();
+	telemetryInit();
 
 	/***** Configure hardware *****/
 
 	/* Enable peripheral clocks */
-	RCC->AHB1ENR |= RCC_AHB1ENR_GPIOAEN | RCC_AHB1ENR_GPIOBEN | RCC_AHB1ENR_GPIOCEN | RCC_AHB1ENR_GPIODEN | RCC_AHB1ENR_DMA1EN;
+	RCC->AHB1ENR |= RCC_AHB1ENR_GPIOAEN | RCC_AHB1ENR_GPIOBEN | RCC_AHB1ENR_GPIOCEN | RCC_AHB1ENR_GPIODEN |
+			RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
 
 	/* PA2 -- ADC IN 2, Analog */
 	gpioSetMode(GPIOA, 2, 3);
@@ -254,14 +310,14 @@ void micInit()
 	/* I2Sext, slave, transmit, 32 bit */
 	I2S3ext->I2SCFGR = SPI_I2SCFGR_I2SMOD | SPI_I2SCFGR_I2SSTD_0 | SPI_I2SCFGR_DATLEN_1;
 
-	/* DMA setup: Channel 0, Memory to peripheral, 16 bit, circular mode, transfer complete interrupt */
-	DMA1_Stream7->CR = DMA_SxCR_PSIZE_0 | DMA_SxCR_MSIZE_0 | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | DMA_SxCR_TCIE;
+	/* DMA setup: Channel 0, Memory to peripheral, 16 bit, circular mode, half and full transfer interrupts */
+	DMA1_Stream7->CR = DMA_SxCR_PSIZE_0 | DMA_SxCR_MSIZE_0 | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | DMA_SxCR_HTIE | DMA_SxCR_TCIE;
 	/* DMA buffer start address */
 	DMA1_Stream7->M0AR = (uint32_t)dacDMABuffer;
 	/* Destination -- SPI3 DR */
 	DMA1_Stream7->PAR = (uint32_t)&SPI3->DR;
 	/* Data items count */
-	DMA1_Stream7->NDTR = DAC_BUFFER_SIZE * 2;
+	DMA1_Stream7->NDTR = DAC_BUFFER_SIZE * 2 * 2;
 	/* Disable direct mode */
 	DMA1_Stream7->FCR = DMA_SxFCR_DMDIS;
 
@@ -277,6 +333,7 @@ void micInit()
 	DMA1_Stream5->FCR = DMA_SxFCR_DMDIS;
 
 	/* Enable DMA IRQ */
+	NVIC->IP[DMA1_Stream7_IRQn] = DAC_IRQ_PRIORITY;
 	NVIC->ISER[1] |= (1 << (DMA1_Stream7_IRQn & 0x1F));
 	/* Enable I2S DMA */
 	SPI3->CR2 = SPI_CR2_TXDMAEN;
@@ -295,6 +352,15 @@ void micInit()
 	/* Enable ADC */
 	ADC1->CR2 = ADC_CR2_ADON;
 
+	/* Burst DMA setup: DMA2 stream 0 channel 0, peripheral to memory, 16 bit, started by micBurstStart() */
+	DMA2_Stream0->CR = DMA_SxCR_PSIZE_0 | DMA_SxCR_MSIZE_0 | DMA_SxCR_MINC;
+	DMA2_Stream0->PAR = (uint32_t)&ADC1->DR;
+
+	/* Burst sample timer, update event triggers ADC */
+	RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+	TIM2->PSC = BURST_TIMER_TICK - 1;
+	TIM2->CR2 = TIM_CR2_MMS_1;
+
 
 	/* Start piezo DAC */
 	dacStart();
@@ -307,8 +373,109 @@ config_t *micGetConfig(void)
 	return &cfg;
 }
 
+void micSetPosition(uint32_t x, uint32_t y)
+{
+	xSet = x;
+	ySet = y;
+}
+
+void micGetPosition(uint32_t *x, uint32_t *y)
+{
+	*x = xSet;
+	*y = ySet;
+}
+
+uint16_t micGetHeight(void)
+{
+	return zSet >> 16;
+}
+
+/* Pause Z loop, returns Z at the moment */
+uint32_t micHoldHeight(void)
+{
+	zHold = 1;
+
+	return zSet;
+}
+
+void micReleaseHeight(void)
+{
+	zHold = 0;
+}
+
+/* Z setpoint while the loop is held */
+void micSetHeight(uint32_t z)
+{
+	if (zHold) zSet = z;
+}
+
+/* Sample ADC count times into buf, one sample every period (2 or more) microseconds.
+ * Conversions are started by timer and stored by DMA, so sample timing
+ * does not depend on interrupt latency. Z loop must be held. */
+void micBurstStart(uint16_t *buf, uint16_t count, uint16_t period)
+{
+	TIM2->CR1 = 0;
+	DMA2_Stream0->CR &= ~DMA_SxCR_EN;
+	DMA2->LIFCR = DMA_LIFCR_CTCIF0 | DMA_LIFCR_CHTIF0 | DMA_LIFCR_CTEIF0 | DMA_LIFCR_CDMEIF0 | DMA_LIFCR_CFEIF0;
+
+	burstCount = count;
+	burstPeriod = period;
+	DMA2_Stream0->M0AR = (uint32_t)buf;
+	DMA2_Stream0->NDTR = count;
+	DMA2_Stream0->CR |= DMA_SxCR_EN;
+
+	/* TIM2 TRGO, rising edge */
+	ADC1->SR = 0;
+	ADC1->CR2 = ADC_CR2_ADON | ADC_CR2_DMA | ADC_CR2_EXTEN_0 | ADC_CR2_EXTSEL_1 | ADC_CR2_EXTSEL_2;
+
+	TIM2->ARR = period - 1;
+	TIM2->CNT = 0;
+	TIM2->EGR = TIM_EGR_UG;
+	TIM2->CR1 = TIM_CR1_CEN;
+}
+
+/* Samples stored so far */
+uint16_t micBurstDone(void)
+{
+	return burstCount - DMA2_Stream0->NDTR;
+}
+
+/* Samples expected to be stored when the DAC buffer filled after this
+ * scan tick has been sent. Z set now is reached only then: the buffer
+ * waits for the one being sent, and Z ramps to the setpoint across it. */
+uint16_t micBurstAhead(void)
+{
+	uint32_t n = micBurstDone() + (2 * DAC_BUFFER_NS + burstPeriod * 500) / (burstPeriod * 1000);
+
+	return (n < burstCount) ? n : burstCount;
+}
+
+/* ADC goes back to software start by Z loop */
+void micBurstStop(void)
+{
+	TIM2->CR1 = 0;
+	DMA2_Stream0->CR &= ~DMA_SxCR_EN;
+	ADC1->CR2 = ADC_CR2_ADON;
+	ADC1->SR = 0;
+}
+
 void DMA1_Stream7_IRQHandler()
 {
-	/* Clear interrupt flag */
-	DMA1->HIFCR = DMA_HIFCR_CTCIF7;
+	uint32_t isr = DMA1->HISR;
+
+	/* First half is sent, DMA is working on second one */
+	if (isr & DMA_HISR_HTIF7) {
+		DMA1->HIFCR = DMA_HIFCR_CHTIF7;
+		scanTick();
+		fillDACBuffer(dacDMABuffer);
+		telemetryTick();
+	}
+
+	/* Second half is sent */
+	if (isr & DMA_HISR_TCIF7) {
+		DMA1->HIFCR = DMA_HIFCR_CTCIF7;
+		scanTick();
+		fillDACBuffer(dacDMABuffer + DAC_BUFFER_SIZE);
+		telemetryTick();
+	}
 }
@@ -11,10 +11,21 @@ typedef struct {
 	uint8_t				zcontrol;
 	struct afmAFMProp	afm;
 	struct afmSTMProp	stm;
+	uint8_t				dacOrder;	/* DAC sigma-delta modulator order */
 } config_t;
 
 void micInit(void);
 config_t *micGetConfig(void);
+void micSetPosition(uint32_t x, uint32_t y);
+void micGetPosition(uint32_t *x, uint32_t *y);
+uint16_t micGetHeight(void);
+uint32_t micHoldHeight(void);
+void micReleaseHeight(void);
+void micSetHeight(uint32_t z);
+void micBurstStart(uint16_t *buf, uint16_t count, uint16_t period);
+uint16_t micBurstDone(void);
+uint16_t micBurstAhead(void);
+void micBurstStop(void);
 
 
 #endif /* MICROSCOPE_H_ */
@@ -87,6 +87,105 @@ struct afmRun {
 #define AFM_STOP					0x09
 
 
+/* Start trajectory (vector scan) mode
+ * Waypoints are streamed by the host over EP1 OUT (see AFM_PATH_DATA below)
+ * into the firmware FIFO of AFM_PATH_FIFO_SIZE points. The host may only send
+ * as many points as it has credits for; initial credit equals FIFO size, and
+ * consumed points are returned in AFM_PATH_CREDIT messages.
+ */
+#define AFM_PATH_START				0x0A
+
+#define AFM_PATH_FIFO_SIZE		256
+#define AFM_PATH_CREDIT_CHUNK	32		/* Credits are sent after this many points, or when FIFO drains */
+#define AFM_DAC_BUFFER_US		492		/* DAC buffer period, rounded up */
+
+struct afmPathStart {
+	uint16_t	period;				/* DAC buffer periods per waypoint */
+} __PACKED__;
+
+struct afmPathPoint {
+	int32_t		x;					/* Waypoint X, in nanometers */
+	int32_t		y;					/* Waypoint Y, in nanometers */
+} __PACKED__;
+
+
+/* Get/Set piezo DAC 16->20 bit extension mode */
+#define AFM_GET_DAC_MODE			0x0B
+#define AFM_SET_DAC_MODE			0x0C
+
+struct afmDACMode {
+	uint8_t		order;				/* Sigma-delta noise shaping order, 1..3 */
+} __PACKED__;
+
+
+/* Get/Set Z loop telemetry
+ * Every decimation-th control loop sample is sent in AFM_TELEMETRY messages.
+ * Zero decimation turns telemetry off.
+ */
+#define AFM_GET_TELEMETRY			0x0D
+#define AFM_SET_TELEMETRY			0x0E
+
+struct afmTelemetry {
+	uint16_t	decimation;			/* Control loop periods per sample */
+} __PACKED__;
+
+
+/* Start continuous (movie) scanning
+ * Raster of run is restarted right after its last line without host
+ * involvement, every frame is sent as AFM_IMAGE_START ... AFM_IMAGE_END.
+ * Stops after given number of frames, or on AFM_STOP if frames is 0.
+ */
+#define AFM_RUN_MOVIE				0x0F
+
+struct afmRunMovie {
+	struct afmRun	run;
+	uint16_t		frames;			/* Number of frames, 0 is unlimited */
+} __PACKED__;
+
+
+/* Start adaptive raster scan
+ * Every step-th line and the last line are scanned first (coarse pass).
+ * Then the line in the middle of two scanned lines is scanned while their
+ * heights differ by threshold or more somewhere along the line, so lines
+ * are added only where the surface changes. Lines are sent in scan order,
+ * lines never scanned are left for the host to interpolate.
+ */
+#define AFM_RUN_ADAPTIVE			0x10
+
+#define AFM_ADAPTIVE_MAX_STEP		128
+#define AFM_ADAPTIVE_MAX_COARSE		256	/* Lines of coarse pass */
+
+struct afmRunAdaptive {
+	struct afmRun	run;
+	uint8_t			step;			/* Coarse line step, 1..AFM_ADAPTIVE_MAX_STEP */
+	uint16_t		threshold;		/* Height difference, in height units */
+} __PACKED__;
+
+
+/* Force spectroscopy at one point
+ * Probe is moved to (x, y) with Z loop running, then the loop is held and
+ * Z is ramped from the height reached there by travel height units
+ * (approach) and back (retract). ADC is sampled points times each way,
+ * one sample every period microseconds, by timer triggered DMA. Z is set
+ * ahead by the DAC buffer latency, so sample i of approach is taken at
+ * travel * i / points.
+ * Curve is sent as AFM_SPECTRO_START, AFM_SPECTRO_DATA and AFM_SPECTRO_END,
+ * Z loop is running again after it. Z loop must not be off.
+ */
+#define AFM_SPECTRO					0x11
+
+#define AFM_SPECTRO_MAX_POINTS		1024	/* Samples each way */
+#define AFM_SPECTRO_MIN_PERIOD		2		/* Shortest sample period, microseconds */
+
+struct afmSpectro {
+	int32_t			x;				/* In nanometers */
+	int32_t			y;
+	int16_t			travel;			/* Z ramp, in height units */
+	uint16_t		points;			/* Samples each way, 2..AFM_SPECTRO_MAX_POINTS */
+	uint16_t		period;			/* Sample period, in microseconds, from AFM_SPECTRO_MIN_PERIOD */
+} __PACKED__;
+
+
 /* All packet types in one union */
 typedef union {
 	struct afmGetFirmwareVersion afmGetFirmwareVersion;
@@ -96,6 +195,12 @@ typedef union {
 	struct afmAFMProp afmAFMProp;
 	struct afmSTMProp afmSTMProp;
 	struct afmRun afmRun;
+	struct afmPathStart afmPathStart;
+	struct afmDACMode afmDACMode;
+	struct afmTelemetry afmTelemetry;
+	struct afmRunMovie afmRunMovie;
+	struct afmRunAdaptive afmRunAdaptive;
+	struct afmSpectro afmSpectro;
 } afm_t;
 
 
@@ -108,4 +213,87 @@ typedef union {
 #define AFM_IMAGE_DATA				0x81
 #define AFM_IMAGE_END				0x82
 
+struct afmImageStart {
+	uint16_t	res;				/* Image size, in pixels */
+} __PACKED__;
+
+/* Every line is scanned twice: forward (trace) and backward (retrace).
+ * Pixel index is in image coordinates for both directions, so samples
+ * go to pixel, pixel + 1, ... for trace and pixel, pixel - 1, ... for retrace.
+ */
+#define AFM_IMAGE_DATA_POINTS		4
+
+#define AFM_IMAGE_FLAG_RETRACE		0x01	/* Backward pass */
+#define AFM_IMAGE_FLAG_EOL			0x02	/* Last samples of the pass */
+
+struct afmImageData {
+	uint16_t	line;
+	uint16_t	pixel;				/* Pixel index of first sample */
+	uint8_t		flags;
+	uint16_t	z[AFM_IMAGE_DATA_POINTS];	/* Height samples, may be less than AFM_IMAGE_DATA_POINTS */
+} __PACKED__;
+
+/* Trajectory FIFO credit: number of waypoints consumed since last credit */
+#define AFM_PATH_CREDIT				0x83
+
+struct afmPathCredit {
+	uint16_t	credits;
+	uint16_t	underruns;			/* FIFO underruns since AFM_PATH_START */
+} __PACKED__;
+
+/* Trajectory is completed, no data */
+#define AFM_PATH_DONE				0x84
+
+/* Z loop telemetry samples
+ * Samples are sent with lower priority than image data and are dropped
+ * when the link can not keep up; gaps show up as jumps in seq.
+ */
+#define AFM_TELEMETRY				0x85
+
+#define AFM_TELEMETRY_POINTS		3
+
+struct afmTelemetrySample {
+	uint16_t	z;					/* Z setpoint, high 16 bits of DAC value */
+	int16_t		error;				/* ADC value minus ADC setpoint */
+} __PACKED__;
+
+struct afmTelemetryData {
+	uint16_t	seq;				/* Sample number of first sample */
+	struct afmTelemetrySample s[AFM_TELEMETRY_POINTS];
+} __PACKED__;
+
+
+/* Force curve of AFM_SPECTRO
+ * Data blocks carry ADC samples of approach followed by retract,
+ * index is the number of the first sample in the block.
+ */
+#define AFM_SPECTRO_START			0x86
+#define AFM_SPECTRO_DATA			0x87
+#define AFM_SPECTRO_END				0x88
+
+#define AFM_SPECTRO_DATA_POINTS		6
+
+struct afmSpectroStart {
+	uint16_t	points;				/* Samples each way */
+	uint16_t	height;				/* Z at ramp start, height units */
+	int16_t		travel;
+	uint16_t	period;
+} __PACKED__;
+
+struct afmSpectroData {
+	uint16_t	index;
+	uint16_t	adc[AFM_SPECTRO_DATA_POINTS];	/* May be less than AFM_SPECTRO_DATA_POINTS */
+} __PACKED__;
+
+
+/* Data messages transferred over EP1 OUT
+ * Same format as EP1 IN messages, but message can not cross USB packet boundary.
+ *
+ */
+
+/* Array of struct afmPathPoint */
+#define AFM_PATH_DATA				0x40
+/* Last waypoint was sent, no data */
+#define AFM_PATH_END				0x41
+
 #endif /* PROTOCOL_H_ */
@@ -0,0 +1,710 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include "scan.h"
+#include "microscope.h"
+#include "usb.h"
+
+/* Scan engine
+ *
+ * scanTick() is called from DMA interrupt once per DAC buffer period,
+ * right before the buffer is refilled with new setpoints.
+ */
+
+#define SCAN_IDLE			0
+#define SCAN_PATH			1
+#define SCAN_RASTER			2
+#define SCAN_SPECTRO		3
+
+/* Raster scan states */
+#define RASTER_START		0
+#define RASTER_MOVE			1
+#define RASTER_PIXEL		2
+#define RASTER_SEND			3
+#define RASTER_END			4
+#define RASTER_NEXT			5	/* Adaptive scan is choosing the next line */
+
+/* Adaptive scan
+ * Lines are compared by minimum and maximum height in each of
+ * ADAPTIVE_SEGMENTS parts of the trace pass.
+ */
+#define ADAPTIVE_SEGMENTS	8
+#define ADAPTIVE_MAX_DEPTH	8		/* Bisection depth, log2 of AFM_ADAPTIVE_MAX_STEP plus one */
+#define ADAPTIVE_STACK		(ADAPTIVE_MAX_DEPTH + 2)
+#define ADAPTIVE_SPANS		4		/* Spans checked per tick */
+#define ADAPTIVE_BUSY		-2
+
+/* Force spectroscopy states */
+#define SPECTRO_MOVE		0
+#define SPECTRO_RAMP		1
+#define SPECTRO_SEND		2
+#define SPECTRO_END			3
+
+
+
+static volatile uint8_t scanMode;
+
+/* Point to point move with acceleration limited (trapezoidal) velocity profile.
+ * Path parameter runs from 0 to moveLength along the straight line.
+ */
+static uint32_t moveFromX, moveFromY;
+static uint32_t moveToX, moveToY;
+static int64_t moveLength;
+static int64_t movePos;
+static int64_t moveSpeed;
+
+/* Raster scan */
+static struct afmRun run;
+static uint8_t rasterState;
+static uint16_t rasterLine;
+static uint16_t rasterPixel;
+static uint8_t rasterRetrace;
+static uint16_t rasterDwell;
+static struct afmImageData rasterData;
+static uint8_t rasterCount;
+static uint16_t rasterFrames;		/* Frames to scan, 0 is unlimited */
+static uint16_t rasterFrame;
+static uint8_t rasterAdaptive;
+
+/* Adaptive scan state
+ * Spans between two scanned lines are bisected depth first, so at most
+ * one mid line signature per depth is alive.
+ */
+struct adaptiveSig {
+	uint16_t min[ADAPTIVE_SEGMENTS];
+	uint16_t max[ADAPTIVE_SEGMENTS];
+};
+
+struct adaptiveSpan {
+	uint16_t a, b;					/* Scanned lines, a < b */
+	const struct adaptiveSig *sa;
+	const struct adaptiveSig *sb;
+	uint8_t depth;
+};
+
+static uint8_t adaptiveStep;
+static uint16_t adaptiveThreshold;
+static uint16_t adaptiveCoarseCount;
+static uint16_t adaptiveBand;		/* Next coarse band to refine */
+static int32_t adaptiveNextLine;	/* Coarse line scanned next, -1 in refine phase */
+static struct adaptiveSig adaptiveSig;	/* Line being scanned */
+static struct adaptiveSig adaptiveCoarse[AFM_ADAPTIVE_MAX_COARSE];
+static struct adaptiveSig adaptiveMid[ADAPTIVE_MAX_DEPTH];
+static struct adaptiveSpan adaptiveStack[ADAPTIVE_STACK];
+static uint8_t adaptiveTop;
+static struct adaptiveSpan adaptiveSplit;	/* Span whose mid line is being scanned */
+
+/* Force spectroscopy state */
+static struct afmSpectro spectro;
+static uint8_t spectroState;
+static uint32_t spectroBase;		/* Z at ramp start */
+static uint16_t spectroSent;
+static uint16_t spectroBuf[AFM_SPECTRO_MAX_POINTS * 2];
+
+/* Trajectory FIFO
+ * Single producer (USB interrupt) and single consumer (DMA interrupt),
+ * so head and tail indices need no locking. One slot is always kept empty.
+ */
+#define PATH_FIFO_SLOTS		(AFM_PATH_FIFO_SIZE + 1)
+
+static struct afmPathPoint pathFifo[PATH_FIFO_SLOTS];
+static volatile uint16_t pathHead;
+static volatile uint16_t pathTail;
+static volatile uint8_t pathEnd;
+static uint16_t pathPeriod;
+static uint16_t pathCounter;
+static uint16_t pathCredits;
+static uint16_t pathUnderruns;
+
+
+static uint32_t scanNmToDac(int32_t nm)
+{
+	int64_t v;
+
+	v = (int64_t)nm * SCAN_DAC_PER_NM + 0x80000000LL;
+	if (v < 0) v = 0;
+	if (v > 0xFFFFFFFFLL) v = 0xFFFFFFFFLL;
+
+	return (uint32_t)v;
+}
+
+void scanInit()
+{
+	scanMode = SCAN_IDLE;
+	pathHead = 0;
+	pathTail = 0;
+}
+
+int scanIsRunning()
+{
+	return (scanMode != SCAN_IDLE);
+}
+
+void scanStop()
+{
+	scanMode = SCAN_IDLE;
+	/* Z loop is released if force curve was running */
+	micBurstStop();
+	micReleaseHeight();
+}
+
+/***** Smooth moves *****/
+
+static void scanMoveStart(uint32_t x, uint32_t y)
+{
+	int64_t dx, dy;
+
+	micGetPosition(&moveFromX, &moveFromY);
+	moveToX = x;
+	moveToY = y;
+
+	dx = (int64_t)x - moveFromX;
+	dy = (int64_t)y - moveFromY;
+	if (dx < 0) dx = -dx;
+	if (dy < 0) dy = -dy;
+
+	/* Chebyshev distance keeps per-axis speed within the limit */
+	moveLength = (dx > dy) ? dx : dy;
+	movePos = 0;
+	moveSpeed = 0;
+}
+
+/* Advance move by one tick, returns 1 when target is reached */
+static int scanMoveTick(void)
+{
+	const int64_t accel = (int64_t)SCAN_MOVE_ACCEL * SCAN_DAC_PER_NM;
+	const int64_t vmax = (int64_t)SCAN_MOVE_SPEED * SCAN_DAC_PER_NM;
+	int64_t left;
+	uint32_t x, y;
+
+	left = moveLength - movePos;
+
+	/* Brake when remaining distance is close to the braking distance */
+	if (moveSpeed * moveSpeed > 2 * accel * left) {
+		moveSpeed -= accel;
+		if (moveSpeed < accel) moveSpeed = accel;
+	} else if (moveSpeed < vmax) {
+		moveSpeed += accel;
+		if (moveSpeed > vmax) moveSpeed = vmax;
+	}
+
+	movePos += moveSpeed;
+	if (movePos >= moveLength) {
+		micSetPosition(moveToX, moveToY);
+		return 1;
+	}
+
+	x = moveFromX + ((int64_t)moveToX - moveFromX) * movePos / moveLength;
+	y = moveFromY + ((int64_t)moveToY - moveFromY) * movePos / moveLength;
+	micSetPosition(x, y);
+
+	return 0;
+}
+
+/***** Raster scan *****/
+
+static void scanAdaptiveSigReset(void)
+{
+	int i;
+
+	for (i = 0; i < ADAPTIVE_SEGMENTS; i++) {
+		adaptiveSig.min[i] = 0xFFFF;
+		adaptiveSig.max[i] = 0;
+	}
+}
+
+/* Each line is scanned forward (trace) and backward (retrace),
+ * both passes are sent to the host with direction flag.
+ */
+static void scanRasterRestart(void)
+{
+	rasterState = RASTER_START;
+	rasterLine = 0;
+	rasterPixel = 0;
+	rasterRetrace = 0;
+	rasterDwell = 0;
+	rasterCount = 0;
+	scanAdaptiveSigReset();
+}
+
+static int scanRasterStart(struct afmRun *p, uint16_t frames, uint8_t adaptive)
+{
+	if (scanMode != SCAN_IDLE) return 0;
+	if (!p->res) return 0;
+
+	run = *p;
+	rasterFrames = frames;
+	rasterFrame = 0;
+	rasterAdaptive = adaptive;
+	scanRasterRestart();
+
+	scanMode = SCAN_RASTER;
+
+	return 1;
+}
+
+int scanRun(struct afmRun *p)
+{
+	return scanRasterStart(p, 1, 0);
+}
+
+/* Same raster repeated, next frame starts right after the last line */
+int scanRunMovie(struct afmRunMovie *p)
+{
+	return scanRasterStart(&p->run, p->frames, 0);
+}
+
+/* Line scanned in the coarse pass */
+static uint16_t scanAdaptiveCoarseLine(uint16_t index)
+{
+	uint32_t line = (uint32_t)index * adaptiveStep;
+
+	if (line >= run.res) line = run.res - 1;
+
+	return line;
+}
+
+int scanRunAdaptive(struct afmRunAdaptive *p)
+{
+	uint32_t count;
+
+	if (scanMode != SCAN_IDLE) return 0;
+	if (!p->run.res || !p->step || (p->step > AFM_ADAPTIVE_MAX_STEP)) return 0;
+
+	/* Every step-th line and the last one */
+	count = ((uint32_t)p->run.res - 1 + p->step - 1) / p->step + 1;
+	if (count > AFM_ADAPTIVE_MAX_COARSE) return 0;
+
+	adaptiveStep = p->step;
+	adaptiveThreshold = p->threshold;
+	adaptiveCoarseCount = count;
+	adaptiveBand = 0;
+	adaptiveNextLine = 0;
+	adaptiveTop = 0;
+
+	return scanRasterStart(&p->run, 1, 1);
+}
+
+static void scanAdaptiveSample(uint16_t pixel, uint16_t z)
+{
+	uint32_t seg = (uint32_t)pixel * ADAPTIVE_SEGMENTS / run.res;
+
+	if (z < adaptiveSig.min[seg]) adaptiveSig.min[seg] = z;
+	if (z > adaptiveSig.max[seg]) adaptiveSig.max[seg] = z;
+}
+
+/* Largest height difference of two lines */
+static uint16_t scanAdaptiveMetric(const struct adaptiveSig *a, const struct adaptiveSig *b)
+{
+	uint16_t d, m = 0;
+	int i;
+
+	for (i = 0; i < ADAPTIVE_SEGMENTS; i++) {
+		d = (a->min[i] > b->min[i]) ? a->min[i] - b->min[i] : b->min[i] - a->min[i];
+		if (d > m) m = d;
+		d = (a->max[i] > b->max[i]) ? a->max[i] - b->max[i] : b->max[i] - a->max[i];
+		if (d > m) m = d;
+	}
+
+	return m;
+}
+
+static void scanAdaptivePush(uint16_t a, uint16_t b, const struct adaptiveSig *sa,
+		const struct adaptiveSig *sb, uint8_t depth)
+{
+	struct adaptiveSpan *s = &adaptiveStack[adaptiveTop++];
+
+	s->a = a;
+	s->b = b;
+	s->sa = sa;
+	s->sb = sb;
+	s->depth = depth;
+}
+
+/* Keep signature of the line just scanned */
+static void scanAdaptiveLineDone(void)
+{
+	struct adaptiveSpan *s = &adaptiveSplit;
+	uint16_t mid;
+
+	if (adaptiveNextLine >= 0) {
+		/* Coarse pass, lines go in order */
+		adaptiveCoarse[adaptiveNextLine] = adaptiveSig;
+		if (++adaptiveNextLine >= adaptiveCoarseCount) adaptiveNextLine = -1;
+		return;
+	}
+
+	/* Both halves of the split span are checked, lower one first */
+	mid = (s->a + s->b) / 2;
+	adaptiveMid[s->depth] = adaptiveSig;
+	scanAdaptivePush(mid, s->b, &adaptiveMid[s->depth], s->sb, s->depth + 1);
+	scanAdaptivePush(s->a, mid, s->sa, &adaptiveMid[s->depth], s->depth + 1);
+}
+
+/* Next line to scan, -1 when done or ADAPTIVE_BUSY to be called again
+ * on the next tick, which keeps interrupt time bounded */
+static int32_t scanAdaptiveFind(void)
+{
+	struct adaptiveSpan *s;
+	int n;
+
+	if (adaptiveNextLine >= 0) return scanAdaptiveCoarseLine(adaptiveNextLine);
+
+	for (n = 0; n < ADAPTIVE_SPANS; n++) {
+		if (!adaptiveTop) {
+			if (adaptiveBand + 1 >= adaptiveCoarseCount) return -1;
+			scanAdaptivePush(scanAdaptiveCoarseLine(adaptiveBand), scanAdaptiveCoarseLine(adaptiveBand + 1),
+					&adaptiveCoarse[adaptiveBand], &adaptiveCoarse[adaptiveBand + 1], 0);
+			adaptiveBand++;
+		}
+
+		s = &adaptiveStack[--adaptiveTop];
+		if ((s->b - s->a > 1) && (scanAdaptiveMetric(s->sa, s->sb) >= adaptiveThreshold)) {
+			adaptiveSplit = *s;
+			return (s->a + s->b) / 2;
+		}
+	}
+
+	return ADAPTIVE_BUSY;
+}
+
+static void scanRasterPosition(int smooth)
+{
+	int32_t x, y;
+
+	x = run.startX + (int32_t)((uint32_t)rasterPixel * run.size / run.res);
+	y = run.startY + (int32_t)((uint32_t)rasterLine * run.size / run.res);
+
+	if (smooth) {
+		scanMoveStart(scanNmToDac(x), scanNmToDac(y));
+		rasterState = RASTER_MOVE;
+	} else {
+		micSetPosition(scanNmToDac(x), scanNmToDac(y));
+	}
+}
+
+/* Move to the next pixel, returns 1 at the end of the pass */
+static int scanRasterNext(void)
+{
+	if (!rasterRetrace) {
+		if (rasterPixel + 1 < run.res) {
+			rasterPixel++;
+			return 0;
+		}
+		return 1;
+	}
+
+	if (rasterPixel > 0) {
+		rasterPixel--;
+		return 0;
+	}
+	return 1;
+}
+
+static void scanRasterTick(void)
+{
+	struct afmImageStart start;
+	int32_t next;
+	int eol;
+
+	switch (rasterState) {
+	case RASTER_START:
+		start.res = run.res;
+		if (!usbSendFromISR(AFM_IMAGE_START, &start, sizeof(start))) return;
+		/* Fly to the first pixel */
+		scanRasterPosition(1);
+		break;
+
+	case RASTER_MOVE:
+		if (scanMoveTick()) rasterState = RASTER_PIXEL;
+		break;
+
+	case RASTER_PIXEL:
+		/* Wait for probe to settle on the pixel */
+		if (++rasterDwell < SCAN_PIXEL_TICKS) return;
+		rasterDwell = 0;
+
+		if (!rasterCount) {
+			rasterData.line = rasterLine;
+			rasterData.pixel = rasterPixel;
+			rasterData.flags = rasterRetrace ? AFM_IMAGE_FLAG_RETRACE : 0;
+		}
+		rasterData.z[rasterCount] = micGetHeight();
+		if (rasterAdaptive && !rasterRetrace) scanAdaptiveSample(rasterPixel, rasterData.z[rasterCount]);
+		rasterCount++;
+
+		eol = scanRasterNext();
+		if (eol) rasterData.flags |= AFM_IMAGE_FLAG_EOL;
+		if (eol || (rasterCount == AFM_IMAGE_DATA_POINTS)) {
+			rasterState = RASTER_SEND;
+		} else {
+			scanRasterPosition(0);
+			break;
+		}
+		/* no break */
+
+	case RASTER_SEND:
+		/* Hold the probe while host is not reading data */
+		if (!usbSendFromISR(AFM_IMAGE_DATA, &rasterData,
+				sizeof(rasterData) - (AFM_IMAGE_DATA_POINTS - rasterCount) * sizeof(rasterData.z[0]))) return;
+
+		rasterState = RASTER_PIXEL;
+		rasterCount = 0;
+		if (rasterData.flags & AFM_IMAGE_FLAG_EOL) {
+			if (!rasterRetrace) {
+				/* Go back along the same line */
+				rasterRetrace = 1;
+			} else {
+				rasterRetrace = 0;
+				if (rasterAdaptive) {
+					scanAdaptiveLineDone();
+					rasterState = RASTER_NEXT;
+					break;
+				}
+				if (++rasterLine >= run.res) {
+					rasterState = RASTER_END;
+					break;
+				}
+				/* Step to the next line */
+				scanRasterPosition(1);
+				break;
+			}
+		}
+		scanRasterPosition(0);
+		break;
+
+	case RASTER_NEXT:
+		next = scanAdaptiveFind();
+		if (next == ADAPTIVE_BUSY) break;
+		if (next < 0) {
+			rasterState = RASTER_END;
+			break;
+		}
+		rasterLine = next;
+		scanAdaptiveSigReset();
+		/* Move to the line, which may be anywhere in the frame */
+		scanRasterPosition(1);
+		break;
+
+	case RASTER_END:
+		if (!usbSendFromISR(AFM_IMAGE_END, NULL, 0)) return;
+		if (!rasterFrames || (++rasterFrame < rasterFrames)) {
+			/* Movie: fly back and start the next frame */
+			scanRasterRestart();
+			break;
+		}
+		scanMode = SCAN_IDLE;
+		break;
+	}
+}
+
+/***** Trajectory mode *****/
+
+int scanPathStart(struct afmPathStart *p)
+{
+	if (scanMode != SCAN_IDLE) return 0;
+
+	pathHead = 0;
+	pathTail = 0;
+	pathEnd = 0;
+	pathPeriod = (p->period) ? p->period : 1;
+	pathCounter = 0;
+	pathCredits = 0;
+	pathUnderruns = 0;
+
+	scanMode = SCAN_PATH;
+
+	return 1;
+}
+
+/* Parse EP1 OUT packet with waypoints */
+void scanPathData(uint8_t *buf, uint32_t len)
+{
+	uint8_t *end = buf + len;
+	uint8_t cmd, datalen;
+	uint16_t next;
+	struct afmPathPoint *pt;
+
+	if (scanMode != SCAN_PATH) return;
+
+	while (buf + 2 <= end) {
+		cmd = *buf++;
+		if (!cmd) continue;
+		datalen = *buf++;
+		if (buf + datalen > end) break;
+
+		switch (cmd) {
+		case AFM_PATH_DATA:
+			for (pt = (struct afmPathPoint *)buf; datalen >= sizeof(*pt); pt++, datalen -= sizeof(*pt)) {
+				next = (pathHead + 1) % PATH_FIFO_SLOTS;
+				/* Host has sent more than it has credits for */
+				if (next == pathTail) break;
+				pathFifo[pathHead] = *pt;
+				pathHead = next;
+			}
+			break;
+		case AFM_PATH_END:
+			pathEnd = 1;
+			break;
+		}
+
+		buf += datalen;
+	}
+}
+
+static void scanPathCredit(int force)
+{
+	struct afmPathCredit msg;
+
+	if (!pathCredits) return;
+	if ((pathCredits < AFM_PATH_CREDIT_CHUNK) && !force) return;
+
+	msg.credits = pathCredits;
+	msg.underruns = pathUnderruns;
+	/* Queue is full -- keep credits and try again on next tick */
+	if (usbSendFromISR(AFM_PATH_CREDIT, &msg, sizeof(msg))) pathCredits = 0;
+}
+
+static void scanPathTick(void)
+{
+	struct afmPathPoint *pt;
+
+	if (++pathCounter < pathPeriod) return;
+	pathCounter = 0;
+
+	if (pathTail == pathHead) {
+		if (pathEnd) {
+			/* Last credits are not needed by host anymore */
+			if (usbSendFromISR(AFM_PATH_DONE, NULL, 0)) scanMode = SCAN_IDLE;
+			return;
+		}
+		/* FIFO underrun, hold current position */
+		pathUnderruns++;
+		scanPathCredit(1);
+		return;
+	}
+
+	pt = &pathFifo[pathTail];
+	micSetPosition(scanNmToDac(pt->x), scanNmToDac(pt->y));
+	pathTail = (pathTail + 1) % PATH_FIFO_SLOTS;
+
+	pathCredits++;
+	/* Return credits early when FIFO is about to drain */
+	scanPathCredit(pathTail == pathHead);
+}
+
+/***** Force spectroscopy *****/
+
+int scanSpectro(struct afmSpectro *p)
+{
+	if (scanMode != SCAN_IDLE) return 0;
+	if ((p->points < 2) || (p->points > AFM_SPECTRO_MAX_POINTS)) return 0;
+	/* Timer does not count with zero reload value */
+	if (p->period < AFM_SPECTRO_MIN_PERIOD) return 0;
+	/* Z is not kept while loop is off */
+	if (micGetConfig()->zcontrol == AFM_ZCONTROL_OFF) return 0;
+
+	spectro = *p;
+	spectroState = SPECTRO_MOVE;
+	scanMoveStart(scanNmToDac(p->x), scanNmToDac(p->y));
+
+	scanMode = SCAN_SPECTRO;
+
+	return 1;
+}
+
+/* Z at sample number done: approach, then back */
+static void scanSpectroRamp(uint16_t done)
+{
+	uint32_t k = (done <= spectro.points) ? done : 2 * spectro.points - done;
+	int64_t z = spectroBase + ((int64_t)spectro.travel << 16) * k / spectro.points;
+
+	if (z < 0) z = 0;
+	if (z > 0xFFFFFFFFLL) z = 0xFFFFFFFFLL;
+	micSetHeight((uint32_t)z);
+}
+
+static void scanSpectroTick(void)
+{
+	struct afmSpectroStart start;
+	struct afmSpectroData data;
+	uint16_t done, total;
+	int n, i;
+
+	total = spectro.points * 2;
+
+	switch (spectroState) {
+	case SPECTRO_MOVE:
+		/* Z loop follows the surface while moving */
+		if (!scanMoveTick()) break;
+		start.points = spectro.points;
+		start.height = micGetHeight();
+		start.travel = spectro.travel;
+		start.period = spectro.period;
+		if (!usbSendFromISR(AFM_SPECTRO_START, &start, sizeof(start))) break;
+		spectroBase = micHoldHeight();
+		micBurstStart(spectroBuf, total, spectro.period);
+		/* Z leads by the DAC latency, so it matches each sample taken */
+		scanSpectroRamp(micBurstAhead());
+		spectroState = SPECTRO_RAMP;
+		break;
+
+	case SPECTRO_RAMP:
+		done = micBurstDone();
+		scanSpectroRamp(micBurstAhead());
+		if (done < total) break;
+		micBurstStop();
+		micReleaseHeight();
+		spectroSent = 0;
+		spectroState = SPECTRO_SEND;
+		break;
+
+	case SPECTRO_SEND:
+		for (n = 0; (n < SCAN_SPECTRO_SEND) && (spectroSent < total); n++) {
+			data.index = spectroSent;
+			for (i = 0; (i < AFM_SPECTRO_DATA_POINTS) && (spectroSent + i < total); i++)
+				data.adc[i] = spectroBuf[spectroSent + i];
+			if (!usbSendFromISR(AFM_SPECTRO_DATA, &data,
+					sizeof(data.index) + i * sizeof(data.adc[0]))) break;
+			spectroSent += i;
+		}
+		if (spectroSent >= total) spectroState = SPECTRO_END;
+		break;
+
+	case SPECTRO_END:
+		if (!usbSendFromISR(AFM_SPECTRO_END, NULL, 0)) break;
+		scanMode = SCAN_IDLE;
+		break;
+	}
+}
+
+/***** Scan engine tick *****/
+
+void scanTick()
+{
+	switch (scanMode) {
+	case SCAN_PATH:
+		scanPathTick();
+		break;
+	case SCAN_RASTER:
+		scanRasterTick();
+		break;
+	case SCAN_SPECTRO:
+		scanSpectroTick();
+		break;
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+
+#include <FreeRTOS.h>
+#include "protocol.h"
+
+
+/* Piezo XY sensitivity: DAC units (32 bit) per nanometer,
+ * assuming +-5 um scanner range over full DAC scale */
+#define SCAN_DAC_PER_NM		429497
+
+/* Pixel dwell time, in DAC buffer periods */
+#define SCAN_PIXEL_TICKS	2
+
+/* Limits for large moves (line start, flyback), in nanometers per DAC buffer period */
+#define SCAN_MOVE_SPEED		20		/* Maximum speed */
+#define SCAN_MOVE_ACCEL		1		/* Maximum acceleration, per period */
+
+/* Force curve data messages sent per DAC buffer period */
+#define SCAN_SPECTRO_SEND	4
+
+void scanInit(void);
+void scanTick(void);
+int scanIsRunning(void);
+void scanStop(void);
+int scanRun(struct afmRun *p);
+int scanRunMovie(struct afmRunMovie *p);
+int scanRunAdaptive(struct afmRunAdaptive *p);
+int scanSpectro(struct afmSpectro *p);
+int scanPathStart(struct afmPathStart *p);
+void scanPathData(uint8_t *buf, uint32_t len);
+
+
+#endif /* SCAN_H_ */
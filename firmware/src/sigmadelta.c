@@ -0,0 +1,107 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include "sigmadelta.h"
+
+/* Error feedback modulator
+ *
+ * u[n] = v[n] - sum(h[k] * e[n-k])
+ * y[n] = u[n] & 0xFFFF0000
+ * e[n] = y[n] - u[n]
+ *
+ * gives y = v + NTF * e. First order is the plain accumulator
+ * x = (x & 0xFFFF) + v, higher orders push more noise out of band
+ * at the cost of larger output excursion (up to 2^order LSB).
+ */
+
+
+/* u = v + fb, saturated at DAC range */
+static inline uint32_t sdAdd(uint32_t v, int32_t fb)
+{
+	uint32_t u = v + fb;
+
+	if (fb > 0) {
+		if (u < v) u = 0xFFFFFFFF;
+	} else {
+		if (u > v) u = 0;
+	}
+
+	return u;
+}
+
+void sdInit(sd_state_t *s, uint8_t order)
+{
+	if (order < SD_ORDER_MIN) order = SD_ORDER_MIN;
+	if (order > SD_ORDER_MAX) order = SD_ORDER_MAX;
+
+	s->order = order;
+	s->e1 = 0;
+	s->e2 = 0;
+	s->e3 = 0;
+}
+
+/* Fill count DAC words with modulated values
+ * Input value is ramped: v + dv, v + 2*dv, ... v + count*dv.
+ * Words are written with given stride, low bits are set to DAC channel.
+ */
+void sdModulate(sd_state_t *s, uint32_t *buf, int count, int stride, uint32_t v, int32_t dv, uint32_t chan)
+{
+	int i;
+	uint32_t u;
+	int32_t e1 = s->e1;
+	int32_t e2 = s->e2;
+	int32_t e3 = s->e3;
+
+	switch (s->order) {
+	case 1:
+		for (i = 0; i < count; i++) {
+			v += dv;
+			u = sdAdd(v, -e1);
+			e1 = -(int32_t)(u & 0xFFFF);
+			*buf = (u & 0xFFFF0000) | chan;
+			buf += stride;
+		}
+		break;
+
+	case 2:
+		for (i = 0; i < count; i++) {
+			v += dv;
+			u = sdAdd(v, -2 * e1 + e2);
+			e2 = e1;
+			e1 = -(int32_t)(u & 0xFFFF);
+			*buf = (u & 0xFFFF0000) | chan;
+			buf += stride;
+		}
+		break;
+
+	case 3:
+		for (i = 0; i < count; i++) {
+			v += dv;
+			u = sdAdd(v, -3 * e1 + 3 * e2 - e3);
+			e3 = e2;
+			e2 = e1;
+			e1 = -(int32_t)(u & 0xFFFF);
+			*buf = (u & 0xFFFF0000) | chan;
+			buf += stride;
+		}
+		break;
+	}
+
+	s->e1 = e1;
+	s->e2 = e2;
+	s->e3 = e3;
+}
@@ -0,0 +1,25 @@
+#ifndef SIGMADELTA_H_
+#define SIGMADELTA_H_
+
+
+#include <stdint.h>
+
+
+/* Noise shaping modulator for 32 -> 16 bit DAC values
+ * Quantization error is fed back through NTF(z) = (1 - z^-1)^order
+ */
+#define SD_ORDER_MIN	1
+#define SD_ORDER_MAX	3
+
+typedef struct {
+	uint8_t		order;
+	int32_t		e1;			/* Quantization errors of previous samples */
+	int32_t		e2;
+	int32_t		e3;
+} sd_state_t;
+
+void sdInit(sd_state_t *s, uint8_t order);
+void sdModulate(sd_state_t *s, uint32_t *buf, int count, int stride, uint32_t v, int32_t dv, uint32_t chan);
+
+
+#endif /* SIGMADELTA_H_ */
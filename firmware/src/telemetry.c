@@ -0,0 +1,112 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <FreeRTOS.h>
+
+#include "protocol.h"
+#include "telemetry.h"
+#include "usb.h"
+
+
+/* Queue items left free for image data */
+#define TELEMETRY_QUEUE_RESERVE	8
+
+typedef struct {
+	uint16_t	seq;
+	struct afmTelemetrySample s;
+} ring_entry_t;
+
+/* Ring is written and read from DAC DMA interrupt only */
+static ring_entry_t ring[TELEMETRY_RING_SIZE];
+static uint16_t ringHead;
+static uint16_t ringTail;
+
+static uint16_t decimation;
+static uint16_t counter;
+static uint16_t seq;				/* Number of next sample, lost ones included */
+
+
+void telemetryInit()
+{
+	decimation = 0;
+	counter = 0;
+	seq = 0;
+	ringHead = ringTail = 0;
+}
+
+void telemetrySetDecimation(uint16_t d)
+{
+	decimation = d;
+	counter = 0;
+}
+
+uint16_t telemetryGetDecimation()
+{
+	return decimation;
+}
+
+/* Called from the control loop on every period */
+void telemetrySample(uint32_t z, int32_t error)
+{
+	ring_entry_t *e;
+
+	if (!decimation) return;
+	if (++counter < decimation) return;
+	counter = 0;
+
+	/* Ring is full, sample is lost but still numbered */
+	if ((uint16_t)(ringHead - ringTail) >= TELEMETRY_RING_SIZE) {
+		seq++;
+		return;
+	}
+
+	if (error > 32767) error = 32767;
+	if (error < -32768) error = -32768;
+
+	e = &ring[ringHead & (TELEMETRY_RING_SIZE - 1)];
+	e->seq = seq++;
+	e->s.z = z >> 16;
+	e->s.error = error;
+	ringHead++;
+}
+
+/* Send one message of consecutive samples */
+void telemetryTick()
+{
+	struct afmTelemetryData msg;
+	uint16_t avail;
+	int count;
+
+	avail = ringHead - ringTail;
+	if (!avail) return;
+	/* Wait for full message unless telemetry is being turned off */
+	if ((avail < AFM_TELEMETRY_POINTS) && decimation) return;
+
+	if (usbTxFreeFromISR() <= TELEMETRY_QUEUE_RESERVE) return;
+
+	msg.seq = ring[ringTail & (TELEMETRY_RING_SIZE - 1)].seq;
+	for (count = 0; (count < AFM_TELEMETRY_POINTS) && (count < avail); count++) {
+		ring_entry_t *e = &ring[(ringTail + count) & (TELEMETRY_RING_SIZE - 1)];
+		/* Samples after a gap go to the next message */
+		if (e->seq != (uint16_t)(msg.seq + count)) break;
+		msg.s[count] = e->s;
+	}
+
+	if (!usbSendFromISR(AFM_TELEMETRY, &msg, sizeof(msg.seq) + count * sizeof(msg.s[0]))) return;
+
+	ringTail += count;
+}
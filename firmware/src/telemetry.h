@@ -0,0 +1,18 @@
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+
+#include <stdint.h>
+
+
+/* Decimated samples waiting to be sent */
+#define TELEMETRY_RING_SIZE		256		/* Power of 2 */
+
+void telemetryInit(void);
+void telemetrySetDecimation(uint16_t decimation);
+uint16_t telemetryGetDecimation(void);
+void telemetrySample(uint32_t z, int32_t error);
+void telemetryTick(void);
+
+
+#endif /* TELEMETRY_H_ */
@@ -30,9 +30,16 @@
 
 #include "protocol.h"
 #include "microscope.h"
+#include "scan.h"
+#include "sigmadelta.h"
+#include "telemetry.h"
 
 
 #define USB_TX_QUEUE_LENGTH		16
+#define USB_TX_QUEUE_ITEMS		32
+
+/* OTG interrupt priority, must be not higher than configMAX_SYSCALL_INTERRUPT_PRIORITY */
+#define USB_IRQ_PRIORITY		0xC0
 
 
 void OTG_FS_IRQHandler(void);
@@ -44,7 +51,7 @@ static xQueueHandle *usbTxQueue;
 void usbTask(void *p)
 {
 	/* Create queue for device->host bulk transfer */
-	usbTxQueue = xQueueCreate(5, USB_TX_QUEUE_LENGTH);
+	usbTxQueue = xQueueCreate(USB_TX_QUEUE_ITEMS, USB_TX_QUEUE_LENGTH);
 
 	/* Initialize USB stack */
 	USBD_Init(&USB_OTG_dev, USB_OTG_FS_CORE_ID, &USR_desc, &USBD_CDC_cb, &USR_cb);
@@ -54,6 +61,32 @@ void usbTask(void *p)
 	}
 }
 
+/* Put data message to device->host queue
+ * Message should fit in one queue item, unused tail is zero padded.
+ * Returns 0 if queue is full.
+ */
+int usbSendFromISR(uint8_t code, void *data, uint8_t len)
+{
+	uint8_t buf[USB_TX_QUEUE_LENGTH];
+	uint8_t *p = data;
+	int i;
+
+	if (len > USB_TX_QUEUE_LENGTH - 2) return 0;
+
+	buf[0] = code;
+	buf[1] = len;
+	for (i = 0; i < len; i++) buf[i + 2] = p[i];
+	for (i += 2; i < USB_TX_QUEUE_LENGTH; i++) buf[i] = 0;
+
+	return (xQueueSendFromISR(usbTxQueue, buf, NULL) == pdTRUE);
+}
+
+/* Number of free device->host queue items */
+int usbTxFreeFromISR(void)
+{
+	return USB_TX_QUEUE_ITEMS - uxQueueMessagesWaitingFromISR(usbTxQueue);
+}
+
 /***** STM32 USBD board support functions *****/
 
 void USB_OTG_BSP_Init(USB_OTG_CORE_HANDLE *pdev)
@@ -70,6 +103,7 @@ void USB_OTG_BSP_Init(USB_OTG_CORE_HANDLE *pdev)
 void USB_OTG_BSP_EnableInterrupt(USB_OTG_CORE_HANDLE *pdev)
 {
 	/* Enable OTG FS interrupt */
+	NVIC->IP[OTG_FS_IRQn] = USB_IRQ_PRIORITY;
 	NVIC->ISER[2] |= (1 << (OTG_FS_IRQn % 32));
 }
 
@@ -127,7 +161,6 @@ static uint16_t AFM_DeInit(void)
 
 static uint16_t AFM_Ctrl (uint32_t Cmd, uint8_t* Buf, uint32_t Len)
 {
-	uint8_t testBuf[64];
 	afm_t *pkt = (afm_t *)Buf;
 	config_t *cfg = micGetConfig();
 
@@ -139,17 +172,72 @@ static uint16_t AFM_Ctrl (uint32_t Cmd, uint8_t* Buf, uint32_t Len)
 
 	case AFM_GET_STATUS:
 		pkt->afmGetStatus.type = cfg->micType;
-		pkt->afmGetStatus.status = AFM_STATUS_IDLE;
-		pkt->afmGetStatus.zcontrol = AFM_ZCONTROL_OFF;
+		pkt->afmGetStatus.status = scanIsRunning() ? AFM_STATUS_RUNNING : AFM_STATUS_IDLE;
+		pkt->afmGetStatus.zcontrol = cfg->zcontrol;
 		pkt->afmGetStatus.height = 0;
 		break;
 
+	case AFM_SET_ZCONTROL:
+		/* Running scan depends on the Z loop it was started with */
+		if (!scanIsRunning() && (pkt->afmSetZControl.zcontrol <= AFM_ZCONTROL_CONST))
+			cfg->zcontrol = pkt->afmSetZControl.zcontrol;
+		break;
+
+	case AFM_GET_AFM_PROP:
+		pkt->afmAFMProp = cfg->afm;
+		break;
+
+	case AFM_SET_AFM_PROP:
+		cfg->afm = pkt->afmAFMProp;
+		break;
+
+	case AFM_GET_STM_PROP:
+		pkt->afmSTMProp = cfg->stm;
+		break;
+
+	case AFM_SET_STM_PROP:
+		cfg->stm = pkt->afmSTMProp;
+		break;
+
 	case AFM_RUN:
-		testBuf[0] = AFM_IMAGE_START;
-		testBuf[0] = 0x00;
-		testBuf[0] = AFM_IMAGE_END;
-		testBuf[0] = 0x00;
-		xQueueSendFromISR(usbTxQueue, testBuf, NULL);
+		scanRun(&pkt->afmRun);
+		break;
+
+	case AFM_RUN_MOVIE:
+		scanRunMovie(&pkt->afmRunMovie);
+		break;
+
+	case AFM_RUN_ADAPTIVE:
+		scanRunAdaptive(&pkt->afmRunAdaptive);
+		break;
+
+	case AFM_SPECTRO:
+		scanSpectro(&pkt->afmSpectro);
+		break;
+
+	case AFM_STOP:
+		scanStop();
+		break;
+
+	case AFM_PATH_START:
+		scanPathStart(&pkt->afmPathStart);
+		break;
+
+	case AFM_GET_DAC_MODE:
+		pkt->afmDACMode.order = cfg->dacOrder;
+		break;
+
+	case AFM_SET_DAC_MODE:
+		if ((pkt->afmDACMode.order >= SD_ORDER_MIN) && (pkt->afmDACMode.order <= SD_ORDER_MAX))
+			cfg->dacOrder = pkt->afmDACMode.order;
+		break;
+
+	case AFM_GET_TELEMETRY:
+		pkt->afmTelemetry.decimation = telemetryGetDecimation();
+		break;
+
+	case AFM_SET_TELEMETRY:
+		telemetrySetDecimation(pkt->afmTelemetry.decimation);
 		break;
 	}
 
@@ -168,9 +256,11 @@ static uint16_t AFM_DataTx(uint8_t* Buf, uint16_t Len)
 	return 0;
 }
 
-/* Silently discard Rx data */
+/* EP1 OUT carries trajectory waypoints only */
 static uint16_t AFM_DataRx(uint8_t* Buf, uint32_t Len)
 {
+	scanPathData(Buf, Len);
+
 	return USBD_OK;
 }
 
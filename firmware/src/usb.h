@@ -1,6 +1,10 @@
 #ifndef USB_H_
 #define USB_H_
 
+#include <stdint.h>
+
 void usbTask(void *p);
+int usbSendFromISR(uint8_t code, void *data, uint8_t len);
+int usbTxFreeFromISR(void);
 
 #endif /* USB_H_ */
@@ -0,0 +1,90 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <string.h>
+
+#include "adaptive.h"
+
+
+/* Fill lines between measured lines a and b of all channels.
+ * a may be -1 and b may be image height, edge lines are then repeated. */
+static void fillSpan(AFMImage *image, int a, int b)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+
+	if ((b - a < 2) || ((a < 0) && (b >= height))) return;
+
+	for (int ch = 0; ch < image->GetChannels(); ch++) {
+		const float *ra = (a >= 0) ? image->GetRow(ch, a) : NULL;
+		const float *rb = (b < height) ? image->GetRow(ch, b) : NULL;
+
+		#pragma omp parallel for schedule(static) if ((b - a) * width > 65536)
+		for (int y = a + 1; y < b; y++) {
+			float *out = image->GetRow(ch, y);
+			if (!ra) {
+				memcpy(out, rb, sizeof(float) * width);
+			} else if (!rb) {
+				memcpy(out, ra, sizeof(float) * width);
+			} else {
+				float f = (float)(y - a) / (b - a);
+				for (int x = 0; x < width; x++) out[x] = ra[x] + (rb[x] - ra[x]) * f;
+			}
+		}
+	}
+}
+
+/* Whole image after the scan, returns 0 if no line was measured */
+int adaptiveFill(AFMImage *image, const std::vector<uint8_t>& measured)
+{
+	int height = image->GetHeight();
+	int last = -1;
+
+	if ((int)measured.size() != height) return 0;
+
+	for (int y = 0; y < height; y++) {
+		if (!measured[y]) continue;
+		fillSpan(image, last, y);
+		last = y;
+	}
+	if (last < 0) return 0;
+	fillSpan(image, last, height);
+
+	return 1;
+}
+
+/* Lines on both sides of newly measured line, for display while scanning.
+ * Lines from..to, except the measured one, are changed.
+ * Returns 0 if nothing was filled. */
+int adaptiveFillAround(AFMImage *image, const std::vector<uint8_t>& measured, int line, int *from, int *to)
+{
+	int height = image->GetHeight();
+	int a, b;
+
+	if (((int)measured.size() != height) || (line < 0) || (line >= height)) return 0;
+
+	for (a = line - 1; (a >= 0) && !measured[a]; a--);
+	for (b = line + 1; (b < height) && !measured[b]; b++);
+
+	fillSpan(image, a, line);
+	fillSpan(image, line, b);
+
+	*from = a + 1;
+	*to = b - 1;
+
+	return *to > *from;
+}
@@ -0,0 +1,13 @@
+#ifndef ADAPTIVE_H_
+#define ADAPTIVE_H_
+
+#include <vector>
+
+#include "image.h"
+
+/* Lines missing from adaptive scan are interpolated between the nearest
+ * measured lines above and below, measured[y] is nonzero for scanned lines */
+int adaptiveFill(AFMImage *image, const std::vector<uint8_t>& measured);
+int adaptiveFillAround(AFMImage *image, const std::vector<uint8_t>& measured, int line, int *from, int *to);
+
+#endif /* ADAPTIVE_H_ */
@@ -0,0 +1,654 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "archive.h"
+
+
+#define ARCHIVE_MAGIC			"AFMA"
+#define ARCHIVE_VERSION			1
+#define ARCHIVE_HEADER_SIZE		40
+#define ARCHIVE_INDEX_ENTRY		12
+
+/* Tiles compressed or decompressed in parallel before writing */
+#define ARCHIVE_BATCH			64
+
+/* Tile coding modes */
+#define TILE_INT				0	/* Integer values */
+#define TILE_FLOAT				1	/* Order-preserving float bits */
+
+/* Rice coder */
+#define RICE_BLOCK				64	/* Residuals sharing one parameter */
+#define RICE_K_BITS				6
+#define RICE_MAX_K				32
+#define RICE_ESCAPE				24	/* Quotient that switches to raw value */
+#define RICE_RAW_BITS			36	/* Zigzag residual is below 2^34 */
+
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static int fileSeek(FILE *f, uint64_t offset)
+{
+#ifdef WIN32
+	return fseeko64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+/***** Bit stream, LSB first *****/
+
+class BitWriter {
+private:
+	uint8_t *m_buf;
+	size_t m_pos;
+	uint64_t m_acc;
+	int m_bits;
+public:
+	BitWriter(uint8_t *buf) { m_buf = buf; m_pos = 0; m_acc = 0; m_bits = 0; }
+
+	/* n <= 32 */
+	inline void Put(uint32_t v, int n)
+	{
+		m_acc |= (uint64_t)v << m_bits;
+		m_bits += n;
+		while (m_bits >= 8) {
+			m_buf[m_pos++] = (uint8_t)m_acc;
+			m_acc >>= 8;
+			m_bits -= 8;
+		}
+	}
+
+	size_t Flush()
+	{
+		if (m_bits > 0) m_buf[m_pos++] = (uint8_t)m_acc;
+		m_acc = 0;
+		m_bits = 0;
+		return m_pos;
+	}
+};
+
+class BitReader {
+private:
+	const uint8_t *m_buf;
+	const uint8_t *m_end;
+	uint64_t m_acc;
+	int m_bits;
+	inline void Fill()
+	{
+		while (m_bits <= 56) {
+			uint64_t b = (m_buf < m_end) ? *m_buf++ : 0;
+			m_acc |= b << m_bits;
+			m_bits += 8;
+		}
+	}
+public:
+	BitReader(const uint8_t *buf, size_t len) { m_buf = buf; m_end = buf + len; m_acc = 0; m_bits = 0; }
+
+	/* n <= 32 */
+	inline uint32_t Get(int n)
+	{
+		uint32_t v;
+
+		if (m_bits < n) Fill();
+		v = (uint32_t)(m_acc & (((uint64_t)1 << n) - 1));
+		m_acc >>= n;
+		m_bits -= n;
+		return v;
+	}
+
+	/* Number of one bits before zero, up to limit ones */
+	inline int Unary(int limit)
+	{
+		int q;
+
+		if (m_bits < limit + 1) Fill();
+		q = __builtin_ctzll(~m_acc);
+		if (q >= limit) {
+			m_acc >>= limit;
+			m_bits -= limit;
+			return limit;
+		}
+		m_acc >>= q + 1;
+		m_bits -= q + 1;
+		return q;
+	}
+};
+
+/***** Tile coding *****/
+
+static inline int64_t predict(int64_t a, int64_t b, int64_t c)
+{
+	int64_t lo = (a < b) ? a : b;
+	int64_t hi = (a < b) ? b : a;
+
+	if (c >= hi) return lo;
+	if (c <= lo) return hi;
+	return a + b - c;
+}
+
+static inline uint32_t floatToOrdered(float f)
+{
+	uint32_t u;
+
+	memcpy(&u, &f, sizeof(u));
+	return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+static inline float orderedToFloat(uint32_t u)
+{
+	float f;
+
+	u = (u & 0x80000000) ? (u & 0x7FFFFFFF) : ~u;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+/* Tile rectangle of the image */
+typedef struct {
+	int channel;
+	int x0;
+	int y0;
+	int w;
+	int h;
+} tile_rect_t;
+
+static void tileRect(int index, int tilesX, int tilesY, int tileSize,
+		int width, int height, tile_rect_t *r)
+{
+	int perChannel = tilesX * tilesY;
+	int t = index % perChannel;
+
+	r->channel = index / perChannel;
+	r->x0 = (t % tilesX) * tileSize;
+	r->y0 = (t / tilesX) * tileSize;
+	r->w = (r->x0 + tileSize < width) ? tileSize : width - r->x0;
+	r->h = (r->y0 + tileSize < height) ? tileSize : height - r->y0;
+}
+
+static void riceBlock(BitWriter *bw, const uint64_t *zz, int n)
+{
+	uint64_t sum = 0, mean;
+	int i, k;
+
+	for (i = 0; i < n; i++) sum += zz[i];
+	mean = sum / n;
+	for (k = 0; (k < RICE_MAX_K) && (((uint64_t)2 << k) <= mean); k++) {}
+	bw->Put(k, RICE_K_BITS);
+
+	for (i = 0; i < n; i++) {
+		uint64_t q = zz[i] >> k;
+		if (q < RICE_ESCAPE) {
+			bw->Put(((uint32_t)1 << q) - 1, q + 1);
+			if (k) bw->Put((uint32_t)(zz[i] & (((uint64_t)1 << k) - 1)), k);
+		} else {
+			bw->Put(((uint32_t)1 << RICE_ESCAPE) - 1, RICE_ESCAPE);
+			bw->Put((uint32_t)(zz[i] & ((1 << (RICE_RAW_BITS / 2)) - 1)), RICE_RAW_BITS / 2);
+			bw->Put((uint32_t)(zz[i] >> (RICE_RAW_BITS / 2)), RICE_RAW_BITS / 2);
+		}
+	}
+}
+
+/* Compress one tile. Returns malloc'ed blob or NULL. */
+static uint8_t *encodeTile(AFMImage *image, const tile_rect_t *r, uint32_t *length)
+{
+	size_t count = (size_t)r->w * r->h;
+	int64_t *v = (int64_t *)malloc(sizeof(int64_t) * count);
+	uint64_t *zz = (uint64_t *)malloc(sizeof(uint64_t) * count);
+	/* Worst case: escape and raw value for every residual */
+	uint8_t *blob = (uint8_t *)malloc(count * 8 + count / RICE_BLOCK + 16);
+	int mode = TILE_INT;
+	size_t i, n;
+	int x, y;
+
+	if (!v || !zz || !blob) {
+		free(v);
+		free(zz);
+		free(blob);
+		return NULL;
+	}
+
+	/* Raw ADC data is integer valued and is coded as integers */
+	for (y = 0; y < r->h && mode == TILE_INT; y++) {
+		const float *row = image->GetRow(r->channel, r->y0 + y) + r->x0;
+		for (x = 0; x < r->w; x++) {
+			float f = row[x];
+			if (!(f > -16777216.0f && f < 16777216.0f) || ((float)(int32_t)f != f)) {
+				mode = TILE_FLOAT;
+				break;
+			}
+		}
+	}
+
+	for (y = 0; y < r->h; y++) {
+		const float *row = image->GetRow(r->channel, r->y0 + y) + r->x0;
+		int64_t *dst = v + (size_t)y * r->w;
+		if (mode == TILE_INT)
+			for (x = 0; x < r->w; x++) dst[x] = (int32_t)row[x];
+		else
+			for (x = 0; x < r->w; x++) dst[x] = floatToOrdered(row[x]);
+	}
+
+	/* Residuals of median edge predictor, zigzag mapped */
+	for (y = 0; y < r->h; y++) {
+		for (x = 0; x < r->w; x++) {
+			size_t p = (size_t)y * r->w + x;
+			int64_t pred;
+			if (y == 0)
+				pred = x ? v[p - 1] : 0;
+			else if (x == 0)
+				pred = v[p - r->w];
+			else
+				pred = predict(v[p - 1], v[p - r->w], v[p - r->w - 1]);
+			int64_t d = v[p] - pred;
+			zz[p] = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+		}
+	}
+
+	blob[0] = mode;
+	BitWriter bw(blob + 1);
+	for (i = 0; i < count; i += n) {
+		n = (count - i < RICE_BLOCK) ? count - i : RICE_BLOCK;
+		riceBlock(&bw, zz + i, n);
+	}
+	*length = 1 + bw.Flush();
+
+	free(v);
+	free(zz);
+
+	return blob;
+}
+
+static int decodeTile(const uint8_t *blob, uint32_t length, float *dst, int stride, int w, int h)
+{
+	size_t count = (size_t)w * h;
+	int64_t *v;
+	int mode;
+	size_t i;
+	int j, k = 0;
+
+	if (length < 1) return 0;
+	mode = blob[0];
+	if ((mode != TILE_INT) && (mode != TILE_FLOAT)) return 0;
+
+	v = (int64_t *)malloc(sizeof(int64_t) * count);
+	if (!v) return 0;
+
+	BitReader br(blob + 1, length - 1);
+	for (i = 0, j = 0; i < count; i++, j--) {
+		uint64_t zz;
+		int64_t d, pred;
+		int x = i % w, y = i / w;
+
+		if (j == 0) {
+			k = br.Get(RICE_K_BITS);
+			j = RICE_BLOCK;
+		}
+
+		int q = br.Unary(RICE_ESCAPE);
+		if (q < RICE_ESCAPE) {
+			zz = ((uint64_t)q << k) | (k ? br.Get(k) : 0);
+		} else {
+			zz = br.Get(RICE_RAW_BITS / 2);
+			zz |= (uint64_t)br.Get(RICE_RAW_BITS / 2) << (RICE_RAW_BITS / 2);
+		}
+		d = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+
+		if (y == 0)
+			pred = x ? v[i - 1] : 0;
+		else if (x == 0)
+			pred = v[i - w];
+		else
+			pred = predict(v[i - 1], v[i - w], v[i - w - 1]);
+		v[i] = pred + d;
+	}
+
+	for (int y = 0; y < h; y++) {
+		float *row = dst + (size_t)y * stride;
+		const int64_t *src = v + (size_t)y * w;
+		if (mode == TILE_INT)
+			for (int x = 0; x < w; x++) row[x] = (float)src[x];
+		else
+			for (int x = 0; x < w; x++) row[x] = orderedToFloat((uint32_t)src[x]);
+	}
+
+	free(v);
+
+	return 1;
+}
+
+/***** Writer *****/
+
+int archiveWrite(AFMImage *image, std::string filename, int tileSize)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	int channels = image->GetChannels();
+	int tilesX, tilesY, total;
+	uint8_t header[ARCHIVE_HEADER_SIZE];
+	uint8_t *index, *blob[ARCHIVE_BATCH];
+	uint32_t length[ARCHIVE_BATCH];
+	uint64_t offset;
+	FILE *f;
+	int ret = 1;
+
+	if (!width || !height || !channels) return 0;
+	if ((tileSize < 16) || (tileSize > 4096)) return 0;
+
+	tilesX = (width + tileSize - 1) / tileSize;
+	tilesY = (height + tileSize - 1) / tileSize;
+	total = tilesX * tilesY * channels;
+
+	index = (uint8_t *)malloc((size_t)total * ARCHIVE_INDEX_ENTRY);
+	if (!index) return 0;
+
+	f = fopen(filename.c_str(), "wb");
+	if (!f) {
+		free(index);
+		return 0;
+	}
+
+	/* Header is rewritten with index offset at the end */
+	memset(header, 0, sizeof(header));
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header)) ret = 0;
+	offset = sizeof(header);
+
+	for (int b0 = 0; ret && (b0 < total); b0 += ARCHIVE_BATCH) {
+		int count = (total - b0 < ARCHIVE_BATCH) ? total - b0 : ARCHIVE_BATCH;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < count; i++) {
+			tile_rect_t r;
+			tileRect(b0 + i, tilesX, tilesY, tileSize, width, height, &r);
+			blob[i] = encodeTile(image, &r, &length[i]);
+		}
+
+		/* Tiles are stored in index order */
+		for (int i = 0; i < count; i++) {
+			if (!blob[i]) {
+				ret = 0;
+				continue;
+			}
+			if (ret && (fwrite(blob[i], 1, length[i], f) != length[i])) ret = 0;
+			put64(index + (size_t)(b0 + i) * ARCHIVE_INDEX_ENTRY, offset);
+			put32(index + (size_t)(b0 + i) * ARCHIVE_INDEX_ENTRY + 8, length[i]);
+			offset += length[i];
+			free(blob[i]);
+		}
+	}
+
+	if (ret && (fwrite(index, ARCHIVE_INDEX_ENTRY, total, f) != (size_t)total)) ret = 0;
+
+	memcpy(header, ARCHIVE_MAGIC, 4);
+	put16(header + 4, ARCHIVE_VERSION);
+	put16(header + 6, channels);
+	put16(header + 8, width);
+	put16(header + 10, height);
+	put16(header + 12, tileSize);
+	put32(header + 16, image->GetStartX());
+	put32(header + 20, image->GetStartY());
+	put32(header + 24, image->GetSizeX());
+	put32(header + 28, image->GetSizeY());
+	put64(header + 32, offset);
+	if (ret && (fileSeek(f, 0) || (fwrite(header, 1, sizeof(header), f) != sizeof(header)))) ret = 0;
+
+	if (fclose(f) != 0) ret = 0;
+	free(index);
+
+	return ret;
+}
+
+/***** Reader *****/
+
+ArchiveReader::ArchiveReader()
+{
+	m_file = NULL;
+	m_offset = NULL;
+	m_length = NULL;
+	m_width = 0;
+	m_height = 0;
+	m_channels = 0;
+	m_tileSize = 0;
+	m_tilesX = 0;
+	m_tilesY = 0;
+	m_startX = 0;
+	m_startY = 0;
+	m_sizeX = 0;
+	m_sizeY = 0;
+}
+
+ArchiveReader::~ArchiveReader()
+{
+	Close();
+}
+
+void ArchiveReader::Close()
+{
+	if (m_file) fclose(m_file);
+	free(m_offset);
+	free(m_length);
+	m_file = NULL;
+	m_offset = NULL;
+	m_length = NULL;
+	m_width = 0;
+	m_height = 0;
+	m_channels = 0;
+}
+
+/* Read header and tile index */
+int ArchiveReader::Open(std::string filename)
+{
+	uint8_t header[ARCHIVE_HEADER_SIZE];
+	uint8_t *index;
+	uint64_t indexOffset;
+	int total;
+
+	Close();
+
+	m_file = fopen(filename.c_str(), "rb");
+	if (!m_file) return 0;
+
+	if ((fread(header, 1, sizeof(header), m_file) != sizeof(header)) ||
+			memcmp(header, ARCHIVE_MAGIC, 4) || (get16(header + 4) != ARCHIVE_VERSION)) {
+		Close();
+		return 0;
+	}
+
+	m_channels = get16(header + 6);
+	m_width = get16(header + 8);
+	m_height = get16(header + 10);
+	m_tileSize = get16(header + 12);
+	m_startX = (int32_t)get32(header + 16);
+	m_startY = (int32_t)get32(header + 20);
+	m_sizeX = get32(header + 24);
+	m_sizeY = get32(header + 28);
+	/* Extents are 32-bit X and Y; older files hold the square size in X only */
+	if (!m_sizeY) m_sizeY = m_sizeX;
+	indexOffset = get64(header + 32);
+	if (!m_channels || !m_width || !m_height || !m_tileSize) {
+		Close();
+		return 0;
+	}
+
+	m_tilesX = (m_width + m_tileSize - 1) / m_tileSize;
+	m_tilesY = (m_height + m_tileSize - 1) / m_tileSize;
+	total = m_tilesX * m_tilesY * m_channels;
+
+	index = (uint8_t *)malloc((size_t)total * ARCHIVE_INDEX_ENTRY);
+	m_offset = (uint64_t *)malloc(sizeof(uint64_t) * total);
+	m_length = (uint32_t *)malloc(sizeof(uint32_t) * total);
+	if (!index || !m_offset || !m_length || fileSeek(m_file, indexOffset) ||
+			(fread(index, ARCHIVE_INDEX_ENTRY, total, m_file) != (size_t)total)) {
+		free(index);
+		Close();
+		return 0;
+	}
+
+	for (int i = 0; i < total; i++) {
+		m_offset[i] = get64(index + (size_t)i * ARCHIVE_INDEX_ENTRY);
+		m_length[i] = get32(index + (size_t)i * ARCHIVE_INDEX_ENTRY + 8);
+	}
+	free(index);
+
+	return 1;
+}
+
+int ArchiveReader::GetWidth()
+{
+	return m_width;
+}
+
+int ArchiveReader::GetHeight()
+{
+	return m_height;
+}
+
+int ArchiveReader::GetChannels()
+{
+	return m_channels;
+}
+
+int ArchiveReader::GetTileSize()
+{
+	return m_tileSize;
+}
+
+int ArchiveReader::GetTilesX()
+{
+	return m_tilesX;
+}
+
+int ArchiveReader::GetTilesY()
+{
+	return m_tilesY;
+}
+
+int ArchiveReader::TileIndex(int channel, int tx, int ty)
+{
+	if (!m_file) return -1;
+	if ((channel < 0) || (channel >= m_channels)) return -1;
+	if ((tx < 0) || (tx >= m_tilesX) || (ty < 0) || (ty >= m_tilesY)) return -1;
+
+	return (channel * m_tilesY + ty) * m_tilesX + tx;
+}
+
+int ArchiveReader::ReadBlob(int index, uint8_t **blob)
+{
+	*blob = (uint8_t *)malloc(m_length[index] ? m_length[index] : 1);
+	if (!*blob) return 0;
+
+	if (fileSeek(m_file, m_offset[index]) ||
+			(fread(*blob, 1, m_length[index], m_file) != m_length[index])) {
+		free(*blob);
+		*blob = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Decompress single tile. dst receives tile rows, stride in floats.
+ * Border tiles are smaller than tile size.
+ */
+int ArchiveReader::ReadTile(int channel, int tx, int ty, float *dst, int stride)
+{
+	int index = TileIndex(channel, tx, ty);
+	tile_rect_t r;
+	uint8_t *blob;
+	int ret;
+
+	if (index < 0) return 0;
+	if (!ReadBlob(index, &blob)) return 0;
+
+	tileRect(index, m_tilesX, m_tilesY, m_tileSize, m_width, m_height, &r);
+	ret = decodeTile(blob, m_length[index], dst, stride, r.w, r.h);
+	free(blob);
+
+	return ret;
+}
+
+/* Decompress all tiles into image, decoding runs in parallel */
+int ArchiveReader::ReadImage(AFMImage *image)
+{
+	int total = m_tilesX * m_tilesY * m_channels;
+	uint8_t *blob[ARCHIVE_BATCH];
+	int ret = 1;
+
+	if (!m_file) return 0;
+	if (!image->Create(m_width, m_height, m_channels)) return 0;
+	image->SetGeometry(m_startX, m_startY, 0);
+	image->SetExtent(m_sizeX, m_sizeY);
+
+	for (int b0 = 0; ret && (b0 < total); b0 += ARCHIVE_BATCH) {
+		int count = (total - b0 < ARCHIVE_BATCH) ? total - b0 : ARCHIVE_BATCH;
+
+		for (int i = 0; i < count; i++) {
+			if (!ReadBlob(b0 + i, &blob[i])) ret = 0;
+		}
+
+		#pragma omp parallel for schedule(dynamic) reduction(&:ret)
+		for (int i = 0; i < count; i++) {
+			tile_rect_t r;
+			if (!blob[i]) {
+				ret = 0;
+				continue;
+			}
+			tileRect(b0 + i, m_tilesX, m_tilesY, m_tileSize, m_width, m_height, &r);
+			/* Image rows are contiguous, tile is written in place */
+			if (!decodeTile(blob[i], m_length[b0 + i],
+					image->GetRow(r.channel, r.y0) + r.x0, m_width, r.w, r.h)) ret = 0;
+			free(blob[i]);
+		}
+	}
+
+	return ret;
+}
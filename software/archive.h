@@ -0,0 +1,54 @@
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <stdio.h>
+#include <string>
+
+#include "image.h"
+
+#define ARCHIVE_TILE_SIZE		256
+
+/* Compressed scan archive (.afa)
+ * Every channel is split into square tiles, each tile is compressed
+ * independently: median edge predictor followed by block adaptive Rice
+ * coding of the residuals. Integer valued tiles (raw ADC data) are coded
+ * as integers, other tiles as order-preserving float bit patterns, both
+ * losslessly. Index of tile offsets at the end of file gives random
+ * access to single tiles.
+ */
+int archiveWrite(AFMImage *image, std::string filename, int tileSize = ARCHIVE_TILE_SIZE);
+
+class ArchiveReader {
+private:
+	FILE *m_file;
+	int m_width;
+	int m_height;
+	int m_channels;
+	int m_tileSize;
+	int m_tilesX;
+	int m_tilesY;
+	int32_t m_startX;
+	int32_t m_startY;
+	uint32_t m_sizeX;
+	uint32_t m_sizeY;
+	uint64_t *m_offset;
+	uint32_t *m_length;
+	int TileIndex(int channel, int tx, int ty);
+	int ReadBlob(int index, uint8_t **blob);
+public:
+	ArchiveReader(void);
+	~ArchiveReader(void);
+	int Open(std::string filename);
+	void Close();
+	int GetWidth();
+	int GetHeight();
+	int GetChannels();
+	int GetTileSize();
+	int GetTilesX();
+	int GetTilesY();
+	int ReadTile(int channel, int tx, int ty, float *dst, int stride);
+	int ReadImage(AFMImage *image);
+};
+
+
+#endif /* ARCHIVE_H_ */
@@ -0,0 +1,275 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "background.h"
+#include "simd.h"
+
+/* Least squares fit is done with normal equations.
+ * All moments sum(x^a * y^b) and sum(z * x^a * y^b) are collected in one pass:
+ * per row only sums over x are needed, y powers are applied once per row.
+ * Rows are split between threads, partial moments are added at the end.
+ */
+
+#define MOMENT_ORDER	(2 * BACKGROUND_MAX_ORDER + 1)
+
+
+int backgroundTerms(int order)
+{
+	return (order + 1) * (order + 2) / 2;
+}
+
+/* Term index -> x and y powers */
+static void backgroundTermPowers(int order, int *pi, int *pj)
+{
+	int i, j, t = 0;
+
+	for (j = 0; j <= order; j++)
+		for (i = 0; i + j <= order; i++) {
+			pi[t] = i;
+			pj[t] = j;
+			t++;
+		}
+}
+
+static double normCoord(int i, int n)
+{
+	return (n > 1) ? (2.0 * i / (n - 1) - 1.0) : 0;
+}
+
+/* Table of x powers, rows of width floats for powers 0..maxpow */
+static float *powerTable(int width, int maxpow)
+{
+	float *t;
+	int a, x;
+
+	t = (float *)malloc(sizeof(float) * width * (maxpow + 1));
+	if (!t) return NULL;
+
+	for (x = 0; x < width; x++) {
+		double xn = normCoord(x, width), p = 1;
+		for (a = 0; a <= maxpow; a++) {
+			t[a * width + x] = p;
+			p *= xn;
+		}
+	}
+
+	return t;
+}
+
+/* Solve n x n system in place with partial pivoting, result in b */
+static int solve(double *m, double *b, int n)
+{
+	int i, j, k, p;
+	double t, f;
+
+	for (k = 0; k < n; k++) {
+		p = k;
+		for (i = k + 1; i < n; i++)
+			if (fabs(m[i * n + k]) > fabs(m[p * n + k])) p = i;
+		if (fabs(m[p * n + k]) < 1e-12) return 0;
+
+		if (p != k) {
+			for (j = 0; j < n; j++) {
+				t = m[k * n + j]; m[k * n + j] = m[p * n + j]; m[p * n + j] = t;
+			}
+			t = b[k]; b[k] = b[p]; b[p] = t;
+		}
+
+		for (i = k + 1; i < n; i++) {
+			f = m[i * n + k] / m[k * n + k];
+			if (f == 0) continue;
+			for (j = k; j < n; j++) m[i * n + j] -= f * m[k * n + j];
+			b[i] -= f * b[k];
+		}
+	}
+
+	for (k = n - 1; k >= 0; k--) {
+		t = b[k];
+		for (j = k + 1; j < n; j++) t -= m[k * n + j] * b[j];
+		b[k] = t / m[k * n + k];
+	}
+
+	return 1;
+}
+
+/* Fit background to channel data
+ * mask (optional) has one byte per pixel, nonzero pixels are excluded from fit.
+ * coeffs receive backgroundTerms(order) values, ordered by y power, then x power.
+ */
+int backgroundFit(AFMImage *image, int channel, int order, const uint8_t *mask, double *coeffs)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	int terms, t, u;
+	int pi[BACKGROUND_MAX_TERMS], pj[BACKGROUND_MAX_TERMS];
+	double mxy[MOMENT_ORDER][MOMENT_ORDER];		/* sum(x^a * y^b) */
+	double mzxy[MOMENT_ORDER][MOMENT_ORDER];	/* sum(z * x^a * y^b) */
+	double m[BACKGROUND_MAX_TERMS * BACKGROUND_MAX_TERMS];
+	double colsum[MOMENT_ORDER];
+	float *xpow;
+
+	if ((order < 0) || (order > BACKGROUND_MAX_ORDER)) return 0;
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+	if (!width || !height) return 0;
+
+	xpow = powerTable(width, 2 * order);
+	if (!xpow) return 0;
+
+	memset(mxy, 0, sizeof(mxy));
+	memset(mzxy, 0, sizeof(mzxy));
+
+	/* Without mask x sums are the same for every row */
+	for (int a = 0; a <= 2 * order; a++)
+		colsum[a] = vecSum(xpow + a * width, width);
+
+	#pragma omp parallel
+	{
+		double lxy[MOMENT_ORDER][MOMENT_ORDER];
+		double lzxy[MOMENT_ORDER][MOMENT_ORDER];
+		double sx[MOMENT_ORDER], szx[MOMENT_ORDER];
+
+		memset(lxy, 0, sizeof(lxy));
+		memset(lzxy, 0, sizeof(lzxy));
+
+		for (int tile = 0; tile < image->GetTileCount(); tile++) {
+			int y0, y1;
+
+			image->GetTileBounds(tile, &y0, &y1);
+
+			#pragma omp single nowait
+			image->PrefetchTile(channel, tile + 1);
+
+			#pragma omp for schedule(static)
+			for (int y = y0; y < y1; y++) {
+				const float *row = image->GetRow(channel, y);
+				double yn = normCoord(y, height), yp;
+				int a, b, x;
+
+				if (mask) {
+					const uint8_t *mrow = mask + (size_t)y * width;
+
+					memset(sx, 0, sizeof(sx));
+					memset(szx, 0, sizeof(szx));
+					for (x = 0; x < width; x++) {
+						if (mrow[x]) continue;
+						for (a = 0; a <= 2 * order; a++) sx[a] += xpow[a * width + x];
+						for (a = 0; a <= order; a++) szx[a] += (double)row[x] * xpow[a * width + x];
+					}
+				} else {
+					for (a = 0; a <= 2 * order; a++) sx[a] = colsum[a];
+					for (a = 0; a <= order; a++) szx[a] = vecDot(row, xpow + a * width, width);
+				}
+
+				yp = 1;
+				for (b = 0; b <= 2 * order; b++) {
+					for (a = 0; a + b <= 2 * order; a++) lxy[a][b] += sx[a] * yp;
+					if (b <= order)
+						for (a = 0; a + b <= order; a++) lzxy[a][b] += szx[a] * yp;
+					yp *= yn;
+				}
+			}
+
+			#pragma omp single nowait
+			image->ReleaseTile(channel, tile);
+		}
+
+		#pragma omp critical
+		{
+			for (int a = 0; a < MOMENT_ORDER; a++)
+				for (int b = 0; b < MOMENT_ORDER; b++) {
+					mxy[a][b] += lxy[a][b];
+					mzxy[a][b] += lzxy[a][b];
+				}
+		}
+	}
+
+	free(xpow);
+
+	/* Normal equations */
+	terms = backgroundTerms(order);
+	backgroundTermPowers(order, pi, pj);
+	for (t = 0; t < terms; t++) {
+		for (u = 0; u < terms; u++)
+			m[t * terms + u] = mxy[pi[t] + pi[u]][pj[t] + pj[u]];
+		coeffs[t] = mzxy[pi[t]][pj[t]];
+	}
+
+	return solve(m, coeffs, terms);
+}
+
+void backgroundSubtract(AFMImage *image, int channel, int order, const double *coeffs)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	int terms = backgroundTerms(order);
+	int pi[BACKGROUND_MAX_TERMS], pj[BACKGROUND_MAX_TERMS];
+	float *xpow;
+
+	if ((order < 0) || (order > BACKGROUND_MAX_ORDER)) return;
+
+	xpow = powerTable(width, order);
+	if (!xpow) return;
+
+	backgroundTermPowers(order, pi, pj);
+
+	/* Each row is a 1D polynomial in x with coefficients depending on y */
+	#pragma omp parallel
+	{
+		for (int tile = 0; tile < image->GetTileCount(); tile++) {
+			int y0, y1;
+
+			image->GetTileBounds(tile, &y0, &y1);
+
+			#pragma omp single nowait
+			image->PrefetchTile(channel, tile + 1);
+
+			#pragma omp for schedule(static)
+			for (int y = y0; y < y1; y++) {
+				float *row = image->GetRow(channel, y);
+				double yn = normCoord(y, height);
+				double cx[BACKGROUND_MAX_ORDER + 1];
+				int t, a;
+
+				if (!row) continue;
+
+				memset(cx, 0, sizeof(cx));
+				for (t = 0; t < terms; t++) cx[pi[t]] += coeffs[t] * pow(yn, pj[t]);
+				for (a = 0; a <= order; a++) vecAxpy(row, -cx[a], xpow + a * width, width);
+			}
+
+			#pragma omp single nowait
+			image->ReleaseTile(channel, tile);
+		}
+	}
+
+	free(xpow);
+}
+
+/* Fit and subtract background */
+int backgroundRemove(AFMImage *image, int channel, int order, const uint8_t *mask)
+{
+	double coeffs[BACKGROUND_MAX_TERMS];
+
+	if (!backgroundFit(image, channel, order, mask, coeffs)) return 0;
+	backgroundSubtract(image, channel, order, coeffs);
+
+	return 1;
+}
@@ -0,0 +1,19 @@
+#ifndef BACKGROUND_H_
+#define BACKGROUND_H_
+
+#include "image.h"
+
+/* 2D polynomial background z = sum c[i][j] * x^i * y^j, i + j <= order.
+ * x and y are normalized to [-1, 1] over the image.
+ * Order 1 is a plane.
+ */
+#define BACKGROUND_MAX_ORDER	5
+#define BACKGROUND_MAX_TERMS	((BACKGROUND_MAX_ORDER + 1) * (BACKGROUND_MAX_ORDER + 2) / 2)
+
+int backgroundTerms(int order);
+int backgroundFit(AFMImage *image, int channel, int order, const uint8_t *mask, double *coeffs);
+void backgroundSubtract(AFMImage *image, int channel, int order, const double *coeffs);
+int backgroundRemove(AFMImage *image, int channel, int order, const uint8_t *mask);
+
+
+#endif /* BACKGROUND_H_ */
@@ -0,0 +1,295 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <stdlib.h>
+
+#include "colormap.h"
+#include "stats.h"
+
+
+/* Histogram resolution for percentile range */
+#define RANGE_BINS			4096
+/* Percentile range is refined when it spans less than 1/RANGE_REFINE of the histogram */
+#define RANGE_REFINE		16
+
+/* Color table control points, position is 0..255 */
+struct colorPoint {
+	uint8_t pos;
+	uint8_t r, g, b;
+};
+
+static const struct colorPoint mapGrey[] = {
+	{0, 0, 0, 0}, {255, 255, 255, 255}
+};
+
+static const struct colorPoint mapGold[] = {
+	{0, 0, 0, 0}, {90, 168, 40, 15}, {160, 243, 194, 93}, {255, 255, 255, 255}
+};
+
+static const struct colorPoint mapRainbow[] = {
+	{0, 0, 0, 160}, {51, 0, 96, 255}, {102, 0, 224, 224}, {153, 64, 224, 0},
+	{204, 255, 224, 0}, {255, 224, 0, 0}
+};
+
+static const struct {
+	const struct colorPoint *points;
+	int count;
+} colorMaps[COLORMAP_COUNT] = {
+	{mapGrey, sizeof(mapGrey) / sizeof(mapGrey[0])},
+	{mapGold, sizeof(mapGold) / sizeof(mapGold[0])},
+	{mapRainbow, sizeof(mapRainbow) / sizeof(mapRainbow[0])}
+};
+
+
+ColorMap::ColorMap(void)
+{
+	m_lut = NULL;
+	m_size = 0;
+}
+
+ColorMap::~ColorMap(void)
+{
+	free(m_lut);
+}
+
+/* Interpolate control points into table of given size */
+int ColorMap::Create(int type, int size)
+{
+	const struct colorPoint *pt;
+	uint32_t *lut;
+	int count, seg = 0;
+
+	if ((type < 0) || (type >= COLORMAP_COUNT)) return 0;
+	if ((size < COLORMAP_MIN_SIZE) || (size > COLORMAP_MAX_SIZE)) return 0;
+
+	lut = (uint32_t *)malloc(size * sizeof(uint32_t));
+	if (!lut) return 0;
+
+	pt = colorMaps[type].points;
+	count = colorMaps[type].count;
+
+	for (int i = 0; i < size; i++) {
+		double pos = 255.0 * i / (size - 1);
+		double t;
+
+		while ((seg < count - 2) && (pos > pt[seg + 1].pos)) seg++;
+		t = (pos - pt[seg].pos) / (pt[seg + 1].pos - pt[seg].pos);
+
+		uint32_t r = (uint32_t)(pt[seg].r + t * (pt[seg + 1].r - pt[seg].r) + 0.5);
+		uint32_t g = (uint32_t)(pt[seg].g + t * (pt[seg + 1].g - pt[seg].g) + 0.5);
+		uint32_t b = (uint32_t)(pt[seg].b + t * (pt[seg + 1].b - pt[seg].b) + 0.5);
+		lut[i] = r | (g << 8) | (b << 16);
+	}
+
+	free(m_lut);
+	m_lut = lut;
+	m_size = size;
+
+	return 1;
+}
+
+int ColorMap::GetSize()
+{
+	return m_size;
+}
+
+const uint32_t *ColorMap::GetTable()
+{
+	return m_lut;
+}
+
+static inline void putRGB(uint8_t *dst, uint32_t c)
+{
+	dst[0] = c;
+	dst[1] = c >> 8;
+	dst[2] = c >> 16;
+}
+
+#if defined(__AVX2__)
+/* Look up 8 normalized values and store 24 bytes of RGB.
+ * Writes 4 bytes past the end, caller keeps the slack.
+ */
+static inline void lookup8(const uint32_t *lut, __m256 v, __m256 offset, __m256 scale,
+		__m256 top, uint8_t *dst)
+{
+	/* Drop the high byte of each entry, 16 bytes -> 12 in each lane */
+	const __m256i pack = _mm256_setr_epi8(
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256 f;
+	__m256i c;
+
+	f = _mm256_mul_ps(_mm256_sub_ps(v, offset), scale);
+	/* NaN ends up at the bottom, same as scalar code */
+	f = _mm256_min_ps(_mm256_max_ps(f, _mm256_setzero_ps()), top);
+	c = _mm256_i32gather_epi32((const int *)lut, _mm256_cvttps_epi32(f), 4);
+	c = _mm256_shuffle_epi8(c, pack);
+
+	_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(c));
+	_mm_storeu_si128((__m128i *)(dst + 12), _mm256_extracti128_si256(c, 1));
+}
+#endif
+
+/* Map n values to RGB, min and max go to the ends of the table */
+void ColorMap::RenderRow(const float *src, int n, float min, float max, uint8_t *rgb)
+{
+	float scale = (max > min) ? (m_size - 1) / (max - min) : 0;
+	float top = m_size - 1;
+	int i = 0;
+
+	if (!m_lut) return;
+
+#if defined(__AVX2__)
+	__m256 vOffset = _mm256_set1_ps(min);
+	__m256 vScale = _mm256_set1_ps(scale);
+	__m256 vTop = _mm256_set1_ps(top);
+
+	for (; i + 10 <= n; i += 8)
+		lookup8(m_lut, _mm256_loadu_ps(src + i), vOffset, vScale, vTop, rgb + 3 * i);
+#elif defined(__SSE2__)
+	__m128 vOffset = _mm_set1_ps(min);
+	__m128 vScale = _mm_set1_ps(scale);
+	__m128 vTop = _mm_set1_ps(top);
+	int32_t idx[4];
+
+	/* No gather instruction, indexes are computed in vector registers */
+	for (; i + 4 <= n; i += 4) {
+		__m128 f = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i), vOffset), vScale);
+		f = _mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), vTop);
+		_mm_storeu_si128((__m128i *)idx, _mm_cvttps_epi32(f));
+		putRGB(rgb + 3 * i, m_lut[idx[0]]);
+		putRGB(rgb + 3 * i + 3, m_lut[idx[1]]);
+		putRGB(rgb + 3 * i + 6, m_lut[idx[2]]);
+		putRGB(rgb + 3 * i + 9, m_lut[idx[3]]);
+	}
+#endif
+
+	for (; i < n; i++) {
+		float f = (src[i] - min) * scale;
+		if (!(f > 0)) f = 0;
+		if (f > top) f = top;
+		putRGB(rgb + 3 * i, m_lut[(int)f]);
+	}
+}
+
+/* Same as RenderRow, value of output pixel i is src[columns[i]].
+ * Used to draw scaled views without intermediate buffer.
+ */
+void ColorMap::RenderRowIndexed(const float *src, const int *columns, int n, float min, float max, uint8_t *rgb)
+{
+	float scale = (max > min) ? (m_size - 1) / (max - min) : 0;
+	float top = m_size - 1;
+	int i = 0;
+
+	if (!m_lut) return;
+
+#if defined(__AVX2__)
+	__m256 vOffset = _mm256_set1_ps(min);
+	__m256 vScale = _mm256_set1_ps(scale);
+	__m256 vTop = _mm256_set1_ps(top);
+
+	for (; i + 10 <= n; i += 8) {
+		__m256 v = _mm256_i32gather_ps(src, _mm256_loadu_si256((const __m256i *)(columns + i)), 4);
+		lookup8(m_lut, v, vOffset, vScale, vTop, rgb + 3 * i);
+	}
+#endif
+
+	for (; i < n; i++) {
+		float f = (src[columns[i]] - min) * scale;
+		if (!(f > 0)) f = 0;
+		if (f > top) f = top;
+		putRGB(rgb + 3 * i, m_lut[(int)f]);
+	}
+}
+
+/* Display range of image channel
+ * COLORMAP_RANGE_PERCENTILE spans from percentile low to percentile high,
+ * both fractions of the samples, so single spikes do not compress the
+ * rest of the image.
+ */
+int colormapRange(AFMImage *image, int channel, int mode, double low, double high, float *min, float *max)
+{
+	SurfaceStats *stats;
+
+	stats = new SurfaceStats();
+	if (!statsImage(image, channel, stats) || !stats->GetCount()) {
+		delete stats;
+		return 0;
+	}
+
+	*min = stats->GetMin();
+	*max = stats->GetMax();
+	delete stats;
+
+	if ((mode != COLORMAP_RANGE_PERCENTILE) || !(*max > *min)) return 1;
+
+	/* Histogram fitted to the data range, then to the bins holding the
+	 * found percentiles when spikes left them only a few bins apart.
+	 * End bins hold samples out of the histogram range, so fractions
+	 * stay exact. */
+	float histMin = *min, histMax = *max;
+	for (int pass = 0; pass < 2; pass++) {
+		float bin = (histMax - histMin) / RANGE_BINS;
+
+		stats = new SurfaceStats(histMin, histMax, RANGE_BINS);
+		if (statsImage(image, channel, stats)) {
+			*min = stats->GetPercentile(low);
+			*max = stats->GetPercentile(high);
+		}
+		delete stats;
+		if (!(*max > *min) || ((*max - *min) * RANGE_REFINE > histMax - histMin)) break;
+		histMin = *min - bin;
+		histMax = *max + bin;
+	}
+
+	return 1;
+}
+
+/* Render complete image channel to 24-bit RGB buffer, rows are stride bytes apart */
+int colormapRender(ColorMap *map, AFMImage *image, int channel, float min, float max, uint8_t *rgb, int stride)
+{
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+	if (!map->GetSize()) return 0;
+
+	#pragma omp parallel
+	{
+		for (int tile = 0; tile < image->GetTileCount(); tile++) {
+			int y0, y1;
+
+			image->GetTileBounds(tile, &y0, &y1);
+
+			#pragma omp single nowait
+			image->PrefetchTile(channel, tile + 1);
+
+			#pragma omp for schedule(static)
+			for (int y = y0; y < y1; y++) {
+				float *row = image->GetRow(channel, y);
+				if (row) map->RenderRow(row, image->GetWidth(), min, max, rgb + (size_t)y * stride);
+			}
+
+			#pragma omp single nowait
+			image->ReleaseTile(channel, tile);
+		}
+	}
+
+	return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef COLORMAP_H_
+#define COLORMAP_H_
+
+#include <stdint.h>
+
+#include "image.h"
+
+#define COLORMAP_MIN_SIZE		256
+#define COLORMAP_MAX_SIZE		4096
+
+enum {
+	COLORMAP_GREY = 0,
+	COLORMAP_GOLD,				/* Black - brown - gold - white */
+	COLORMAP_RAINBOW,			/* Blue - cyan - green - yellow - red */
+	COLORMAP_COUNT
+};
+
+enum {
+	COLORMAP_RANGE_MINMAX = 0,	/* Full data range */
+	COLORMAP_RANGE_PERCENTILE	/* Range between given percentiles */
+};
+
+/* Precomputed color table
+ * Heights are normalized to the table size, entries are packed
+ * as 0x00BBGGRR and written out as 24-bit RGB.
+ */
+class ColorMap {
+private:
+	uint32_t *m_lut;
+	int m_size;
+public:
+	ColorMap(void);
+	~ColorMap(void);
+	int Create(int type, int size = COLORMAP_MIN_SIZE);
+	int GetSize();
+	const uint32_t *GetTable();
+	void RenderRow(const float *src, int n, float min, float max, uint8_t *rgb);
+	void RenderRowIndexed(const float *src, const int *columns, int n, float min, float max, uint8_t *rgb);
+};
+
+int colormapRange(AFMImage *image, int channel, int mode, double low, double high, float *min, float *max);
+int colormapRender(ColorMap *map, AFMImage *image, int channel, float min, float max, uint8_t *rgb, int stride);
+
+
+#endif /* COLORMAP_H_ */
@@ -15,8 +15,12 @@
  *
  */
 
+#include <stdio.h>
+#include <stddef.h>
+#include <vector>
 #include <libusb.h>
 
+#include "adaptive.h"
 #include "device.h"
 #include "protocol.h"
 
@@ -25,15 +29,49 @@
 #define AFM_PID				0x6742
 
 #define AFM_BULK_IN			0x81
+#define AFM_BULK_OUT		0x01
+
+#define USB_PACKET_SIZE		64
 
 #define USB_EP0_TIMEOUT		500
 #define USB_BULK_TIMEOUT	1000
 
+/* Non-blocking image reception */
+#define USB_POLL_TIMEOUT	10		/* Bulk IN timeout while polling, ms */
+#define USB_POLL_TRANSFERS	256		/* Max transfers per poll */
+#define USB_POLL_IDLE		100		/* Polls without data before giving up */
+
 
 Device::Device()
 {
 	afm = NULL;
 	m_image = NULL;
+	m_cmd = 0;
+	m_datalen = 0;
+	m_datafollow = 0;
+	m_run.startX = 0;
+	m_run.startY = 0;
+	m_run.size = 0;
+	m_run.res = 0;
+	m_linesDone = 0;
+	m_imageDone = false;
+	m_imageStarted = false;
+	m_rxCount = 0;
+	m_timeout = USB_BULK_TIMEOUT;
+	m_telemetry = NULL;
+	m_pollRx = 0;
+	m_pollIdle = 0;
+	m_ring = NULL;
+	m_movieFrames = 0;
+	m_movieDone = 0;
+	m_adaptive = false;
+	m_curve = NULL;
+	m_curveTime = 0;
+	m_curveHeight = 0;
+	m_curveDone = false;
+	m_pathCredits = 0;
+	m_pathUnderruns = 0;
+	m_pathDone = false;
 	libusb_init(NULL);
 }
 
@@ -122,6 +160,82 @@ int Device::UpdateStatus()
 	return 1;
 }
 
+int Device::GetAFMProp(struct afmAFMProp *prop)
+{
+	afm_t cmd;
+
+	if (!AfmCommand(AFM_GET_AFM_PROP, DEVICE_GET, (uint8_t *)&cmd, sizeof(cmd.afmAFMProp)))
+		return 0;
+
+	*prop = cmd.afmAFMProp;
+	return 1;
+}
+
+int Device::GetSTMProp(struct afmSTMProp *prop)
+{
+	afm_t cmd;
+
+	if (!AfmCommand(AFM_GET_STM_PROP, DEVICE_GET, (uint8_t *)&cmd, sizeof(cmd.afmSTMProp)))
+		return 0;
+
+	*prop = cmd.afmSTMProp;
+	return 1;
+}
+
+/* Piezo DAC sigma-delta modulator order, 0 on error */
+int Device::GetDACOrder()
+{
+	afm_t cmd;
+
+	cmd.afmDACMode.order = 0;
+	if (!AfmCommand(AFM_GET_DAC_MODE, DEVICE_GET, (uint8_t *)&cmd, sizeof(cmd.afmDACMode)))
+		return 0;
+
+	return cmd.afmDACMode.order;
+}
+
+int Device::SetDACOrder(uint8_t order)
+{
+	afm_t cmd;
+
+	cmd.afmDACMode.order = order;
+	return AfmCommand(AFM_SET_DAC_MODE, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmDACMode));
+}
+
+/* Z loop mode, AFM_ZCONTROL_*; ignored by device while scanning */
+int Device::SetZControl(uint8_t zcontrol)
+{
+	afm_t cmd;
+
+	cmd.afmSetZControl.zcontrol = zcontrol;
+	return AfmCommand(AFM_SET_ZCONTROL, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmSetZControl));
+}
+
+/* Telemetry decimation, 0 when telemetry is off or on error */
+int Device::GetTelemetry()
+{
+	afm_t cmd;
+
+	cmd.afmTelemetry.decimation = 0;
+	if (!AfmCommand(AFM_GET_TELEMETRY, DEVICE_GET, (uint8_t *)&cmd, sizeof(cmd.afmTelemetry)))
+		return 0;
+
+	return cmd.afmTelemetry.decimation;
+}
+
+int Device::SetTelemetry(uint16_t decimation)
+{
+	afm_t cmd;
+
+	cmd.afmTelemetry.decimation = decimation;
+	return AfmCommand(AFM_SET_TELEMETRY, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmTelemetry));
+}
+
+void Device::SetTelemetryListener(TelemetryListener *listener)
+{
+	m_telemetry = listener;
+}
+
 int Device::Run(int startX, int startY, uint16_t realsize, uint16_t pixelsize)
 {
 	afm_t cmd;
@@ -130,15 +244,66 @@ int Device::Run(int startX, int startY, uint16_t realsize, uint16_t pixelsize)
 	cmd.afmRun.startY = startY;
 	cmd.afmRun.size = realsize;
 	cmd.afmRun.res = pixelsize;
+	m_run = cmd.afmRun;
+	m_adaptive = false;
 	return AfmCommand(AFM_RUN, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmRun));
 }
 
+/* Scan the same area frames times, or until stopped if frames is 0 */
+int Device::RunMovie(int startX, int startY, uint16_t realsize, uint16_t pixelsize, uint16_t frames)
+{
+	afm_t cmd;
+
+	cmd.afmRunMovie.run.startX = startX;
+	cmd.afmRunMovie.run.startY = startY;
+	cmd.afmRunMovie.run.size = realsize;
+	cmd.afmRunMovie.run.res = pixelsize;
+	cmd.afmRunMovie.frames = frames;
+	m_run = cmd.afmRunMovie.run;
+	m_movieFrames = frames;
+	m_adaptive = false;
+	return AfmCommand(AFM_RUN_MOVIE, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmRunMovie));
+}
+
+/* Scan every step-th line, then more lines where height changes by
+ * threshold or more; lines not scanned are interpolated */
+int Device::RunAdaptive(int startX, int startY, uint16_t realsize, uint16_t pixelsize, uint8_t step, uint16_t threshold)
+{
+	afm_t cmd;
+
+	cmd.afmRunAdaptive.run.startX = startX;
+	cmd.afmRunAdaptive.run.startY = startY;
+	cmd.afmRunAdaptive.run.size = realsize;
+	cmd.afmRunAdaptive.run.res = pixelsize;
+	cmd.afmRunAdaptive.step = step;
+	cmd.afmRunAdaptive.threshold = threshold;
+	m_run = cmd.afmRunAdaptive.run;
+	m_adaptive = true;
+	return AfmCommand(AFM_RUN_ADAPTIVE, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmRunAdaptive));
+}
+
+/* Take one force curve at (x, y), read it with ReadCurve().
+ * Z loop must be on, see SetZControl(). */
+int Device::RunSpectro(int x, int y, int16_t travel, uint16_t points, uint16_t period)
+{
+	afm_t cmd;
+
+	cmd.afmSpectro.x = x;
+	cmd.afmSpectro.y = y;
+	cmd.afmSpectro.travel = travel;
+	cmd.afmSpectro.points = points;
+	cmd.afmSpectro.period = period;
+	/* Nothing is sent while Z ramps down and back */
+	m_curveTime = ((uint32_t)2 * points * period + 999) / 1000;
+	return AfmCommand(AFM_SPECTRO, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmSpectro));
+}
+
 int Device::ReadData(uint8_t *buf, int len)
 {
 	int ret;
 	int readlen;
 
-	if (!afm) return 0;
+	if (!afm) return -1;
 
 	readlen = 0;
 	ret = libusb_bulk_transfer(afm,
@@ -146,64 +311,524 @@ int Device::ReadData(uint8_t *buf, int len)
 			buf,
 			len,
 			&readlen,
-			USB_BULK_TIMEOUT);
+			m_timeout);
+
+	if ((ret < 0) && (ret != LIBUSB_ERROR_TIMEOUT)) return -1;
 
+	m_rxCount += readlen;
 	return readlen;
 }
 
+int Device::WriteData(uint8_t *buf, int len)
+{
+	int ret;
+	int writelen;
+
+	if (!afm) return 0;
+
+	writelen = 0;
+	ret = libusb_bulk_transfer(afm,
+			AFM_BULK_OUT,
+			buf,
+			len,
+			&writelen,
+			USB_BULK_TIMEOUT);
+
+	if (ret < 0) return 0;
+
+	return (writelen == len);
+}
+
 int Device::ProcessDataPackets()
 {
 	uint8_t buf[64];
-	uint8_t data[256];
-	int ret, i;
+	int ret;
 	uint8_t *p;
-	uint8_t cmd, datalen, datafollow;
 
-	cmd = 0;
-	datafollow = 0;
+	/* Parser state is kept between calls, so messages may cross transfers */
 	while ( (ret = ReadData(buf, sizeof(buf))) > 0) {
 		for (p = buf; p < (buf+ret); p++) {
-			if (datafollow--) {
+			if (m_datafollow) {
 				/* Fetch data */
-				data[datalen++] = *p;
-				if (!datafollow) {
-					ProcessDataPacket(cmd, datalen, data);
-					cmd = 0;
+				m_data[m_datalen++] = *p;
+				if (!--m_datafollow) {
+					ProcessDataPacket(m_cmd, m_datalen, m_data);
+					m_cmd = 0;
 				}
 			} else {
-				if (cmd) {
+				if (m_cmd) {
 					/* Fetch data length */
-					datafollow = *p;
-					datalen = 0;
-					if (!datafollow) {
-						ProcessDataPacket(cmd, datalen, data);
-						cmd = 0;
+					m_datafollow = *p;
+					m_datalen = 0;
+					if (!m_datafollow) {
+						ProcessDataPacket(m_cmd, m_datalen, m_data);
+						m_cmd = 0;
 					}
 				} else {
-					/* Fetch command code */
-					cmd = *p;
+					/* Fetch command code, zero is padding */
+					m_cmd = *p;
 				}
 			}
 		}
-		if (ret < sizeof(buf)) break;
+		if (ret < (int)sizeof(buf)) break;
 	}
 
 	if (ret < 0) return 0;
 	return 1;
 }
 
+/* Put received samples to trace or retrace channel */
+int Device::ProcessImageData(uint8_t len, uint8_t *data)
+{
+	struct afmImageData *pkt = (struct afmImageData *)data;
+	int i, count, channel, step;
+	float *row;
+
+	if (len < offsetof(struct afmImageData, z)) return 0;
+	count = (len - offsetof(struct afmImageData, z)) / sizeof(pkt->z[0]);
+
+	if (pkt->flags & AFM_IMAGE_FLAG_RETRACE) {
+		channel = AFM_CHANNEL_RETRACE;
+		step = -1;
+	} else {
+		channel = AFM_CHANNEL_TRACE;
+		step = 1;
+	}
+
+	row = m_image->GetRow(channel, pkt->line);
+	if (!row) return 0;
+
+	for (i = 0; i < count; i++) {
+		int x = pkt->pixel + i * step;
+		if ((x < 0) || (x >= m_image->GetWidth())) break;
+		row[x] = pkt->z[i];
+	}
+
+	if (pkt->flags & AFM_IMAGE_FLAG_EOL) {
+		m_linesDone++;
+
+		if (m_adaptive) {
+			int from, to;
+
+			/* Lines come in any order, listeners get them only as preview
+			 * until AdaptiveEnd(); tiles are not released */
+			for (size_t l = 0; l < m_listeners.size(); l++)
+				m_listeners[l]->OnImagePreview(m_image, channel, pkt->line);
+
+			/* Retrace ends the line, lines around it are shown interpolated */
+			if (channel != AFM_CHANNEL_RETRACE) return 1;
+			m_lineMask[pkt->line] = 1;
+			if (!adaptiveFillAround(m_image, m_lineMask, pkt->line, &from, &to)) return 1;
+			for (int y = from; y <= to; y++) {
+				if (y == pkt->line) continue;
+				for (size_t l = 0; l < m_listeners.size(); l++) {
+					m_listeners[l]->OnImagePreview(m_image, AFM_CHANNEL_TRACE, y);
+					m_listeners[l]->OnImagePreview(m_image, AFM_CHANNEL_RETRACE, y);
+				}
+			}
+			return 1;
+		}
+
+		for (size_t l = 0; l < m_listeners.size(); l++)
+			m_listeners[l]->OnImageLine(m_image, channel, pkt->line);
+
+		/* Completed tile of file backed image is written out */
+		int rows = m_image->GetTileRows();
+		if (rows && (((pkt->line + 1) % rows == 0) || (pkt->line + 1 == m_image->GetHeight())))
+			m_image->ReleaseTile(channel, pkt->line / rows);
+	}
+
+	return 1;
+}
+
+/* Interpolate lines missing from adaptive scan, then pass every line to
+ * listeners once and in order, as a raster scan would */
+void Device::AdaptiveEnd()
+{
+	int rows = m_image->GetTileRows();
+
+	adaptiveFill(m_image, m_lineMask);
+	for (int y = 0; y < m_image->GetHeight(); y++) {
+		for (size_t l = 0; l < m_listeners.size(); l++) {
+			m_listeners[l]->OnImageLine(m_image, AFM_CHANNEL_TRACE, y);
+			m_listeners[l]->OnImageLine(m_image, AFM_CHANNEL_RETRACE, y);
+		}
+		if (rows && (((y + 1) % rows == 0) || (y + 1 == m_image->GetHeight()))) {
+			m_image->ReleaseTile(AFM_CHANNEL_TRACE, y / rows);
+			m_image->ReleaseTile(AFM_CHANNEL_RETRACE, y / rows);
+		}
+	}
+}
+
 int Device::ProcessDataPacket(uint8_t cmd, uint8_t len, uint8_t *data)
 {
+	struct afmPathCredit *credit;
+	struct afmImageStart *start;
+	struct afmSpectroStart *spStart;
+	struct afmSpectroData *spData;
+
+	switch (cmd) {
+	case AFM_IMAGE_START:
+		if (m_ring) m_image = m_ring->GetWriteBuffer();
+		if (!m_image || (len < sizeof(*start))) return 0;
+		start = (struct afmImageStart *)data;
+		if (!m_image->Create(start->res, start->res, AFM_CHANNEL_COUNT)) return 0;
+		m_image->SetGeometry(m_run.startX, m_run.startY, m_run.size);
+		m_linesDone = 0;
+		m_imageStarted = true;
+		if (m_adaptive) m_lineMask.assign(start->res, 0);
+		for (size_t l = 0; l < m_listeners.size(); l++)
+			m_listeners[l]->OnImageStart(m_image);
+		return 1;
+
+	case AFM_IMAGE_DATA:
+		/* AFM_STOP sends no end marker, lines queued before it are dropped */
+		if (!m_imageStarted) return 1;
+		if (!m_image) return 0;
+		return ProcessImageData(len, data);
+
+	case AFM_IMAGE_END:
+		if (!m_imageStarted) return 1;
+		m_imageStarted = false;
+		if (m_image && m_adaptive) AdaptiveEnd();
+		if (m_image) {
+			for (size_t l = 0; l < m_listeners.size(); l++)
+				m_listeners[l]->OnImageEnd(m_image);
+		}
+		if (m_ring && m_image) {
+			/* Device starts the next frame by itself */
+			m_ring->Commit();
+			m_image = m_ring->GetWriteBuffer();
+			if (!m_movieFrames || (++m_movieDone < m_movieFrames)) return 1;
+		}
+		m_imageDone = true;
+		return 1;
+
+	case AFM_SPECTRO_START:
+		if (!m_curve || (len < sizeof(*spStart))) return 0;
+		spStart = (struct afmSpectroStart *)data;
+		m_curve->assign(spStart->points * 2, 0);
+		m_curveHeight = spStart->height;
+		return 1;
+
+	case AFM_SPECTRO_DATA:
+		if (!m_curve || (len < offsetof(struct afmSpectroData, adc))) return 0;
+		spData = (struct afmSpectroData *)data;
+		for (int i = 0; i < (int)((len - offsetof(struct afmSpectroData, adc)) / sizeof(spData->adc[0])); i++) {
+			size_t idx = spData->index + i;
+			if (idx >= m_curve->size()) break;
+			(*m_curve)[idx] = spData->adc[i];
+		}
+		return 1;
+
+	case AFM_SPECTRO_END:
+		m_curveDone = true;
+		return 1;
+
+	case AFM_TELEMETRY:
+		if (len < sizeof(uint16_t)) return 0;
+		if (m_telemetry) {
+			struct afmTelemetryData *tm = (struct afmTelemetryData *)data;
+			m_telemetry->OnTelemetry(tm->seq, tm->s, (len - sizeof(tm->seq)) / sizeof(tm->s[0]));
+		}
+		return 1;
+
+	case AFM_PATH_CREDIT:
+		if (len < sizeof(*credit)) return 0;
+		credit = (struct afmPathCredit *)data;
+		m_pathCredits += credit->credits;
+		m_pathUnderruns = credit->underruns;
+		return 1;
+
+	case AFM_PATH_DONE:
+		m_pathDone = true;
+		return 1;
+	}
+
 	return 0;
 }
 
+/* Receive image data until the end of scan
+ * Trace and retrace lines are assembled into two channels of the same image.
+ */
 int Device::ReadImage(AFMImage *image, void(*progress)(int percent))
 {
-	int ret;
+	int ret, idle, lines;
+	unsigned int rx;
 
 	m_image = image;
-	ret = ProcessDataPackets();
+	m_imageDone = false;
+	m_imageStarted = false;
+	m_linesDone = 0;
+
+	idle = 0;
+	do {
+		lines = m_linesDone;
+		rx = m_rxCount;
+		ret = ProcessDataPackets();
+		if (!ret) break;
+
+		if ((m_linesDone != lines) && progress && image->GetHeight())
+			progress(m_linesDone * 50 / image->GetHeight());
+
+		if (m_rxCount != rx) {
+			idle = 0;
+		} else if (++idle > 5) {
+			/* Device stopped sending data */
+			ret = 0;
+			break;
+		}
+	} while (!m_imageDone);
+
 	m_image = NULL;
 
 	return ret;
 }
+
+/* Receive force curve of RunSpectro(): ADC samples of approach and retract,
+ * and Z height at ramp start */
+int Device::ReadCurve(std::vector<uint16_t> *curve, uint16_t *height)
+{
+	int ret, idle, maxIdle;
+	unsigned int rx;
+
+	curve->clear();
+	m_curve = curve;
+	m_curveDone = false;
+
+	/* Every idle read waits for USB_BULK_TIMEOUT */
+	maxIdle = 5 + (m_curveTime + USB_BULK_TIMEOUT - 1) / USB_BULK_TIMEOUT;
+
+	idle = 0;
+	do {
+		rx = m_rxCount;
+		ret = ProcessDataPackets();
+		if (!ret) break;
+
+		if (m_rxCount != rx) {
+			idle = 0;
+		} else if (++idle > maxIdle) {
+			/* Device stopped sending data */
+			ret = 0;
+			break;
+		}
+	} while (!m_curveDone);
+
+	m_curve = NULL;
+	*height = m_curveHeight;
+
+	return ret && !curve->empty();
+}
+
+/* Prepare to receive image with PollImage() */
+void Device::StartImage(AFMImage *image)
+{
+	m_ring = NULL;
+	m_image = image;
+	m_imageDone = false;
+	m_imageStarted = false;
+	m_linesDone = 0;
+	m_pollRx = m_rxCount;
+	m_pollIdle = 0;
+}
+
+/* Receive frames of RunMovie() into ring buffers, polled by PollImage() */
+void Device::StartMovie(FrameRing *ring)
+{
+	StartImage(ring->GetWriteBuffer());
+	m_ring = ring;
+	m_movieDone = 0;
+}
+
+/* Process data received so far, waiting at most a few milliseconds,
+ * so it can be called from GUI timer. done is set when image is complete.
+ * Returns 0 on error or when device stops sending data.
+ */
+int Device::PollImage(bool *done)
+{
+	int ret;
+
+	*done = false;
+	if (!m_image) return 0;
+
+	ret = PollData();
+
+	if (m_rxCount != m_pollRx) {
+		m_pollRx = m_rxCount;
+		m_pollIdle = 0;
+	} else if (++m_pollIdle > USB_POLL_IDLE) {
+		/* Device stopped sending data */
+		ret = 0;
+	}
+
+	*done = m_imageDone;
+	if (!ret || m_imageDone) {
+		m_image = NULL;
+		m_ring = NULL;
+	}
+
+	return ret;
+}
+
+/* Process data messages received so far, waiting at most a few milliseconds.
+ * Stops after the end of image being received.
+ */
+int Device::PollData()
+{
+	unsigned int rx;
+	int ret = 1;
+
+	m_timeout = USB_POLL_TIMEOUT;
+	for (int i = 0; i < USB_POLL_TRANSFERS; i++) {
+		if (m_image && m_imageDone) break;
+		rx = m_rxCount;
+		ret = ProcessDataPackets();
+		if (!ret || (m_rxCount == rx)) break;
+	}
+	m_timeout = USB_BULK_TIMEOUT;
+
+	return ret;
+}
+
+/* Stop scanning and finish partially received image */
+int Device::AbortImage()
+{
+	uint8_t buf[1];
+	int ret;
+
+	ret = AfmCommand(AFM_STOP, DEVICE_SET, buf, 0);
+
+	if (m_image) {
+		if (m_adaptive) AdaptiveEnd();
+		for (size_t l = 0; l < m_listeners.size(); l++)
+			m_listeners[l]->OnImageEnd(m_image);
+		m_image = NULL;
+	}
+	m_ring = NULL;
+	m_imageStarted = false;
+
+	return ret;
+}
+
+/* Listeners are notified when image is started, line is received and image is completed */
+void Device::AddListener(ImageListener *listener)
+{
+	m_listeners.push_back(listener);
+}
+
+void Device::RemoveListener(ImageListener *listener)
+{
+	for (size_t l = 0; l < m_listeners.size(); l++) {
+		if (m_listeners[l] == listener) {
+			m_listeners.erase(m_listeners.begin() + l);
+			break;
+		}
+	}
+}
+
+/* Drive the tip along arbitrary path
+ * Coordinates are in nanometers, one waypoint is applied every period of DAC buffer.
+ * Waypoints are sent only when the device has free FIFO slots (credits) for them.
+ * Path is stopped on the device if it fails.
+ */
+int Device::RunPath(const int32_t *x, const int32_t *y, int count, uint16_t period)
+{
+	afm_t cmd;
+	uint8_t buf[USB_PACKET_SIZE];
+	struct afmPathPoint *pt;
+	int i, n, idle, maxIdle;
+	const int maxPoints = (USB_PACKET_SIZE - 2) / sizeof(struct afmPathPoint);
+
+	m_pathCredits = AFM_PATH_FIFO_SIZE;
+	m_pathUnderruns = 0;
+	m_pathDone = false;
+
+	/* Credits come back once per chunk of points, every idle read waits
+	 * for USB_BULK_TIMEOUT */
+	maxIdle = 5 + ((uint32_t)AFM_PATH_CREDIT_CHUNK * period * AFM_DAC_BUFFER_US / 1000 +
+			USB_BULK_TIMEOUT - 1) / USB_BULK_TIMEOUT;
+
+	cmd.afmPathStart.period = period;
+	if (!AfmCommand(AFM_PATH_START, DEVICE_SET, (uint8_t *)&cmd, sizeof(cmd.afmPathStart)))
+		return 0;
+
+	i = 0;
+	idle = 0;
+	while (i < count) {
+		/* Send as many waypoints as we have credits for */
+		while ((m_pathCredits > 0) && (i < count)) {
+			n = count - i;
+			if (n > maxPoints) n = maxPoints;
+			if (n > m_pathCredits) n = m_pathCredits;
+
+			buf[0] = AFM_PATH_DATA;
+			buf[1] = n * sizeof(struct afmPathPoint);
+			pt = (struct afmPathPoint *)(buf + 2);
+			for (int j = 0; j < n; j++, i++) {
+				pt[j].x = x[i];
+				pt[j].y = y[i];
+			}
+			if (!WriteData(buf, 2 + buf[1])) goto fail;
+			m_pathCredits -= n;
+			idle = 0;
+		}
+
+		if (i >= count) break;
+
+		/* Wait for credits */
+		if (!ProcessDataPackets()) goto fail;
+		if ((m_pathCredits == 0) && (++idle > maxIdle)) goto fail;
+	}
+
+	/* Mark end of path and wait for the device to finish */
+	buf[0] = AFM_PATH_END;
+	buf[1] = 0;
+	if (!WriteData(buf, 2)) goto fail;
+
+	idle = 0;
+	while (!m_pathDone) {
+		int credits = m_pathCredits;
+		if (!ProcessDataPackets()) goto fail;
+		if (m_pathCredits != credits) idle = 0;
+		else if (++idle > maxIdle) goto fail;
+	}
+
+	return 1;
+
+fail:
+	/* Device would stay in path mode and refuse other scans */
+	AfmCommand(AFM_STOP, DEVICE_SET, (uint8_t *)&cmd, 0);
+	return 0;
+}
+
+/* Read path from text file
+ * Each line contains X and Y coordinates in nanometers, '#' starts a comment.
+ */
+int Device::RunPathFile(std::string filename, uint16_t period)
+{
+	FILE *f;
+	char line[256];
+	long px, py;
+	std::vector<int32_t> x, y;
+
+	f = fopen(filename.c_str(), "r");
+	if (!f) return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%ld %ld", &px, &py) != 2) continue;
+		x.push_back(px);
+		y.push_back(py);
+	}
+
+	fclose(f);
+
+	if (x.empty()) return 0;
+
+	return RunPath(&x[0], &y[0], x.size(), period);
+}
+
+int Device::GetPathUnderruns()
+{
+	return m_pathUnderruns;
+}
@@ -2,17 +2,62 @@
 #define DEVICE_H_
 
 #include <libusb.h>
+#include <string>
+#include <vector>
 
 #include "image.h"
+#include "movie.h"
+#include "protocol.h"
 
 #define DEVICE_GET		0
 #define DEVICE_SET		1
 
+/* Receives Z loop telemetry, seq is number of the first sample */
+class TelemetryListener {
+public:
+	virtual ~TelemetryListener() {}
+	virtual void OnTelemetry(uint16_t seq, const struct afmTelemetrySample *s, int count) = 0;
+};
+
 class Device {
 private:
 	libusb_device_handle *afm;
 	AFMImage *m_image;
+	std::vector<ImageListener *> m_listeners;
+	TelemetryListener *m_telemetry;
+	/* Data packet parser state */
+	uint8_t m_cmd;
+	uint8_t m_datalen;
+	uint8_t m_datafollow;
+	uint8_t m_data[256];
+	unsigned int m_rxCount;
+	unsigned int m_timeout;		/* Bulk IN timeout, ms */
+	/* Image acquisition state */
+	struct afmRun m_run;
+	int m_linesDone;
+	bool m_imageDone;
+	bool m_imageStarted;		/* IMAGE_START seen, data before it is left from a stopped scan */
+	unsigned int m_pollRx;
+	int m_pollIdle;
+	/* Movie state */
+	FrameRing *m_ring;
+	int m_movieFrames;			/* 0 is unlimited */
+	int m_movieDone;
+	/* Adaptive scan state */
+	bool m_adaptive;
+	std::vector<uint8_t> m_lineMask;	/* Lines measured so far */
+	/* Force curve state */
+	std::vector<uint16_t> *m_curve;
+	uint16_t m_curveHeight;
+	bool m_curveDone;
+	uint32_t m_curveTime;		/* Ramp duration of requested curve, ms */
+	/* Trajectory mode state */
+	int m_pathCredits;
+	int m_pathUnderruns;
+	bool m_pathDone;
 	int AfmCommand(uint8_t cmd, uint8_t direction, uint8_t *data, int len);
+	int ProcessImageData(uint8_t len, uint8_t *data);
+	void AdaptiveEnd();
 public:
 	Device(void);
 	int Connect();
@@ -20,11 +65,34 @@ public:
 	bool IsConnected();
 	int GetFirmwareVersion();
 	int UpdateStatus();
+	int GetAFMProp(struct afmAFMProp *prop);
+	int GetSTMProp(struct afmSTMProp *prop);
+	int GetDACOrder();
+	int SetDACOrder(uint8_t order);
+	int SetZControl(uint8_t zcontrol);
+	int GetTelemetry();
+	int SetTelemetry(uint16_t decimation);
+	void SetTelemetryListener(TelemetryListener *listener);
 	int Run(int startX, int startY, uint16_t realsize, uint16_t pixelsize);
+	int RunMovie(int startX, int startY, uint16_t realsize, uint16_t pixelsize, uint16_t frames);
+	int RunAdaptive(int startX, int startY, uint16_t realsize, uint16_t pixelsize, uint8_t step, uint16_t threshold);
+	int RunSpectro(int x, int y, int16_t travel, uint16_t points, uint16_t period);
 	int ReadData(uint8_t *buf, int len);
+	int WriteData(uint8_t *buf, int len);
 	int ProcessDataPackets();
 	int ProcessDataPacket(uint8_t cmd, uint8_t len, uint8_t *data);
+	int PollData();
 	int ReadImage(AFMImage *image, void(*progress)(int percent));
+	int ReadCurve(std::vector<uint16_t> *curve, uint16_t *height);
+	void StartImage(AFMImage *image);
+	void StartMovie(FrameRing *ring);
+	int PollImage(bool *done);
+	int AbortImage();
+	void AddListener(ImageListener *listener);
+	void RemoveListener(ImageListener *listener);
+	int RunPath(const int32_t *x, const int32_t *y, int count, uint16_t period);
+	int RunPathFile(std::string filename, uint16_t period);
+	int GetPathUnderruns();
 };
 
 
@@ -0,0 +1,245 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "drift.h"
+#include "fft.h"
+
+
+DriftTracker::DriftTracker(void)
+{
+	m_ref = NULL;
+	m_refFrame = -1;
+	m_next = 0;
+	Reset(0, 0, 0, 0);
+}
+
+DriftTracker::~DriftTracker(void)
+{
+	delete m_ref;
+}
+
+/* Start a new series of frames, drift knowledge is dropped.
+ * Frames of the previous series still being registered are ignored. */
+void DriftTracker::Reset(int32_t startX, int32_t startY, uint16_t size, uint16_t res)
+{
+	wxMutexLocker lock(m_lock);
+
+	m_startX = startX;
+	m_startY = startY;
+	m_size = size;
+	m_res = res;
+	m_first = m_next;
+	m_corrX.clear();
+	m_corrY.clear();
+	m_measured = 0;
+	m_lastFrame = -1;
+	m_driftX = 0;
+	m_driftY = 0;
+	m_velX = 0;
+	m_velY = 0;
+}
+
+int DriftTracker::Matches(int32_t startX, int32_t startY, uint16_t size, uint16_t res)
+{
+	wxMutexLocker lock(m_lock);
+
+	return (m_startX == startX) && (m_startY == startY) &&
+			(m_size == size) && (m_res == res);
+}
+
+/* Number the next frame and get its start correction in nanometers */
+int DriftTracker::StartFrame(int *dx, int *dy)
+{
+	wxMutexLocker lock(m_lock);
+	int frame = m_next++;
+
+	*dx = 0;
+	*dy = 0;
+	if (m_lastFrame >= 0) {
+		*dx = (int)floor(m_driftX + m_velX * (frame - m_lastFrame) + 0.5);
+		*dy = (int)floor(m_driftY + m_velY * (frame - m_lastFrame) + 0.5);
+	}
+	m_corrX.push_back(*dx);
+	m_corrY.push_back(*dy);
+
+	return frame;
+}
+
+/* Register frame against the last one, frames older than that are skipped.
+ * Returns 1 if drift was measured. */
+int DriftTracker::AddFrame(int frame, AFMImage *image, int channel)
+{
+	wxMutexLocker refLock(m_refLock);
+	AFMImage *copy;
+	double dx = 0, dy = 0, peak = 0;
+	int corrX, corrY, refX = 0, refY = 0;
+	int size, res;
+	int ok = 0;
+
+	{
+		wxMutexLocker lock(m_lock);
+
+		if ((frame < m_first) || (frame >= m_next) || (frame <= m_refFrame)) return 0;
+		if ((image->GetWidth() != m_res) || (image->GetHeight() != m_res)) return 0;
+		if (m_refFrame < m_first) {
+			delete m_ref;
+			m_ref = NULL;
+		}
+		size = m_size;
+		res = m_res;
+		corrX = m_corrX[frame - m_first];
+		corrY = m_corrY[frame - m_first];
+		if (m_ref) {
+			refX = m_corrX[m_refFrame - m_first];
+			refY = m_corrY[m_refFrame - m_first];
+		}
+	}
+
+	copy = new AFMImage();
+	if (!copy->Create(res, res, 1)) {
+		delete copy;
+		return 0;
+	}
+	for (int y = 0; y < res; y++)
+		memcpy(copy->GetRow(0, y), image->GetRow(channel, y), sizeof(float) * res);
+
+	if (m_ref) {
+		ok = fftCorrelate(m_ref, 0, copy, 0, res / 4, &dx, &dy, &peak) &&
+				(peak >= DRIFT_MIN_PEAK);
+		if (!ok) {
+			/* Keep the reference, the next frame may match it */
+			delete copy;
+			return 0;
+		}
+	}
+
+	{
+		wxMutexLocker lock(m_lock);
+
+		if (frame < m_first) {
+			/* Reset while registering */
+			delete copy;
+			return 0;
+		}
+		if (!m_ref) {
+			/* First frame of the series, drift so far is what was applied */
+			m_driftX = corrX;
+			m_driftY = corrY;
+		} else {
+			/* Feature moved by measured shift plus the start difference */
+			double scale = (double)size / res;
+			double moveX = dx * scale + corrX - refX;
+			double moveY = dy * scale + corrY - refY;
+			double frames = frame - m_refFrame;
+
+			if (m_measured) {
+				m_velX += DRIFT_SMOOTHING * (moveX / frames - m_velX);
+				m_velY += DRIFT_SMOOTHING * (moveY / frames - m_velY);
+			} else {
+				m_velX = moveX / frames;
+				m_velY = moveY / frames;
+			}
+			m_driftX += moveX;
+			m_driftY += moveY;
+			m_measured = 1;
+		}
+		m_lastFrame = frame;
+	}
+
+	delete m_ref;
+	m_ref = copy;
+	m_refFrame = frame;
+
+	return ok;
+}
+
+/* Drift velocity in nanometers per frame */
+int DriftTracker::GetVelocity(double *vx, double *vy)
+{
+	wxMutexLocker lock(m_lock);
+
+	*vx = m_velX;
+	*vy = m_velY;
+
+	return m_measured;
+}
+
+/* Undo drift within the frame, assuming lines are scanned evenly over
+ * one frame period: line y is resampled at the position it would have
+ * had at frame start. Area drifted out of the scan repeats the edge. */
+int DriftTracker::CorrectLines(AFMImage *image)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	double vx, vy;
+	float *buf;
+
+	{
+		wxMutexLocker lock(m_lock);
+
+		if (!m_measured || !width || !height) return 0;
+
+		/* Pixels per line */
+		vx = m_velX * m_res / m_size / height;
+		vy = m_velY * m_res / m_size / height;
+	}
+
+	buf = (float *)malloc(sizeof(float) * width * height);
+	if (!buf) return 0;
+
+	for (int ch = 0; ch < image->GetChannels(); ch++) {
+		for (int y = 0; y < height; y++)
+			memcpy(buf + (size_t)y * width, image->GetRow(ch, y), sizeof(float) * width);
+
+		#pragma omp parallel for schedule(static)
+		for (int y = 0; y < height; y++) {
+			float *out = image->GetRow(ch, y);
+			double sy = y + vy * y;
+			int y0 = (int)floor(sy);
+			double fy = sy - y0;
+			int y1;
+
+			if (y0 < 0) { y0 = 0; fy = 0; }
+			if (y0 >= height - 1) { y0 = height - 1; fy = 0; }
+			y1 = (y0 + 1 < height) ? y0 + 1 : y0;
+
+			const float *r0 = buf + (size_t)y0 * width;
+			const float *r1 = buf + (size_t)y1 * width;
+			for (int x = 0; x < width; x++) {
+				double sx = x + vx * y;
+				int x0 = (int)floor(sx);
+				double fx = sx - x0;
+				int x1;
+
+				if (x0 < 0) { x0 = 0; fx = 0; }
+				if (x0 >= width - 1) { x0 = width - 1; fx = 0; }
+				x1 = (x0 + 1 < width) ? x0 + 1 : x0;
+
+				out[x] = (float)((r0[x0] * (1 - fx) + r0[x1] * fx) * (1 - fy) +
+						(r1[x0] * (1 - fx) + r1[x1] * fx) * fy);
+			}
+		}
+	}
+
+	free(buf);
+
+	return 1;
+}
@@ -0,0 +1,59 @@
+#ifndef DRIFT_H_
+#define DRIFT_H_
+
+#include <wx/thread.h>
+#include <vector>
+
+#include "image.h"
+
+/* Correction modes */
+#define DRIFT_OFF			0
+#define DRIFT_FRAME			1	/* Correct scan start of each frame */
+#define DRIFT_LINE			2	/* Also shift lines within the frame */
+
+/* Registration with lower peak to sidelobe ratio is ignored */
+#define DRIFT_MIN_PEAK		6.0
+
+/* Velocity smoothing, weight of the newest measurement */
+#define DRIFT_SMOOTHING		0.5
+
+/* Drift tracking over repeated scans of the same area
+ * Consecutive frames are registered by FFT correlation, giving drift
+ * velocity in nanometers per frame. Start of each new frame is moved by
+ * the drift predicted for it, so registration of the previous frame may
+ * still be running when the next scan starts.
+ * StartFrame() is called by the scanning thread, AddFrame() and
+ * CorrectLines() by any worker thread.
+ */
+class DriftTracker {
+private:
+	int32_t m_startX;			/* Nominal scan area */
+	int32_t m_startY;
+	uint16_t m_size;
+	uint16_t m_res;
+	int m_first;				/* First frame number since Reset() */
+	int m_next;
+	std::vector<int> m_corrX;	/* Start correction applied to each frame */
+	std::vector<int> m_corrY;
+	int m_measured;				/* Velocity is known */
+	int m_lastFrame;			/* Last registered frame and its drift */
+	double m_driftX;
+	double m_driftY;
+	double m_velX;				/* Nanometers per frame */
+	double m_velY;
+	wxMutex m_lock;
+	AFMImage *m_ref;			/* Reference frame, trace channel */
+	int m_refFrame;
+	wxMutex m_refLock;			/* Serializes registration */
+public:
+	DriftTracker();
+	~DriftTracker();
+	void Reset(int32_t startX, int32_t startY, uint16_t size, uint16_t res);
+	int Matches(int32_t startX, int32_t startY, uint16_t size, uint16_t res);
+	int StartFrame(int *dx, int *dy);
+	int AddFrame(int frame, AFMImage *image, int channel);
+	int GetVelocity(double *vx, double *vy);
+	int CorrectLines(AFMImage *image);
+};
+
+#endif /* DRIFT_H_ */
@@ -0,0 +1,518 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <string>
+#include <zlib.h>
+
+#include "export.h"
+
+
+/* Rows per TIFF strip and per independently deflated PNG block */
+#define EXPORT_STRIP_BYTES		(64 * 1024)
+#define EXPORT_BLOCK_BYTES		(1024 * 1024)
+
+/* Strips compressed in parallel before writing */
+#define EXPORT_BATCH			64
+
+#define EXPORT_ZLIB_LEVEL		6
+
+
+typedef struct {
+	float offset;
+	float scale;
+} grey_map_t;
+
+static int greyMap(AFMImage *image, int channel, int mapping, float zmin, float zmax, grey_map_t *map)
+{
+	if (mapping == EXPORT_MAP_RAW) {
+		map->offset = 0;
+		map->scale = 1;
+		return 1;
+	}
+
+	if (mapping == EXPORT_MAP_AUTO) {
+		zmin = FLT_MAX;
+		zmax = -FLT_MAX;
+		for (int y = 0; y < image->GetHeight(); y++) {
+			const float *row = image->GetRow(channel, y);
+			for (int x = 0; x < image->GetWidth(); x++) {
+				if (row[x] < zmin) zmin = row[x];
+				if (row[x] > zmax) zmax = row[x];
+			}
+		}
+	} else if (mapping != EXPORT_MAP_RANGE) {
+		return 0;
+	}
+
+	map->offset = zmin;
+	map->scale = (zmax > zmin) ? 65535.0f / (zmax - zmin) : 0;
+	return 1;
+}
+
+static void greyRow(const float *src, uint16_t *dst, int width, const grey_map_t *map)
+{
+	for (int x = 0; x < width; x++) {
+		float v = (src[x] - map->offset) * map->scale + 0.5f;
+		if (!(v >= 0)) v = 0;
+		if (v > 65535) v = 65535;
+		dst[x] = (uint16_t)v;
+	}
+}
+
+/* Deflate buffer into malloc'ed block.
+ * raw != 0 gives headerless stream ending with sync flush,
+ * suitable for concatenation.
+ */
+static uint8_t *deflateBlock(const uint8_t *src, size_t len, int raw, int last, size_t *outLen)
+{
+	z_stream zs;
+	uint8_t *out;
+	size_t bound;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, EXPORT_ZLIB_LEVEL, Z_DEFLATED, raw ? -15 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	bound = deflateBound(&zs, len) + 16;
+	out = (uint8_t *)malloc(bound);
+	if (!out) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = bound;
+	ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+	if ((last && (ret != Z_STREAM_END)) || (!last && (ret != Z_OK)) || zs.avail_in) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+
+	*outLen = bound - zs.avail_out;
+	deflateEnd(&zs);
+
+	return out;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put32be(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/***** TIFF *****/
+
+/* Strip with horizontal differencing predictor, little endian samples */
+static uint8_t *tiffStrip(AFMImage *image, int channel, const grey_map_t *map,
+		int y0, int rows, size_t *outLen)
+{
+	int width = image->GetWidth();
+	uint16_t *grey = (uint16_t *)malloc(sizeof(uint16_t) * width);
+	uint8_t *raw = (uint8_t *)malloc((size_t)width * 2 * rows);
+	uint8_t *out = NULL;
+
+	if (grey && raw) {
+		for (int r = 0; r < rows; r++) {
+			uint8_t *dst = raw + (size_t)r * width * 2;
+			uint16_t prev = 0;
+
+			greyRow(image->GetRow(channel, y0 + r), grey, width, map);
+			for (int x = 0; x < width; x++) {
+				put16(dst + 2 * x, grey[x] - prev);
+				prev = grey[x];
+			}
+		}
+		out = deflateBlock(raw, (size_t)width * 2 * rows, 0, 1, outLen);
+	}
+
+	free(grey);
+	free(raw);
+
+	return out;
+}
+
+static void tiffTag(uint8_t *p, uint16_t tag, uint16_t type, uint32_t count, uint32_t value)
+{
+	put16(p, tag);
+	put16(p + 2, type);
+	put32(p + 4, count);
+	/* SHORT values are left justified in the value field */
+	if ((type == 3) && (count == 1)) {
+		put16(p + 8, value);
+		put16(p + 10, 0);
+	} else {
+		put32(p + 8, value);
+	}
+}
+
+/* Unsigned RATIONAL with the finest power of ten denominator that fits */
+static void tiffRational(uint8_t *p, double value)
+{
+	uint32_t den = 1;
+
+	while ((den < 1000000) && (value * den * 10 < 4294967295.0)) den *= 10;
+	if (value * den > 4294967295.0) value = 4294967295.0 / den;
+	put32(p, (uint32_t)(value * den + 0.5));
+	put32(p + 4, den);
+}
+
+/* Baseline little endian TIFF, one IFD after the strips.
+ * Offsets are 32-bit, so file must stay below 4 GB.
+ */
+int exportTIFF(AFMImage *image, int channel, std::string filename,
+		int mapping, float zmin, float zmax)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	int rowsPerStrip, strips;
+	uint32_t *offsets, *counts;
+	uint64_t offset;
+	grey_map_t map;
+	uint8_t header[8];
+	FILE *f;
+	int ret = 1;
+
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+	if (!width || !height) return 0;
+	if (!greyMap(image, channel, mapping, zmin, zmax, &map)) return 0;
+
+	rowsPerStrip = EXPORT_STRIP_BYTES / (width * 2);
+	if (rowsPerStrip < 1) rowsPerStrip = 1;
+	strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+
+	offsets = (uint32_t *)malloc(sizeof(uint32_t) * strips);
+	counts = (uint32_t *)malloc(sizeof(uint32_t) * strips);
+	f = fopen(filename.c_str(), "wb");
+	if (!offsets || !counts || !f) {
+		free(offsets);
+		free(counts);
+		if (f) fclose(f);
+		return 0;
+	}
+
+	memcpy(header, "II*\0", 4);
+	put32(header + 4, 0);		/* IFD offset, rewritten at the end */
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header)) ret = 0;
+	offset = sizeof(header);
+
+	for (int s0 = 0; ret && (s0 < strips); s0 += EXPORT_BATCH) {
+		int count = (strips - s0 < EXPORT_BATCH) ? strips - s0 : EXPORT_BATCH;
+		uint8_t *blob[EXPORT_BATCH];
+		size_t len[EXPORT_BATCH];
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < count; i++) {
+			int y0 = (s0 + i) * rowsPerStrip;
+			int rows = (y0 + rowsPerStrip < height) ? rowsPerStrip : height - y0;
+			blob[i] = tiffStrip(image, channel, &map, y0, rows, &len[i]);
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (!blob[i]) {
+				ret = 0;
+				continue;
+			}
+			offsets[s0 + i] = (uint32_t)offset;
+			counts[s0 + i] = len[i];
+			if (ret && (fwrite(blob[i], 1, len[i], f) != len[i])) ret = 0;
+			offset += len[i];
+			free(blob[i]);
+		}
+	}
+
+	/* Arrays and IFD, word aligned */
+	if (offset & 1) {
+		if (ret && fputc(0, f) == EOF) ret = 0;
+		offset++;
+	}
+
+	uint64_t offsetsPos = offset;
+	uint64_t countsPos = offsetsPos + 4 * strips;
+	uint64_t resPos = countsPos + 4 * strips;
+	uint64_t ifdPos = resPos + 16;
+	const int tags = 14;
+	uint8_t ifd[2 + tags * 12 + 4];
+	uint8_t res[16];
+	uint8_t *t = ifd + 2;
+	int unit = 1;
+
+	/* Pixels per centimeter from scan extents in nm, no unit if unknown */
+	if (image->GetSizeX() && image->GetSizeY()) {
+		tiffRational(res, width * 1e7 / image->GetSizeX());
+		tiffRational(res + 8, height * 1e7 / image->GetSizeY());
+		unit = 3;
+	} else {
+		tiffRational(res, 1);
+		tiffRational(res + 8, 1);
+	}
+
+	if (ifdPos + sizeof(ifd) > 0xFFFFFFFFULL) ret = 0;
+
+	if (ret) {
+		uint8_t *arr = (uint8_t *)malloc(8 * strips);
+		if (!arr) {
+			ret = 0;
+		} else {
+			for (int i = 0; i < strips; i++) {
+				put32(arr + 4 * i, offsets[i]);
+				put32(arr + 4 * (strips + i), counts[i]);
+			}
+			if (fwrite(arr, 4, 2 * strips, f) != (size_t)(2 * strips)) ret = 0;
+			free(arr);
+		}
+	}
+	if (ret && (fwrite(res, 1, sizeof(res), f) != sizeof(res))) ret = 0;
+
+	/* Single value arrays are stored in the tag itself */
+	put16(ifd, tags);
+	tiffTag(t, 256, 4, 1, width); t += 12;				/* ImageWidth */
+	tiffTag(t, 257, 4, 1, height); t += 12;				/* ImageLength */
+	tiffTag(t, 258, 3, 1, 16); t += 12;					/* BitsPerSample */
+	tiffTag(t, 259, 3, 1, 8); t += 12;					/* Compression: deflate */
+	tiffTag(t, 262, 3, 1, 1); t += 12;					/* Photometric: black is zero */
+	tiffTag(t, 273, 4, strips, strips > 1 ? (uint32_t)offsetsPos : offsets[0]); t += 12;
+	tiffTag(t, 277, 3, 1, 1); t += 12;					/* SamplesPerPixel */
+	tiffTag(t, 278, 4, 1, rowsPerStrip); t += 12;		/* RowsPerStrip */
+	tiffTag(t, 279, 4, strips, strips > 1 ? (uint32_t)countsPos : counts[0]); t += 12;
+	tiffTag(t, 282, 5, 1, (uint32_t)resPos); t += 12;		/* XResolution */
+	tiffTag(t, 283, 5, 1, (uint32_t)resPos + 8); t += 12;	/* YResolution */
+	tiffTag(t, 296, 3, 1, unit); t += 12;				/* ResolutionUnit */
+	tiffTag(t, 317, 3, 1, 2); t += 12;					/* Predictor: horizontal */
+	tiffTag(t, 339, 3, 1, 1); t += 12;					/* SampleFormat: unsigned */
+	put32(t, 0);
+
+	if (ret && (fwrite(ifd, 1, sizeof(ifd), f) != sizeof(ifd))) ret = 0;
+
+	put32(header + 4, (uint32_t)ifdPos);
+	if (ret && (fseek(f, 0, SEEK_SET) || (fwrite(header, 1, sizeof(header), f) != sizeof(header)))) ret = 0;
+
+	if (fclose(f) != 0) ret = 0;
+	free(offsets);
+	free(counts);
+
+	return ret;
+}
+
+/***** PNG *****/
+
+static inline int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if ((pa <= pb) && (pa <= pc)) return a;
+	if (pb <= pc) return b;
+	return c;
+}
+
+/* Filter one row of big endian samples, picking filter with the smallest
+ * sum of absolute differences. dst has filter type byte and len bytes.
+ */
+static void pngFilterRow(const uint8_t *cur, const uint8_t *prev, uint8_t *dst, uint8_t *tmp, int len)
+{
+	const int bpp = 2;
+	unsigned long best = ~0UL;
+
+	for (int type = 0; type < 5; type++) {
+		unsigned long sum = 0;
+
+		for (int i = 0; i < len; i++) {
+			int a = (i >= bpp) ? cur[i - bpp] : 0;
+			int b = prev ? prev[i] : 0;
+			int c = (prev && (i >= bpp)) ? prev[i - bpp] : 0;
+			uint8_t v;
+
+			switch (type) {
+			case 1: v = cur[i] - a; break;
+			case 2: v = cur[i] - b; break;
+			case 3: v = cur[i] - ((a + b) >> 1); break;
+			case 4: v = cur[i] - paeth(a, b, c); break;
+			default: v = cur[i]; break;
+			}
+			tmp[i] = v;
+			sum += (v < 128) ? v : 256 - v;
+		}
+
+		if (sum < best) {
+			best = sum;
+			dst[0] = type;
+			memcpy(dst + 1, tmp, len);
+		}
+	}
+}
+
+/* Filter and deflate rows y0..y0+rows-1 as part of one zlib stream */
+static uint8_t *pngBlock(AFMImage *image, int channel, const grey_map_t *map,
+		int y0, int rows, int last, size_t *outLen, uLong *adler)
+{
+	int width = image->GetWidth();
+	int len = width * 2;
+	size_t size = (size_t)(len + 1) * rows;
+	uint16_t *grey = (uint16_t *)malloc(sizeof(uint16_t) * width);
+	uint8_t *line = (uint8_t *)malloc(2 * len + len);
+	uint8_t *raw = (uint8_t *)malloc(size);
+	uint8_t *out = NULL;
+
+	if (grey && line && raw) {
+		uint8_t *cur = line, *prev = line + len, *tmp = line + 2 * len;
+
+		/* Filters look at the previous row, also across block border */
+		if (y0 > 0) {
+			greyRow(image->GetRow(channel, y0 - 1), grey, width, map);
+			for (int x = 0; x < width; x++) {
+				prev[2 * x] = grey[x] >> 8;
+				prev[2 * x + 1] = grey[x];
+			}
+		}
+
+		for (int r = 0; r < rows; r++) {
+			greyRow(image->GetRow(channel, y0 + r), grey, width, map);
+			for (int x = 0; x < width; x++) {
+				cur[2 * x] = grey[x] >> 8;
+				cur[2 * x + 1] = grey[x];
+			}
+			pngFilterRow(cur, (y0 + r > 0) ? prev : NULL, raw + (size_t)r * (len + 1), tmp, len);
+			uint8_t *swap = cur;
+			cur = prev;
+			prev = swap;
+		}
+
+		*adler = adler32(1L, raw, size);
+		out = deflateBlock(raw, size, 1, last, outLen);
+	}
+
+	free(grey);
+	free(line);
+	free(raw);
+
+	return out;
+}
+
+static int pngChunk(FILE *f, const char *type, const uint8_t *data, uint32_t len)
+{
+	uint8_t buf[8];
+	uLong crc;
+
+	put32be(buf, len);
+	memcpy(buf + 4, type, 4);
+	crc = crc32(0L, (const Bytef *)type, 4);
+	if (len) crc = crc32(crc, data, len);
+
+	if (fwrite(buf, 1, 8, f) != 8) return 0;
+	if (len && (fwrite(data, 1, len, f) != len)) return 0;
+	put32be(buf, crc);
+	if (fwrite(buf, 1, 4, f) != 4) return 0;
+
+	return 1;
+}
+
+/* Row blocks are deflated independently and joined into one zlib
+ * stream, every block goes into its own IDAT chunk.
+ */
+int exportPNG(AFMImage *image, int channel, std::string filename,
+		int mapping, float zmin, float zmax)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	int rowsPerBlock, blocks;
+	uint8_t ihdr[13], zhdr[2] = { 0x78, 0x9C }, tail[4];
+	uLong adler = 1;
+	grey_map_t map;
+	FILE *f;
+	int ret = 1;
+
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+	if (!width || !height) return 0;
+	if (!greyMap(image, channel, mapping, zmin, zmax, &map)) return 0;
+
+	rowsPerBlock = EXPORT_BLOCK_BYTES / (width * 2 + 1);
+	if (rowsPerBlock < 1) rowsPerBlock = 1;
+	blocks = (height + rowsPerBlock - 1) / rowsPerBlock;
+
+	f = fopen(filename.c_str(), "wb");
+	if (!f) return 0;
+
+	put32be(ihdr, width);
+	put32be(ihdr + 4, height);
+	ihdr[8] = 16;		/* Bit depth */
+	ihdr[9] = 0;		/* Grayscale */
+	ihdr[10] = 0;		/* Deflate */
+	ihdr[11] = 0;		/* Adaptive filtering */
+	ihdr[12] = 0;		/* No interlace */
+
+	if (fwrite(signature, 1, 8, f) != 8) ret = 0;
+	if (ret) ret = pngChunk(f, "IHDR", ihdr, sizeof(ihdr));
+	if (ret) ret = pngChunk(f, "IDAT", zhdr, sizeof(zhdr));
+
+	for (int b0 = 0; ret && (b0 < blocks); b0 += EXPORT_BATCH) {
+		int count = (blocks - b0 < EXPORT_BATCH) ? blocks - b0 : EXPORT_BATCH;
+		uint8_t *blob[EXPORT_BATCH];
+		size_t len[EXPORT_BATCH];
+		uLong ad[EXPORT_BATCH];
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < count; i++) {
+			int y0 = (b0 + i) * rowsPerBlock;
+			int rows = (y0 + rowsPerBlock < height) ? rowsPerBlock : height - y0;
+			blob[i] = pngBlock(image, channel, &map, y0, rows, b0 + i == blocks - 1, &len[i], &ad[i]);
+		}
+
+		for (int i = 0; i < count; i++) {
+			int y0 = (b0 + i) * rowsPerBlock;
+			int rows = (y0 + rowsPerBlock < height) ? rowsPerBlock : height - y0;
+
+			if (!blob[i]) {
+				ret = 0;
+				continue;
+			}
+			adler = adler32_combine(adler, ad[i], (z_off_t)(width * 2 + 1) * rows);
+			if (ret) ret = pngChunk(f, "IDAT", blob[i], len[i]);
+			free(blob[i]);
+		}
+	}
+
+	put32be(tail, adler);
+	if (ret) ret = pngChunk(f, "IDAT", tail, sizeof(tail));
+	if (ret) ret = pngChunk(f, "IEND", NULL, 0);
+
+	if (fclose(f) != 0) ret = 0;
+
+	return ret;
+}
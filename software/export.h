@@ -0,0 +1,22 @@
+#ifndef EXPORT_H_
+#define EXPORT_H_
+
+#include <string>
+
+#include "image.h"
+
+/* Height to grey level mapping */
+#define EXPORT_MAP_RAW		0	/* Values are 16-bit ADC counts, clamped */
+#define EXPORT_MAP_RANGE	1	/* zmin..zmax to 0..65535 */
+#define EXPORT_MAP_AUTO		2	/* Channel minimum..maximum to 0..65535 */
+
+/* 16-bit grayscale export of one channel.
+ * Strips (TIFF) or row groups (PNG) are deflated in parallel.
+ */
+int exportTIFF(AFMImage *image, int channel, std::string filename,
+		int mapping, float zmin = 0, float zmax = 0);
+int exportPNG(AFMImage *image, int channel, std::string filename,
+		int mapping, float zmin = 0, float zmax = 0);
+
+
+#endif /* EXPORT_H_ */
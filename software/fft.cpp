@@ -0,0 +1,767 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <map>
+
+#include "fft.h"
+
+
+/* Transpose block size, in complex values */
+#define TRANSPOSE_BLOCK		32
+
+
+static inline fft_complex cmul(fft_complex a, fft_complex b)
+{
+	fft_complex r;
+
+	r.re = a.re * b.re - a.im * b.im;
+	r.im = a.re * b.im + a.im * b.re;
+	return r;
+}
+
+static inline fft_complex cconj(fft_complex a)
+{
+	a.im = -a.im;
+	return a;
+}
+
+static inline fft_complex cexpi(double phase)
+{
+	fft_complex r;
+
+	r.re = cos(phase);
+	r.im = sin(phase);
+	return r;
+}
+
+/***** 1D plan *****/
+
+FFTPlan::FFTPlan(int n)
+{
+	int i, m;
+
+	m_n = n;
+	m_log2 = 0;
+	m_twiddle = NULL;
+	m_bitrev = NULL;
+	m_conv = NULL;
+	m_chirp = NULL;
+	m_filter = NULL;
+
+	if ((n & (n - 1)) == 0) {
+		/* Radix-2 */
+		while ((1 << m_log2) < n) m_log2++;
+
+		/* Twiddles of stage with half length h start at h - 1,
+		 * so butterfly loops read them sequentially */
+		m_twiddle = (fft_complex *)malloc(sizeof(fft_complex) * 2 * n);
+		m_bitrev = (int *)malloc(sizeof(int) * n);
+		for (int h = 1; h < n; h <<= 1) {
+			for (i = 0; i < h; i++) {
+				m_twiddle[h - 1 + i] = cexpi(-M_PI * i / h);
+				m_twiddle[n + h - 1 + i] = cconj(m_twiddle[h - 1 + i]);
+			}
+		}
+		for (i = 0; i < n; i++) {
+			int r = 0;
+			for (int b = 0; b < m_log2; b++) r |= ((i >> b) & 1) << (m_log2 - 1 - b);
+			m_bitrev[i] = r;
+		}
+		return;
+	}
+
+	/* Bluestein: DFT as convolution with chirp, done by power of two FFT */
+	for (m = 1; m < 2 * n - 1; m <<= 1) {}
+
+	m_conv = fftGetPlan(m);
+	m_chirp = (fft_complex *)malloc(sizeof(fft_complex) * n);
+	m_filter = (fft_complex *)calloc(m, sizeof(fft_complex));
+
+	for (i = 0; i < n; i++) {
+		/* k^2 mod 2n keeps phase accurate for large k */
+		long long k2 = ((long long)i * i) % (2LL * n);
+		m_chirp[i] = cexpi(M_PI * k2 / n);
+	}
+	m_filter[0] = m_chirp[0];
+	for (i = 1; i < n; i++) {
+		m_filter[i] = m_chirp[i];
+		m_filter[m - i] = m_chirp[i];
+	}
+	m_conv->Execute(m_filter, 0, NULL);
+}
+
+FFTPlan::~FFTPlan()
+{
+	free(m_twiddle);
+	free(m_bitrev);
+	free(m_chirp);
+	free(m_filter);
+}
+
+int FFTPlan::GetSize()
+{
+	return m_n;
+}
+
+/* Scratch buffer size needed by Execute(), in complex values */
+int FFTPlan::GetWorkSize()
+{
+	return m_conv ? m_conv->GetSize() : 0;
+}
+
+void FFTPlan::Radix2(fft_complex *data, int inverse)
+{
+	int i, j, half;
+	fft_complex t, u, v;
+	const fft_complex *w;
+
+	for (i = 0; i < m_n; i++) {
+		j = m_bitrev[i];
+		if (j > i) {
+			t = data[i];
+			data[i] = data[j];
+			data[j] = t;
+		}
+	}
+
+	/* First stage needs no multiplications */
+	for (i = 0; i + 1 < m_n; i += 2) {
+		u = data[i];
+		v = data[i + 1];
+		data[i].re = u.re + v.re;
+		data[i].im = u.im + v.im;
+		data[i + 1].re = u.re - v.re;
+		data[i + 1].im = u.im - v.im;
+	}
+
+	for (half = 2; half < m_n; half <<= 1) {
+		w = m_twiddle + (inverse ? m_n : 0) + half - 1;
+		for (i = 0; i < m_n; i += 2 * half) {
+			for (j = 0; j < half; j++) {
+				u = data[i + j];
+				v = cmul(data[i + j + half], w[j]);
+				data[i + j].re = u.re + v.re;
+				data[i + j].im = u.im + v.im;
+				data[i + j + half].re = u.re - v.re;
+				data[i + j + half].im = u.im - v.im;
+			}
+		}
+	}
+}
+
+void FFTPlan::Bluestein(fft_complex *data, int inverse, fft_complex *work)
+{
+	int i, m = m_conv->GetSize();
+	float scale = 1.0f / m;
+
+	/* Inverse transform is conj(FFT(conj(x))) */
+	for (i = 0; i < m_n; i++) {
+		fft_complex x = inverse ? cconj(data[i]) : data[i];
+		work[i] = cmul(x, cconj(m_chirp[i]));
+	}
+	memset(work + m_n, 0, sizeof(fft_complex) * (m - m_n));
+
+	m_conv->Execute(work, 0, NULL);
+	for (i = 0; i < m; i++) work[i] = cmul(work[i], m_filter[i]);
+	m_conv->Execute(work, 1, NULL);
+
+	for (i = 0; i < m_n; i++) {
+		fft_complex x = cmul(work[i], cconj(m_chirp[i]));
+		x.re *= scale;
+		x.im *= scale;
+		data[i] = inverse ? cconj(x) : x;
+	}
+}
+
+/* In-place transform, inverse is not normalized.
+ * work should have GetWorkSize() values.
+ */
+void FFTPlan::Execute(fft_complex *data, int inverse, fft_complex *work)
+{
+	if (m_conv)
+		Bluestein(data, inverse, work);
+	else
+		Radix2(data, inverse);
+}
+
+/***** Plan cache *****/
+
+static std::map<int, FFTPlan *> fftPlans;
+
+FFTPlan *fftGetPlan(int n)
+{
+	FFTPlan *plan;
+
+	#pragma omp critical(fftplans)
+	{
+		std::map<int, FFTPlan *>::iterator it = fftPlans.find(n);
+		if (it != fftPlans.end()) {
+			plan = it->second;
+		} else {
+			plan = NULL;
+		}
+	}
+	if (plan) return plan;
+
+	/* Bluestein plan asks for power of two plan in constructor,
+	 * so plan is created outside of the critical section */
+	plan = new FFTPlan(n);
+
+	#pragma omp critical(fftplans)
+	{
+		std::map<int, FFTPlan *>::iterator it = fftPlans.find(n);
+		if (it != fftPlans.end()) {
+			delete plan;
+			plan = it->second;
+		} else {
+			fftPlans[n] = plan;
+		}
+	}
+
+	return plan;
+}
+
+void fftFreePlans()
+{
+	std::map<int, FFTPlan *>::iterator it;
+
+	for (it = fftPlans.begin(); it != fftPlans.end(); ++it) delete it->second;
+	fftPlans.clear();
+}
+
+/***** 2D real transform *****/
+
+/* dst (cols x rows) = transpose of src (rows x cols)
+ * Called from inside parallel region, blocks are shared between threads.
+ */
+static void transpose(const fft_complex *src, fft_complex *dst, int rows, int cols)
+{
+	#pragma omp for schedule(static)
+	for (int rb = 0; rb < rows; rb += TRANSPOSE_BLOCK) {
+		int re = (rb + TRANSPOSE_BLOCK < rows) ? rb + TRANSPOSE_BLOCK : rows;
+		for (int cb = 0; cb < cols; cb += TRANSPOSE_BLOCK) {
+			int ce = (cb + TRANSPOSE_BLOCK < cols) ? cb + TRANSPOSE_BLOCK : cols;
+			for (int r = rb; r < re; r++)
+				for (int c = cb; c < ce; c++)
+					dst[(size_t)c * rows + r] = src[(size_t)r * cols + c];
+		}
+	}
+}
+
+FFT2D::FFT2D(int width, int height)
+{
+	int h, k;
+
+	m_width = width;
+	m_height = height;
+	m_specWidth = width / 2 + 1;
+	m_realTwiddle = NULL;
+
+	m_colPlan = fftGetPlan(height);
+
+	if (width & 1) {
+		m_rowPlan = fftGetPlan(width);
+	} else {
+		/* Even width: real row is packed into width/2 complex values */
+		h = width / 2;
+		m_rowPlan = fftGetPlan(h);
+		m_realTwiddle = (fft_complex *)malloc(sizeof(fft_complex) * (h + 1));
+		for (k = 0; k <= h; k++) m_realTwiddle[k] = cexpi(-2 * M_PI * k / width);
+	}
+}
+
+FFT2D::~FFT2D()
+{
+	free(m_realTwiddle);
+}
+
+int FFT2D::GetSpectrumWidth()
+{
+	return m_specWidth;
+}
+
+size_t FFT2D::GetSpectrumSize()
+{
+	return (size_t)m_specWidth * m_height;
+}
+
+/* Real row -> width/2 + 1 spectrum values */
+void FFT2D::RowForward(const float *src, fft_complex *dst, fft_complex *tmp, fft_complex *work)
+{
+	int k, h;
+
+	if (m_width & 1) {
+		for (k = 0; k < m_width; k++) {
+			tmp[k].re = src[k];
+			tmp[k].im = 0;
+		}
+		m_rowPlan->Execute(tmp, 0, work);
+		memcpy(dst, tmp, sizeof(fft_complex) * m_specWidth);
+		return;
+	}
+
+	h = m_width / 2;
+	memcpy(tmp, src, sizeof(float) * m_width);
+	m_rowPlan->Execute(tmp, 0, work);
+
+	/* Split even and odd sample spectra */
+	for (k = 0; k <= h; k++) {
+		fft_complex a = tmp[k % h];
+		fft_complex b = cconj(tmp[(h - k) % h]);
+		fft_complex e, o;
+
+		e.re = 0.5f * (a.re + b.re);
+		e.im = 0.5f * (a.im + b.im);
+		/* (a - b) / 2i */
+		o.re = 0.5f * (a.im - b.im);
+		o.im = -0.5f * (a.re - b.re);
+		o = cmul(o, m_realTwiddle[k]);
+		dst[k].re = e.re + o.re;
+		dst[k].im = e.im + o.im;
+	}
+}
+
+/* width/2 + 1 spectrum values -> real row */
+void FFT2D::RowInverse(const fft_complex *src, float *dst, float scale, fft_complex *tmp, fft_complex *work)
+{
+	int k, h;
+
+	if (m_width & 1) {
+		tmp[0] = src[0];
+		for (k = 1; k < m_specWidth; k++) {
+			tmp[k] = src[k];
+			tmp[m_width - k] = cconj(src[k]);
+		}
+		m_rowPlan->Execute(tmp, 1, work);
+		for (k = 0; k < m_width; k++) dst[k] = tmp[k].re * scale;
+		return;
+	}
+
+	h = m_width / 2;
+	for (k = 0; k < h; k++) {
+		fft_complex a = src[k];
+		fft_complex b = cconj(src[h - k]);
+		fft_complex e, o;
+
+		e.re = 0.5f * (a.re + b.re);
+		e.im = 0.5f * (a.im + b.im);
+		o.re = 0.5f * (a.re - b.re);
+		o.im = 0.5f * (a.im - b.im);
+		o = cmul(o, cconj(m_realTwiddle[k]));
+		/* Z = E + i * O */
+		tmp[k].re = e.re - o.im;
+		tmp[k].im = e.im + o.re;
+	}
+	m_rowPlan->Execute(tmp, 1, work);
+	/* Half length transform: scale is for full width */
+	scale *= 2;
+	for (k = 0; k < h; k++) {
+		dst[2 * k] = tmp[k].re * scale;
+		dst[2 * k + 1] = tmp[k].im * scale;
+	}
+}
+
+/* spectrum should have GetSpectrumSize() values */
+int FFT2D::Forward(AFMImage *image, int channel, fft_complex *spectrum)
+{
+	fft_complex *rows;
+	int ok = 1;
+
+	if ((image->GetWidth() != m_width) || (image->GetHeight() != m_height)) return 0;
+
+	rows = (fft_complex *)malloc(sizeof(fft_complex) * GetSpectrumSize());
+	if (!rows) return 0;
+
+	#pragma omp parallel reduction(&:ok)
+	{
+		fft_complex *tmp = (fft_complex *)malloc(sizeof(fft_complex) * m_width);
+		fft_complex *work = (fft_complex *)malloc(sizeof(fft_complex) *
+				(m_rowPlan->GetWorkSize() + m_colPlan->GetWorkSize() + 1));
+
+		if (!tmp || !work) ok = 0;
+
+		/* Row transforms */
+		#pragma omp for schedule(static)
+		for (int y = 0; y < m_height; y++) {
+			const float *src = image->GetRow(channel, y);
+			if (ok && src) RowForward(src, rows + (size_t)y * m_specWidth, tmp, work);
+		}
+
+		/* Columns become rows after transpose */
+		transpose(rows, spectrum, m_height, m_specWidth);
+
+		#pragma omp for schedule(static)
+		for (int x = 0; x < m_specWidth; x++) {
+			if (ok) m_colPlan->Execute(spectrum + (size_t)x * m_height, 0, work);
+		}
+
+		free(tmp);
+		free(work);
+	}
+
+	free(rows);
+
+	return ok;
+}
+
+/* Spectrum is left unchanged */
+int FFT2D::Inverse(fft_complex *spectrum, AFMImage *image, int channel)
+{
+	fft_complex *cols, *rows;
+	float scale = 1.0f / ((float)m_width * m_height);
+	int ok = 1;
+
+	if ((image->GetWidth() != m_width) || (image->GetHeight() != m_height)) return 0;
+
+	cols = (fft_complex *)malloc(sizeof(fft_complex) * GetSpectrumSize());
+	rows = (fft_complex *)malloc(sizeof(fft_complex) * GetSpectrumSize());
+	if (!cols || !rows) {
+		free(cols);
+		free(rows);
+		return 0;
+	}
+	memcpy(cols, spectrum, sizeof(fft_complex) * GetSpectrumSize());
+
+	#pragma omp parallel reduction(&:ok)
+	{
+		fft_complex *tmp = (fft_complex *)malloc(sizeof(fft_complex) * m_width);
+		fft_complex *work = (fft_complex *)malloc(sizeof(fft_complex) *
+				(m_rowPlan->GetWorkSize() + m_colPlan->GetWorkSize() + 1));
+
+		if (!tmp || !work) ok = 0;
+
+		#pragma omp for schedule(static)
+		for (int x = 0; x < m_specWidth; x++) {
+			if (ok) m_colPlan->Execute(cols + (size_t)x * m_height, 1, work);
+		}
+
+		transpose(cols, rows, m_specWidth, m_height);
+
+		#pragma omp for schedule(static)
+		for (int y = 0; y < m_height; y++) {
+			float *dst = image->GetRow(channel, y);
+			if (ok && dst) RowInverse(rows + (size_t)y * m_specWidth, dst, scale, tmp, work);
+		}
+
+		free(tmp);
+		free(work);
+	}
+
+	free(cols);
+	free(rows);
+
+	return ok;
+}
+
+/***** Filtering and PSD *****/
+
+/* Signed frequency of spectrum bin, in cycles per pixel */
+static double binFreq(int k, int n)
+{
+	return ((k <= n / 2) ? k : k - n) / (double)n;
+}
+
+/* Multiply spectrum by real gain function of (fx, fy) */
+static int fftApplyGain(AFMImage *image, int channel, double (*gain)(double fx, double fy, const double *p), const double *p)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	FFT2D fft(width, height);
+	fft_complex *spec;
+	int ret;
+
+	spec = (fft_complex *)malloc(sizeof(fft_complex) * fft.GetSpectrumSize());
+	if (!spec) return 0;
+
+	ret = fft.Forward(image, channel, spec);
+	if (ret) {
+		#pragma omp parallel for schedule(static)
+		for (int kx = 0; kx < fft.GetSpectrumWidth(); kx++) {
+			double fx = kx / (double)width;
+			fft_complex *col = spec + (size_t)kx * height;
+			for (int ky = 0; ky < height; ky++) {
+				float g = gain(fx, binFreq(ky, height), p);
+				col[ky].re *= g;
+				col[ky].im *= g;
+			}
+		}
+		ret = fft.Inverse(spec, image, channel);
+	}
+
+	free(spec);
+
+	return ret;
+}
+
+/* 4th order Butterworth magnitude response */
+static double lowPassGain(double fx, double fy, const double *p)
+{
+	double r = (fx * fx + fy * fy) / (p[0] * p[0]);
+
+	return 1.0 / sqrt(1.0 + r * r * r * r);
+}
+
+int fftLowPass(AFMImage *image, int channel, double cutoff)
+{
+	if (cutoff <= 0) return 0;
+
+	return fftApplyGain(image, channel, lowPassGain, &cutoff);
+}
+
+/* Gaussian notch at (fx, fy) and its mirror (-fx, -fy) */
+static double notchGain(double fx, double fy, const double *p)
+{
+	double d1 = (fx - p[0]) * (fx - p[0]) + (fy - p[1]) * (fy - p[1]);
+	double d2 = (fx + p[0]) * (fx + p[0]) + (fy + p[1]) * (fy + p[1]);
+	double s = 2 * p[2] * p[2];
+
+	return (1.0 - exp(-d1 / s)) * (1.0 - exp(-d2 / s));
+}
+
+int fftNotch(AFMImage *image, int channel, double fx, double fy, double radius)
+{
+	double p[3] = { fx, fy, radius };
+
+	if (radius <= 0) return 0;
+
+	return fftApplyGain(image, channel, notchGain, p);
+}
+
+/* Radially averaged power spectral density
+ * Mean is removed and Hann window is applied before transform.
+ * psd[i] is average power of bins with frequency in [i, i + 1) * 0.5 / bins.
+ */
+int fftPSD(AFMImage *image, int channel, double *psd, int bins)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	AFMImage windowed;
+	FFT2D fft(width, height);
+	fft_complex *spec;
+	double mean, wsum;
+	double *count;
+	int ret;
+
+	if ((bins <= 0) || !width || !height) return 0;
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+	if (!windowed.Create(width, height, 1)) return 0;
+
+	/* Mean */
+	mean = 0;
+	for (int y = 0; y < height; y++) {
+		const float *row = image->GetRow(channel, y);
+		double s = 0;
+		for (int x = 0; x < width; x++) s += row[x];
+		mean += s;
+	}
+	mean /= (double)width * height;
+
+	/* Windowed copy, window power for normalization */
+	wsum = 0;
+	for (int y = 0; y < height; y++) {
+		const float *src = image->GetRow(channel, y);
+		float *dst = windowed.GetRow(0, y);
+		double wy = 0.5 - 0.5 * cos(2 * M_PI * (y + 0.5) / height);
+		for (int x = 0; x < width; x++) {
+			double w = wy * (0.5 - 0.5 * cos(2 * M_PI * (x + 0.5) / width));
+			dst[x] = (src[x] - mean) * w;
+			wsum += w * w;
+		}
+	}
+
+	spec = (fft_complex *)malloc(sizeof(fft_complex) * fft.GetSpectrumSize());
+	count = (double *)calloc(bins, sizeof(double));
+	if (!spec || !count) {
+		free(spec);
+		free(count);
+		return 0;
+	}
+
+	ret = fft.Forward(&windowed, 0, spec);
+	if (ret) {
+		memset(psd, 0, sizeof(double) * bins);
+		for (int kx = 0; kx < fft.GetSpectrumWidth(); kx++) {
+			double fx = kx / (double)width;
+			const fft_complex *col = spec + (size_t)kx * height;
+			for (int ky = 0; ky < height; ky++) {
+				double fy = binFreq(ky, height);
+				int b = (int)(sqrt(fx * fx + fy * fy) / 0.5 * bins);
+				if (b >= bins) continue;
+				psd[b] += ((double)col[ky].re * col[ky].re + (double)col[ky].im * col[ky].im) / wsum;
+				count[b] += 1;
+			}
+		}
+		for (int b = 0; b < bins; b++)
+			if (count[b] > 0) psd[b] /= count[b];
+	}
+
+	free(spec);
+	free(count);
+
+	return ret;
+}
+
+/* Plane removed, Hann windowed copy of channel */
+static void fftWindow(AFMImage *src, int channel, AFMImage *dst, int dstChannel)
+{
+	int width = src->GetWidth();
+	int height = src->GetHeight();
+	double mean = 0, slopeX = 0, slopeY = 0;
+	double cx = 0.5 * (width - 1), cy = 0.5 * (height - 1);
+	double sxx = 0, syy = 0;
+
+	/* Least squares plane, x and y are orthogonal on a full grid */
+	for (int y = 0; y < height; y++) {
+		const float *row = src->GetRow(channel, y);
+		double s = 0, sx = 0;
+		for (int x = 0; x < width; x++) {
+			s += row[x];
+			sx += (x - cx) * row[x];
+		}
+		mean += s;
+		slopeX += sx;
+		slopeY += (y - cy) * s;
+	}
+	for (int x = 0; x < width; x++) sxx += (x - cx) * (x - cx);
+	for (int y = 0; y < height; y++) syy += (y - cy) * (y - cy);
+	mean /= (double)width * height;
+	slopeX = (sxx > 0) ? slopeX / (sxx * height) : 0;
+	slopeY = (syy > 0) ? slopeY / (syy * width) : 0;
+
+	for (int y = 0; y < height; y++) {
+		const float *row = src->GetRow(channel, y);
+		float *out = dst->GetRow(dstChannel, y);
+		double wy = 0.5 - 0.5 * cos(2 * M_PI * (y + 0.5) / height);
+		double base = mean + slopeY * (y - cy);
+		for (int x = 0; x < width; x++)
+			out[x] = (row[x] - base - slopeX * (x - cx)) * wy *
+					(0.5 - 0.5 * cos(2 * M_PI * (x + 0.5) / width));
+	}
+}
+
+/* Vertex of parabola through (-1, a), (0, b), (1, c) */
+static double peakOffset(double a, double b, double c)
+{
+	double d = a - 2 * b + c;
+
+	if (d >= 0) return 0;
+	d = 0.5 * (a - c) / d;
+
+	return (d < -0.5) ? -0.5 : (d > 0.5) ? 0.5 : d;
+}
+
+/* Phase correlation of two images of the same size
+ * Finds shift with b(x, y) ~ a(x - dx, y - dy), |dx|, |dy| <= maxShift,
+ * refined to sub-pixel by parabolic fit around the peak.
+ * peak is peak to sidelobe ratio, (peak - mean) / deviation of the whole
+ * correlation surface: below 5..6 the match is not reliable.
+ */
+int fftCorrelate(AFMImage *a, int chA, AFMImage *b, int chB, double maxShift,
+		double *dx, double *dy, double *peak)
+{
+	int width = a->GetWidth();
+	int height = a->GetHeight();
+	AFMImage work;
+	FFT2D fft(width, height);
+	fft_complex *specA, *specB;
+	int bestX = 0, bestY = 0;
+	float best = -FLT_MAX;
+	int ret;
+
+	if (!width || !height || (b->GetWidth() != width) || (b->GetHeight() != height)) return 0;
+	if ((chA < 0) || (chA >= a->GetChannels()) || (chB < 0) || (chB >= b->GetChannels())) return 0;
+	if (!work.Create(width, height, 2)) return 0;
+
+	fftWindow(a, chA, &work, 0);
+	fftWindow(b, chB, &work, 1);
+
+	specA = (fft_complex *)malloc(sizeof(fft_complex) * fft.GetSpectrumSize());
+	specB = (fft_complex *)malloc(sizeof(fft_complex) * fft.GetSpectrumSize());
+	if (!specA || !specB) {
+		free(specA);
+		free(specB);
+		return 0;
+	}
+
+	ret = fft.Forward(&work, 0, specA) && fft.Forward(&work, 1, specB);
+
+	if (ret) {
+		/* Cross power spectrum conj(A) * B, divided by square root of its magnitude.
+		 * Full normalization (pure phase correlation) lets uncorrelated noise
+		 * at high frequencies shift the peak on small overlaps. */
+		for (size_t i = 0; i < fft.GetSpectrumSize(); i++) {
+			float re = specA[i].re * specB[i].re + specA[i].im * specB[i].im;
+			float im = specA[i].re * specB[i].im - specA[i].im * specB[i].re;
+			float mag = sqrtf(sqrtf(re * re + im * im));
+			if (mag > 1e-20f) {
+				specA[i].re = re / mag;
+				specA[i].im = im / mag;
+			} else {
+				specA[i].re = specA[i].im = 0;
+			}
+		}
+		ret = fft.Inverse(specA, &work, 0);
+	}
+
+	if (ret) {
+		double sum = 0, sum2 = 0, n = (double)width * height;
+		int mx = (int)maxShift;
+		if (mx > width / 2) mx = width / 2;
+		int my = (int)maxShift;
+		if (my > height / 2) my = height / 2;
+
+		for (int sy = -my; sy <= my; sy++) {
+			const float *row = work.GetRow(0, (sy + height) % height);
+			for (int sx = -mx; sx <= mx; sx++) {
+				float v = row[(sx + width) % width];
+				if (v > best) {
+					best = v;
+					bestX = sx;
+					bestY = sy;
+				}
+			}
+		}
+
+		for (int y = 0; y < height; y++) {
+			const float *row = work.GetRow(0, y);
+			for (int x = 0; x < width; x++) {
+				sum += row[x];
+				sum2 += (double)row[x] * row[x];
+			}
+		}
+		sum /= n;
+		sum2 = sum2 / n - sum * sum;
+
+		float *r0 = work.GetRow(0, (bestY + height) % height);
+		float *rm = work.GetRow(0, (bestY - 1 + height) % height);
+		float *rp = work.GetRow(0, (bestY + 1 + height) % height);
+		int x0 = (bestX + width) % width;
+
+		*dx = bestX + peakOffset(r0[(x0 - 1 + width) % width], best, r0[(x0 + 1) % width]);
+		*dy = bestY + peakOffset(rm[x0], best, rp[x0]);
+		*peak = (sum2 > 0) ? (best - sum) / sqrt(sum2) : 0;
+	}
+
+	free(specA);
+	free(specB);
+
+	return ret;
+}
@@ -0,0 +1,72 @@
+#ifndef FFT_H_
+#define FFT_H_
+
+#include "image.h"
+
+typedef struct {
+	float re;
+	float im;
+} fft_complex;
+
+/* 1D complex FFT plan
+ * Power of two sizes use radix-2, other sizes use Bluestein algorithm
+ * on top of power of two plan. Plans are read-only after creation
+ * and may be shared between threads.
+ */
+class FFTPlan {
+private:
+	int m_n;
+	int m_log2;
+	fft_complex *m_twiddle;		/* radix-2 twiddles, stage by stage, forward then inverse */
+	int *m_bitrev;
+	/* Bluestein */
+	FFTPlan *m_conv;
+	fft_complex *m_chirp;		/* exp(i*pi*k^2/n) */
+	fft_complex *m_filter;		/* Spectrum of chirp filter */
+	void Radix2(fft_complex *data, int inverse);
+	void Bluestein(fft_complex *data, int inverse, fft_complex *work);
+public:
+	FFTPlan(int n);
+	~FFTPlan(void);
+	int GetSize();
+	int GetWorkSize();
+	void Execute(fft_complex *data, int inverse, fft_complex *work);
+};
+
+FFTPlan *fftGetPlan(int n);
+void fftFreePlans(void);
+
+/* 2D real FFT
+ * Spectrum has (width/2 + 1) x height complex values and is stored transposed:
+ * spectrum[kx * height + ky]. Inverse transform is normalized.
+ */
+class FFT2D {
+private:
+	int m_width;
+	int m_height;
+	int m_specWidth;
+	FFTPlan *m_rowPlan;			/* width/2 for even width, width otherwise */
+	FFTPlan *m_colPlan;
+	fft_complex *m_realTwiddle;
+	void RowForward(const float *src, fft_complex *dst, fft_complex *tmp, fft_complex *work);
+	void RowInverse(const fft_complex *src, float *dst, float scale, fft_complex *tmp, fft_complex *work);
+public:
+	FFT2D(int width, int height);
+	~FFT2D(void);
+	int GetSpectrumWidth();
+	size_t GetSpectrumSize();
+	int Forward(AFMImage *image, int channel, fft_complex *spectrum);
+	int Inverse(fft_complex *spectrum, AFMImage *image, int channel);
+};
+
+/* Spectral processing of image channel
+ * Frequencies are in cycles per pixel, Nyquist frequency is 0.5.
+ */
+int fftLowPass(AFMImage *image, int channel, double cutoff);
+int fftNotch(AFMImage *image, int channel, double fx, double fy, double radius);
+int fftPSD(AFMImage *image, int channel, double *psd, int bins);
+int fftCorrelate(AFMImage *a, int chA, AFMImage *b, int chB, double maxShift,
+		double *dx, double *dy, double *peak);
+
+
+#endif /* FFT_H_ */
@@ -0,0 +1,182 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "forcevolume.h"
+
+
+ForceVolume::ForceVolume(void)
+{
+	m_startX = 0;
+	m_startY = 0;
+	m_size = 0;
+	m_res = 0;
+	m_points = 0;
+	m_travel = 0;
+	m_period = 0;
+	m_data = NULL;
+}
+
+ForceVolume::~ForceVolume(void)
+{
+	free(m_data);
+}
+
+/* Allocate res x res curves of points samples each way, all invalid */
+int ForceVolume::Create(int32_t startX, int32_t startY, uint16_t size, uint16_t res,
+		int points, int16_t travel, uint16_t period)
+{
+	if (!res || (points < 2) || (points > AFM_SPECTRO_MAX_POINTS)) return 0;
+	if (period < AFM_SPECTRO_MIN_PERIOD) return 0;
+
+	m_startX = startX;
+	m_startY = startY;
+	m_size = size;
+	m_res = res;
+	m_points = points;
+	m_travel = travel;
+	m_period = period;
+
+	free(m_data);
+	m_data = (uint16_t *)calloc((size_t)res * res * points * 2, sizeof(uint16_t));
+	if (!m_data) {
+		m_res = 0;
+		return 0;
+	}
+	m_height.assign((size_t)res * res, 0);
+	m_valid.assign((size_t)res * res, 0);
+
+	return 1;
+}
+
+uint16_t ForceVolume::GetRes()
+{
+	return m_res;
+}
+
+int ForceVolume::GetPoints()
+{
+	return m_points;
+}
+
+int ForceVolume::GetSamples()
+{
+	return m_points * 2;
+}
+
+int16_t ForceVolume::GetTravel()
+{
+	return m_travel;
+}
+
+uint16_t ForceVolume::GetPeriod()
+{
+	return m_period;
+}
+
+/* Curve position in nanometers, same as raster pixels of the firmware */
+void ForceVolume::GetPosition(int col, int row, int32_t *x, int32_t *y)
+{
+	*x = m_startX + (int32_t)((int64_t)col * m_size / m_res);
+	*y = m_startY + (int32_t)((int64_t)row * m_size / m_res);
+}
+
+int ForceVolume::SetCurve(int col, int row, uint16_t height, const std::vector<uint16_t>& curve)
+{
+	size_t idx;
+
+	if ((col < 0) || (col >= m_res) || (row < 0) || (row >= m_res)) return 0;
+	if ((int)curve.size() != GetSamples()) return 0;
+
+	idx = (size_t)row * m_res + col;
+	memcpy(m_data + idx * GetSamples(), &curve[0], sizeof(uint16_t) * GetSamples());
+	m_height[idx] = height;
+	m_valid[idx] = 1;
+
+	return 1;
+}
+
+/* GetSamples() samples, NULL if curve was not captured */
+const uint16_t *ForceVolume::GetCurve(int col, int row)
+{
+	if (!IsValid(col, row)) return NULL;
+
+	return m_data + ((size_t)row * m_res + col) * GetSamples();
+}
+
+uint16_t ForceVolume::GetHeight(int col, int row)
+{
+	if (!IsValid(col, row)) return 0;
+
+	return m_height[(size_t)row * m_res + col];
+}
+
+int ForceVolume::IsValid(int col, int row)
+{
+	if ((col < 0) || (col >= m_res) || (row < 0) || (row >= m_res)) return 0;
+
+	return m_valid[(size_t)row * m_res + col];
+}
+
+/* One sample of every curve as an image, missing curves are zero */
+int ForceVolume::GetSlice(int sample, AFMImage *image)
+{
+	int samples = GetSamples();
+	int res = m_res;
+
+	if ((sample < 0) || (sample >= samples)) return 0;
+	if (!image->Create(res, res, 1)) return 0;
+	image->SetGeometry(m_startX, m_startY, m_size);
+
+	#pragma omp parallel for schedule(static) if (res > 64)
+	for (int y = 0; y < res; y++) {
+		float *out = image->GetRow(0, y);
+		for (int x = 0; x < res; x++) {
+			size_t idx = (size_t)y * res + x;
+			out[x] = m_valid[idx] ? m_data[idx * samples + sample] : 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Take all curves of the grid, row by row.
+ * Returns 0 if the device failed, curves taken so far are kept. */
+int forceVolumeCapture(Device *afm, ForceVolume *fv, void(*progress)(int percent))
+{
+	std::vector<uint16_t> curve;
+	uint16_t height;
+	int32_t x, y;
+	int res = fv->GetRes();
+
+	/* Height of every curve is kept by the Z loop, device is off after boot */
+	if (!afm->SetZControl(AFM_ZCONTROL_ON)) return 0;
+
+	for (int row = 0; row < res; row++) {
+		for (int col = 0; col < res; col++) {
+			fv->GetPosition(col, row, &x, &y);
+			if (!afm->RunSpectro(x, y, fv->GetTravel(), fv->GetPoints(), fv->GetPeriod())) return 0;
+			if (!afm->ReadCurve(&curve, &height)) return 0;
+			if (!fv->SetCurve(col, row, height, curve)) return 0;
+		}
+		if (progress) progress((row + 1) * 100 / res);
+	}
+
+	return 1;
+}
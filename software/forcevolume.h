@@ -0,0 +1,47 @@
+#ifndef FORCEVOLUME_H_
+#define FORCEVOLUME_H_
+
+#include <vector>
+
+#include "device.h"
+#include "image.h"
+
+/* Grid of force curves
+ * Curves are kept as raw ADC samples in one array, res x res curves of
+ * GetSamples() samples each: approach followed by retract. Curve at
+ * (col, row) is taken at the same place as pixel (col, row) of an
+ * image scanned with the same geometry.
+ */
+class ForceVolume {
+private:
+	int32_t m_startX;
+	int32_t m_startY;
+	uint16_t m_size;
+	uint16_t m_res;
+	int m_points;				/* Samples each way */
+	int16_t m_travel;
+	uint16_t m_period;
+	uint16_t *m_data;			/* Curves, row by row */
+	std::vector<uint16_t> m_height;		/* Z at ramp start of each curve */
+	std::vector<uint8_t> m_valid;
+public:
+	ForceVolume();
+	~ForceVolume();
+	int Create(int32_t startX, int32_t startY, uint16_t size, uint16_t res,
+			int points, int16_t travel, uint16_t period);
+	uint16_t GetRes();
+	int GetPoints();
+	int GetSamples();
+	int16_t GetTravel();
+	uint16_t GetPeriod();
+	void GetPosition(int col, int row, int32_t *x, int32_t *y);
+	int SetCurve(int col, int row, uint16_t height, const std::vector<uint16_t>& curve);
+	const uint16_t *GetCurve(int col, int row);
+	uint16_t GetHeight(int col, int row);
+	int IsValid(int col, int row);
+	int GetSlice(int sample, AFMImage *image);
+};
+
+int forceVolumeCapture(Device *afm, ForceVolume *fv, void(*progress)(int percent));
+
+#endif /* FORCEVOLUME_H_ */
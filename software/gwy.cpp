@@ -0,0 +1,334 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "gwy.h"
+
+
+/* GWY file is a serialized GwyContainer, see Gwyddion file format
+ * documentation. Every object is stored as type name, 32-bit size of the
+ * component data and the components. Components are name, type character
+ * and value, all numbers are little endian (host order on x86).
+ *
+ * Object sizes are found by running the same writer without output file,
+ * so the file is written in one pass and pixel planes are only read
+ * row by row. The whole file is counted first, an object larger than
+ * 32-bit size fails the export before anything is written.
+ */
+
+class GwyStream {
+private:
+	FILE *m_file;
+	uint64_t m_count;
+	double *m_row;
+	int m_rowSize;
+	int m_error;
+public:
+	GwyStream(FILE *file);
+	~GwyStream(void);
+	int IsCounting();
+	uint64_t GetCount();
+	int GetError();
+	void Fail();
+	void Raw(const void *data, size_t len);
+	void Component(const char *name, char type);
+	void Int(const char *name, int32_t value);
+	void Double(const char *name, double value);
+	void String(const char *name, std::string value);
+	void Channel(const char *name, AFMImage *image, int channel);
+};
+
+GwyStream::GwyStream(FILE *file)
+{
+	m_file = file;
+	m_count = 0;
+	m_row = NULL;
+	m_rowSize = 0;
+	m_error = 0;
+}
+
+GwyStream::~GwyStream()
+{
+	free(m_row);
+}
+
+int GwyStream::IsCounting()
+{
+	return m_file == NULL;
+}
+
+uint64_t GwyStream::GetCount()
+{
+	return m_count;
+}
+
+int GwyStream::GetError()
+{
+	return m_error;
+}
+
+void GwyStream::Fail()
+{
+	m_error = 1;
+}
+
+void GwyStream::Raw(const void *data, size_t len)
+{
+	m_count += len;
+	if (m_file && !m_error) {
+		if (fwrite(data, 1, len, m_file) != len) m_error = 1;
+	}
+}
+
+void GwyStream::Component(const char *name, char type)
+{
+	Raw(name, strlen(name) + 1);
+	Raw(&type, 1);
+}
+
+void GwyStream::Int(const char *name, int32_t value)
+{
+	Component(name, 'i');
+	Raw(&value, sizeof(value));
+}
+
+void GwyStream::Double(const char *name, double value)
+{
+	Component(name, 'd');
+	Raw(&value, sizeof(value));
+}
+
+void GwyStream::String(const char *name, std::string value)
+{
+	Component(name, 's');
+	Raw(value.c_str(), value.size() + 1);
+}
+
+/* Double array with channel data, converted one row at a time */
+void GwyStream::Channel(const char *name, AFMImage *image, int channel)
+{
+	int width = image->GetWidth();
+	uint32_t count = (uint32_t)width * image->GetHeight();
+
+	Component(name, 'D');
+	Raw(&count, sizeof(count));
+
+	if (IsCounting()) {
+		m_count += (uint64_t)count * sizeof(double);
+		return;
+	}
+
+	if (width > m_rowSize) {
+		free(m_row);
+		m_row = (double *)malloc(sizeof(double) * width);
+		m_rowSize = m_row ? width : 0;
+		if (!m_row) {
+			m_error = 1;
+			return;
+		}
+	}
+
+	for (int tile = 0; tile < image->GetTileCount(); tile++) {
+		int y0, y1;
+
+		image->GetTileBounds(tile, &y0, &y1);
+		image->PrefetchTile(channel, tile + 1);
+		for (int y = y0; y < y1; y++) {
+			const float *row = image->GetRow(channel, y);
+			for (int x = 0; x < width; x++) m_row[x] = row[x];
+			Raw(m_row, sizeof(double) * width);
+		}
+		image->ReleaseTile(channel, tile);
+	}
+}
+
+/* Writes components of an object */
+typedef void (*gwy_body_t)(GwyStream *s, const void *ctx);
+
+/* Object value: type name, size, components */
+static void gwyObjectValue(GwyStream *s, const char *type, gwy_body_t body, const void *ctx)
+{
+	GwyStream counter(NULL);
+	uint32_t size;
+
+	body(&counter, ctx);
+	if (counter.GetError() || (counter.GetCount() > 0xFFFFFFFFULL)) s->Fail();
+	size = (uint32_t)counter.GetCount();
+
+	s->Raw(type, strlen(type) + 1);
+	s->Raw(&size, sizeof(size));
+	body(s, ctx);
+}
+
+static void gwyObject(GwyStream *s, const char *name, const char *type, gwy_body_t body, const void *ctx)
+{
+	s->Component(name, 'o');
+	gwyObjectValue(s, type, body, ctx);
+}
+
+/***** Objects *****/
+
+typedef struct {
+	AFMImage *image;
+	int channel;
+} gwy_field_t;
+
+typedef std::vector<std::pair<std::string, std::string> > gwy_meta_t;
+
+typedef struct {
+	AFMImage *image;
+	const gwy_meta_t *meta;
+} gwy_file_t;
+
+static void gwyUnitMeter(GwyStream *s, const void *ctx)
+{
+	s->String("unitstr", "m");
+}
+
+/* Height is stored in ADC counts, so Z unit is empty */
+static void gwyUnitNone(GwyStream *s, const void *ctx)
+{
+	s->String("unitstr", "");
+}
+
+static void gwyDataField(GwyStream *s, const void *ctx)
+{
+	const gwy_field_t *f = (const gwy_field_t *)ctx;
+	AFMImage *image = f->image;
+	double sizeX = image->GetSizeX() * 1e-9;
+	double sizeY = image->GetSizeY() * 1e-9;
+
+	s->Int("xres", image->GetWidth());
+	s->Int("yres", image->GetHeight());
+	s->Double("xreal", sizeX > 0 ? sizeX : 1e-9);
+	s->Double("yreal", sizeY > 0 ? sizeY : 1e-9);
+	s->Double("xoff", image->GetStartX() * 1e-9);
+	s->Double("yoff", image->GetStartY() * 1e-9);
+	gwyObject(s, "si_unit_xy", "GwySIUnit", gwyUnitMeter, NULL);
+	gwyObject(s, "si_unit_z", "GwySIUnit", gwyUnitNone, NULL);
+	s->Channel("data", image, f->channel);
+}
+
+static void gwyMeta(GwyStream *s, const void *ctx)
+{
+	const gwy_meta_t *meta = (const gwy_meta_t *)ctx;
+
+	for (size_t i = 0; i < meta->size(); i++)
+		s->String((*meta)[i].first.c_str(), (*meta)[i].second);
+}
+
+static void gwyContainer(GwyStream *s, const void *ctx)
+{
+	const gwy_file_t *file = (const gwy_file_t *)ctx;
+	char key[32];
+
+	for (int ch = 0; ch < file->image->GetChannels(); ch++) {
+		gwy_field_t field;
+		std::string title;
+
+		field.image = file->image;
+		field.channel = ch;
+
+		if (ch == AFM_CHANNEL_TRACE)
+			title = "Height (trace)";
+		else if (ch == AFM_CHANNEL_RETRACE)
+			title = "Height (retrace)";
+		else {
+			snprintf(key, sizeof(key), "Channel %d", ch);
+			title = key;
+		}
+
+		snprintf(key, sizeof(key), "/%d/data", ch);
+		gwyObject(s, key, "GwyDataField", gwyDataField, &field);
+		snprintf(key, sizeof(key), "/%d/data/title", ch);
+		s->String(key, title);
+		snprintf(key, sizeof(key), "/%d/meta", ch);
+		gwyObject(s, key, "GwyContainer", gwyMeta, file->meta);
+	}
+}
+
+static std::string gwyFormat(const char *format, double value)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), format, value);
+	return buf;
+}
+
+int gwyExport(AFMImage *image, std::string filename,
+		const struct afmAFMProp *afm, const struct afmSTMProp *stm, int fwVersion)
+{
+	GwyStream *s;
+	gwy_meta_t meta;
+	gwy_file_t file;
+	FILE *f;
+	int ret;
+
+	if (!image->GetWidth() || !image->GetHeight()) return 0;
+
+	/* Metadata values are strings, as shown in Gwyddion metadata browser */
+	meta.push_back(std::make_pair("Start X", gwyFormat("%.0f nm", image->GetStartX())));
+	meta.push_back(std::make_pair("Start Y", gwyFormat("%.0f nm", image->GetStartY())));
+	if (image->GetSizeX() == image->GetSizeY()) {
+		meta.push_back(std::make_pair("Scan size", gwyFormat("%.0f nm", image->GetSizeX())));
+	} else {
+		meta.push_back(std::make_pair("Size X", gwyFormat("%.0f nm", image->GetSizeX())));
+		meta.push_back(std::make_pair("Size Y", gwyFormat("%.0f nm", image->GetSizeY())));
+	}
+	meta.push_back(std::make_pair("Resolution", gwyFormat("%.0f px", image->GetWidth())));
+	if (afm) {
+		meta.push_back(std::make_pair("Amplitude setpoint", gwyFormat("%.0f %%", afm->amplitude)));
+		meta.push_back(std::make_pair("Cantilever frequency", gwyFormat("%.0f Hz", afm->freq)));
+	}
+	if (stm) {
+		meta.push_back(std::make_pair("Bias", gwyFormat("%.0f mV", stm->bias)));
+		meta.push_back(std::make_pair("Current setpoint", gwyFormat("%.2f nA", stm->current * 0.01)));
+	}
+	if (fwVersion >= 0) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%d.%d", fwVersion >> 8, fwVersion & 0xFF);
+		meta.push_back(std::make_pair("Firmware version", std::string(buf)));
+	}
+
+	file.image = image;
+	file.meta = &meta;
+
+	/* Sizes of all objects are 32-bit */
+	s = new GwyStream(NULL);
+	gwyObjectValue(s, "GwyContainer", gwyContainer, &file);
+	ret = !s->GetError();
+	delete s;
+	if (!ret) return 0;
+
+	f = fopen(filename.c_str(), "wb");
+	if (!f) return 0;
+
+	s = new GwyStream(f);
+	s->Raw("GWYP", 4);
+	gwyObjectValue(s, "GwyContainer", gwyContainer, &file);
+	ret = !s->GetError();
+	delete s;
+
+	if (fclose(f) != 0) ret = 0;
+
+	return ret;
+}
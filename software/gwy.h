@@ -0,0 +1,17 @@
+#ifndef GWY_H_
+#define GWY_H_
+
+#include <string>
+
+#include "image.h"
+#include "protocol.h"
+
+/* Export all image channels to Gwyddion native file (.gwy).
+ * afm, stm (optional) are stored as channel metadata together with scan
+ * geometry; fwVersion is (major << 8) | minor, negative when unknown.
+ */
+int gwyExport(AFMImage *image, std::string filename,
+		const struct afmAFMProp *afm, const struct afmSTMProp *stm, int fwVersion);
+
+
+#endif /* GWY_H_ */
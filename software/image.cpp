@@ -15,23 +15,410 @@
  *
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 #include "image.h"
 
 
+#ifdef WIN32
+/* PrefetchVirtualMemory is available since Windows 8 and is missing
+ * from older MinGW headers, so it is looked up at run time */
+typedef struct {
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+} prefetch_range_t;
+
+typedef BOOL (WINAPI *prefetch_func_t)(HANDLE, ULONG_PTR, prefetch_range_t *, ULONG);
+
+static prefetch_func_t prefetchFunc(void)
+{
+	static prefetch_func_t func = NULL;
+	static bool checked = false;
+
+	if (!checked) {
+		func = (prefetch_func_t)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+		checked = true;
+	}
+
+	return func;
+}
+#endif
+
+
 AFMImage::AFMImage()
 {
 	width = 0;
 	height = 0;
+	channels = 0;
 	image = NULL;
+	planeStride = 0;
+	mapTileRows = 0;
+	tileRows = 0;
+	mapSize = 0;
+	spilled = false;
+#ifdef WIN32
+	mapFileHandle = INVALID_HANDLE_VALUE;
+	mapHandle = NULL;
+#else
+	mapFd = -1;
+#endif
+	startX = 0;
+	startY = 0;
+	sizeX = 0;
+	sizeY = 0;
 }
 
 AFMImage::~AFMImage()
 {
-	if (image)
+	Free();
+}
+
+void AFMImage::Free()
+{
+	if (mapSize) {
+#ifdef WIN32
+		UnmapViewOfFile(image);
+		CloseHandle(mapHandle);
+		CloseHandle(mapFileHandle);
+		mapHandle = NULL;
+		mapFileHandle = INVALID_HANDLE_VALUE;
+#else
+		munmap(image, mapSize);
+		close(mapFd);
+		mapFd = -1;
+#endif
+		mapSize = 0;
+	} else if (image) {
 		free(image);
+	}
+
+	if (spilled) {
+		remove(spillFile.c_str());
+		spilled = false;
+	}
+
+	image = NULL;
+}
+
+/* Keep image planes in memory mapped file instead of heap.
+ * Pages are loaded on access and written back by the system, so images
+ * larger than RAM do not use swap. Existing file is overwritten and
+ * is left on disk when the image is freed. tileRows = 0 selects
+ * tiles of about IMAGE_TILE_BYTES.
+ * Takes effect on the next Create().
+ */
+void AFMImage::SetBackingFile(std::string filename, int tileRows)
+{
+	mapFile = filename;
+	mapTileRows = (tileRows > 0) ? tileRows : 0;
+}
+
+/* Acquisition buffers which may exceed RAM. Images larger than
+ * IMAGE_HEAP_MAX_BYTES are kept in this file like with SetBackingFile(),
+ * smaller ones stay on heap. The file is removed when the image is freed.
+ * Backing file set by SetBackingFile() takes precedence.
+ */
+void AFMImage::SetSpillFile(std::string filename)
+{
+	spillFile = filename;
+}
+
+int AFMImage::CreateMapped(std::string filename, size_t planeBytes)
+{
+	size_t total = planeBytes * channels;
+
+	if (!total) total = IMAGE_MAP_ALIGN;
+
+#ifdef WIN32
+	mapFileHandle = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mapFileHandle == INVALID_HANDLE_VALUE) return 0;
+
+	mapHandle = CreateFileMappingA(mapFileHandle, NULL, PAGE_READWRITE,
+			(DWORD)((uint64_t)total >> 32), (DWORD)total, NULL);
+	if (mapHandle) image = (float *)MapViewOfFile(mapHandle, FILE_MAP_ALL_ACCESS, 0, 0, total);
+	if (!image) {
+		if (mapHandle) CloseHandle(mapHandle);
+		CloseHandle(mapFileHandle);
+		mapHandle = NULL;
+		mapFileHandle = INVALID_HANDLE_VALUE;
+		return 0;
+	}
+#else
+	void *addr;
+
+	mapFd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (mapFd < 0) return 0;
+
+	/* New file is sparse and reads as zeros */
+	addr = MAP_FAILED;
+	if (ftruncate(mapFd, total) == 0)
+		addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, mapFd, 0);
+	if (addr == MAP_FAILED) {
+		close(mapFd);
+		mapFd = -1;
+		return 0;
+	}
+	image = (float *)addr;
+#endif
+
+	mapSize = total;
+
+	return 1;
+}
+
+/* Allocate image planes, one per channel */
+int AFMImage::Create(uint16_t width, uint16_t height, int channels)
+{
+	size_t count, planeBytes;
+	uint64_t bytes;
+	bool spill;
+	int ok;
+
+	/* Same shape in memory is only cleared, so frame buffers can be reused */
+	if (image && !mapSize && mapFile.empty() && (width == this->width) &&
+			(height == this->height) && (channels == this->channels)) {
+		memset(image, 0, (size_t)width * height * channels * sizeof(float));
+		return 1;
+	}
+
+	Free();
+
+	/* Whole image is addressed at once, the largest scans need
+	 * 64-bit address space */
+	bytes = ((uint64_t)width * height * sizeof(float) + IMAGE_MAP_ALIGN) * channels;
+	if (bytes > (uint64_t)((size_t)-1 / 2)) {
+		this->width = 0;
+		this->height = 0;
+		this->channels = 0;
+		return 0;
+	}
+
+	this->width = width;
+	this->height = height;
+	this->channels = channels;
+
+	spill = mapFile.empty() && !spillFile.empty() && (bytes > IMAGE_HEAP_MAX_BYTES);
+
+	count = (size_t)width * height;
+	if (mapFile.empty() && !spill) {
+		planeStride = count;
+		tileRows = height;
+		count *= channels;
+		image = (float *)calloc(count ? count : 1, sizeof(float));
+		ok = (image != NULL);
+	} else {
+		/* Planes start on mapping granularity, so tiles of different
+		 * channels never share pages */
+		planeBytes = (count * sizeof(float) + IMAGE_MAP_ALIGN - 1) & ~(size_t)(IMAGE_MAP_ALIGN - 1);
+		planeStride = planeBytes / sizeof(float);
+		tileRows = mapTileRows;
+		if (!tileRows) tileRows = width ? IMAGE_TILE_BYTES / (width * sizeof(float)) : 1;
+		if (tileRows < 1) tileRows = 1;
+		ok = CreateMapped(spill ? spillFile : mapFile, planeBytes);
+		spilled = spill && ok;
+	}
+
+	if (!ok) {
+		this->width = 0;
+		this->height = 0;
+		this->channels = 0;
+		tileRows = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+int AFMImage::IsMapped()
+{
+	return mapSize != 0;
+}
+
+/* Tile is a band of full rows. In memory image is a single tile. */
+int AFMImage::GetTileRows()
+{
+	return tileRows;
+}
+
+int AFMImage::GetTileCount()
+{
+	if (!tileRows) return 0;
+
+	return (height + tileRows - 1) / tileRows;
+}
+
+/* Rows y0 to y1 - 1 belong to the tile */
+void AFMImage::GetTileBounds(int tile, int *y0, int *y1)
+{
+	*y0 = tile * tileRows;
+	*y1 = *y0 + tileRows;
+	if (*y1 > height) *y1 = height;
+}
+
+/* Page aligned part of the mapping covered by tile */
+void AFMImage::TilePages(int channel, int tile, char **start, size_t *len)
+{
+	size_t page = 4096;
+	size_t y0, y1, a, b;
+
+	*len = 0;
+	if (!mapSize || (channel < 0) || (channel >= channels)) return;
+	if ((tile < 0) || (tile >= GetTileCount())) return;
+
+	y0 = (size_t)tile * tileRows;
+	y1 = y0 + tileRows;
+	if (y1 > height) y1 = height;
+
+	a = (((size_t)channel * planeStride + y0 * width) * sizeof(float)) & ~(page - 1);
+	b = (((size_t)channel * planeStride + y1 * width) * sizeof(float) + page - 1) & ~(page - 1);
+	if (b > mapSize) b = mapSize;
+
+	*start = (char *)image + a;
+	*len = b - a;
+}
+
+/* Ask the system to start reading the tile, does not wait */
+void AFMImage::PrefetchTile(int channel, int tile)
+{
+	char *start;
+	size_t len;
+
+	TilePages(channel, tile, &start, &len);
+	if (!len) return;
+
+#ifdef WIN32
+	prefetch_func_t prefetch = prefetchFunc();
+	if (prefetch) {
+		prefetch_range_t range;
+		range.VirtualAddress = start;
+		range.NumberOfBytes = len;
+		prefetch(GetCurrentProcess(), 1, &range, 0);
+	}
+#else
+	madvise(start, len, MADV_WILLNEED);
+#endif
+}
+
+/* Start writing the tile back and drop it from the working set.
+ * Data stays valid, next access loads it from the file again.
+ */
+void AFMImage::ReleaseTile(int channel, int tile)
+{
+	char *start;
+	size_t len;
+
+	TilePages(channel, tile, &start, &len);
+	if (!len) return;
+
+#ifdef WIN32
+	FlushViewOfFile(start, len);
+	/* Unlocking pages that are not locked removes them from working set */
+	VirtualUnlock(start, len);
+#else
+	msync(start, len, MS_ASYNC);
+	madvise(start, len, MADV_DONTNEED);
+#endif
+}
+
+/* Square scan area */
+void AFMImage::SetGeometry(int32_t startX, int32_t startY, uint16_t size)
+{
+	this->startX = startX;
+	this->startY = startY;
+	sizeX = size;
+	sizeY = size;
+}
+
+/* Area size of images not taken by a single scan, like mosaics */
+void AFMImage::SetExtent(uint32_t sizeX, uint32_t sizeY)
+{
+	this->sizeX = sizeX;
+	this->sizeY = sizeY;
+}
+
+void AFMImage::CopyGeometry(AFMImage *from)
+{
+	startX = from->startX;
+	startY = from->startY;
+	sizeX = from->sizeX;
+	sizeY = from->sizeY;
+}
+
+/* Same shape, geometry and data as from; backing file set before is kept */
+int AFMImage::CopyFrom(AFMImage *from)
+{
+	if (!Create(from->width, from->height, from->channels)) return 0;
+	CopyGeometry(from);
+
+	for (int ch = 0; ch < channels; ch++) {
+		for (int tile = 0; tile < from->GetTileCount(); tile++) {
+			int y0, y1;
+
+			from->GetTileBounds(tile, &y0, &y1);
+			from->PrefetchTile(ch, tile + 1);
+			for (int y = y0; y < y1; y++)
+				memcpy(GetRow(ch, y), from->GetRow(ch, y), sizeof(float) * width);
+			from->ReleaseTile(ch, tile);
+		}
+	}
+
+	return 1;
+}
+
+uint16_t AFMImage::GetWidth()
+{
+	return width;
+}
+
+uint16_t AFMImage::GetHeight()
+{
+	return height;
+}
+
+int AFMImage::GetChannels()
+{
+	return channels;
+}
+
+int32_t AFMImage::GetStartX()
+{
+	return startX;
+}
+
+int32_t AFMImage::GetStartY()
+{
+	return startY;
+}
+
+uint32_t AFMImage::GetSizeX()
+{
+	return sizeX;
+}
+
+uint32_t AFMImage::GetSizeY()
+{
+	return sizeY;
+}
+
+float *AFMImage::GetRow(int channel, int y)
+{
+	if (!image) return NULL;
+	if ((channel < 0) || (channel >= channels)) return NULL;
+	if ((y < 0) || (y >= height)) return NULL;
+
+	return image + (size_t)channel * planeStride + (size_t)y * width;
 }
 
 int AFMImage::SaveAsGSF(std::string filename)
@@ -5,16 +5,83 @@
 #include <stdint.h>
 #include <string>
 
+/* Image channels */
+#define AFM_CHANNEL_TRACE		0	/* Forward pass */
+#define AFM_CHANNEL_RETRACE		1	/* Backward pass */
+#define AFM_CHANNEL_COUNT		2
+
+/* File backed images */
+#define IMAGE_TILE_BYTES		(4 * 1024 * 1024)	/* Default tile size */
+#define IMAGE_MAP_ALIGN			65536				/* Channel plane alignment */
+#define IMAGE_HEAP_MAX_BYTES	((uint64_t)1 << 30)	/* Larger images go to spill file */
+
 class AFMImage {
 private:
 	uint16_t width;
 	uint16_t height;
-	uint8_t *image;
+	int channels;
+	float *image;
+	size_t planeStride;		/* Floats between channel planes */
+	/* Backing file, image is kept in memory when empty */
+	std::string mapFile;
+	int mapTileRows;
+	int tileRows;
+	size_t mapSize;
+	/* Used as backing file only by images above IMAGE_HEAP_MAX_BYTES */
+	std::string spillFile;
+	bool spilled;
+#ifdef WIN32
+	void *mapFileHandle;
+	void *mapHandle;
+#else
+	int mapFd;
+#endif
+	/* Scan geometry, in nanometers */
+	int32_t startX;
+	int32_t startY;
+	uint32_t sizeX;
+	uint32_t sizeY;
+	void Free();
+	int CreateMapped(std::string filename, size_t planeBytes);
+	void TilePages(int channel, int tile, char **start, size_t *len);
 public:
 	AFMImage(void);
 	~AFMImage(void);
+	void SetBackingFile(std::string filename, int tileRows = 0);
+	void SetSpillFile(std::string filename);
+	int Create(uint16_t width, uint16_t height, int channels);
+	int IsMapped();
+	int GetTileRows();
+	int GetTileCount();
+	void GetTileBounds(int tile, int *y0, int *y1);
+	void PrefetchTile(int channel, int tile);
+	void ReleaseTile(int channel, int tile);
+	void SetGeometry(int32_t startX, int32_t startY, uint16_t size);
+	void SetExtent(uint32_t sizeX, uint32_t sizeY);
+	void CopyGeometry(AFMImage *from);
+	int CopyFrom(AFMImage *from);
+	uint16_t GetWidth();
+	uint16_t GetHeight();
+	int GetChannels();
+	int32_t GetStartX();
+	int32_t GetStartY();
+	uint32_t GetSizeX();
+	uint32_t GetSizeY();
+	float *GetRow(int channel, int y);
 	int SaveAsGSF(std::string filename);
 };
 
+/* Receives image data as it arrives from the device */
+class ImageListener {
+public:
+	virtual ~ImageListener() {}
+	virtual void OnImageStart(AFMImage *image) {}
+	virtual void OnImageLine(AFMImage *image, int channel, int line) {}
+	virtual void OnImageEnd(AFMImage *image) {}
+	/* Line for display only, in any order and possibly repeated; the same
+	 * lines are passed to OnImageLine in order before OnImageEnd */
+	virtual void OnImagePreview(AFMImage *image, int channel, int line) {}
+};
+
 
 #endif /* IMAGE_H_ */
@@ -0,0 +1,628 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <wx/wx.h>
+#include <wx/dcbuffer.h>
+#include <float.h>
+#include <string.h>
+#include <math.h>
+
+#include "imagepanel.h"
+#include "roi.h"
+
+
+/* Color range grows by this fraction when a line falls outside of it,
+ * so full redraws stay rare */
+#define RANGE_MARGIN		0.1f
+
+/* Percentiles of complete image mapped to the ends of the colormap */
+#define RANGE_LOW			0.001
+#define RANGE_HIGH			0.999
+
+/* Background color */
+#define VIEW_BG				0x30
+
+/* Zoom change per mouse wheel step */
+#define ZOOM_STEP			1.25
+
+/* Largest magnification, view pixels per image pixel */
+#define ZOOM_MAX_SCALE		16.0
+
+
+wxBEGIN_EVENT_TABLE(ImagePanel, wxPanel)
+	EVT_PAINT(ImagePanel::OnPaint)
+	EVT_SIZE(ImagePanel::OnSize)
+	EVT_LEFT_DOWN(ImagePanel::OnMouseDown)
+	EVT_MOTION(ImagePanel::OnMouseMove)
+	EVT_LEFT_UP(ImagePanel::OnMouseUp)
+	EVT_MOUSEWHEEL(ImagePanel::OnMouseWheel)
+	EVT_RIGHT_DOWN(ImagePanel::OnPanStart)
+	EVT_RIGHT_UP(ImagePanel::OnPanEnd)
+	EVT_MOUSE_CAPTURE_LOST(ImagePanel::OnCaptureLost)
+wxEND_EVENT_TABLE()
+
+
+ImagePanel::ImagePanel(wxWindow *parent, int channel)
+	: wxPanel(parent, wxID_ANY), m_pyramid(PYRAMID_BOX)
+{
+	m_image = NULL;
+	m_channel = channel;
+	m_level = 0;
+	m_levelX0 = 0;
+	m_colFrom = 0;
+	m_scale = 1;
+	m_zoom = 1;
+	m_centerX = 0;
+	m_centerY = 0;
+	m_viewX = 0;
+	m_viewY = 0;
+	m_viewW = 0;
+	m_viewH = 0;
+	m_min = FLT_MAX;
+	m_max = -FLT_MAX;
+	m_rows = 0;
+	m_dirtyFrom = 0;
+	m_dirtyTo = 0;
+	m_overlay = NULL;
+	m_ovRows = 0;
+	m_ovLeft = 0;
+	m_ovTop = 0;
+	m_ovScaleY = 1;
+	m_ovX0 = m_ovY0 = m_ovY1 = 0;
+	m_haveSel = false;
+	m_selecting = false;
+	m_selX0 = m_selY0 = m_selX1 = m_selY1 = 0;
+	m_panning = false;
+	m_panX = m_panY = 0;
+	m_colormap.Create(COLORMAP_GREY, COLORMAP_MAX_SIZE);
+
+	/* All pixels come from backbuffer */
+	SetBackgroundStyle(wxBG_STYLE_PAINT);
+	Place();
+}
+
+/* Fit image into panel, keeping aspect ratio, then apply zoom and pan.
+ * Columns are mapped only for the visible part of the image.
+ */
+void ImagePanel::Place()
+{
+	wxSize size = GetClientSize();
+	int w = (size.GetWidth() > 0) ? size.GetWidth() : 1;
+	int h = (size.GetHeight() > 0) ? size.GetHeight() : 1;
+	int width, height, from, to;
+
+	if (!m_view.IsOk() || (m_view.GetWidth() != w) || (m_view.GetHeight() != h))
+		m_view.Create(w, h, false);
+
+	m_viewX = m_viewY = m_viewW = m_viewH = 0;
+	m_colFrom = 0;
+	m_level = 0;
+	m_column.clear();
+	m_levelColumn.clear();
+	if (!m_image || !m_image->GetWidth() || !m_image->GetHeight()) {
+		PlaceOverlay();
+		return;
+	}
+	width = m_image->GetWidth();
+	height = m_image->GetHeight();
+
+	m_scale = (double)w / width;
+	if ((double)h / height < m_scale) m_scale = (double)h / height;
+	m_scale *= m_zoom;
+
+	/* Fitted image is centered, zoomed one may not leave the panel */
+	if (m_zoom <= 1) {
+		m_centerX = width / 2.0;
+		m_centerY = height / 2.0;
+	}
+	if (m_centerX < 0) m_centerX = 0;
+	if (m_centerY < 0) m_centerY = 0;
+	if (m_centerX > width) m_centerX = width;
+	if (m_centerY > height) m_centerY = height;
+
+	m_viewW = (int)(width * m_scale);
+	m_viewH = (int)(height * m_scale);
+	if (m_viewW < 1) m_viewW = 1;
+	if (m_viewH < 1) m_viewH = 1;
+	m_viewX = (int)floor(w / 2.0 - m_centerX * m_scale);
+	m_viewY = (int)floor(h / 2.0 - m_centerY * m_scale);
+
+	from = (m_viewX < 0) ? -m_viewX : 0;
+	to = (w - m_viewX < m_viewW) ? w - m_viewX : m_viewW;
+	if (to > from) {
+		m_colFrom = from;
+		m_column.resize(to - from);
+		for (int x = 0; x < to - from; x++) {
+			int ix = (int)((from + x) / m_scale);
+			m_column[x] = (ix < width) ? ix : width - 1;
+		}
+	}
+
+	m_level = m_pyramid.ChooseLevel(m_scale);
+	if (m_level && !m_column.empty()) {
+		int lw = m_pyramid.GetLevelWidth(m_level);
+
+		m_levelX0 = m_column[0] >> m_level;
+		m_levelColumn.resize(m_column.size());
+		for (size_t x = 0; x < m_column.size(); x++) {
+			int lx = m_column[x] >> m_level;
+			m_levelColumn[x] = ((lx < lw) ? lx : lw - 1) - m_levelX0;
+		}
+	}
+
+	PlaceOverlay();
+}
+
+/* Overlay goes where its scan area is in the image, clipped to the image */
+void ImagePanel::PlaceOverlay()
+{
+	double x, y, w, h, scaleX;
+	int x1, ovW, ovH;
+
+	m_ovColumn.clear();
+	m_ovX0 = m_ovY0 = m_ovY1 = 0;
+	if (!m_overlay || !m_image || m_column.empty()) return;
+
+	ovW = m_overlay->GetWidth();
+	ovH = m_overlay->GetHeight();
+	if (!ovW || !ovH || !roiPlacement(m_image, m_overlay, &x, &y, &w, &h)) return;
+
+	m_ovLeft = x * m_scale;
+	m_ovTop = y * m_scale;
+	scaleX = w * m_scale / ovW;
+	m_ovScaleY = h * m_scale / ovH;
+
+	m_ovX0 = (int)floor(m_ovLeft);
+	x1 = (int)ceil(m_ovLeft + w * m_scale);
+	m_ovY0 = (int)floor(m_ovTop);
+	m_ovY1 = (int)ceil(m_ovTop + h * m_scale);
+	if (m_ovX0 < m_colFrom) m_ovX0 = m_colFrom;
+	if (m_ovY0 < 0) m_ovY0 = 0;
+	if (x1 > m_colFrom + (int)m_column.size()) x1 = m_colFrom + m_column.size();
+	if (m_ovY1 > m_viewH) m_ovY1 = m_viewH;
+	if ((x1 <= m_ovX0) || (m_ovY1 <= m_ovY0)) {
+		m_ovX0 = m_ovY0 = m_ovY1 = 0;
+		return;
+	}
+
+	m_ovColumn.resize(x1 - m_ovX0);
+	for (int c = 0; c < x1 - m_ovX0; c++) {
+		int ix = (int)((m_ovX0 + c - m_ovLeft) / scaleX);
+		m_ovColumn[c] = (ix < 0) ? 0 : (ix < ovW) ? ix : ovW - 1;
+	}
+}
+
+void ImagePanel::Clear()
+{
+	unsigned char *data = m_view.GetData();
+
+	memset(data, VIEW_BG, (size_t)m_view.GetWidth() * m_view.GetHeight() * 3);
+}
+
+/* Draw image rows y0..y1-1 into backbuffer */
+void ImagePanel::RenderRows(int y0, int y1)
+{
+	/* View rows covering the image rows */
+	RenderView((int)floor(y0 * m_scale), (int)ceil(y1 * m_scale));
+}
+
+/* Draw view rows v0..v1-1, relative to image placement.
+ * Only the visible part is drawn, from pyramid level rows when they are
+ * complete and from image rows otherwise.
+ */
+void ImagePanel::RenderView(int v0, int v1)
+{
+	unsigned char *data = m_view.GetData();
+	int stride = m_view.GetWidth() * 3;
+	int n = m_column.size();
+	int levelW;
+
+	if (!m_image || !n) return;
+
+	if (v0 < -m_viewY) v0 = -m_viewY;
+	if (v1 > m_view.GetHeight() - m_viewY) v1 = m_view.GetHeight() - m_viewY;
+	if (v0 < 0) v0 = 0;
+	if (v1 > m_viewH) v1 = m_viewH;
+
+	levelW = m_level ? m_levelColumn[n - 1] + 1 : 1;
+
+	#pragma omp parallel if (v1 - v0 > 64)
+	{
+		std::vector<float> level(levelW);
+
+		#pragma omp for schedule(static)
+		for (int vy = v0; vy < v1; vy++) {
+			int iy = (int)(vy / m_scale);
+			unsigned char *dst = data + (size_t)(m_viewY + vy) * stride + (m_viewX + m_colFrom) * 3;
+			const float *src;
+
+			if (iy >= m_image->GetHeight()) iy = m_image->GetHeight() - 1;
+
+			if (m_level && ((iy >> m_level) < m_pyramid.GetLevelRows(m_level)) &&
+					m_pyramid.ReadRegion(m_level, 0, m_levelX0, iy >> m_level, levelW, 1, &level[0], levelW)) {
+				m_colormap.RenderRowIndexed(&level[0], &m_levelColumn[0], n, m_min, m_max, dst);
+			} else {
+				src = (iy < m_rows) ? m_image->GetRow(m_channel, iy) : NULL;
+				if (src)
+					m_colormap.RenderRowIndexed(src, &m_column[0], n, m_min, m_max, dst);
+				else
+					memset(dst, VIEW_BG, n * 3);
+			}
+
+			/* Overlay uses the same color range, so heights compare */
+			if (!m_ovColumn.empty() && (vy >= m_ovY0) && (vy < m_ovY1)) {
+				int oy = (int)((vy - m_ovTop) / m_ovScaleY);
+				if (oy >= m_overlay->GetHeight()) oy = m_overlay->GetHeight() - 1;
+				src = ((oy >= 0) && (oy < m_ovRows)) ? m_overlay->GetRow(m_channel, oy) : NULL;
+				if (src)
+					m_colormap.RenderRowIndexed(src, &m_ovColumn[0], m_ovColumn.size(),
+							m_min, m_max, dst + (m_ovX0 - m_colFrom) * 3);
+			}
+		}
+	}
+
+	MarkDirty(m_viewY + v0, m_viewY + v1);
+}
+
+void ImagePanel::RenderAll()
+{
+	Clear();
+	if (m_image) RenderRows(0, m_image->GetHeight());
+	MarkDirty(0, m_view.GetHeight());
+}
+
+void ImagePanel::MarkDirty(int from, int to)
+{
+	if (from < 0) from = 0;
+	if (to > m_view.GetHeight()) to = m_view.GetHeight();
+	if (from >= to) return;
+
+	if (m_dirtyFrom >= m_dirtyTo) {
+		m_dirtyFrom = from;
+		m_dirtyTo = to;
+	} else {
+		if (from < m_dirtyFrom) m_dirtyFrom = from;
+		if (to > m_dirtyTo) m_dirtyTo = to;
+	}
+}
+
+/* Placement changed, whole panel is drawn again */
+void ImagePanel::Redraw()
+{
+	Place();
+	RenderAll();
+	Refresh(false);
+}
+
+/* Invalidate rows changed since the last call */
+void ImagePanel::Flush()
+{
+	if (m_dirtyFrom >= m_dirtyTo) return;
+
+	RefreshRect(wxRect(0, m_dirtyFrom, m_view.GetWidth(), m_dirtyTo - m_dirtyFrom), false);
+	m_dirtyFrom = m_dirtyTo = 0;
+}
+
+/* Forget the image before it is deleted, picture stays on screen */
+void ImagePanel::Detach()
+{
+	m_image = NULL;
+	m_rows = 0;
+	m_overlay = NULL;
+	m_ovRows = 0;
+	m_ovColumn.clear();
+	m_haveSel = false;
+	m_selecting = false;
+	m_panning = false;
+}
+
+AFMImage *ImagePanel::GetImage()
+{
+	return m_image;
+}
+
+/* Draw scan of a region over the image, image may still be acquired.
+ * NULL removes the overlay. */
+void ImagePanel::SetOverlay(AFMImage *image)
+{
+	m_overlay = image;
+	m_ovRows = image ? image->GetHeight() : 0;
+	PlaceOverlay();
+	RenderAll();
+	Flush();
+}
+
+/* Selected image pixels x0..x1-1, y0..y1-1 */
+int ImagePanel::GetSelection(int *x0, int *y0, int *x1, int *y1)
+{
+	if (!m_haveSel || !m_image) return 0;
+
+	*x0 = (m_selX0 < m_selX1) ? m_selX0 : m_selX1;
+	*y0 = (m_selY0 < m_selY1) ? m_selY0 : m_selY1;
+	*x1 = ((m_selX0 > m_selX1) ? m_selX0 : m_selX1) + 1;
+	*y1 = ((m_selY0 > m_selY1) ? m_selY0 : m_selY1) + 1;
+
+	return 1;
+}
+
+/* Complete image, drawn at once with its percentile range */
+void ImagePanel::ShowImage(AFMImage *image)
+{
+	m_image = image;
+	m_rows = image->GetHeight();
+	m_haveSel = false;
+	m_zoom = 1;
+	m_min = FLT_MAX;
+	m_max = -FLT_MAX;
+	colormapRange(image, m_channel, COLORMAP_RANGE_PERCENTILE, RANGE_LOW, RANGE_HIGH, &m_min, &m_max);
+	pyramidBuild(image, m_channel, &m_pyramid);
+
+	Place();
+	RenderAll();
+	Flush();
+}
+
+int ImagePanel::SetColorMap(int type)
+{
+	if (!m_colormap.Create(type, COLORMAP_MAX_SIZE)) return 0;
+
+	RenderAll();
+	Refresh(false);
+
+	return 1;
+}
+
+void ImagePanel::OnPaint(wxPaintEvent& event)
+{
+	wxAutoBufferedPaintDC dc(this);
+	wxRect bounds(0, 0, m_view.GetWidth(), m_view.GetHeight());
+
+	/* Only the invalidated part of the backbuffer is converted and drawn */
+	for (wxRegionIterator upd(GetUpdateRegion()); upd; upd++) {
+		wxRect r = upd.GetRect().Intersect(bounds);
+		if (r.IsEmpty()) continue;
+		dc.DrawBitmap(wxBitmap(m_view.GetSubImage(r)), r.x, r.y);
+	}
+
+	if (m_haveSel) {
+		dc.SetPen(*wxYELLOW_PEN);
+		dc.SetBrush(*wxTRANSPARENT_BRUSH);
+		dc.DrawRectangle(SelectionRect());
+	}
+}
+
+void ImagePanel::OnSize(wxSizeEvent& event)
+{
+	Redraw();
+	event.Skip();
+}
+
+/* Image pixel under view point, clamped to the image */
+void ImagePanel::ViewToImage(int vx, int vy, int *x, int *y)
+{
+	*x = (int)floor((vx - m_viewX) / m_scale);
+	*y = (int)floor((vy - m_viewY) / m_scale);
+	if (*x < 0) *x = 0;
+	if (*y < 0) *y = 0;
+	if (*x >= m_image->GetWidth()) *x = m_image->GetWidth() - 1;
+	if (*y >= m_image->GetHeight()) *y = m_image->GetHeight() - 1;
+}
+
+wxRect ImagePanel::SelectionRect()
+{
+	int x0, y0, x1, y1;
+
+	if (!GetSelection(&x0, &y0, &x1, &y1)) return wxRect();
+
+	return wxRect(m_viewX + (int)floor(x0 * m_scale), m_viewY + (int)floor(y0 * m_scale),
+			(int)ceil((x1 - x0) * m_scale), (int)ceil((y1 - y0) * m_scale));
+}
+
+/* Only the area of old and new outline is repainted */
+void ImagePanel::RefreshSelection(wxRect old)
+{
+	wxRect r = SelectionRect();
+
+	if (old.IsEmpty()) old = r;
+	else if (!r.IsEmpty()) old.Union(r);
+	RefreshRect(old.Inflate(2), false);
+}
+
+void ImagePanel::OnMouseDown(wxMouseEvent& event)
+{
+	wxRect old = SelectionRect();
+
+	if (!m_image || m_column.empty() || m_panning) return;
+
+	ViewToImage(event.GetX(), event.GetY(), &m_selX0, &m_selY0);
+	m_selX1 = m_selX0;
+	m_selY1 = m_selY0;
+	m_haveSel = true;
+	m_selecting = true;
+	CaptureMouse();
+	RefreshSelection(old);
+}
+
+void ImagePanel::OnMouseMove(wxMouseEvent& event)
+{
+	wxRect old;
+
+	if (m_panning && m_image) {
+		m_centerX -= (event.GetX() - m_panX) / m_scale;
+		m_centerY -= (event.GetY() - m_panY) / m_scale;
+		m_panX = event.GetX();
+		m_panY = event.GetY();
+		Redraw();
+		return;
+	}
+
+	if (!m_selecting || !m_image) return;
+
+	old = SelectionRect();
+	ViewToImage(event.GetX(), event.GetY(), &m_selX1, &m_selY1);
+	RefreshSelection(old);
+}
+
+void ImagePanel::OnMouseUp(wxMouseEvent& event)
+{
+	if (!m_selecting) return;
+
+	m_selecting = false;
+	if (HasCapture()) ReleaseMouse();
+}
+
+/* Zoom around the image point under the cursor */
+void ImagePanel::OnMouseWheel(wxMouseEvent& event)
+{
+	wxSize size = GetClientSize();
+	double fit, zoom, x, y;
+
+	if (!m_image || m_column.empty() || !event.GetWheelRotation()) return;
+
+	fit = m_scale / m_zoom;
+	zoom = m_zoom * ((event.GetWheelRotation() > 0) ? ZOOM_STEP : 1 / ZOOM_STEP);
+	if (zoom * fit > ZOOM_MAX_SCALE) zoom = ZOOM_MAX_SCALE / fit;
+	if (zoom < 1) zoom = 1;
+	if (zoom == m_zoom) return;
+
+	x = (event.GetX() - m_viewX) / m_scale;
+	y = (event.GetY() - m_viewY) / m_scale;
+	m_zoom = zoom;
+	m_centerX = x - (event.GetX() - size.GetWidth() / 2.0) / (zoom * fit);
+	m_centerY = y - (event.GetY() - size.GetHeight() / 2.0) / (zoom * fit);
+	Redraw();
+}
+
+void ImagePanel::OnPanStart(wxMouseEvent& event)
+{
+	if (!m_image || (m_zoom <= 1) || m_selecting) return;
+
+	m_panning = true;
+	m_panX = event.GetX();
+	m_panY = event.GetY();
+	CaptureMouse();
+}
+
+void ImagePanel::OnPanEnd(wxMouseEvent& event)
+{
+	if (!m_panning) return;
+
+	m_panning = false;
+	if (HasCapture()) ReleaseMouse();
+}
+
+void ImagePanel::OnCaptureLost(wxMouseCaptureLostEvent& event)
+{
+	m_selecting = false;
+	m_panning = false;
+}
+
+void ImagePanel::OnImageStart(AFMImage *image)
+{
+	if (image == m_overlay) {
+		/* Region scan draws over the image, which stays as it is */
+		m_ovRows = 0;
+		PlaceOverlay();
+		RenderView(m_ovY0, m_ovY1);
+		return;
+	}
+
+	m_image = image;
+	m_rows = 0;
+	m_haveSel = false;
+	m_zoom = 1;
+	m_min = FLT_MAX;
+	m_max = -FLT_MAX;
+	m_pyramid.Create(image->GetWidth(), image->GetHeight());
+	Place();
+	RenderAll();
+}
+
+/* Lines come in order, so they are added to the pyramid */
+void ImagePanel::OnImageLine(AFMImage *image, int channel, int line)
+{
+	const float *row = image->GetRow(channel, line);
+	int first = line;
+
+	/* Completed level row replaces image rows drawn before it */
+	if ((image == m_image) && (channel == m_channel) && row &&
+			(line == m_pyramid.GetLevelRows(0)) && m_pyramid.AddRow(row) && m_level)
+		first = line & ~((1 << m_level) - 1);
+
+	DrawLine(image, channel, line, first);
+}
+
+/* Draw received line, image rows from first to line are drawn again */
+void ImagePanel::DrawLine(AFMImage *image, int channel, int line, int first)
+{
+	const float *row = image->GetRow(channel, line);
+	float lo, hi;
+
+	if ((channel != m_channel) || !row) return;
+
+	if (image == m_overlay) {
+		if (line + 1 > m_ovRows) m_ovRows = line + 1;
+		RenderView((int)floor(m_ovTop + line * m_ovScaleY),
+				(int)ceil(m_ovTop + (line + 1) * m_ovScaleY));
+		return;
+	}
+
+	if (line + 1 > m_rows) m_rows = line + 1;
+
+	lo = hi = row[0];
+	for (int x = 1; x < image->GetWidth(); x++) {
+		if (row[x] < lo) lo = row[x];
+		if (row[x] > hi) hi = row[x];
+	}
+
+	if ((lo < m_min) || (hi > m_max)) {
+		/* Range changed, every received row has to be redrawn */
+		if (m_min > m_max) {
+			m_min = lo;
+			m_max = hi;
+		} else {
+			float margin = ((hi > m_max ? hi : m_max) - (lo < m_min ? lo : m_min)) * RANGE_MARGIN;
+			if (lo < m_min) m_min = lo - margin;
+			if (hi > m_max) m_max = hi + margin;
+		}
+		RenderAll();
+	} else {
+		RenderRows(first, line + 1);
+	}
+}
+
+/* Preview lines are drawn like received ones, they may come in any order
+ * and are left out of the pyramid */
+void ImagePanel::OnImagePreview(AFMImage *image, int channel, int line)
+{
+	DrawLine(image, channel, line, line);
+}
+
+void ImagePanel::OnImageEnd(AFMImage *image)
+{
+	if (image == m_overlay) {
+		m_ovRows = image->GetHeight();
+		return;
+	}
+
+	/* Range grown during the scan is replaced by the percentile range,
+	 * rows of an image stopped early complete the pyramid */
+	m_rows = image->GetHeight();
+	m_pyramid.Finish();
+	colormapRange(image, m_channel, COLORMAP_RANGE_PERCENTILE, RANGE_LOW, RANGE_HIGH, &m_min, &m_max);
+	RenderAll();
+}
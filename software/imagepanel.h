@@ -0,0 +1,101 @@
+#ifndef IMAGEPANEL_H_
+#define IMAGEPANEL_H_
+
+#include <wx/wx.h>
+#include <vector>
+
+#include "image.h"
+#include "colormap.h"
+#include "pyramid.h"
+
+/* Live view of one image channel
+ * Received lines are drawn into a persistent panel sized backbuffer,
+ * Flush() invalidates only the rows that changed since the last call.
+ * A scan of a region may be drawn over the image at its scan position,
+ * the region for such scan is selected with the mouse.
+ * Mouse wheel zooms and right button drag pans the image. Zoomed out
+ * views are drawn from a pyramid of the channel, built as lines arrive,
+ * so only the visible part of one level is read.
+ */
+class ImagePanel : public wxPanel, public ImageListener {
+private:
+	AFMImage *m_image;
+	int m_channel;
+	wxImage m_view;				/* Backbuffer */
+	ColorMap m_colormap;
+	ImagePyramid m_pyramid;
+	int m_level;				/* Pyramid level drawn, 0 is the image */
+	std::vector<int> m_column;	/* Image column of every visible view column */
+	std::vector<int> m_levelColumn;	/* The same in level, relative to m_levelX0 */
+	int m_levelX0;
+	int m_colFrom;				/* First visible view column, relative to image */
+	double m_scale;				/* View pixels per image pixel */
+	double m_zoom;				/* Magnification of the fitted image */
+	double m_centerX;			/* Image point in the middle of panel */
+	double m_centerY;
+	int m_viewX;				/* Image placement in view, may be outside */
+	int m_viewY;
+	int m_viewW;
+	int m_viewH;
+	float m_min;				/* Color range */
+	float m_max;
+	int m_rows;					/* Image rows received */
+	int m_dirtyFrom;			/* Dirty view rows, m_dirtyFrom < m_dirtyTo */
+	int m_dirtyTo;
+	AFMImage *m_overlay;		/* Region scan drawn over the image */
+	int m_ovRows;				/* Overlay rows received */
+	std::vector<int> m_ovColumn;	/* Overlay column of every covered view column */
+	double m_ovLeft;			/* Overlay placement in view, relative to image */
+	double m_ovTop;
+	double m_ovScaleY;			/* View rows per overlay row */
+	int m_ovX0;					/* Covered view area, relative to image */
+	int m_ovY0;
+	int m_ovY1;
+	bool m_haveSel;
+	bool m_selecting;
+	int m_selX0;				/* Selection corners, in image pixels */
+	int m_selY0;
+	int m_selX1;
+	int m_selY1;
+	bool m_panning;
+	int m_panX;					/* Mouse position of the last pan step */
+	int m_panY;
+	void Place();
+	void PlaceOverlay();
+	void Clear();
+	void RenderRows(int y0, int y1);
+	void RenderView(int v0, int v1);
+	void RenderAll();
+	void MarkDirty(int from, int to);
+	void Redraw();
+	void DrawLine(AFMImage *image, int channel, int line, int first);
+	void OnPaint(wxPaintEvent& event);
+	void OnSize(wxSizeEvent& event);
+	void ViewToImage(int vx, int vy, int *x, int *y);
+	wxRect SelectionRect();
+	void RefreshSelection(wxRect old);
+	void OnMouseDown(wxMouseEvent& event);
+	void OnMouseMove(wxMouseEvent& event);
+	void OnMouseUp(wxMouseEvent& event);
+	void OnMouseWheel(wxMouseEvent& event);
+	void OnPanStart(wxMouseEvent& event);
+	void OnPanEnd(wxMouseEvent& event);
+	void OnCaptureLost(wxMouseCaptureLostEvent& event);
+	wxDECLARE_EVENT_TABLE();
+public:
+	ImagePanel(wxWindow *parent, int channel);
+	void Flush();
+	int SetColorMap(int type);
+	void Detach();
+	void ShowImage(AFMImage *image);
+	AFMImage *GetImage();
+	void SetOverlay(AFMImage *image);
+	int GetSelection(int *x0, int *y0, int *x1, int *y1);
+	virtual void OnImageStart(AFMImage *image);
+	virtual void OnImageLine(AFMImage *image, int channel, int line);
+	virtual void OnImageEnd(AFMImage *image);
+	virtual void OnImagePreview(AFMImage *image, int channel, int line);
+};
+
+
+#endif /* IMAGEPANEL_H_ */
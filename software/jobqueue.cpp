@@ -0,0 +1,518 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "jobqueue.h"
+#include "level.h"
+#include "gwy.h"
+#include "export.h"
+#include "archive.h"
+
+
+/* Finished images waiting for workers, per worker; acquisition waits
+ * when processing falls behind, so memory use stays bounded */
+#define JOB_QUEUE_DEPTH		2
+
+
+/* Processing thread, takes tasks until it gets one with negative index */
+class JobWorker : public wxThread {
+private:
+	wxMessageQueue<JobTask> *m_tasks;
+	wxMessageQueue<JobResult> *m_results;
+public:
+	JobWorker(wxMessageQueue<JobTask> *tasks, wxMessageQueue<JobResult> *results)
+		: wxThread(wxTHREAD_JOINABLE)
+	{
+		m_tasks = tasks;
+		m_results = results;
+	}
+
+	virtual ExitCode Entry()
+	{
+		JobTask task;
+		JobResult result;
+
+		while (m_tasks->Receive(task) == wxMSGQUEUE_NO_ERROR) {
+			if (task.index < 0) break;
+			result.index = task.index;
+			result.ok = jobProcess(&task);
+			m_results->Post(result);
+		}
+
+		return 0;
+	}
+};
+
+
+JobQueue::JobQueue(Device *device, int workers)
+{
+	m_device = device;
+	m_next = 0;
+	m_current = -1;
+	m_inFlight = 0;
+	m_stopped = true;
+
+	if (workers < 1) workers = 1;
+	m_maxInFlight = workers * JOB_QUEUE_DEPTH;
+
+	for (int i = 0; i < workers; i++) {
+		JobWorker *w = new JobWorker(&m_tasks, &m_results);
+		if (w->Run() != wxTHREAD_NO_ERROR) {
+			delete w;
+			continue;
+		}
+		m_workers.push_back(w);
+	}
+}
+
+/* Waits for images being processed */
+JobQueue::~JobQueue(void)
+{
+	JobTask stop;
+
+	Abort();
+
+	stop.index = -1;
+	stop.image = NULL;
+	for (size_t i = 0; i < m_workers.size(); i++) m_tasks.Post(stop);
+	for (size_t i = 0; i < m_workers.size(); i++) {
+		m_workers[i]->Wait();
+		delete m_workers[i];
+	}
+
+	for (size_t i = 0; i < m_images.size(); i++) delete m_images[i];
+	for (size_t i = 0; i < m_mosaics.size(); i++) delete m_mosaics[i];
+}
+
+int JobQueue::Add(const ScanJob& job)
+{
+	if (!job.res || !job.size || job.filename.empty()) return 0;
+	if ((job.format < 0) || (job.format > JOB_SAVE_ARCHIVE)) return 0;
+
+	m_jobs.push_back(job);
+	m_state.push_back(JOB_PENDING);
+	m_images.push_back(NULL);
+
+	return 1;
+}
+
+/* Grid of overlapping scans stitched into one image
+ * tile gives scan area of the first (top left) tile, level and output file.
+ * Stitched image is kept in a file next to the output while tiles arrive.
+ */
+int JobQueue::AddMosaic(const ScanJob& tile, int cols, int rows, double overlap)
+{
+	Mosaic *mosaic = new Mosaic();
+	ScanJob job = tile;
+
+	if ((job.format < 0) || (job.format > JOB_SAVE_ARCHIVE) ||
+			!mosaic->Create(tile.startX, tile.startY, tile.size, tile.res,
+			cols, rows, overlap, tile.filename + ".tmp")) {
+		delete mosaic;
+		return 0;
+	}
+	m_mosaics.push_back(mosaic);
+
+	job.mosaic = mosaic;
+	job.drift = DRIFT_OFF;
+	for (int i = 0; i < mosaic->GetTileCount(); i++) {
+		mosaic->GetTileArea(i, &job.startX, &job.startY);
+		job.tile = i;
+		Add(job);
+	}
+
+	return 1;
+}
+
+/* Level name from job file */
+static int parseLevel(const char *name, int *level, int *order)
+{
+	*level = JOB_LEVEL_NONE;
+	*order = 0;
+
+	if (!name[0] || !strcmp(name, "none")) {
+		return 1;
+	} else if (!strcmp(name, "mean")) {
+		*level = LEVEL_MEAN;
+	} else if (!strcmp(name, "median")) {
+		*level = LEVEL_MEDIAN;
+	} else if (!strncmp(name, "poly", 4)) {
+		*level = LEVEL_POLY;
+		*order = name[4] ? atoi(name + 4) : 1;
+		if ((*order < 0) || (*order > LEVEL_MAX_ORDER)) return 0;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Job file has one scan per line:
+ *   startX startY size res filename [none|mean|median|polyN]
+ * or a mosaic of cols x rows scans, with overlap as fraction of scan size:
+ *   mosaic startX startY size res cols rows overlap filename [level]
+ * Line "drift off|frame|line" sets drift correction of the following scans,
+ * tracked over consecutive scans of the same area.
+ * Coordinates are in nanometers, file name can not contain spaces,
+ * lines starting with '#' are ignored. Returns number of lines accepted.
+ */
+int JobQueue::LoadFile(std::string filename)
+{
+	FILE *f;
+	char line[512];
+	char name[256];
+	char level[32];
+	long x, y;
+	unsigned long size, res;
+	int cols, rows;
+	double overlap;
+	int drift = DRIFT_OFF;
+	int count = 0;
+
+	f = fopen(filename.c_str(), "r");
+	if (!f) return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		ScanJob job;
+		int n, mosaic;
+
+		if (line[0] == '#') continue;
+
+		if (sscanf(line, "drift %31s", level) == 1) {
+			if (!strcmp(level, "off")) drift = DRIFT_OFF;
+			else if (!strcmp(level, "frame")) drift = DRIFT_FRAME;
+			else if (!strcmp(level, "line")) drift = DRIFT_LINE;
+			continue;
+		}
+
+		level[0] = 0;
+		mosaic = !strncmp(line, "mosaic", 6);
+		if (mosaic) {
+			n = sscanf(line + 6, "%ld %ld %lu %lu %d %d %lf %255s %31s",
+					&x, &y, &size, &res, &cols, &rows, &overlap, name, level);
+			if (n < 8) continue;
+		} else {
+			n = sscanf(line, "%ld %ld %lu %lu %255s %31s", &x, &y, &size, &res, name, level);
+			if (n < 5) continue;
+		}
+		if ((size > 0xFFFF) || (res > 0xFFFF)) continue;
+
+		job.startX = x;
+		job.startY = y;
+		job.size = size;
+		job.res = res;
+		job.filename = name;
+		job.format = jobFormatFromName(job.filename);
+		job.mosaic = NULL;
+		job.tile = 0;
+		job.drift = drift;
+		job.frame = -1;
+		if (!parseLevel(level, &job.level, &job.levelOrder)) continue;
+
+		if (mosaic ? !AddMosaic(job, cols, rows, overlap) : !Add(job)) continue;
+		count++;
+	}
+
+	fclose(f);
+
+	return count;
+}
+
+int JobQueue::Start()
+{
+	if (m_workers.empty()) return 0;
+
+	m_stopped = false;
+	return 1;
+}
+
+/* Start acquisition of the next pending job */
+/* Large images are kept next to the job output instead of heap.
+ * Mosaic tiles share the output name, so the job index is part of it.
+ */
+static std::string jobSpillFile(ScanJob *job, int index, const char *kind)
+{
+	char suffix[32];
+
+	if (job->filename.empty()) return "";
+	snprintf(suffix, sizeof(suffix), ".%d.%s.tmp", index, kind);
+
+	return job->filename + suffix;
+}
+
+int JobQueue::StartNext()
+{
+	while (!m_stopped && (m_next < (int)m_jobs.size()) && (m_inFlight < m_maxInFlight)) {
+		int idx = m_next++;
+		ScanJob *job = &m_jobs[idx];
+		int dx = 0, dy = 0;
+
+		if (job->drift != DRIFT_OFF) {
+			if (!m_drift.Matches(job->startX, job->startY, job->size, job->res))
+				m_drift.Reset(job->startX, job->startY, job->size, job->res);
+			job->frame = m_drift.StartFrame(&dx, &dy);
+		}
+
+		if (!m_device->Run(job->startX + dx, job->startY + dy, job->size, job->res)) {
+			if (job->mosaic) PostTask(idx, NULL);
+			else m_state[idx] = JOB_FAILED;
+			continue;
+		}
+
+		m_images[idx] = new AFMImage();
+		m_images[idx]->SetSpillFile(jobSpillFile(job, idx, "scan"));
+		m_device->StartImage(m_images[idx]);
+		m_current = idx;
+		m_state[idx] = JOB_ACQUIRING;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Hand image to workers, with device properties read here,
+ * since workers never talk to the device */
+void JobQueue::PostTask(int idx, AFMImage *image)
+{
+	JobTask task;
+
+	task.index = idx;
+	task.job = m_jobs[idx];
+	task.image = image;
+	task.drift = (m_jobs[idx].drift != DRIFT_OFF) ? &m_drift : NULL;
+	task.haveAFM = m_device->GetAFMProp(&task.afmProp);
+	task.haveSTM = m_device->GetSTMProp(&task.stmProp);
+	task.fwVersion = m_device->GetFirmwareVersion();
+
+	m_state[idx] = JOB_PROCESSING;
+	m_inFlight++;
+	m_tasks.Post(task);
+}
+
+void JobQueue::FinishAcquisition(int ok)
+{
+	int idx = m_current;
+
+	m_current = -1;
+
+	if (ok && m_images[idx]->GetHeight()) {
+		PostTask(idx, m_images[idx]);
+	} else if (m_jobs[idx].mosaic) {
+		/* Mosaic still needs to know, its neighbours wait for this tile */
+		PostTask(idx, NULL);
+	} else {
+		m_state[idx] = JOB_FAILED;
+	}
+}
+
+/* Pick up worker results and free images nobody looks at anymore.
+ * Image of the most recently started scan is kept for the display.
+ */
+void JobQueue::CollectResults()
+{
+	JobResult result;
+	int newest = -1;
+
+	while (m_results.ReceiveTimeout(0, result) == wxMSGQUEUE_NO_ERROR) {
+		m_state[result.index] = result.ok ? JOB_DONE : JOB_FAILED;
+		m_inFlight--;
+	}
+
+	for (int i = 0; i < (int)m_images.size(); i++)
+		if (m_images[i] && m_images[i]->GetHeight()) newest = i;
+
+	for (int i = 0; i < newest; i++) {
+		if (!m_images[i]) continue;
+		if ((m_state[i] != JOB_DONE) && (m_state[i] != JOB_FAILED)) continue;
+		delete m_images[i];
+		m_images[i] = NULL;
+	}
+}
+
+/* Call periodically from GUI timer.
+ * Returns 0 when all jobs are finished.
+ */
+int JobQueue::Poll()
+{
+	bool done;
+	int ret;
+
+	if (m_current >= 0) {
+		ret = m_device->PollImage(&done);
+		if (!ret || done) {
+			FinishAcquisition(ret);
+			/* Next scan starts right away, before results are collected */
+			StartNext();
+		}
+	}
+
+	CollectResults();
+
+	if (m_current < 0) StartNext();
+
+	return (m_current >= 0) || (m_inFlight > 0) ||
+			(!m_stopped && (m_next < (int)m_jobs.size()));
+}
+
+/* Stop running scan, pending jobs are not started.
+ * Images already acquired are still saved.
+ */
+void JobQueue::Abort()
+{
+	if (m_current >= 0) {
+		m_device->AbortImage();
+		m_state[m_current] = JOB_FAILED;
+		m_current = -1;
+	}
+
+	m_stopped = true;
+}
+
+int JobQueue::GetCount()
+{
+	return m_jobs.size();
+}
+
+int JobQueue::GetState(int job)
+{
+	if ((job < 0) || (job >= (int)m_state.size())) return JOB_FAILED;
+
+	return m_state[job];
+}
+
+/* Job being acquired, -1 if none */
+int JobQueue::GetCurrent()
+{
+	return m_current;
+}
+
+int JobQueue::CountState(int state)
+{
+	int count = 0;
+
+	for (size_t i = 0; i < m_state.size(); i++)
+		if (m_state[i] == state) count++;
+
+	return count;
+}
+
+/* Image of the job while it is kept by the queue, NULL otherwise */
+AFMImage *JobQueue::GetImage(int job)
+{
+	if ((job < 0) || (job >= (int)m_images.size())) return NULL;
+
+	return m_images[job];
+}
+
+int jobFormatFromName(std::string filename)
+{
+	static const struct {
+		const char *ext;
+		int format;
+	} formats[] = {
+		{".gwy", JOB_SAVE_GWY},
+		{".tif", JOB_SAVE_TIFF},
+		{".tiff", JOB_SAVE_TIFF},
+		{".png", JOB_SAVE_PNG},
+		{".afa", JOB_SAVE_ARCHIVE}
+	};
+	size_t dot = filename.rfind('.');
+
+	if (dot == std::string::npos) return -1;
+
+	std::string ext = filename.substr(dot);
+	for (size_t i = 0; i < ext.size(); i++) ext[i] = tolower(ext[i]);
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+		if (ext == formats[i].ext) return formats[i].format;
+
+	return -1;
+}
+
+static int jobSave(AFMImage *image, JobTask *task)
+{
+	ScanJob *job = &task->job;
+
+	switch (job->format) {
+	case JOB_SAVE_GWY:
+		return gwyExport(image, job->filename,
+				task->haveAFM ? &task->afmProp : NULL,
+				task->haveSTM ? &task->stmProp : NULL,
+				task->fwVersion);
+	case JOB_SAVE_TIFF:
+		return exportTIFF(image, AFM_CHANNEL_TRACE, job->filename, EXPORT_MAP_AUTO);
+	case JOB_SAVE_PNG:
+		return exportPNG(image, AFM_CHANNEL_TRACE, job->filename, EXPORT_MAP_AUTO);
+	case JOB_SAVE_ARCHIVE:
+		return archiveWrite(image, job->filename);
+	}
+
+	return 0;
+}
+
+/* Level and save one image, runs on worker thread.
+ * Mosaic tiles are stitched instead, the last one saves the mosaic.
+ * Acquired image may still be drawn by GUI thread, so it is only read;
+ * leveling and line drift correction work on a copy.
+ */
+int jobProcess(JobTask *task)
+{
+	AFMImage *image = task->image;
+	AFMImage *copy = NULL;
+	ScanJob *job = &task->job;
+	int ret;
+
+	if (image && ((job->level != JOB_LEVEL_NONE) || (task->drift && (job->drift == DRIFT_LINE)))) {
+		copy = new AFMImage();
+		copy->SetSpillFile(jobSpillFile(job, task->index, "copy"));
+		image = copy->CopyFrom(image) ? copy : NULL;
+	}
+
+	/* Image which failed is dropped, mosaic tile is still reported as missing
+	 * and may be the one completing the mosaic */
+	if (image && (job->level != JOB_LEVEL_NONE)) {
+		for (int ch = 0; ch < image->GetChannels(); ch++) {
+			if (levelImage(image, ch, job->level, job->levelOrder)) continue;
+			image = NULL;
+			break;
+		}
+	}
+
+	if (image && task->drift) {
+		task->drift->AddFrame(job->frame, image, AFM_CHANNEL_TRACE);
+		if (job->drift == DRIFT_LINE) task->drift->CorrectLines(image);
+	}
+
+	if (!job->mosaic) {
+		ret = image ? jobSave(image, task) : 0;
+	} else {
+		ret = job->mosaic->AddTile(job->tile, image);
+		if (ret == MOSAIC_COMPLETE) {
+			ret = job->mosaic->Finish() && jobSave(job->mosaic->GetImage(), task) && image;
+		} else {
+			ret = (ret != MOSAIC_ERROR) && image;
+		}
+	}
+
+	delete copy;
+
+	return ret;
+}
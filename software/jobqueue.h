@@ -0,0 +1,110 @@
+#ifndef JOBQUEUE_H_
+#define JOBQUEUE_H_
+
+#include <wx/thread.h>
+#include <wx/msgqueue.h>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "image.h"
+#include "mosaic.h"
+#include "drift.h"
+
+/* Output formats, chosen by file name extension in job files */
+#define JOB_SAVE_GWY		0
+#define JOB_SAVE_TIFF		1
+#define JOB_SAVE_PNG		2
+#define JOB_SAVE_ARCHIVE	3
+
+/* No line leveling */
+#define JOB_LEVEL_NONE		-1
+
+/* Job states */
+#define JOB_PENDING			0
+#define JOB_ACQUIRING		1
+#define JOB_PROCESSING		2
+#define JOB_DONE			3
+#define JOB_FAILED			4
+
+struct ScanJob {
+	int32_t startX;				/* Scan area, as in struct afmRun */
+	int32_t startY;
+	uint16_t size;
+	uint16_t res;
+	int level;					/* LEVEL_* or JOB_LEVEL_NONE */
+	int levelOrder;				/* Polynomial order for LEVEL_POLY */
+	int format;					/* JOB_SAVE_* */
+	std::string filename;
+	Mosaic *mosaic;				/* Tile of mosaic, filename is mosaic output */
+	int tile;
+	int drift;					/* DRIFT_* */
+	int frame;					/* Drift tracker frame, set when started */
+};
+
+/* Acquired image handed over to worker threads */
+struct JobTask {
+	int index;					/* -1 stops the worker */
+	ScanJob job;
+	AFMImage *image;
+	DriftTracker *drift;		/* NULL if not tracked */
+	bool haveAFM;
+	bool haveSTM;
+	struct afmAFMProp afmProp;
+	struct afmSTMProp stmProp;
+	int fwVersion;
+};
+
+struct JobResult {
+	int index;
+	int ok;
+};
+
+class JobWorker;
+
+/* Runs scans back to back
+ * Acquisition is driven by Poll() from the GUI thread, so the device is only
+ * used from one thread. Finished images are leveled and saved by worker
+ * threads while the next scan is running.
+ */
+class JobQueue {
+private:
+	Device *m_device;
+	std::vector<ScanJob> m_jobs;
+	std::vector<int> m_state;
+	std::vector<AFMImage *> m_images;	/* Owned until processing is done */
+	std::vector<JobWorker *> m_workers;
+	std::vector<Mosaic *> m_mosaics;
+	DriftTracker m_drift;
+	wxMessageQueue<JobTask> m_tasks;
+	wxMessageQueue<JobResult> m_results;
+	int m_next;					/* Next job to start */
+	int m_current;				/* Job being acquired, -1 if none */
+	int m_inFlight;				/* Jobs handed to workers */
+	int m_maxInFlight;
+	bool m_stopped;
+	int StartNext();
+	void PostTask(int idx, AFMImage *image);
+	void FinishAcquisition(int ok);
+	void CollectResults();
+public:
+	JobQueue(Device *device, int workers = 1);
+	~JobQueue(void);
+	int Add(const ScanJob& job);
+	int AddMosaic(const ScanJob& tile, int cols, int rows, double overlap);
+	int LoadFile(std::string filename);
+	int Start();
+	int Poll();
+	void Abort();
+	int GetCount();
+	int GetState(int job);
+	int GetCurrent();
+	int CountState(int state);
+	AFMImage *GetImage(int job);
+};
+
+int jobFormatFromName(std::string filename);
+int jobProcess(JobTask *task);
+
+
+#endif /* JOBQUEUE_H_ */
@@ -0,0 +1,196 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "level.h"
+#include "simd.h"
+
+
+/***** Line leveling *****/
+
+LineLevel::LineLevel(int method, int order)
+{
+	if (order < 0) order = 0;
+	if (order > LEVEL_MAX_ORDER) order = LEVEL_MAX_ORDER;
+
+	m_method = method;
+	m_order = order;
+	m_width = 0;
+	m_basis = NULL;
+	m_scratch = NULL;
+}
+
+LineLevel::~LineLevel()
+{
+	free(m_basis);
+	free(m_scratch);
+}
+
+/* Scratch row for the median, and for LEVEL_POLY the polynomial basis,
+ * orthonormal over the line pixels. Least squares fit then reduces to
+ * dot products with basis rows.
+ */
+int LineLevel::Prepare(int width)
+{
+	double *q, d;
+	int i, j, k, count;
+
+	if (width == m_width) return 1;
+
+	free(m_basis);
+	free(m_scratch);
+	m_basis = NULL;
+	m_scratch = NULL;
+	m_width = 0;
+
+	m_scratch = (float *)malloc(sizeof(float) * width);
+	if (!m_scratch) return 0;
+	if (m_method != LEVEL_POLY) {
+		m_width = width;
+		return 1;
+	}
+
+	count = m_order + 1;
+	m_basis = (float *)malloc(sizeof(float) * count * width);
+	q = (double *)malloc(sizeof(double) * count * width);
+	if (!m_basis || !q) {
+		free(q);
+		return 0;
+	}
+
+	/* Gram-Schmidt over monomials of x in [-1, 1] */
+	for (k = 0; k < count; k++) {
+		double *qk = q + k * width;
+
+		for (i = 0; i < width; i++) {
+			double x = (width > 1) ? (2.0 * i / (width - 1) - 1.0) : 0;
+			qk[i] = pow(x, k);
+		}
+		for (j = 0; j < k; j++) {
+			double *qj = q + j * width;
+			for (d = 0, i = 0; i < width; i++) d += qk[i] * qj[i];
+			for (i = 0; i < width; i++) qk[i] -= d * qj[i];
+		}
+		for (d = 0, i = 0; i < width; i++) d += qk[i] * qk[i];
+		d = (d > 0) ? 1.0 / sqrt(d) : 0;
+		for (i = 0; i < width; i++) {
+			qk[i] *= d;
+			m_basis[k * width + i] = qk[i];
+		}
+	}
+
+	free(q);
+	m_width = width;
+
+	return 1;
+}
+
+int LineLevel::Level(float *row, int width)
+{
+	int k;
+
+	if (width <= 0) return 0;
+
+	switch (m_method) {
+	case LEVEL_MEAN:
+		vecAddConst(row, -vecSum(row, width) / width, width);
+		break;
+
+	case LEVEL_MEDIAN:
+		if (!Prepare(width)) return 0;
+		memcpy(m_scratch, row, sizeof(float) * width);
+		std::nth_element(m_scratch, m_scratch + width / 2, m_scratch + width);
+		vecAddConst(row, -m_scratch[width / 2], width);
+		break;
+
+	case LEVEL_POLY:
+		if (!Prepare(width)) return 0;
+		/* Basis is orthonormal, so projections can be removed one by one */
+		for (k = 0; k <= m_order; k++) {
+			const float *q = m_basis + k * width;
+			vecAxpy(row, -vecDot(row, q, width), q, width);
+		}
+		break;
+
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Level all lines of image channel in place, tile by tile */
+int levelImage(AFMImage *image, int channel, int method, int order)
+{
+	int width = image->GetWidth();
+	int ret = 1;
+
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+
+	#pragma omp parallel reduction(&:ret)
+	{
+		LineLevel level(method, order);
+
+		for (int tile = 0; tile < image->GetTileCount(); tile++) {
+			int y0, y1;
+
+			image->GetTileBounds(tile, &y0, &y1);
+
+			#pragma omp single nowait
+			image->PrefetchTile(channel, tile + 1);
+
+			#pragma omp for schedule(static)
+			for (int y = y0; y < y1; y++) {
+				if (!level.Level(image->GetRow(channel, y), width)) ret = 0;
+			}
+
+			#pragma omp single nowait
+			image->ReleaseTile(channel, tile);
+		}
+	}
+
+	return ret;
+}
+
+/***** Live leveling *****/
+
+LineLeveler::LineLeveler(AFMImage *preview, int method, int order)
+	: m_level(method, order)
+{
+	m_preview = preview;
+}
+
+void LineLeveler::OnImageStart(AFMImage *image)
+{
+	m_preview->Create(image->GetWidth(), image->GetHeight(), image->GetChannels());
+	m_preview->CopyGeometry(image);
+}
+
+void LineLeveler::OnImageLine(AFMImage *image, int channel, int line)
+{
+	float *src = image->GetRow(channel, line);
+	float *dst = m_preview->GetRow(channel, line);
+
+	if (!src || !dst) return;
+
+	memcpy(dst, src, sizeof(float) * image->GetWidth());
+	m_level.Level(dst, image->GetWidth());
+}
@@ -0,0 +1,44 @@
+#ifndef LEVEL_H_
+#define LEVEL_H_
+
+#include "image.h"
+
+/* Line leveling methods */
+#define LEVEL_MEAN			0	/* Subtract line mean */
+#define LEVEL_MEDIAN		1	/* Subtract line median */
+#define LEVEL_POLY			2	/* Subtract least squares polynomial */
+
+#define LEVEL_MAX_ORDER		5
+
+/* Per-line leveling kernel
+ * Keeps polynomial basis and scratch buffer between lines of the same width.
+ */
+class LineLevel {
+private:
+	int m_method;
+	int m_order;
+	int m_width;
+	float *m_basis;
+	float *m_scratch;
+	int Prepare(int width);
+public:
+	LineLevel(int method, int order);
+	~LineLevel(void);
+	int Level(float *row, int width);
+};
+
+int levelImage(AFMImage *image, int channel, int method, int order);
+
+/* Keeps leveled copy of the image while it is being acquired */
+class LineLeveler : public ImageListener {
+private:
+	AFMImage *m_preview;
+	LineLevel m_level;
+public:
+	LineLeveler(AFMImage *preview, int method, int order);
+	virtual void OnImageStart(AFMImage *image);
+	virtual void OnImageLine(AFMImage *image, int channel, int line);
+};
+
+
+#endif /* LEVEL_H_ */
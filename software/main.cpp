@@ -17,15 +17,45 @@
 
 #include <wx/wx.h>
 #include <wx/intl.h>
-#include <wx/progdlg.h>
+#include <wx/filename.h>
 
 #include "device.h"
 #include "image.h"
 #include "dfu.h"
+#include "gwy.h"
+#include "export.h"
+#include "imagepanel.h"
+#include "scopepanel.h"
+#include "jobqueue.h"
+#include "movie.h"
+#include "roi.h"
+#include "stats.h"
+#include "scar.h"
 
 
 #define UPDATE_TIMER_CONNECTED		500
 #define UPDATE_TIMER_DISCONNECTED	2000
+#define SCAN_TIMER					50
+#define SCOPE_TIMER					50
+
+/* Pixels of region scan */
+#define ZOOM_RES					100
+
+/* Adaptive scan: coarse line step and height difference
+ * which makes lines between two scanned ones to be scanned */
+#define ADAPTIVE_STEP				8
+#define ADAPTIVE_THRESHOLD			256
+
+/* Scar removal: lines compared with their neighbours, and deviation
+ * which is repaired, in robust line noise */
+#define SCAR_WINDOW					5
+#define SCAR_THRESHOLD				6.0f
+
+/* Frames kept in movie mode */
+#define MOVIE_FRAMES				16
+
+/* Control loop periods per telemetry sample */
+#define SCOPE_DECIMATION			1
 
 
 class MyApp: public wxApp
@@ -45,31 +75,87 @@ class MainFrame: public wxFrame
 {
 public:
     MainFrame(const wxString& title, const wxPoint& pos, const wxSize& size);
+    ~MainFrame();
     void UpdateAFMState();
 private:
     wxTimer *tmrUpdate;
+    wxTimer *tmrScan;
+    wxTimer *tmrScope;
+    AFMImage *scanImage;
+    AFMImage *overviewImage;	/* Shown under region scans */
+    StatsCollector *scanStats;	/* Roughness of the scan, shown when it ends */
+    ScarRemover *scars;			/* First listener of the device, others listen to it */
+    wxCheckBox *cbScars;
+    JobQueue *jobs;
+    wxTimer *tmrJobs;
+    wxButton *btnJobs;
+    FrameRing *movie;
+    unsigned int movieShown;	/* Frames completed when view was updated */
+    wxTimer *tmrMovie;
+    wxButton *btnMovie;
+    wxCheckBox *cbDiff;
+    ImagePanel *imagePanel;
+    ScopePanel *scopePanel;
+    wxCheckBox *cbScope;
     wxStaticText *stMicroType;
     wxStaticText *stHeightControl;
     wxStaticText *stHeightValue;
     wxButton *btnStart;
+    wxButton *btnZoom;
+    wxCheckBox *cbAdaptive;
     void OnExit(wxCommandEvent& event);
     void OnAbout(wxCommandEvent& event);
     void OnRun(wxCommandEvent& event);
+    void OnZoom(wxCommandEvent& event);
+    int StartScan(int32_t startX, int32_t startY, uint16_t size, uint16_t res);
     void OnUpdateTimer(wxTimerEvent& evt);
+    void OnScanTimer(wxTimerEvent& evt);
+    void OnJobs(wxCommandEvent& event);
+    void OnJobsTimer(wxTimerEvent& evt);
+    void StopJobs();
+    void OnMovie(wxCommandEvent& event);
+    void OnMovieTimer(wxTimerEvent& evt);
+    void OnDiff(wxCommandEvent& event);
+    void OnScars(wxCommandEvent& event);
+    void StopMovie();
+    void OnScope(wxCommandEvent& event);
+    void OnScopeTimer(wxTimerEvent& evt);
+    void StopScan();
+    void SaveImage();
     wxDECLARE_EVENT_TABLE();
 };
 
 enum
 {
     ID_Run = 1,
-    ID_UpdateTimer
+    ID_UpdateTimer,
+    ID_ScanTimer,
+    ID_Scope,
+    ID_ScopeTimer,
+    ID_Jobs,
+    ID_JobsTimer,
+    ID_Movie,
+    ID_MovieTimer,
+    ID_Diff,
+    ID_Scars,
+    ID_Zoom
 };
 
 wxBEGIN_EVENT_TABLE(MainFrame, wxFrame)
     EVT_MENU(wxID_EXIT,  MainFrame::OnExit)
     EVT_MENU(wxID_ABOUT, MainFrame::OnAbout)
     EVT_COMMAND(ID_Run, wxEVT_COMMAND_BUTTON_CLICKED, MainFrame::OnRun)
+    EVT_COMMAND(ID_Zoom, wxEVT_COMMAND_BUTTON_CLICKED, MainFrame::OnZoom)
     EVT_TIMER(ID_UpdateTimer, MainFrame::OnUpdateTimer)
+    EVT_TIMER(ID_ScanTimer, MainFrame::OnScanTimer)
+    EVT_COMMAND(ID_Jobs, wxEVT_COMMAND_BUTTON_CLICKED, MainFrame::OnJobs)
+    EVT_TIMER(ID_JobsTimer, MainFrame::OnJobsTimer)
+    EVT_COMMAND(ID_Movie, wxEVT_COMMAND_BUTTON_CLICKED, MainFrame::OnMovie)
+    EVT_TIMER(ID_MovieTimer, MainFrame::OnMovieTimer)
+    EVT_CHECKBOX(ID_Diff, MainFrame::OnDiff)
+    EVT_CHECKBOX(ID_Scars, MainFrame::OnScars)
+    EVT_CHECKBOX(ID_Scope, MainFrame::OnScope)
+    EVT_TIMER(ID_ScopeTimer, MainFrame::OnScopeTimer)
 wxEND_EVENT_TABLE()
 
 wxIMPLEMENT_APP(MyApp);
@@ -99,7 +185,7 @@ bool MyApp::OnInit()
 
     MainFrame *frame = new MainFrame(_("AFM Control"),
     		wxPoint(50, 50),
-    		wxSize(450, 340) );
+    		wxSize(640, 720) );
     frame->Show( true );
 
     return true;
@@ -152,7 +238,8 @@ MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& si
 
     /* Status bar */
 
-    CreateStatusBar();
+    /* Second field shows roughness of the last scan */
+    CreateStatusBar(2);
    	SetStatusText("");
 
    	/* Status controls */
@@ -195,22 +282,89 @@ MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& si
    	wxStaticBoxSizer *scanBox = new wxStaticBoxSizer(wxVERTICAL, panel, _("Scan"));
    	btnStart = new wxButton(panel, ID_Run, _("Start"));
    	scanBox->Add(btnStart, 0, 0);
+   	btnZoom = new wxButton(panel, ID_Zoom, _("Zoom"));
+   	scanBox->Add(btnZoom, 0, wxTOP, 5);
+   	cbAdaptive = new wxCheckBox(scanBox->GetStaticBox(), wxID_ANY, _("Adaptive"));
+   	scanBox->Add(cbAdaptive, 0, wxTOP, 5);
+   	cbScars = new wxCheckBox(scanBox->GetStaticBox(), ID_Scars, _("Remove scars"));
+   	scanBox->Add(cbScars, 0, wxTOP, 5);
+   	btnJobs = new wxButton(panel, ID_Jobs, _("Jobs..."));
+   	scanBox->Add(btnJobs, 0, wxTOP, 5);
+   	btnMovie = new wxButton(panel, ID_Movie, _("Movie"));
+   	scanBox->Add(btnMovie, 0, wxTOP, 5);
+   	cbDiff = new wxCheckBox(scanBox->GetStaticBox(), ID_Diff, _("Difference"));
+   	scanBox->Add(cbDiff, 0, wxTOP, 5);
 
    	cols->Add(scanBox, 0, wxALL, 5);
 
-   	panel->SetSizer(cols);
+   	/* Z loop TextBox */
+   	wxStaticBoxSizer *loopBox = new wxStaticBoxSizer(wxVERTICAL, panel, _("Z loop"));
+   	cbScope = new wxCheckBox(loopBox->GetStaticBox(), ID_Scope, _("Scope"));
+   	loopBox->Add(cbScope, 0, 0);
+
+   	cols->Add(loopBox, 0, wxALL, 5);
+
+   	/* Live image view */
+   	wxBoxSizer *rows = new wxBoxSizer(wxVERTICAL);
+   	imagePanel = new ImagePanel(panel, AFM_CHANNEL_TRACE);
+   	rows->Add(cols, 0, 0);
+   	rows->Add(imagePanel, 1, wxEXPAND | wxALL, 5);
+   	scopePanel = new ScopePanel(panel);
+   	scopePanel->SetMinSize(wxSize(-1, 120));
+   	scopePanel->Hide();
+   	rows->Add(scopePanel, 0, wxEXPAND | wxALL, 5);
+
+   	panel->SetSizer(rows);
 
    	/* Update status */
    	tmrUpdate = new wxTimer(this, ID_UpdateTimer);
+   	tmrScan = new wxTimer(this, ID_ScanTimer);
+   	tmrScope = new wxTimer(this, ID_ScopeTimer);
+   	tmrJobs = new wxTimer(this, ID_JobsTimer);
+   	tmrMovie = new wxTimer(this, ID_MovieTimer);
+   	scanImage = NULL;
+   	overviewImage = NULL;
+   	scanStats = new StatsCollector();
+   	scars = new ScarRemover(NULL, SCAR_WINDOW, SCAR_THRESHOLD);
+   	scars->SetEnabled(false);
+   	wxGetApp().afm->AddListener(scars);
+   	jobs = NULL;
+   	movie = new FrameRing();
+   	movieShown = 0;
    	UpdateAFMState();
 }
 
+/* Images still being processed by jobs are saved before exit */
+MainFrame::~MainFrame()
+{
+	tmrJobs->Stop();
+	tmrScan->Stop();
+	if (tmrMovie->IsRunning()) {
+		tmrMovie->Stop();
+		wxGetApp().afm->AbortImage();
+	}
+	imagePanel->Detach();
+	delete jobs;
+	delete scanImage;
+	delete overviewImage;
+	wxGetApp().afm->RemoveListener(scars);
+	delete scars;
+	delete scanStats;
+	delete movie;
+}
+
 void MainFrame::UpdateAFMState()
 {
 	Device *afm;
 
 	afm = wxGetApp().afm;
 
+	/* Status is left alone while image is received */
+	if (tmrScan->IsRunning() || tmrJobs->IsRunning() || tmrMovie->IsRunning()) {
+		tmrUpdate->StartOnce(UPDATE_TIMER_CONNECTED);
+		return;
+	}
+
 	if (!afm->IsConnected())
 		afm->Connect();
 
@@ -245,42 +399,380 @@ void MainFrame::OnAbout(wxCommandEvent& event)
 void MainFrame::OnRun(wxCommandEvent& event)
 {
 	Device *afm;
-	AFMImage *image;
 
-	/* Start scanning */
 	afm = wxGetApp().afm;
-	if (!afm->Run(0, 0, 100, 100)) {
+
+	if (tmrScan->IsRunning()) {
+		/* Stop button pressed, keep what is received so far */
+		afm->AbortImage();
+		StopScan();
+		SaveImage();
+		return;
+	}
+	if (tmrMovie->IsRunning()) return;
+
+	/* Previous images are kept on screen until the new one starts */
+	imagePanel->Detach();
+	delete overviewImage;
+	overviewImage = NULL;
+	delete scanImage;
+	scanImage = NULL;
+
+	StartScan(0, 0, 100, 100);
+}
+
+/* Scan the area selected on the image; the image it was selected on
+ * stays as overview, with region scans drawn over it */
+void MainFrame::OnZoom(wxCommandEvent& event)
+{
+	AFMImage *base;
+	struct afmRun run;
+	int x0, y0, x1, y1;
+
+	if (tmrScan->IsRunning() || tmrJobs->IsRunning() || tmrMovie->IsRunning()) return;
+
+	/* Selection is on the image shown, which may be from jobs or movie */
+	base = imagePanel->GetImage();
+	if (!base || ((base != overviewImage) && (base != scanImage)) ||
+			!imagePanel->GetSelection(&x0, &y0, &x1, &y1) ||
+			!roiToRun(base, x0, y0, x1, y1, ZOOM_RES, &run)) {
+		wxMessageBox( _("Select an area on the scanned image first."),
+				_("Scanning"), wxOK | wxICON_INFORMATION);
+		return;
+	}
+
+	/* Previous region scan is replaced */
+	imagePanel->SetOverlay(NULL);
+	if (scanImage != base) delete scanImage;
+	if (overviewImage != base) delete overviewImage;
+	overviewImage = base;
+	scanImage = NULL;
+
+	if (StartScan(run.startX, run.startY, run.size, run.res))
+		imagePanel->SetOverlay(scanImage);
+}
+
+/* Large scans are kept in temporary directory instead of heap */
+static std::string tempSpillFile(const char *kind)
+{
+	wxString name = wxString::Format("afm-%lu-%s.tmp", wxGetProcessId(), kind);
+
+	return wxFileName(wxFileName::GetTempDir(), name).GetFullPath().ToStdString();
+}
+
+/* Start scanning into a new scanImage */
+int MainFrame::StartScan(int32_t startX, int32_t startY, uint16_t size, uint16_t res)
+{
+	Device *afm;
+	int ret;
+
+	afm = wxGetApp().afm;
+
+	if (cbAdaptive->GetValue())
+		ret = afm->RunAdaptive(startX, startY, size, res, ADAPTIVE_STEP, ADAPTIVE_THRESHOLD);
+	else
+		ret = afm->Run(startX, startY, size, res);
+	if (!ret) {
 		wxMessageBox( _("Failed to start a scan. Check parameters and try again."),
 				_("Scanning"), wxOK | wxICON_ERROR);
+		return 0;
+	}
+
+	scanImage = new AFMImage();
+	scanImage->SetSpillFile(tempSpillFile("scan"));
+
+	/* Lines are drawn as they arrive */
+	scars->AddListener(scanStats);
+	scars->AddListener(imagePanel);
+	afm->StartImage(scanImage);
+	tmrScan->Start(SCAN_TIMER);
+
+	btnStart->SetLabel(_("Stop"));
+	btnZoom->Disable();
+	SetStatusText(_("Scanning"));
+
+	return 1;
+}
+
+void MainFrame::OnScanTimer(wxTimerEvent& evt)
+{
+	Device *afm;
+	bool done;
+	int ret;
+
+	afm = wxGetApp().afm;
+	ret = afm->PollImage(&done);
+	imagePanel->Flush();
+	scopePanel->Flush();
+
+	if (ret && !done) return;
+
+	StopScan();
+	if (!ret) {
+		wxMessageBox( _("Failed to retrieve scan image."),
+				_("Scanning"), wxOK | wxICON_ERROR);
 		return;
 	}
 
-	/* Create image object */
-	image = new AFMImage();
+	SaveImage();
+}
 
-	wxProgressDialog progress( _("Scanning"), _("Retrieving image data") );
-	do {
-		/* Read image from the device */
-		if (!afm->ReadImage(image, NULL)) {
-			wxMessageBox( _("Failed to retrieve scan image."),
-					_("Scanning"), wxOK | wxICON_ERROR);
-			break;
+/* Run scans listed in job file, or stop running jobs */
+void MainFrame::OnJobs(wxCommandEvent& event)
+{
+	Device *afm;
+
+	afm = wxGetApp().afm;
+
+	if (tmrJobs->IsRunning()) {
+		jobs->Abort();
+		return;
+	}
+	if (tmrScan->IsRunning() || tmrMovie->IsRunning()) return;
+
+	wxFileDialog openFile(NULL, _("Open job file"), "", "",
+			"Job files (*.txt)|*.txt|All files (*.*)|*.*", wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+
+	if (openFile.ShowModal() == wxID_CANCEL) return;
+
+	imagePanel->Detach();
+	delete jobs;
+	jobs = new JobQueue(afm, wxThread::GetCPUCount() > 2 ? 2 : 1);
+
+	if (!jobs->LoadFile(openFile.GetPath().ToStdString()) || !jobs->Start()) {
+		wxMessageBox( _("Job file contains no valid jobs."),
+				_("Jobs"), wxOK | wxICON_ERROR);
+		delete jobs;
+		jobs = NULL;
+		return;
+	}
+
+	scars->AddListener(imagePanel);
+	tmrJobs->Start(SCAN_TIMER);
+	btnStart->Disable();
+	btnJobs->SetLabel(_("Stop jobs"));
+}
+
+void MainFrame::OnJobsTimer(wxTimerEvent& evt)
+{
+	int busy;
+
+	busy = jobs->Poll();
+	imagePanel->Flush();
+	scopePanel->Flush();
+
+	SetStatusText(wxString::Format(_("Job %d of %d, %d saved, %d failed"),
+			jobs->GetCurrent() + 1, jobs->GetCount(),
+			jobs->CountState(JOB_DONE), jobs->CountState(JOB_FAILED)));
+
+	if (!busy) StopJobs();
+}
+
+void MainFrame::StopJobs()
+{
+	tmrJobs->Stop();
+	scars->RemoveListener(imagePanel);
+	imagePanel->Flush();
+
+	btnStart->Enable();
+	btnJobs->SetLabel(_("Jobs..."));
+
+	wxMessageBox(wxString::Format(_("%d of %d scans saved."),
+			jobs->CountState(JOB_DONE), jobs->GetCount()),
+			_("Jobs"), wxOK | wxICON_INFORMATION);
+	SetStatusText(_("Connected"));
+}
+
+/* Scan the same area continuously, or stop it */
+void MainFrame::OnMovie(wxCommandEvent& event)
+{
+	Device *afm;
+
+	afm = wxGetApp().afm;
+
+	if (tmrMovie->IsRunning()) {
+		afm->AbortImage();
+		StopMovie();
+		return;
+	}
+	if (tmrScan->IsRunning() || tmrJobs->IsRunning()) return;
+
+	/* All frame buffers are allocated before the first frame */
+	imagePanel->Detach();
+	if (!movie->Create(MOVIE_FRAMES, 100, tempSpillFile("movie")) || !afm->RunMovie(0, 0, 100, 100, 0)) {
+		wxMessageBox( _("Failed to start a scan. Check parameters and try again."),
+				_("Scanning"), wxOK | wxICON_ERROR);
+		return;
+	}
+
+	if (!cbDiff->IsChecked()) scars->AddListener(imagePanel);
+	afm->StartMovie(movie);
+	movieShown = 0;
+	tmrMovie->Start(SCAN_TIMER);
+
+	btnStart->Disable();
+	btnJobs->Disable();
+	btnMovie->SetLabel(_("Stop movie"));
+	SetStatusText(_("Scanning"));
+}
+
+void MainFrame::OnMovieTimer(wxTimerEvent& evt)
+{
+	Device *afm;
+	bool done;
+	int ret;
+
+	afm = wxGetApp().afm;
+	ret = afm->PollImage(&done);
+
+	/* Difference view changes once per frame */
+	if (cbDiff->IsChecked() && (movie->GetTotal() != movieShown)) {
+		AFMImage *diff = movie->GetDifference(0, AFM_CHANNEL_TRACE);
+		if (diff) imagePanel->ShowImage(diff);
+	}
+	movieShown = movie->GetTotal();
+
+	imagePanel->Flush();
+	scopePanel->Flush();
+	SetStatusText(wxString::Format(_("Movie frame %u"), movie->GetTotal() + 1));
+
+	if (ret && !done) return;
+
+	StopMovie();
+	if (!ret) {
+		wxMessageBox( _("Failed to retrieve scan image."),
+				_("Scanning"), wxOK | wxICON_ERROR);
+	}
+}
+
+/* Switch live view between frames and their difference */
+void MainFrame::OnDiff(wxCommandEvent& event)
+{
+	AFMImage *image;
+
+	if (!tmrMovie->IsRunning()) return;
+
+	imagePanel->Detach();
+	if (cbDiff->IsChecked()) {
+		scars->RemoveListener(imagePanel);
+		image = movie->GetDifference(0, AFM_CHANNEL_TRACE);
+	} else {
+		/* Live frame is drawn again from its next start */
+		scars->AddListener(imagePanel);
+		image = movie->GetFrame(0);
+	}
+	if (image) imagePanel->ShowImage(image);
+}
+
+/* Scans and jobs get repaired images from the next image on */
+void MainFrame::OnScars(wxCommandEvent& event)
+{
+	scars->SetEnabled(cbScars->IsChecked());
+}
+
+void MainFrame::StopMovie()
+{
+	tmrMovie->Stop();
+	scars->RemoveListener(imagePanel);
+	imagePanel->Flush();
+
+	btnStart->Enable();
+	btnJobs->Enable();
+	btnMovie->SetLabel(_("Movie"));
+	SetStatusText(_("Connected"));
+}
+
+void MainFrame::OnScope(wxCommandEvent& event)
+{
+	Device *afm;
+
+	afm = wxGetApp().afm;
+
+	if (cbScope->IsChecked()) {
+		if (!afm->SetTelemetry(SCOPE_DECIMATION)) {
+			cbScope->SetValue(false);
+			return;
 		}
+		afm->SetTelemetryListener(scopePanel);
+		scopePanel->Show();
+		tmrScope->Start(SCOPE_TIMER);
+	} else {
+		afm->SetTelemetry(0);
+		afm->SetTelemetryListener(NULL);
+		scopePanel->Hide();
+		tmrScope->Stop();
+	}
 
-		/* Hide progress dialog */
-		progress.Update(100);
+	scopePanel->GetParent()->Layout();
+}
 
-		/* Save file dialog */
-		wxFileDialog saveFile(NULL, _("Save image"), "", "",
-				"Gwyddion Simple Field (*.gsf)|*.gsf", wxFD_SAVE);
+void MainFrame::OnScopeTimer(wxTimerEvent& evt)
+{
+	/* Data is read by scan timers while scanning */
+	if (!tmrScan->IsRunning() && !tmrJobs->IsRunning() && !tmrMovie->IsRunning())
+		wxGetApp().afm->PollData();
 
-		if (saveFile.ShowModal() == wxID_CANCEL) break;
+	scopePanel->Flush();
+}
 
-		/* Save image to file */
-		image->SaveAsGSF(saveFile.GetFilename().ToStdString());
-	} while (0);
+void MainFrame::StopScan()
+{
+	SurfaceStats *trace = scanStats->GetStats(AFM_CHANNEL_TRACE);
+
+	tmrScan->Stop();
+	scars->RemoveListener(imagePanel);
+	scars->RemoveListener(scanStats);
+	imagePanel->Flush();
+
+	btnStart->SetLabel(_("Start"));
+	btnZoom->Enable();
+	SetStatusText(_("Connected"));
+	if (trace->GetCount() > 0)
+		SetStatusText(wxString::Format(_("Ra %.1f, Rq %.1f"), trace->GetRa(), trace->GetRq()), 1);
+	else
+		SetStatusText("", 1);
+}
+
+void MainFrame::SaveImage()
+{
+	Device *afm;
+	AFMImage *image = scanImage;
 
-	delete image;
+	afm = wxGetApp().afm;
+	if (!image || !image->GetHeight()) return;
+
+	/* Save file dialog */
+	wxFileDialog saveFile(NULL, _("Save image"), "", "",
+			"Gwyddion native (*.gwy)|*.gwy|Gwyddion Simple Field (*.gsf)|*.gsf|"
+			"16-bit TIFF (*.tif)|*.tif|16-bit PNG (*.png)|*.png", wxFD_SAVE);
+
+	if (saveFile.ShowModal() == wxID_CANCEL) return;
+
+	/* Save image to file */
+	if (saveFile.GetFilterIndex() == 0) {
+		struct afmAFMProp afmProp;
+		struct afmSTMProp stmProp;
+		bool haveAFM = afm->GetAFMProp(&afmProp);
+		bool haveSTM = afm->GetSTMProp(&stmProp);
+
+		if (!gwyExport(image, saveFile.GetPath().ToStdString(),
+				haveAFM ? &afmProp : NULL, haveSTM ? &stmProp : NULL,
+				afm->GetFirmwareVersion())) {
+			wxMessageBox( _("Failed to save image."),
+					_("Scanning"), wxOK | wxICON_ERROR);
+		}
+	} else if (saveFile.GetFilterIndex() == 1) {
+		image->SaveAsGSF(saveFile.GetFilename().ToStdString());
+	} else {
+		std::string path = saveFile.GetPath().ToStdString();
+		int ok = (saveFile.GetFilterIndex() == 2) ?
+				exportTIFF(image, AFM_CHANNEL_TRACE, path, EXPORT_MAP_AUTO) :
+				exportPNG(image, AFM_CHANNEL_TRACE, path, EXPORT_MAP_AUTO);
+		if (!ok) {
+			wxMessageBox( _("Failed to save image."),
+					_("Scanning"), wxOK | wxICON_ERROR);
+		}
+	}
 }
 
 void MainFrame::OnUpdateTimer(wxTimerEvent& evt)
@@ -0,0 +1,521 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+#include "mosaic.h"
+#include "fft.h"
+
+
+/* Tile states */
+#define TILE_WAITING		0
+#define TILE_ARRIVED		1
+#define TILE_PLACED			2
+#define TILE_MISSING		3	/* Scan failed, area stays empty */
+
+/* Strip sides */
+#define SIDE_LEFT			0
+#define SIDE_TOP			1
+#define SIDE_RIGHT			2
+#define SIDE_BOTTOM			3
+
+#define MOSAIC_MIN_OVERLAP	8
+
+
+Mosaic::Mosaic(void)
+	: m_changed(m_lock)
+{
+	m_startX = 0;
+	m_startY = 0;
+	m_tileSize = 0;
+	m_res = 0;
+	m_cols = 0;
+	m_rows = 0;
+	m_step = 0;
+	m_overlap = 0;
+	m_margin = 0;
+	m_output = NULL;
+	m_result = NULL;
+	m_done = 0;
+}
+
+Mosaic::~Mosaic(void)
+{
+	Free();
+}
+
+void Mosaic::Free()
+{
+	for (size_t i = 0; i < m_tiles.size(); i++)
+		for (int s = 0; s < 4; s++) delete m_tiles[i].strip[s];
+	m_tiles.clear();
+
+	delete m_output;
+	m_output = NULL;
+	delete m_result;
+	m_result = NULL;
+
+	/* Backing files are scratch space */
+	if (!m_backingFile.empty()) {
+		remove(m_backingFile.c_str());
+		remove((m_backingFile + MOSAIC_RESULT_SUFFIX).c_str());
+	}
+	m_backingFile.clear();
+}
+
+/* cols x rows tiles of tileSize nanometers and res pixels,
+ * neighbours overlap by given fraction of tile size (0..0.5] */
+int Mosaic::Create(int32_t startX, int32_t startY, uint16_t tileSize, uint16_t res,
+		int cols, int rows, double overlap, std::string backingFile)
+{
+	int width, height;
+
+	Free();
+
+	if ((cols < 1) || (rows < 1) || !tileSize || !res) return 0;
+	if ((overlap <= 0) || (overlap > 0.5)) return 0;
+
+	m_startX = startX;
+	m_startY = startY;
+	m_tileSize = tileSize;
+	m_res = res;
+	m_cols = cols;
+	m_rows = rows;
+	m_overlap = (int)(res * overlap + 0.5);
+	if (m_overlap < MOSAIC_MIN_OVERLAP) return 0;
+	m_step = res - m_overlap;
+	m_margin = m_overlap / 2;
+	m_done = 0;
+
+	width = 2 * m_margin + (cols - 1) * m_step + res;
+	height = 2 * m_margin + (rows - 1) * m_step + res;
+	if ((width > 0xFFFF) || (height > 0xFFFF)) return 0;
+
+	m_output = new AFMImage();
+	if (!backingFile.empty()) {
+		m_output->SetBackingFile(backingFile);
+		m_backingFile = backingFile;
+	}
+	if (!m_output->Create(width, height, 2)) {
+		delete m_output;
+		m_output = NULL;
+		return 0;
+	}
+	double pitch = (double)tileSize / res;
+	m_output->SetGeometry(startX - (int32_t)floor(m_margin * pitch + 0.5),
+			startY - (int32_t)floor(m_margin * pitch + 0.5), 0);
+	m_output->SetExtent((uint32_t)floor(width * pitch + 0.5), (uint32_t)floor(height * pitch + 0.5));
+
+	m_tiles.resize(cols * rows);
+	for (size_t i = 0; i < m_tiles.size(); i++) {
+		Tile *t = &m_tiles[i];
+		t->state = TILE_WAITING;
+		for (int s = 0; s < 4; s++) t->strip[s] = NULL;
+		t->measured[0] = t->measured[1] = 0;
+		t->peak[0] = t->peak[1] = 0;
+		t->posX = t->posY = 0;
+	}
+
+	return 1;
+}
+
+int Mosaic::GetTileCount()
+{
+	return m_tiles.size();
+}
+
+/* Scan origin of the tile, in nanometers */
+void Mosaic::GetTileArea(int tile, int32_t *startX, int32_t *startY)
+{
+	double stepNm = (double)m_step * m_tileSize / m_res;
+
+	*startX = m_startX + (int32_t)((tile % m_cols) * stepNm + 0.5);
+	*startY = m_startY + (int32_t)((tile / m_cols) * stepNm + 0.5);
+}
+
+uint16_t Mosaic::GetTileSize()
+{
+	return m_tileSize;
+}
+
+uint16_t Mosaic::GetTileRes()
+{
+	return m_res;
+}
+
+/* Neighbour tile index on given side, -1 at the border */
+int Mosaic::Neighbour(int tile, int side)
+{
+	int c = tile % m_cols;
+	int r = tile / m_cols;
+
+	switch (side) {
+	case SIDE_LEFT:		return (c > 0) ? tile - 1 : -1;
+	case SIDE_TOP:		return (r > 0) ? tile - m_cols : -1;
+	case SIDE_RIGHT:	return (c < m_cols - 1) ? tile + 1 : -1;
+	case SIDE_BOTTOM:	return (r < m_rows - 1) ? tile + m_cols : -1;
+	}
+
+	return -1;
+}
+
+AFMImage *Mosaic::CopyStrip(AFMImage *image, int side)
+{
+	AFMImage *strip = new AFMImage();
+	int x0 = 0, y0 = 0, w = m_res, h = m_res;
+
+	switch (side) {
+	case SIDE_LEFT:		w = m_overlap; break;
+	case SIDE_TOP:		h = m_overlap; break;
+	case SIDE_RIGHT:	x0 = m_step; w = m_overlap; break;
+	case SIDE_BOTTOM:	y0 = m_step; h = m_overlap; break;
+	}
+
+	if (!strip->Create(w, h, 1)) {
+		delete strip;
+		return NULL;
+	}
+
+	for (int y = 0; y < h; y++) {
+		const float *src = image->GetRow(AFM_CHANNEL_TRACE, y0 + y);
+		float *dst = strip->GetRow(0, y);
+		for (int x = 0; x < w; x++) dst[x] = src[x0 + x];
+	}
+
+	return strip;
+}
+
+/* Register overlap of tile first (left or top neighbour) and second */
+void Mosaic::Register(int first, int second, int side)
+{
+	AFMImage *a = m_tiles[first].strip[side + 2];
+	AFMImage *b = m_tiles[second].strip[side];
+	double dx = 0, dy = 0, peak = 0;
+
+	if (!a || !b || !fftCorrelate(a, 0, b, 0, m_margin, &dx, &dy, &peak)) peak = 0;
+
+	wxMutexLocker lock(m_lock);
+	Tile *t = &m_tiles[second];
+	t->shift[side][0] = dx;
+	t->shift[side][1] = dy;
+	t->peak[side] = peak;
+	t->measured[side] = 1;
+	m_changed.Broadcast();
+}
+
+/* Tile can be placed when left and top neighbours are placed or missing
+ * and registration against them is done. Called with m_lock held. */
+int Mosaic::Ready(int tile)
+{
+	for (int side = SIDE_LEFT; side <= SIDE_TOP; side++) {
+		int n = Neighbour(tile, side);
+		if (n < 0) continue;
+		if (m_tiles[n].state == TILE_MISSING) continue;
+		if (m_tiles[n].state != TILE_PLACED) return 0;
+		if (!m_tiles[tile].measured[side]) return 0;
+	}
+
+	return 1;
+}
+
+/* Position from placed neighbours and measured shifts, kept within
+ * the margin around nominal position. Called with m_lock held. */
+void Mosaic::Place(int tile)
+{
+	Tile *t = &m_tiles[tile];
+	double nomX = m_margin + (tile % m_cols) * m_step;
+	double nomY = m_margin + (tile / m_cols) * m_step;
+	double sx = 0, sy = 0, weight = 0;
+
+	for (int pass = 0; (pass < 2) && (weight == 0); pass++) {
+		for (int side = SIDE_LEFT; side <= SIDE_TOP; side++) {
+			int n = Neighbour(tile, side);
+			if ((n < 0) || (m_tiles[n].state != TILE_PLACED)) continue;
+
+			double x = m_tiles[n].posX + ((side == SIDE_LEFT) ? m_step : 0);
+			double y = m_tiles[n].posY + ((side == SIDE_TOP) ? m_step : 0);
+
+			/* Reliable measurements first, dead reckoning from neighbour otherwise */
+			if (!pass) {
+				if (t->peak[side] < MOSAIC_MIN_PEAK) continue;
+				x -= t->shift[side][0];
+				y -= t->shift[side][1];
+			}
+			sx += x;
+			sy += y;
+			weight += 1;
+		}
+	}
+
+	if (weight > 0) {
+		t->posX = sx / weight;
+		t->posY = sy / weight;
+	} else {
+		t->posX = nomX;
+		t->posY = nomY;
+	}
+
+	if (t->posX < nomX - m_margin) t->posX = nomX - m_margin;
+	if (t->posX > nomX + m_margin) t->posX = nomX + m_margin;
+	if (t->posY < nomY - m_margin) t->posY = nomY - m_margin;
+	if (t->posY > nomY + m_margin) t->posY = nomY + m_margin;
+}
+
+/* Add tile to output with weights falling linearly over the overlap,
+ * height offset is matched to already blended neighbours */
+void Mosaic::Blend(int tile, AFMImage *image)
+{
+	Tile *t = &m_tiles[tile];
+	int ox = (int)floor(t->posX + 0.5);
+	int oy = (int)floor(t->posY + 0.5);
+	int res = m_res;
+	float ramp = m_overlap + 1;
+	double diff = 0, count = 0;
+	float offset;
+
+	wxMutexLocker lock(m_blendLock);
+
+	#pragma omp parallel for schedule(static) reduction(+:diff,count)
+	for (int y = 0; y < res; y++) {
+		const float *src = image->GetRow(AFM_CHANNEL_TRACE, y);
+		const float *sum = m_output->GetRow(0, oy + y);
+		const float *wsum = m_output->GetRow(1, oy + y);
+		for (int x = 0; x < res; x++) {
+			if (wsum[ox + x] <= 0) continue;
+			diff += sum[ox + x] / wsum[ox + x] - src[x];
+			count += 1;
+		}
+	}
+	offset = (count > 0) ? diff / count : 0;
+
+	#pragma omp parallel for schedule(static)
+	for (int y = 0; y < res; y++) {
+		const float *src = image->GetRow(AFM_CHANNEL_TRACE, y);
+		float *sum = m_output->GetRow(0, oy + y);
+		float *wsum = m_output->GetRow(1, oy + y);
+		float wy = ((y + 1 < res - y) ? y + 1 : res - y) / ramp;
+		if (wy > 1) wy = 1;
+		for (int x = 0; x < res; x++) {
+			float w = ((x + 1 < res - x) ? x + 1 : res - x) / ramp;
+			if (w > 1) w = 1;
+			w *= wy;
+			sum[ox + x] += w * (src[x] + offset);
+			wsum[ox + x] += w;
+		}
+	}
+}
+
+/* Register and blend one tile, thread safe.
+ * NULL image marks failed scan, its area is left empty.
+ */
+int Mosaic::AddTile(int tile, AFMImage *image)
+{
+	AFMImage *strip[4] = { NULL, NULL, NULL, NULL };
+	int pairs[4][3];
+	int npairs = 0;
+	int ret;
+
+	if (!m_output || (tile < 0) || (tile >= (int)m_tiles.size())) return MOSAIC_ERROR;
+	if (image && ((image->GetWidth() != m_res) || (image->GetHeight() != m_res)))
+		image = NULL;
+
+	/* Overlap strips are kept for neighbours arriving later */
+	if (image) {
+		for (int side = 0; side < 4; side++)
+			if (Neighbour(tile, side) >= 0) strip[side] = CopyStrip(image, side);
+	}
+
+	{
+		wxMutexLocker lock(m_lock);
+		Tile *t = &m_tiles[tile];
+
+		if (t->state != TILE_WAITING) {
+			for (int side = 0; side < 4; side++) delete strip[side];
+			return MOSAIC_ERROR;
+		}
+
+		if (!image) {
+			t->state = TILE_MISSING;
+			m_changed.Broadcast();
+			return (++m_done == (int)m_tiles.size()) ? MOSAIC_COMPLETE : MOSAIC_ADDED;
+		}
+
+		for (int side = 0; side < 4; side++) t->strip[side] = strip[side];
+		t->state = TILE_ARRIVED;
+
+		/* Pair is registered by the tile which arrives second */
+		for (int side = 0; side < 4; side++) {
+			int n = Neighbour(tile, side);
+			if ((n < 0) || (m_tiles[n].state == TILE_WAITING) || (m_tiles[n].state == TILE_MISSING))
+				continue;
+			if (side < SIDE_RIGHT) {
+				pairs[npairs][0] = n;
+				pairs[npairs][1] = tile;
+				pairs[npairs][2] = side;
+			} else {
+				pairs[npairs][0] = tile;
+				pairs[npairs][1] = n;
+				pairs[npairs][2] = side - 2;
+			}
+			npairs++;
+		}
+	}
+
+	for (int i = 0; i < npairs; i++) Register(pairs[i][0], pairs[i][1], pairs[i][2]);
+
+	{
+		wxMutexLocker lock(m_lock);
+		while (!Ready(tile)) m_changed.Wait();
+		Place(tile);
+	}
+
+	Blend(tile, image);
+
+	{
+		wxMutexLocker lock(m_lock);
+		m_tiles[tile].state = TILE_PLACED;
+		ret = (++m_done == (int)m_tiles.size()) ? MOSAIC_COMPLETE : MOSAIC_ADDED;
+		m_changed.Broadcast();
+	}
+
+	return ret;
+}
+
+/* Tile position in blending image, pixels; 0 if tile is not placed */
+int Mosaic::GetPlacement(int tile, double *x, double *y)
+{
+	wxMutexLocker lock(m_lock);
+
+	if ((tile < 0) || (tile >= (int)m_tiles.size())) return 0;
+	if (m_tiles[tile].state != TILE_PLACED) return 0;
+
+	*x = m_tiles[tile].posX;
+	*y = m_tiles[tile].posY;
+
+	return 1;
+}
+
+/* Normalize blended heights into a single channel result image.
+ * Result is cropped to the area covered by placed tiles, so the border
+ * left for placement corrections is not saved. Holes of missing tiles
+ * inside it get the mean height, keeping them out of the height range.
+ * Returns 0 if no tile was placed.
+ */
+int Mosaic::Finish()
+{
+	AFMImage *out = m_output;
+	AFMImage *result;
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0, placed = 0;
+	int width, height;
+	double pitch, sum = 0, count = 0;
+	float mean;
+
+	if (!out) return 0;
+	if (m_result) return 1;
+
+	/* Tiles are blended at rounded positions, every tile pixel has weight */
+	{
+		wxMutexLocker lock(m_lock);
+
+		for (size_t i = 0; i < m_tiles.size(); i++) {
+			if (m_tiles[i].state != TILE_PLACED) continue;
+			int ox = (int)floor(m_tiles[i].posX + 0.5);
+			int oy = (int)floor(m_tiles[i].posY + 0.5);
+			if (!placed || (ox < x0)) x0 = ox;
+			if (!placed || (oy < y0)) y0 = oy;
+			if (!placed || (ox + m_res > x1)) x1 = ox + m_res;
+			if (!placed || (oy + m_res > y1)) y1 = oy + m_res;
+			placed = 1;
+		}
+	}
+	if (!placed) return 0;
+
+	width = x1 - x0;
+	height = y1 - y0;
+	result = new AFMImage();
+	if (!m_backingFile.empty()) result->SetBackingFile(m_backingFile + MOSAIC_RESULT_SUFFIX);
+	if (!result->Create(width, height, 1)) {
+		delete result;
+		return 0;
+	}
+	pitch = (double)m_tileSize / m_res;
+	result->SetGeometry(out->GetStartX() + (int32_t)floor(x0 * pitch + 0.5),
+			out->GetStartY() + (int32_t)floor(y0 * pitch + 0.5), 0);
+	result->SetExtent((uint32_t)floor(width * pitch + 0.5), (uint32_t)floor(height * pitch + 0.5));
+
+	#pragma omp parallel
+	{
+		for (int tile = 0; tile < out->GetTileCount(); tile++) {
+			int ty0, ty1;
+
+			out->GetTileBounds(tile, &ty0, &ty1);
+			if ((ty1 <= y0) || (ty0 >= y1)) continue;
+			if (ty0 < y0) ty0 = y0;
+			if (ty1 > y1) ty1 = y1;
+
+			#pragma omp single nowait
+			{
+				out->PrefetchTile(0, tile + 1);
+				out->PrefetchTile(1, tile + 1);
+			}
+
+			#pragma omp for schedule(static) reduction(+:sum,count)
+			for (int y = ty0; y < ty1; y++) {
+				const float *wsum = out->GetRow(1, y) + x0;
+				const float *hsum = out->GetRow(0, y) + x0;
+				float *dst = result->GetRow(0, y - y0);
+				for (int x = 0; x < width; x++) {
+					if (wsum[x] > 0) {
+						dst[x] = hsum[x] / wsum[x];
+						sum += dst[x];
+						count += 1;
+					} else {
+						dst[x] = NAN;
+					}
+				}
+			}
+
+			#pragma omp single nowait
+			{
+				out->ReleaseTile(0, tile);
+				out->ReleaseTile(1, tile);
+			}
+		}
+	}
+
+	if (count < (double)width * height) {
+		mean = sum / count;
+
+		#pragma omp parallel for schedule(static)
+		for (int y = 0; y < height; y++) {
+			float *dst = result->GetRow(0, y);
+			for (int x = 0; x < width; x++)
+				if (isnan(dst[x])) dst[x] = mean;
+		}
+	}
+
+	m_result = result;
+
+	return 1;
+}
+
+/* Stitched heights, available after Finish() */
+AFMImage *Mosaic::GetImage()
+{
+	return m_result;
+}
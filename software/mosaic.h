@@ -0,0 +1,82 @@
+#ifndef MOSAIC_H_
+#define MOSAIC_H_
+
+#include <wx/thread.h>
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+/* AddTile results */
+#define MOSAIC_ERROR		0
+#define MOSAIC_ADDED		1
+#define MOSAIC_COMPLETE		2	/* Last tile is placed, Finish() can be called */
+
+/* Backing file of the result, appended to mosaic backing file name */
+#define MOSAIC_RESULT_SUFFIX	".height"
+
+/* Registration with lower peak to sidelobe ratio is ignored */
+#define MOSAIC_MIN_PEAK		6.0
+
+/* Grid of overlapping scans stitched into one image
+ * Tiles are registered against their neighbours by phase correlation of
+ * the overlap strips and blended into the output as they arrive. AddTile()
+ * may be called from several threads; a tile waits only for its left and
+ * top neighbours to be placed.
+ * Blending image channel 0 holds weighted sum of heights and channel 1
+ * the weight sum. Finish() divides them into a single channel result
+ * cropped to the placed tiles, both may be file backed; backing files are
+ * removed with the mosaic.
+ */
+class Mosaic {
+private:
+	struct Tile {
+		int state;
+		AFMImage *strip[4];		/* Left, top, right, bottom overlap of trace channel */
+		int measured[2];		/* Registration against left and top neighbour is done */
+		double shift[2][2];		/* Measured shift, x and y */
+		double peak[2];
+		double posX;			/* Placement in output, pixels */
+		double posY;
+	};
+	int32_t m_startX;
+	int32_t m_startY;
+	uint16_t m_tileSize;
+	uint16_t m_res;
+	int m_cols;
+	int m_rows;
+	int m_step;					/* Tile origin step, pixels */
+	int m_overlap;				/* Overlap width, pixels */
+	int m_margin;				/* Output border for placement corrections */
+	AFMImage *m_output;			/* Blending sums */
+	AFMImage *m_result;
+	std::string m_backingFile;
+	std::vector<Tile> m_tiles;
+	int m_done;
+	wxMutex m_lock;
+	wxCondition m_changed;
+	wxMutex m_blendLock;
+	void Free();
+	AFMImage *CopyStrip(AFMImage *image, int side);
+	int Neighbour(int tile, int side);
+	void Register(int first, int second, int side);
+	int Ready(int tile);
+	void Place(int tile);
+	void Blend(int tile, AFMImage *image);
+public:
+	Mosaic(void);
+	~Mosaic(void);
+	int Create(int32_t startX, int32_t startY, uint16_t tileSize, uint16_t res,
+			int cols, int rows, double overlap, std::string backingFile = "");
+	int GetTileCount();
+	void GetTileArea(int tile, int32_t *startX, int32_t *startY);
+	uint16_t GetTileSize();
+	uint16_t GetTileRes();
+	int AddTile(int tile, AFMImage *image);
+	int GetPlacement(int tile, double *x, double *y);
+	int Finish();
+	AFMImage *GetImage();
+};
+
+
+#endif /* MOSAIC_H_ */
@@ -0,0 +1,135 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdio.h>
+
+#include "movie.h"
+
+
+FrameRing::FrameRing(void)
+{
+	m_head = 0;
+	m_count = 0;
+	m_total = 0;
+}
+
+FrameRing::~FrameRing(void)
+{
+	Free();
+}
+
+void FrameRing::Free()
+{
+	for (size_t i = 0; i < m_frames.size(); i++) delete m_frames[i];
+	m_frames.clear();
+	m_head = 0;
+	m_count = 0;
+	m_total = 0;
+}
+
+/* Keep last frames of res x res pixels, buffers of the same shape
+ * are reused by the device instead of being allocated per frame */
+int FrameRing::Create(int frames, uint16_t res, std::string spillFile)
+{
+	char suffix[16];
+
+	Free();
+
+	if ((frames < 1) || (frames > MOVIE_MAX_FRAMES) || !res) return 0;
+
+	for (int i = 0; i <= frames; i++) {
+		AFMImage *image = new AFMImage();
+		m_frames.push_back(image);
+		if (!spillFile.empty()) {
+			snprintf(suffix, sizeof(suffix), ".%d", i);
+			image->SetSpillFile(spillFile + suffix);
+		}
+		if (!image->Create(res, res, AFM_CHANNEL_COUNT)) {
+			Free();
+			return 0;
+		}
+	}
+
+	if (!spillFile.empty()) m_diff.SetSpillFile(spillFile + ".diff");
+	if (!m_diff.Create(res, res, 1)) {
+		Free();
+		return 0;
+	}
+
+	return 1;
+}
+
+AFMImage *FrameRing::GetWriteBuffer()
+{
+	return m_frames.empty() ? NULL : m_frames[m_head];
+}
+
+/* Frame in write buffer is complete, the oldest buffer is written next */
+void FrameRing::Commit()
+{
+	int size = m_frames.size();
+
+	if (!size) return;
+
+	m_head = (m_head + 1) % size;
+	if (m_count < size - 1) m_count++;
+	m_total++;
+}
+
+int FrameRing::GetCount()
+{
+	return m_count;
+}
+
+unsigned int FrameRing::GetTotal()
+{
+	return m_total;
+}
+
+AFMImage *FrameRing::GetFrame(int age)
+{
+	int size = m_frames.size();
+
+	if ((age < 0) || (age >= m_count)) return NULL;
+
+	return m_frames[(m_head - 1 - age + 2 * size) % size];
+}
+
+/* Frame minus the one before it, in a buffer shared by all calls */
+AFMImage *FrameRing::GetDifference(int age, int channel)
+{
+	AFMImage *cur = GetFrame(age);
+	AFMImage *prev = GetFrame(age + 1);
+	int width = m_diff.GetWidth();
+	int height = m_diff.GetHeight();
+
+	if (!cur || !prev || (channel < 0) || (channel >= cur->GetChannels())) return NULL;
+	if ((cur->GetWidth() != width) || (cur->GetHeight() != height) ||
+			(prev->GetWidth() != width) || (prev->GetHeight() != height)) return NULL;
+
+	m_diff.CopyGeometry(cur);
+
+	#pragma omp parallel for schedule(static) if (height > 64)
+	for (int y = 0; y < height; y++) {
+		const float *a = cur->GetRow(channel, y);
+		const float *b = prev->GetRow(channel, y);
+		float *d = m_diff.GetRow(0, y);
+		for (int x = 0; x < width; x++) d[x] = a[x] - b[x];
+	}
+
+	return &m_diff;
+}
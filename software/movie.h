@@ -0,0 +1,38 @@
+#ifndef MOVIE_H_
+#define MOVIE_H_
+
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+#define MOVIE_MAX_FRAMES	256
+
+/* Last frames of continuous scanning
+ * All buffers are allocated by Create(): one more than the number of
+ * frames kept, so the frame being received never overwrites a kept one.
+ * Frame age 0 is the newest complete frame.
+ * Large frames spill to files named after spillFile, see
+ * AFMImage::SetSpillFile().
+ */
+class FrameRing {
+private:
+	std::vector<AFMImage *> m_frames;
+	AFMImage m_diff;			/* Difference view */
+	int m_head;					/* Buffer being written */
+	int m_count;				/* Complete frames kept */
+	unsigned int m_total;		/* Frames completed since Create() */
+	void Free();
+public:
+	FrameRing();
+	~FrameRing();
+	int Create(int frames, uint16_t res, std::string spillFile = "");
+	AFMImage *GetWriteBuffer();
+	void Commit();
+	int GetCount();
+	unsigned int GetTotal();
+	AFMImage *GetFrame(int age);
+	AFMImage *GetDifference(int age, int channel);
+};
+
+#endif /* MOVIE_H_ */
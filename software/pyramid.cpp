@@ -0,0 +1,339 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pyramid.h"
+
+
+ImagePyramid::ImagePyramid(int mode)
+{
+	m_mode = mode;
+	m_planes = (mode == PYRAMID_MINMAX) ? 2 : 1;
+	m_levels = 0;
+	memset(m_level, 0, sizeof(m_level));
+}
+
+ImagePyramid::~ImagePyramid()
+{
+	Free();
+}
+
+void ImagePyramid::Free()
+{
+	int l, p, t;
+
+	for (l = 0; l < m_levels; l++) {
+		level_t *lv = &m_level[l];
+		for (p = 0; p < 2; p++) {
+			if (lv->tiles[p]) {
+				for (t = 0; t < lv->tilesX * lv->tilesY; t++) free(lv->tiles[p][t]);
+				free(lv->tiles[p]);
+			}
+			free(lv->pending[p]);
+			free(lv->next[p]);
+		}
+	}
+	memset(m_level, 0, sizeof(m_level));
+	m_levels = 0;
+}
+
+/* Prepare levels down to the one that fits into a single tile */
+int ImagePyramid::Create(int width, int height)
+{
+	int l, p;
+
+	Free();
+
+	if ((width <= 0) || (height <= 0)) return 0;
+
+	for (l = 0; l < PYRAMID_MAX_LEVELS; l++) {
+		level_t *lv = &m_level[l];
+
+		lv->width = width;
+		lv->height = height;
+		lv->tilesX = (width + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE;
+		lv->tilesY = (height + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE;
+		m_levels = l + 1;
+
+		if ((width <= PYRAMID_TILE_SIZE) && (height <= PYRAMID_TILE_SIZE)) break;
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	for (l = 0; l < m_levels; l++) {
+		level_t *lv = &m_level[l];
+		int last = (l == m_levels - 1);
+
+		/* Level 0 tiles are the image itself */
+		lv->stored = (l > 0) && ((uint64_t)lv->tilesX * lv->tilesY * m_planes *
+				PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE * sizeof(float) <= PYRAMID_LEVEL_MAX_BYTES);
+
+		for (p = 0; p < m_planes; p++) {
+			if (lv->stored) {
+				lv->tiles[p] = (float **)calloc(lv->tilesX * lv->tilesY, sizeof(float *));
+				if (!lv->tiles[p]) goto fail;
+			}
+			if (last) continue;
+			lv->pending[p] = (float *)malloc(sizeof(float) * lv->width);
+			lv->next[p] = (float *)malloc(sizeof(float) * m_level[l + 1].width);
+			if (!lv->pending[p] || !lv->next[p]) goto fail;
+		}
+	}
+
+	return 1;
+
+fail:
+	Free();
+	return 0;
+}
+
+/* Downsample two rows of the level into the row of the next level */
+void ImagePyramid::Combine(int level, const float *const *a, const float *const *b)
+{
+	level_t *lv = &m_level[level];
+	int width = m_level[level + 1].width;
+	int x, x0, x1;
+
+	for (x = 0; x < width; x++) {
+		x0 = 2 * x;
+		x1 = (x0 + 1 < lv->width) ? x0 + 1 : x0;
+
+		if (m_mode == PYRAMID_MINMAX) {
+			float lo = a[0][x0], hi = a[1][x0];
+			if (a[0][x1] < lo) lo = a[0][x1];
+			if (b[0][x0] < lo) lo = b[0][x0];
+			if (b[0][x1] < lo) lo = b[0][x1];
+			if (a[1][x1] > hi) hi = a[1][x1];
+			if (b[1][x0] > hi) hi = b[1][x0];
+			if (b[1][x1] > hi) hi = b[1][x1];
+			lv->next[0][x] = lo;
+			lv->next[1][x] = hi;
+		} else {
+			lv->next[0][x] = 0.25f * (a[0][x0] + a[0][x1] + b[0][x0] + b[0][x1]);
+		}
+	}
+}
+
+/* Copy row into tiles, tiles are allocated on first write */
+int ImagePyramid::Store(int level, int y, const float *const *row)
+{
+	level_t *lv = &m_level[level];
+	int ty = y / PYRAMID_TILE_SIZE;
+	int oy = y % PYRAMID_TILE_SIZE;
+	int p, tx, x, n;
+
+	for (p = 0; p < m_planes; p++) {
+		for (tx = 0; tx < lv->tilesX; tx++) {
+			float **tile = &lv->tiles[p][ty * lv->tilesX + tx];
+
+			if (!*tile) {
+				*tile = (float *)calloc(PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE, sizeof(float));
+				if (!*tile) return 0;
+			}
+			x = tx * PYRAMID_TILE_SIZE;
+			n = lv->width - x;
+			if (n > PYRAMID_TILE_SIZE) n = PYRAMID_TILE_SIZE;
+			memcpy(*tile + oy * PYRAMID_TILE_SIZE, row[p] + x, sizeof(float) * n);
+		}
+	}
+
+	return 1;
+}
+
+/* Add next row of the level and propagate it up */
+int ImagePyramid::Push(int level, const float *const *row)
+{
+	level_t *lv = &m_level[level];
+	int p;
+
+	if (lv->rows >= lv->height) return 0;
+	if (lv->stored && !Store(level, lv->rows, row)) return 0;
+	lv->rows++;
+
+	if (level + 1 >= m_levels) return 1;
+
+	if (lv->hasPending) {
+		lv->hasPending = 0;
+		Combine(level, lv->pending, row);
+		return Push(level + 1, lv->next);
+	}
+
+	/* Last row of odd height level is paired with itself */
+	if (lv->rows == lv->height) {
+		Combine(level, row, row);
+		return Push(level + 1, lv->next);
+	}
+
+	for (p = 0; p < m_planes; p++) memcpy(lv->pending[p], row[p], sizeof(float) * lv->width);
+	lv->hasPending = 1;
+
+	return 1;
+}
+
+/* Push next image row, rows must come in order */
+int ImagePyramid::AddRow(const float *row)
+{
+	const float *planes[2] = { row, row };
+
+	if (!m_levels) return 0;
+
+	return Push(0, planes);
+}
+
+/* Complete upper levels when image ends early */
+int ImagePyramid::Finish()
+{
+	int l;
+
+	for (l = 0; l + 1 < m_levels; l++) {
+		level_t *lv = &m_level[l];
+		if (!lv->hasPending) continue;
+		lv->hasPending = 0;
+		Combine(l, lv->pending, lv->pending);
+		if (!Push(l + 1, lv->next)) return 0;
+	}
+
+	return 1;
+}
+
+int ImagePyramid::GetMode()
+{
+	return m_mode;
+}
+
+int ImagePyramid::GetLevels()
+{
+	return m_levels;
+}
+
+int ImagePyramid::GetLevelWidth(int level)
+{
+	if ((level < 0) || (level >= m_levels)) return 0;
+
+	return m_level[level].width;
+}
+
+int ImagePyramid::GetLevelHeight(int level)
+{
+	if ((level < 0) || (level >= m_levels)) return 0;
+
+	return m_level[level].height;
+}
+
+int ImagePyramid::GetLevelRows(int level)
+{
+	if ((level < 0) || (level >= m_levels)) return 0;
+
+	return m_level[level].rows;
+}
+
+/* Level 0 and levels too large to keep have no tiles */
+int ImagePyramid::IsStored(int level)
+{
+	if ((level < 0) || (level >= m_levels)) return 0;
+
+	return m_level[level].stored;
+}
+
+/* Tile of stored level, PYRAMID_TILE_SIZE floats per row.
+ * Returns NULL if nothing was written to the tile yet.
+ */
+float *ImagePyramid::GetTile(int level, int plane, int tx, int ty)
+{
+	level_t *lv;
+
+	if (!IsStored(level)) return NULL;
+	if ((plane < 0) || (plane >= m_planes)) return NULL;
+	lv = &m_level[level];
+	if ((tx < 0) || (tx >= lv->tilesX) || (ty < 0) || (ty >= lv->tilesY)) return NULL;
+
+	return lv->tiles[plane][ty * lv->tilesX + tx];
+}
+
+/* Copy rectangle of stored level, missing tiles read as zero */
+int ImagePyramid::ReadRegion(int level, int plane, int x, int y, int w, int h, float *dst, int stride)
+{
+	level_t *lv;
+	int row, cx, n;
+
+	if (!IsStored(level)) return 0;
+	if ((plane < 0) || (plane >= m_planes)) return 0;
+	lv = &m_level[level];
+	if ((x < 0) || (y < 0) || (w <= 0) || (h <= 0)) return 0;
+	if ((x + w > lv->width) || (y + h > lv->height)) return 0;
+
+	for (row = 0; row < h; row++) {
+		int ty = (y + row) / PYRAMID_TILE_SIZE;
+		int oy = (y + row) % PYRAMID_TILE_SIZE;
+		float *out = dst + (size_t)row * stride;
+
+		for (cx = x; cx < x + w; cx += n) {
+			int tx = cx / PYRAMID_TILE_SIZE;
+			int ox = cx % PYRAMID_TILE_SIZE;
+			float *tile = lv->tiles[plane][ty * lv->tilesX + tx];
+
+			n = PYRAMID_TILE_SIZE - ox;
+			if (n > x + w - cx) n = x + w - cx;
+			if (tile)
+				memcpy(out + cx - x, tile + oy * PYRAMID_TILE_SIZE + ox, sizeof(float) * n);
+			else
+				memset(out + cx - x, 0, sizeof(float) * n);
+		}
+	}
+
+	return 1;
+}
+
+/* Coarsest level that still has at least one pixel per screen pixel.
+ * zoom is screen pixels per image pixel. Level 0 is returned when the
+ * right level is not stored, finer ones are not stored either.
+ */
+int ImagePyramid::ChooseLevel(double zoom)
+{
+	int level;
+
+	if (!m_levels) return 0;
+	if (zoom <= 0) return m_levels - 1;
+
+	level = (int)floor(log2(1.0 / zoom));
+	if (level < 0) level = 0;
+	if (level >= m_levels) level = m_levels - 1;
+
+	return IsStored(level) ? level : 0;
+}
+
+int pyramidBuild(AFMImage *image, int channel, ImagePyramid *pyramid)
+{
+	int tile, y, y0, y1;
+
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+	if (!pyramid->Create(image->GetWidth(), image->GetHeight())) return 0;
+
+	for (tile = 0; tile < image->GetTileCount(); tile++) {
+		image->GetTileBounds(tile, &y0, &y1);
+		image->PrefetchTile(channel, tile + 1);
+		for (y = y0; y < y1; y++) {
+			if (!pyramid->AddRow(image->GetRow(channel, y))) return 0;
+		}
+		image->ReleaseTile(channel, tile);
+	}
+
+	return 1;
+}
@@ -0,0 +1,67 @@
+#ifndef PYRAMID_H_
+#define PYRAMID_H_
+
+#include "image.h"
+
+/* Downsampling modes */
+#define PYRAMID_BOX			0	/* Plane 0 is mean of 2x2 block */
+#define PYRAMID_MINMAX		1	/* Plane 0 is minimum, plane 1 is maximum */
+
+#define PYRAMID_TILE_SIZE	256
+#define PYRAMID_MAX_LEVELS	17
+
+/* Larger levels are not stored, display reads level 0 instead */
+#define PYRAMID_LEVEL_MAX_BYTES		(64 * 1024 * 1024)
+
+/* Multi-resolution pyramid of one image channel
+ * Level 0 is the image itself and is not stored, level n is downsampled
+ * 2^n times. Levels are kept in square tiles allocated on first write,
+ * so display code can fetch only the visible part of the selected level.
+ * Levels above PYRAMID_LEVEL_MAX_BYTES are skipped, so heap use stays
+ * small for images kept in backing files.
+ * Rows of level 0 are pushed in order, upper levels are updated as soon
+ * as both source rows are known.
+ */
+class ImagePyramid {
+private:
+	typedef struct {
+		int width;
+		int height;
+		int tilesX;
+		int tilesY;
+		int rows;				/* Rows completed */
+		int stored;				/* Tiles are kept */
+		float **tiles[2];
+		float *pending[2];		/* Even row waiting for its pair */
+		int hasPending;
+		float *next[2];			/* Row of the next level */
+	} level_t;
+	int m_mode;
+	int m_planes;
+	int m_levels;
+	level_t m_level[PYRAMID_MAX_LEVELS];
+	void Free();
+	void Combine(int level, const float *const *a, const float *const *b);
+	int Push(int level, const float *const *row);
+	int Store(int level, int y, const float *const *row);
+public:
+	ImagePyramid(int mode);
+	~ImagePyramid(void);
+	int Create(int width, int height);
+	int AddRow(const float *row);
+	int Finish();
+	int GetMode();
+	int GetLevels();
+	int GetLevelWidth(int level);
+	int GetLevelHeight(int level);
+	int GetLevelRows(int level);
+	int IsStored(int level);
+	float *GetTile(int level, int plane, int tx, int ty);
+	int ReadRegion(int level, int plane, int x, int y, int w, int h, float *dst, int stride);
+	int ChooseLevel(double zoom);
+};
+
+int pyramidBuild(AFMImage *image, int channel, ImagePyramid *pyramid);
+
+
+#endif /* PYRAMID_H_ */
@@ -0,0 +1,91 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <math.h>
+
+#include "roi.h"
+
+
+/* Scan area for pixels x0..x1-1, y0..y1-1 of image, with res pixels
+ * Scans are square, so the larger side is used, centered on the
+ * rectangle and moved to stay inside the image.
+ */
+int roiToRun(AFMImage *image, int x0, int y0, int x1, int y1, uint16_t res, struct afmRun *run)
+{
+	int width = image->GetWidth();
+	int height = image->GetHeight();
+	double sizeX = image->GetSizeX();
+	double sizeY = image->GetSizeY();
+	double pitchX, pitchY, side, left, top, size, limit;
+	int t;
+
+	if (!width || !height || !sizeX || !sizeY || !res) return 0;
+
+	if (x1 < x0) { t = x0; x0 = x1; x1 = t; }
+	if (y1 < y0) { t = y0; y0 = y1; y1 = t; }
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > width) x1 = width;
+	if (y1 > height) y1 = height;
+	if ((x1 <= x0) || (y1 <= y0)) return 0;
+
+	pitchX = sizeX / width;
+	pitchY = sizeY / height;
+
+	/* Square side in nanometers */
+	side = (x1 - x0) * pitchX;
+	if ((y1 - y0) * pitchY > side) side = (y1 - y0) * pitchY;
+	size = floor(side + 0.5);
+	if (size < 1) size = 1;
+	/* Scan size is 16 bit */
+	limit = (sizeX < sizeY) ? sizeX : sizeY;
+	if (limit > 0xFFFF) limit = 0xFFFF;
+	if (size > limit) size = limit;
+
+	left = 0.5 * (x0 + x1) * pitchX - 0.5 * size;
+	top = 0.5 * (y0 + y1) * pitchY - 0.5 * size;
+	if (left > sizeX - size) left = sizeX - size;
+	if (top > sizeY - size) top = sizeY - size;
+	if (left < 0) left = 0;
+	if (top < 0) top = 0;
+
+	run->startX = image->GetStartX() + (int32_t)floor(left + 0.5);
+	run->startY = image->GetStartY() + (int32_t)floor(top + 0.5);
+	run->size = (uint16_t)size;
+	run->res = res;
+
+	return 1;
+}
+
+/* Area of roi scan in pixels of base image, may reach outside of it */
+int roiPlacement(AFMImage *base, AFMImage *roi, double *x, double *y, double *w, double *h)
+{
+	double pitchX, pitchY;
+
+	if (!base->GetWidth() || !base->GetHeight() || !base->GetSizeX() || !base->GetSizeY() ||
+			!roi->GetSizeX() || !roi->GetSizeY()) return 0;
+
+	pitchX = (double)base->GetSizeX() / base->GetWidth();
+	pitchY = (double)base->GetSizeY() / base->GetHeight();
+
+	*x = (roi->GetStartX() - base->GetStartX()) / pitchX;
+	*y = (roi->GetStartY() - base->GetStartY()) / pitchY;
+	*w = roi->GetSizeX() / pitchX;
+	*h = roi->GetSizeY() / pitchY;
+
+	return 1;
+}
@@ -0,0 +1,14 @@
+#ifndef ROI_H_
+#define ROI_H_
+
+#include "image.h"
+#include "protocol.h"
+
+/* Region of interest of a scanned image
+ * Scans share the nanometer coordinate system of struct afmRun, pixel
+ * x of a scan lies at startX + x * size / res.
+ */
+int roiToRun(AFMImage *image, int x0, int y0, int x1, int y1, uint16_t res, struct afmRun *run);
+int roiPlacement(AFMImage *base, AFMImage *roi, double *x, double *y, double *w, double *h);
+
+#endif /* ROI_H_ */
@@ -0,0 +1,312 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "scar.h"
+
+
+/* MAD to standard deviation of normal distribution */
+#define MAD_SCALE			1.4826
+
+/* Weight of the current line in running noise estimate */
+#define NOISE_WEIGHT		0.1
+
+static float median(float *v, int count)
+{
+	std::nth_element(v, v + count / 2, v + count);
+	float m = v[count / 2];
+	if ((count & 1) == 0) {
+		m = (m + *std::max_element(v, v + count / 2)) / 2;
+	}
+	return m;
+}
+
+ScarFilter::ScarFilter(int window, float threshold)
+{
+	if (window < SCAR_MIN_WINDOW) window = SCAR_MIN_WINDOW;
+	if (window > SCAR_MAX_WINDOW) window = SCAR_MAX_WINDOW;
+
+	m_window = window | 1;
+	m_threshold = threshold;
+	m_width = 0;
+	m_ring = NULL;
+	m_ref = NULL;
+	m_diff = NULL;
+	m_scratch = NULL;
+	m_pushed = 0;
+	m_emitted = 0;
+	m_noise = 0;
+	m_repaired = 0;
+}
+
+ScarFilter::~ScarFilter()
+{
+	free(m_ring);
+	free(m_ref);
+	free(m_diff);
+	free(m_scratch);
+}
+
+int ScarFilter::Start(int width)
+{
+	m_pushed = 0;
+	m_emitted = 0;
+	m_noise = 0;
+	m_repaired = 0;
+
+	if (width == m_width) return 1;
+
+	free(m_ring);
+	free(m_ref);
+	free(m_diff);
+	free(m_scratch);
+	m_width = width;
+	m_ring = (float *)malloc(sizeof(float) * m_window * width);
+	m_ref = (float *)malloc(sizeof(float) * width);
+	m_diff = (float *)malloc(sizeof(float) * width);
+	m_scratch = (float *)malloc(sizeof(float) * width);
+	if (!m_ring || !m_ref || !m_diff || !m_scratch) {
+		m_width = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+float *ScarFilter::Line(int n)
+{
+	return m_ring + (size_t)(n % m_window) * m_width;
+}
+
+/* Repair line n using all lines inside the window that are available */
+float *ScarFilter::Repair(int n)
+{
+	float *row = Line(n);
+	float *nb[SCAR_MAX_WINDOW];
+	float v[SCAR_MAX_WINDOW * 3];
+	int half = m_window / 2;
+	int count = 0, before = 0, after = 0;
+	int x, k, c;
+	float off, noise, limit;
+
+	for (k = n - half; k <= n + half; k++) {
+		if ((k < 0) || (k == n) || (k >= m_pushed)) continue;
+		nb[count++] = Line(k);
+		if (k < n) before++; else after++;
+	}
+	/* One-sided neighbours can not tell a scar from a slope */
+	if (!before || !after) return row;
+
+	/* Reference is median of 3 pixel neighbourhoods on neighbour lines,
+	 * so spike on a neighbour line does not leak into it */
+	for (x = 0; x < m_width; x++) {
+		c = 0;
+		for (k = 0; k < count; k++) {
+			v[c++] = nb[k][x];
+			if (x > 0) v[c++] = nb[k][x - 1];
+			if (x < m_width - 1) v[c++] = nb[k][x + 1];
+		}
+		m_ref[x] = median(v, c);
+		m_diff[x] = row[x] - m_ref[x];
+	}
+
+	/* Robust noise of the difference to neighbours.
+	 * Scarred line has large median offset but normal spread.
+	 */
+	memcpy(m_scratch, m_diff, sizeof(float) * m_width);
+	off = median(m_scratch, m_width);
+	for (x = 0; x < m_width; x++) m_scratch[x] = fabsf(m_diff[x] - off);
+	noise = MAD_SCALE * median(m_scratch, m_width);
+
+	/* Running estimate keeps threshold sane on fully scarred lines */
+	if (m_noise == 0)
+		m_noise = noise;
+	else
+		m_noise += NOISE_WEIGHT * (noise - m_noise);
+	if (noise < m_noise) noise = m_noise;
+
+	/* Pixel must stand out against every neighbour line in the same
+	 * direction, otherwise the defect is on the neighbour */
+	limit = m_threshold * noise;
+	for (x = 0; x < m_width; x++) {
+		float d = m_diff[x];
+		if (fabsf(d) <= limit) continue;
+		for (k = 0; k < count; k++) {
+			float dk = row[x] - nb[k][x];
+			if ((fabsf(dk) <= limit) || ((dk > 0) != (d > 0))) break;
+		}
+		if (k < count) continue;
+		row[x] = m_ref[x];
+		m_repaired++;
+	}
+
+	return row;
+}
+
+/* Feed next line. Returns number of line written to *out,
+ * or -1 if no line is ready yet.
+ */
+int ScarFilter::Push(const float *row, float **out)
+{
+	int half = m_window / 2;
+
+	if (!m_width) return -1;
+
+	memcpy(Line(m_pushed), row, sizeof(float) * m_width);
+	m_pushed++;
+
+	if (m_pushed - m_emitted <= half) return -1;
+
+	*out = Repair(m_emitted);
+	return m_emitted++;
+}
+
+/* Drain lines left in the window after the last Push().
+ * Call until it returns -1.
+ */
+int ScarFilter::Flush(float **out)
+{
+	if (!m_width || (m_emitted >= m_pushed)) return -1;
+
+	*out = Repair(m_emitted);
+	return m_emitted++;
+}
+
+int ScarFilter::GetRepairedCount()
+{
+	return m_repaired;
+}
+
+/***** Acquisition listener *****/
+
+ScarRemover::ScarRemover(AFMImage *output, int window, float threshold)
+{
+	m_output = output;
+	m_target = NULL;
+	m_enabled = true;
+	m_active = false;
+	for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) m_filter[ch] = new ScarFilter(window, threshold);
+}
+
+ScarRemover::~ScarRemover()
+{
+	for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) delete m_filter[ch];
+}
+
+void ScarRemover::SetEnabled(bool enabled)
+{
+	m_enabled = enabled;
+}
+
+void ScarRemover::AddListener(ImageListener *listener)
+{
+	m_listeners.push_back(listener);
+}
+
+void ScarRemover::RemoveListener(ImageListener *listener)
+{
+	for (size_t l = 0; l < m_listeners.size(); l++) {
+		if (m_listeners[l] == listener) {
+			m_listeners.erase(m_listeners.begin() + l);
+			break;
+		}
+	}
+}
+
+/* Line leaves the filter: stored and passed on */
+void ScarRemover::Store(int channel, int line, const float *row)
+{
+	float *dst = m_target->GetRow(channel, line);
+
+	if (!dst) return;
+	if (dst != row) memcpy(dst, row, sizeof(float) * m_target->GetWidth());
+
+	for (size_t l = 0; l < m_listeners.size(); l++)
+		m_listeners[l]->OnImageLine(m_target, channel, line);
+}
+
+void ScarRemover::OnImageStart(AFMImage *image)
+{
+	m_active = m_enabled;
+	m_target = m_output ? m_output : image;
+	if (m_output) {
+		m_output->Create(image->GetWidth(), image->GetHeight(), image->GetChannels());
+		m_output->CopyGeometry(image);
+	}
+	for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) {
+		/* Lines pass unchanged if filter can not be set up */
+		if (m_active && !m_filter[ch]->Start(image->GetWidth())) m_active = false;
+	}
+
+	for (size_t l = 0; l < m_listeners.size(); l++)
+		m_listeners[l]->OnImageStart(m_target);
+}
+
+void ScarRemover::OnImageLine(AFMImage *image, int channel, int line)
+{
+	float *src = image->GetRow(channel, line);
+	float *out;
+	int n;
+
+	if (!src || !m_target || (channel < 0) || (channel >= AFM_CHANNEL_COUNT)) return;
+
+	if (!m_active) {
+		Store(channel, line, src);
+		return;
+	}
+
+	n = m_filter[channel]->Push(src, &out);
+	if (n >= 0) Store(channel, n, out);
+}
+
+void ScarRemover::OnImageEnd(AFMImage *image)
+{
+	float *out;
+	int n;
+
+	if (!m_target) return;
+
+	if (m_active) {
+		for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) {
+			while ((n = m_filter[ch]->Flush(&out)) >= 0) Store(ch, n, out);
+		}
+	}
+
+	for (size_t l = 0; l < m_listeners.size(); l++)
+		m_listeners[l]->OnImageEnd(m_target);
+	m_target = NULL;
+}
+
+/* Preview lines are not repaired, they come in any order */
+void ScarRemover::OnImagePreview(AFMImage *image, int channel, int line)
+{
+	float *src = image->GetRow(channel, line);
+	float *dst;
+
+	if (!src || !m_target) return;
+
+	dst = m_target->GetRow(channel, line);
+	if (!dst) return;
+	if (dst != src) memcpy(dst, src, sizeof(float) * m_target->GetWidth());
+
+	for (size_t l = 0; l < m_listeners.size(); l++)
+		m_listeners[l]->OnImagePreview(m_target, channel, line);
+}
@@ -0,0 +1,71 @@
+#ifndef SCAR_H_
+#define SCAR_H_
+
+#include <vector>
+
+#include "image.h"
+
+#define SCAR_MIN_WINDOW		3
+#define SCAR_MAX_WINDOW		5
+
+/* Streaming scan line scar and spike repair
+ * Each line is compared with its neighbours inside a window of 3 to 5 lines.
+ * Pixels deviating from neighbour median by more than threshold times
+ * robust line noise are replaced by that median. First and last lines
+ * are passed unchanged. Only the window is kept, so lines leave
+ * the filter window/2 lines after they were pushed.
+ */
+class ScarFilter {
+private:
+	int m_window;
+	float m_threshold;
+	int m_width;
+	float *m_ring;				/* m_window lines */
+	float *m_ref;				/* Neighbour median of current line */
+	float *m_diff;
+	float *m_scratch;
+	int m_pushed;				/* Lines pushed since Start() */
+	int m_emitted;				/* Lines returned since Start() */
+	double m_noise;				/* Running line noise estimate */
+	int m_repaired;
+	float *Line(int n);
+	float *Repair(int n);
+public:
+	ScarFilter(int window, float threshold);
+	~ScarFilter(void);
+	int Start(int width);
+	int Push(const float *row, float **out);
+	int Flush(float **out);
+	int GetRepairedCount();
+};
+
+/* Repairs the image while it is being acquired
+ * Sits between the device and other listeners, which get the repaired
+ * image and its lines once they leave the filter. Repaired lines go to
+ * output, or back into the acquired image when output is NULL.
+ * When disabled, lines are passed on unchanged; SetEnabled() takes
+ * effect at the next image.
+ */
+class ScarRemover : public ImageListener {
+private:
+	AFMImage *m_output;
+	AFMImage *m_target;			/* Image passed on to listeners */
+	ScarFilter *m_filter[AFM_CHANNEL_COUNT];
+	std::vector<ImageListener *> m_listeners;
+	bool m_enabled;
+	bool m_active;				/* Enabled for the current image */
+	void Store(int channel, int line, const float *row);
+public:
+	ScarRemover(AFMImage *output, int window, float threshold);
+	virtual ~ScarRemover(void);
+	void SetEnabled(bool enabled);
+	void AddListener(ImageListener *listener);
+	void RemoveListener(ImageListener *listener);
+	virtual void OnImageStart(AFMImage *image);
+	virtual void OnImageLine(AFMImage *image, int channel, int line);
+	virtual void OnImageEnd(AFMImage *image);
+	virtual void OnImagePreview(AFMImage *image, int channel, int line);
+};
+
+
+#endif /* SCAR_H_ */
@@ -0,0 +1,282 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include <wx/wx.h>
+#include <wx/dcbuffer.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "scopepanel.h"
+
+
+/* Lost samples above this are treated as a restart of the stream */
+#define SCOPE_MAX_GAP		4096
+
+#define SCOPE_DEFAULT_PER_COLUMN	16
+
+
+/***** Min/max trace *****/
+
+ScopeTrace::ScopeTrace(void)
+{
+	m_min = NULL;
+	m_max = NULL;
+	m_columns = 0;
+	m_head = 0;
+	m_filled = 0;
+	m_perColumn = 1;
+	m_count = 0;
+	m_curMin = NAN;
+	m_curMax = NAN;
+}
+
+ScopeTrace::~ScopeTrace(void)
+{
+	free(m_min);
+	free(m_max);
+}
+
+/* Empty trace of given width, old data is dropped */
+int ScopeTrace::Create(int columns, int perColumn)
+{
+	float *mn, *mx;
+
+	if ((columns <= 0) || (perColumn <= 0)) return 0;
+
+	mn = (float *)malloc(columns * sizeof(float));
+	mx = (float *)malloc(columns * sizeof(float));
+	if (!mn || !mx) {
+		free(mn);
+		free(mx);
+		return 0;
+	}
+
+	free(m_min);
+	free(m_max);
+	m_min = mn;
+	m_max = mx;
+	m_columns = columns;
+	m_perColumn = perColumn;
+	m_head = 0;
+	m_filled = 0;
+	m_count = 0;
+	m_curMin = m_curMax = NAN;
+
+	return 1;
+}
+
+void ScopeTrace::NextColumn()
+{
+	m_min[m_head] = m_curMin;
+	m_max[m_head] = m_curMax;
+	if (++m_head == m_columns) m_head = 0;
+	if (m_filled < m_columns) m_filled++;
+
+	m_count = 0;
+	m_curMin = m_curMax = NAN;
+}
+
+void ScopeTrace::Add(float v)
+{
+	if (!m_columns) return;
+
+	/* NaN compares false, so first sample always sets both */
+	if (!(v >= m_curMin)) m_curMin = v;
+	if (!(v <= m_curMax)) m_curMax = v;
+
+	if (++m_count >= m_perColumn) NextColumn();
+}
+
+/* Advance time over lost samples */
+void ScopeTrace::Skip(int count)
+{
+	if (!m_columns) return;
+
+	while (count > 0) {
+		int n = m_perColumn - m_count;
+		if (n > count) {
+			m_count += count;
+			break;
+		}
+		count -= n;
+		NextColumn();
+	}
+}
+
+int ScopeTrace::GetColumns()
+{
+	return m_columns;
+}
+
+int ScopeTrace::GetFilled()
+{
+	return m_filled;
+}
+
+/* Column by age, 0 is the newest completed one.
+ * Returns 0 if there is no such column or it holds no samples.
+ */
+int ScopeTrace::GetColumn(int age, float *min, float *max)
+{
+	int i;
+
+	if ((age < 0) || (age >= m_filled)) return 0;
+
+	i = m_head - 1 - age;
+	if (i < 0) i += m_columns;
+
+	*min = m_min[i];
+	*max = m_max[i];
+
+	return !isnan(*min);
+}
+
+/* Range of all completed columns */
+int ScopeTrace::GetRange(float *min, float *max)
+{
+	int found = 0;
+
+	for (int age = 0; age < m_filled; age++) {
+		float lo, hi;
+		if (!GetColumn(age, &lo, &hi)) continue;
+		if (!found || (lo < *min)) *min = lo;
+		if (!found || (hi > *max)) *max = hi;
+		found = 1;
+	}
+
+	return found;
+}
+
+/***** Plot panel *****/
+
+wxBEGIN_EVENT_TABLE(ScopePanel, wxPanel)
+	EVT_PAINT(ScopePanel::OnPaint)
+	EVT_SIZE(ScopePanel::OnSize)
+wxEND_EVENT_TABLE()
+
+
+ScopePanel::ScopePanel(wxWindow *parent)
+	: wxPanel(parent, wxID_ANY)
+{
+	m_perColumn = SCOPE_DEFAULT_PER_COLUMN;
+	m_seq = (unsigned int)-1;
+	m_dirty = false;
+
+	SetBackgroundStyle(wxBG_STYLE_PAINT);
+	Resize();
+}
+
+/* One trace column per pixel column */
+void ScopePanel::Resize()
+{
+	int w = GetClientSize().GetWidth();
+
+	if (w < 1) w = 1;
+	if (w == m_z.GetColumns()) return;
+
+	m_z.Create(w, m_perColumn);
+	m_error.Create(w, m_perColumn);
+	m_dirty = true;
+}
+
+/* Time base: telemetry samples per pixel column */
+void ScopePanel::SetSamplesPerColumn(int count)
+{
+	if (count < 1) count = 1;
+
+	m_perColumn = count;
+	m_z.Create(m_z.GetColumns(), count);
+	m_error.Create(m_error.GetColumns(), count);
+	m_dirty = true;
+}
+
+void ScopePanel::OnTelemetry(uint16_t seq, const struct afmTelemetrySample *s, int count)
+{
+	if (m_seq != (unsigned int)-1) {
+		int lost = (uint16_t)(seq - m_seq);
+		if (lost > SCOPE_MAX_GAP) lost = 0;
+		m_z.Skip(lost);
+		m_error.Skip(lost);
+	}
+
+	for (int i = 0; i < count; i++) {
+		m_z.Add(s[i].z);
+		m_error.Add(s[i].error);
+	}
+
+	m_seq = (uint16_t)(seq + count);
+	m_dirty = true;
+}
+
+/* Repaint if new samples arrived */
+void ScopePanel::Flush()
+{
+	if (!m_dirty) return;
+
+	m_dirty = false;
+	Refresh(false);
+}
+
+/* Newest column is at the right edge, every column is a vertical min-max bar */
+void ScopePanel::DrawTrace(wxDC& dc, ScopeTrace *trace, int top, int height, const wxColour& colour)
+{
+	int right = trace->GetColumns() - 1;
+	float lo, hi, k;
+
+	if ((height < 2) || !trace->GetRange(&lo, &hi)) return;
+
+	if (hi <= lo) {
+		lo -= 1;
+		hi += 1;
+	}
+	k = (height - 1) / (hi - lo);
+
+	dc.SetPen(wxPen(colour));
+	for (int age = 0; age < trace->GetFilled(); age++) {
+		float mn, mx;
+		if (!trace->GetColumn(age, &mn, &mx)) continue;
+
+		int y0 = top + height - 1 - (int)((mn - lo) * k);
+		int y1 = top + height - 1 - (int)((mx - lo) * k);
+		/* Line from y1 to y0 inclusive */
+		dc.DrawLine(right - age, y1, right - age, y0 + 1);
+	}
+}
+
+void ScopePanel::OnPaint(wxPaintEvent& event)
+{
+	wxAutoBufferedPaintDC dc(this);
+	wxSize size = GetClientSize();
+	int half = size.GetHeight() / 2;
+
+	dc.SetBackground(*wxBLACK_BRUSH);
+	dc.Clear();
+
+	/* Z setpoint on top, error below */
+	DrawTrace(dc, &m_z, 0, half, *wxGREEN);
+	DrawTrace(dc, &m_error, half, size.GetHeight() - half, *wxYELLOW);
+
+	dc.SetPen(wxPen(wxColour(64, 64, 64)));
+	dc.DrawLine(0, half, size.GetWidth(), half);
+}
+
+void ScopePanel::OnSize(wxSizeEvent& event)
+{
+	Resize();
+	Refresh(false);
+	event.Skip();
+}
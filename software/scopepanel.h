@@ -0,0 +1,58 @@
+#ifndef SCOPEPANEL_H_
+#define SCOPEPANEL_H_
+
+#include <wx/wx.h>
+
+#include "device.h"
+
+/* Scrolling min/max trace
+ * Every column keeps minimum and maximum of a fixed number of samples,
+ * so adding a sample is O(1) and drawing is O(columns) at any sample rate.
+ * Columns without samples (lost telemetry) hold NaN.
+ */
+class ScopeTrace {
+private:
+	float *m_min;
+	float *m_max;
+	int m_columns;
+	int m_head;					/* Next column to be completed */
+	int m_filled;				/* Completed columns */
+	int m_perColumn;			/* Samples per column */
+	int m_count;				/* Samples in current column, lost ones included */
+	float m_curMin;
+	float m_curMax;
+	void NextColumn();
+public:
+	ScopeTrace(void);
+	~ScopeTrace(void);
+	int Create(int columns, int perColumn);
+	void Add(float v);
+	void Skip(int count);
+	int GetColumns();
+	int GetFilled();
+	int GetColumn(int age, float *min, float *max);
+	int GetRange(float *min, float *max);
+};
+
+/* Live plot of Z setpoint and ADC error from device telemetry */
+class ScopePanel : public wxPanel, public TelemetryListener {
+private:
+	ScopeTrace m_z;
+	ScopeTrace m_error;
+	int m_perColumn;
+	unsigned int m_seq;			/* Next expected sample number, -1 before first message */
+	bool m_dirty;
+	void Resize();
+	void DrawTrace(wxDC& dc, ScopeTrace *trace, int top, int height, const wxColour& colour);
+	void OnPaint(wxPaintEvent& event);
+	void OnSize(wxSizeEvent& event);
+	wxDECLARE_EVENT_TABLE();
+public:
+	ScopePanel(wxWindow *parent);
+	void SetSamplesPerColumn(int count);
+	void Flush();
+	virtual void OnTelemetry(uint16_t seq, const struct afmTelemetrySample *s, int count);
+};
+
+
+#endif /* SCOPEPANEL_H_ */
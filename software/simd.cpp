@@ -0,0 +1,149 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "simd.h"
+
+/* Vector kernels for image processing
+ * Built with AVX2 or SSE2 when enabled by compiler flags, scalar code otherwise.
+ */
+
+/* Dot product, products and sum in double */
+double vecDot(const float *a, const float *b, int n)
+{
+	int i = 0;
+	double sum;
+
+#if defined(__AVX2__)
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	double t[4];
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 va = _mm256_loadu_ps(a + i);
+		__m256 vb = _mm256_loadu_ps(b + i);
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(va)),
+				_mm256_cvtps_pd(_mm256_castps256_ps128(vb))));
+		acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(va, 1)),
+				_mm256_cvtps_pd(_mm256_extractf128_ps(vb, 1))));
+	}
+	_mm256_storeu_pd(t, _mm256_add_pd(acc0, acc1));
+	sum = t[0] + t[1] + t[2] + t[3];
+#elif defined(__SSE2__)
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+	double t[2];
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 va = _mm_loadu_ps(a + i);
+		__m128 vb = _mm_loadu_ps(b + i);
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_cvtps_pd(va), _mm_cvtps_pd(vb)));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(va, va)),
+				_mm_cvtps_pd(_mm_movehl_ps(vb, vb))));
+	}
+	_mm_storeu_pd(t, _mm_add_pd(acc0, acc1));
+	sum = t[0] + t[1];
+#else
+	sum = 0;
+#endif
+
+	for (; i < n; i++) sum += (double)a[i] * b[i];
+
+	return sum;
+}
+
+/* Sum of elements, accumulated in double */
+double vecSum(const float *a, int n)
+{
+	int i = 0;
+	double sum;
+
+#if defined(__AVX2__)
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	double t[4];
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 p = _mm256_loadu_ps(a + i);
+		acc0 = _mm256_add_pd(acc0, _mm256_cvtps_pd(_mm256_castps256_ps128(p)));
+		acc1 = _mm256_add_pd(acc1, _mm256_cvtps_pd(_mm256_extractf128_ps(p, 1)));
+	}
+	_mm256_storeu_pd(t, _mm256_add_pd(acc0, acc1));
+	sum = t[0] + t[1] + t[2] + t[3];
+#elif defined(__SSE2__)
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+	double t[2];
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 p = _mm_loadu_ps(a + i);
+		acc0 = _mm_add_pd(acc0, _mm_cvtps_pd(p));
+		acc1 = _mm_add_pd(acc1, _mm_cvtps_pd(_mm_movehl_ps(p, p)));
+	}
+	_mm_storeu_pd(t, _mm_add_pd(acc0, acc1));
+	sum = t[0] + t[1];
+#else
+	sum = 0;
+#endif
+
+	for (; i < n; i++) sum += a[i];
+
+	return sum;
+}
+
+/* a[i] += c */
+void vecAddConst(float *a, float c, int n)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	__m256 vc = _mm256_set1_ps(c);
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(a + i, _mm256_add_ps(_mm256_loadu_ps(a + i), vc));
+#elif defined(__SSE2__)
+	__m128 vc = _mm_set1_ps(c);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(a + i, _mm_add_ps(_mm_loadu_ps(a + i), vc));
+#endif
+
+	for (; i < n; i++) a[i] += c;
+}
+
+/* a[i] += c * b[i] */
+void vecAxpy(float *a, float c, const float *b, int n)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	__m256 vc = _mm256_set1_ps(c);
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(a + i, _mm256_add_ps(_mm256_loadu_ps(a + i),
+				_mm256_mul_ps(vc, _mm256_loadu_ps(b + i))));
+#elif defined(__SSE2__)
+	__m128 vc = _mm_set1_ps(c);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(a + i, _mm_add_ps(_mm_loadu_ps(a + i),
+				_mm_mul_ps(vc, _mm_loadu_ps(b + i))));
+#endif
+
+	for (; i < n; i++) a[i] += c * b[i];
+}
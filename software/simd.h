@@ -0,0 +1,10 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+double vecDot(const float *a, const float *b, int n);
+double vecSum(const float *a, int n);
+void vecAddConst(float *a, float c, int n);
+void vecAxpy(float *a, float c, const float *b, int n);
+
+
+#endif /* SIMD_H_ */
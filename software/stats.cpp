@@ -0,0 +1,397 @@
+/* Copyright (c) 2015 Vasily Voropaev <vvg@cubitel.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "stats.h"
+#include "simd.h"
+
+
+SurfaceStats::SurfaceStats(float histMin, float histMax, int bins)
+{
+	if (bins < 1) bins = 1;
+	if (histMax <= histMin) histMax = histMin + 1;
+
+	m_histMin = histMin;
+	m_histMax = histMax;
+	m_bins = bins;
+	m_hist = (uint32_t *)malloc(sizeof(uint32_t) * bins);
+	m_histSum = (double *)malloc(sizeof(double) * bins);
+	m_index = NULL;
+	m_indexSize = 0;
+
+	Reset();
+}
+
+SurfaceStats::~SurfaceStats()
+{
+	free(m_hist);
+	free(m_histSum);
+	free(m_index);
+}
+
+/* Empty accumulator with the same histogram layout */
+SurfaceStats *SurfaceStats::Clone()
+{
+	return new SurfaceStats(m_histMin, m_histMax, m_bins);
+}
+
+void SurfaceStats::Reset()
+{
+	m_count = 0;
+	m_mean = 0;
+	m_m2 = 0;
+	m_m3 = 0;
+	m_m4 = 0;
+	m_min = FLT_MAX;
+	m_max = -FLT_MAX;
+	if (m_hist) memset(m_hist, 0, sizeof(uint32_t) * m_bins);
+	if (m_histSum) memset(m_histSum, 0, sizeof(double) * m_bins);
+}
+
+/* Add partial result with n values and given central moment sums */
+void SurfaceStats::Combine(double n, double mean, double m2, double m3, double m4)
+{
+	double na = m_count;
+	double nb = n;
+	double nx = na + nb;
+	double d, d2, d3, d4;
+
+	if (nb == 0) return;
+	if (na == 0) {
+		m_count = n;
+		m_mean = mean;
+		m_m2 = m2;
+		m_m3 = m3;
+		m_m4 = m4;
+		return;
+	}
+
+	d = mean - m_mean;
+	d2 = d * d;
+	d3 = d2 * d;
+	d4 = d2 * d2;
+
+	m_m4 += m4 + d4 * na * nb * (na * na - na * nb + nb * nb) / (nx * nx * nx)
+			+ 6 * d2 * (na * na * m2 + nb * nb * m_m2) / (nx * nx)
+			+ 4 * d * (na * m3 - nb * m_m3) / nx;
+	m_m3 += m3 + d3 * na * nb * (na - nb) / (nx * nx)
+			+ 3 * d * (na * m2 - nb * m_m2) / nx;
+	m_m2 += m2 + d2 * na * nb / nx;
+	m_mean += d * nb / nx;
+	m_count = nx;
+}
+
+/* Histogram update. Bin indices are computed by vector code,
+ * counters are updated by scalar code.
+ */
+void SurfaceStats::Bin(const float *row, int n)
+{
+	float scale = m_bins / (m_histMax - m_histMin);
+	float top = (float)(m_bins - 1);
+	int i = 0;
+
+	if (n > m_indexSize) {
+		free(m_index);
+		m_index = (int32_t *)malloc(sizeof(int32_t) * n);
+		m_indexSize = m_index ? n : 0;
+		if (!m_index) return;
+	}
+
+#if defined(__AVX2__)
+	__m256 vmin = _mm256_set1_ps(m_histMin);
+	__m256 vscale = _mm256_set1_ps(scale);
+	__m256 vtop = _mm256_set1_ps(top);
+	__m256 vzero = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		__m256 b = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(row + i), vmin), vscale);
+		b = _mm256_min_ps(_mm256_max_ps(b, vzero), vtop);
+		_mm256_storeu_si256((__m256i *)(m_index + i), _mm256_cvttps_epi32(b));
+	}
+#elif defined(__SSE2__)
+	__m128 vmin = _mm_set1_ps(m_histMin);
+	__m128 vscale = _mm_set1_ps(scale);
+	__m128 vtop = _mm_set1_ps(top);
+	__m128 vzero = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		__m128 b = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(row + i), vmin), vscale);
+		b = _mm_min_ps(_mm_max_ps(b, vzero), vtop);
+		_mm_storeu_si128((__m128i *)(m_index + i), _mm_cvttps_epi32(b));
+	}
+#endif
+
+	for (; i < n; i++) {
+		float b = (row[i] - m_histMin) * scale;
+		if (b < 0) b = 0;
+		if (b > top) b = top;
+		m_index[i] = (int32_t)b;
+	}
+
+	for (i = 0; i < n; i++) {
+		m_hist[m_index[i]]++;
+		m_histSum[m_index[i]] += row[i];
+	}
+}
+
+void SurfaceStats::AddLine(const float *row, int n)
+{
+	double mean, m2 = 0, m3 = 0, m4 = 0;
+	float lmin, lmax;
+	int i;
+
+	if ((n <= 0) || !m_hist || !m_histSum) return;
+
+	lmin = lmax = row[0];
+
+	/* Line moments around line mean, line is still in cache */
+	mean = vecSum(row, n) / n;
+	for (i = 0; i < n; i++) {
+		double d = row[i] - mean;
+		double d2 = d * d;
+		m2 += d2;
+		m3 += d2 * d;
+		m4 += d2 * d2;
+		if (row[i] < lmin) lmin = row[i];
+		if (row[i] > lmax) lmax = row[i];
+	}
+
+	Combine(n, mean, m2, m3, m4);
+	if (lmin < m_min) m_min = lmin;
+	if (lmax > m_max) m_max = lmax;
+
+	Bin(row, n);
+}
+
+/* Add statistics collected by other accumulator with the same histogram */
+int SurfaceStats::Merge(SurfaceStats *other)
+{
+	int i;
+
+	if ((other->m_bins != m_bins) || (other->m_histMin != m_histMin) ||
+			(other->m_histMax != m_histMax)) return 0;
+
+	Combine(other->m_count, other->m_mean, other->m_m2, other->m_m3, other->m_m4);
+	if (other->m_min < m_min) m_min = other->m_min;
+	if (other->m_max > m_max) m_max = other->m_max;
+	for (i = 0; i < m_bins; i++) {
+		m_hist[i] += other->m_hist[i];
+		m_histSum[i] += other->m_histSum[i];
+	}
+
+	return 1;
+}
+
+double SurfaceStats::GetCount()
+{
+	return m_count;
+}
+
+double SurfaceStats::GetMean()
+{
+	return m_mean;
+}
+
+float SurfaceStats::GetMin()
+{
+	return m_min;
+}
+
+float SurfaceStats::GetMax()
+{
+	return m_max;
+}
+
+/* Mean absolute deviation from the mean */
+double SurfaceStats::GetRa()
+{
+	double sum = 0;
+	int i;
+
+	if (m_count == 0) return 0;
+
+	for (i = 0; i < m_bins; i++) {
+		double lo = m_histMin + (m_histMax - m_histMin) * i / m_bins;
+		double hi = m_histMin + (m_histMax - m_histMin) * (i + 1) / m_bins;
+		double d = m_histSum[i] - m_hist[i] * m_mean;
+
+		/* End bins also hold out of range values */
+		if (i == 0) lo = -DBL_MAX;
+		if (i == m_bins - 1) hi = DBL_MAX;
+
+		if (lo >= m_mean) {
+			sum += d;
+		} else if (hi <= m_mean) {
+			sum -= d;
+		} else {
+			/* Bin with the mean: assume values spread evenly over it */
+			double a = (m_min > lo) ? m_min : lo;
+			double b = (m_max < hi) ? m_max : hi;
+			if (b > a) {
+				double fa = (m_mean - a) / (b - a);
+				double fb = (b - m_mean) / (b - a);
+				sum += m_hist[i] * (fa * (m_mean - a) + fb * (b - m_mean)) / 2;
+			}
+		}
+	}
+
+	return sum / m_count;
+}
+
+/* Root mean square deviation from the mean */
+double SurfaceStats::GetRq()
+{
+	if (m_count == 0) return 0;
+
+	return sqrt(m_m2 / m_count);
+}
+
+double SurfaceStats::GetSkewness()
+{
+	if (m_m2 == 0) return 0;
+
+	return sqrt(m_count) * m_m3 / pow(m_m2, 1.5);
+}
+
+/* Excess kurtosis, zero for normal distribution */
+double SurfaceStats::GetKurtosis()
+{
+	if (m_m2 == 0) return 0;
+
+	return m_count * m_m4 / (m_m2 * m_m2) - 3.0;
+}
+
+/* Value below which the given fraction of samples lies,
+ * interpolated within the histogram bin */
+float SurfaceStats::GetPercentile(double fraction)
+{
+	double target, acc = 0;
+
+	if (m_count == 0) return 0;
+	if (fraction <= 0) return m_min;
+	if (fraction >= 1) return m_max;
+
+	target = fraction * m_count;
+	for (int i = 0; i < m_bins; i++) {
+		if (acc + m_hist[i] >= target) {
+			double lo = m_histMin + (double)(m_histMax - m_histMin) * i / m_bins;
+			double hi = m_histMin + (double)(m_histMax - m_histMin) * (i + 1) / m_bins;
+			double v;
+
+			if (lo < m_min) lo = m_min;
+			if (hi > m_max) hi = m_max;
+			v = lo + (hi - lo) * (target - acc) / m_hist[i];
+			return (v < lo) ? lo : (v > hi) ? hi : v;
+		}
+		acc += m_hist[i];
+	}
+
+	return m_max;
+}
+
+int SurfaceStats::GetBins()
+{
+	return m_bins;
+}
+
+const uint32_t *SurfaceStats::GetHistogram()
+{
+	return m_hist;
+}
+
+/* Statistics of complete image channel, threads merge partial results */
+int statsImage(AFMImage *image, int channel, SurfaceStats *stats)
+{
+	int ok = 1;
+
+	if ((channel < 0) || (channel >= image->GetChannels())) return 0;
+
+	stats->Reset();
+
+	#pragma omp parallel
+	{
+		SurfaceStats *local = stats->Clone();
+
+		for (int tile = 0; tile < image->GetTileCount(); tile++) {
+			int y0, y1;
+
+			image->GetTileBounds(tile, &y0, &y1);
+
+			#pragma omp single nowait
+			image->PrefetchTile(channel, tile + 1);
+
+			#pragma omp for schedule(static)
+			for (int y = y0; y < y1; y++) {
+				float *row = image->GetRow(channel, y);
+				if (row) local->AddLine(row, image->GetWidth());
+			}
+
+			#pragma omp single nowait
+			image->ReleaseTile(channel, tile);
+		}
+
+		#pragma omp critical(statsmerge)
+		{
+			if (!stats->Merge(local)) ok = 0;
+		}
+
+		delete local;
+	}
+
+	return ok;
+}
+
+/***** Acquisition listener *****/
+
+StatsCollector::StatsCollector(float histMin, float histMax, int bins)
+{
+	for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) m_stats[ch] = new SurfaceStats(histMin, histMax, bins);
+}
+
+StatsCollector::~StatsCollector()
+{
+	for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) delete m_stats[ch];
+}
+
+SurfaceStats *StatsCollector::GetStats(int channel)
+{
+	if ((channel < 0) || (channel >= AFM_CHANNEL_COUNT)) return NULL;
+
+	return m_stats[channel];
+}
+
+void StatsCollector::OnImageStart(AFMImage *image)
+{
+	for (int ch = 0; ch < AFM_CHANNEL_COUNT; ch++) m_stats[ch]->Reset();
+}
+
+void StatsCollector::OnImageLine(AFMImage *image, int channel, int line)
+{
+	float *row = image->GetRow(channel, line);
+
+	if (!row || (channel < 0) || (channel >= AFM_CHANNEL_COUNT)) return;
+
+	m_stats[channel]->AddLine(row, image->GetWidth());
+}
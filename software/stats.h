@@ -0,0 +1,68 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "image.h"
+
+#define STATS_DEFAULT_BINS		1024
+
+/* Streaming surface statistics
+ * Lines are added as they arrive, central moments are combined with
+ * pairwise update formulas, so partial results from several threads
+ * can be merged. Histogram keeps sum of values per bin, which makes
+ * Ra exact except for the bin containing the mean.
+ * Values outside of histogram range are counted in the end bins.
+ */
+class SurfaceStats {
+private:
+	double m_count;
+	double m_mean;
+	double m_m2;
+	double m_m3;
+	double m_m4;
+	float m_min;
+	float m_max;
+	float m_histMin;
+	float m_histMax;
+	int m_bins;
+	uint32_t *m_hist;
+	double *m_histSum;
+	int32_t *m_index;			/* Bin index scratch */
+	int m_indexSize;
+	void Combine(double n, double mean, double m2, double m3, double m4);
+	void Bin(const float *row, int n);
+public:
+	SurfaceStats(float histMin = 0, float histMax = 65536, int bins = STATS_DEFAULT_BINS);
+	~SurfaceStats(void);
+	SurfaceStats *Clone();
+	void Reset();
+	void AddLine(const float *row, int n);
+	int Merge(SurfaceStats *other);
+	double GetCount();
+	double GetMean();
+	float GetMin();
+	float GetMax();
+	double GetRa();
+	double GetRq();
+	double GetSkewness();
+	double GetKurtosis();
+	float GetPercentile(double fraction);
+	int GetBins();
+	const uint32_t *GetHistogram();
+};
+
+int statsImage(AFMImage *image, int channel, SurfaceStats *stats);
+
+/* Collects statistics of the image while it is being acquired */
+class StatsCollector : public ImageListener {
+private:
+	SurfaceStats *m_stats[AFM_CHANNEL_COUNT];
+public:
+	StatsCollector(float histMin = 0, float histMax = 65536, int bins = STATS_DEFAULT_BINS);
+	virtual ~StatsCollector(void);
+	SurfaceStats *GetStats(int channel);
+	virtual void OnImageStart(AFMImage *image);
+	virtual void OnImageLine(AFMImage *image, int channel, int line);
+};
+
+
+#endif /* STATS_H_ */